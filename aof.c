@@ -0,0 +1,553 @@
+//
+// Append only file (AOF) source file
+//
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "aof.h"
+
+aof_state aof_status = {
+        .fd = -1,
+        .last_write_ok = 1,
+        .rewrite_child_pid = -1,
+        .last_bgrewrite_ok = 1,
+        .last_rewrite_time_sec = -1,
+        .fsync_mutex = PTHREAD_MUTEX_INITIALIZER,
+        .fsync_cond = PTHREAD_COND_INITIALIZER
+};
+
+static int fsync_thread_started = 0;
+static int fsync_fd = -1; // what the fsync thread was asked to sync, guarded by fsync_mutex
+static off_t fsync_size = 0;
+static off_t fsync_requested_size = 0; // only touched by the main thread
+static int *pending_closes = NULL; // files replaced by a rewrite, closed by the fsync thread. Guarded by fsync_mutex
+static int num_pending_closes = 0;
+static int pending_closes_capacity = 0;
+
+static void buffer_reserve(aof_buffer *buffer, size_t needed){
+    if (needed <= buffer->capacity)
+        return;
+    size_t new_capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    buffer->data = realloc(buffer->data, new_capacity);
+    buffer->capacity = new_capacity;
+}
+
+static void buffer_append(aof_buffer *buffer, const char *data, size_t len){
+    buffer_reserve(buffer, buffer->len + len);
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+/*
+ * Appends a command as an RESP array of bulk strings. If argv_len is NULL the arguments are NUL terminated.
+ */
+void buffer_append_command(aof_buffer *buffer, const char *argv[], const size_t argv_len[], int argc){
+    char header[32];
+    int header_len = snprintf(header, sizeof header, "*%d\r\n", argc);
+
+    buffer_append(buffer, header, header_len);
+    for (int i = 0; i < argc; i++){
+        size_t len = argv_len == NULL ? strlen(argv[i]) : argv_len[i];
+        header_len = snprintf(header, sizeof header, "$%zu\r\n", len);
+        buffer_append(buffer, header, header_len);
+        buffer_append(buffer, argv[i], len);
+        buffer_append(buffer, "\r\n", 2);
+    }
+}
+
+/*
+ * Background thread for appendfsync everysec, so that the event loop never waits on the disk. It also closes the files
+ * replaced by a rewrite: the last close of a renamed-over file frees its blocks, which can take a while, and it must
+ * not happen while the file is being synced.
+ */
+static void * aof_fsync_thread(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&aof_status.fsync_mutex);
+    for (;;) {
+        while (!aof_status.fsync_requested && num_pending_closes == 0)
+            pthread_cond_wait(&aof_status.fsync_cond, &aof_status.fsync_mutex);
+        if (!aof_status.fsync_requested){
+            int fd = pending_closes[--num_pending_closes];
+            pthread_mutex_unlock(&aof_status.fsync_mutex);
+            close(fd);
+            pthread_mutex_lock(&aof_status.fsync_mutex);
+            continue;
+        }
+        aof_status.fsync_requested = 0;
+        aof_status.fsync_in_progress = 1;
+        int fd = fsync_fd;
+        off_t size = fsync_size;
+        pthread_mutex_unlock(&aof_status.fsync_mutex);
+
+        int ret_val = fdatasync(fd);
+
+        pthread_mutex_lock(&aof_status.fsync_mutex);
+        aof_status.fsync_in_progress = 0;
+        if (ret_val == -1)
+            perror("Error syncing the append only file");
+        else {
+            aof_status.fsynced_size = size;
+            aof_status.fsync_count++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Opens the append only file for appending and starts logging write commands to it. Returns -1 on failure.
+ */
+int aof_open(const char *filename){
+    struct stat file_stat;
+    int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+    if (fd == -1){
+        perror("Error opening the append only file");
+        return -1;
+    }
+    if (fstat(fd, &file_stat) == -1){
+        perror("Error opening the append only file");
+        close(fd);
+        return -1;
+    }
+    if (!fsync_thread_started){
+        if (pthread_create(&aof_status.fsync_thread, NULL, aof_fsync_thread, NULL) != 0){
+            close(fd);
+            return -1;
+        }
+        pthread_detach(aof_status.fsync_thread);
+        fsync_thread_started = 1;
+    }
+    aof_status.fd = fd;
+    aof_status.selected_db = -1; // the file may end in any database
+    aof_status.current_size = file_stat.st_size;
+    aof_status.fsynced_size = file_stat.st_size;
+    aof_status.base_size = file_stat.st_size;
+    aof_status.last_fsync_ms = get_current_time_ms();
+    fsync_requested_size = file_stat.st_size;
+    return 0;
+}
+
+/*
+ * Runs the commands of a transaction read from the append only file, once its EXEC was found: the ones between the
+ * MULTI at offset start and the EXEC at offset end. Returns how many ran.
+ */
+static int replay_commands(const char *data, size_t start, size_t end){
+    int num_commands = 0;
+    size_t pos = start;
+
+    while (pos < end){
+        char **argv;
+        size_t *argv_len;
+        int argc;
+        long parsed = parse_resp_command(data + pos, end - pos, &argv, &argv_len, &argc);
+
+        if (argc > 0 && strcmp(argv[0], "MULTI") != 0){
+            free(handle_resp_command((const char **)argv, argc));
+            num_commands++;
+        }
+        free_command_args(argv, argv_len, argc);
+        pos += parsed;
+    }
+    return num_commands;
+}
+
+/*
+ * Replays the commands of an append only file. If the file ends in the middle of a command (the server died while
+ * writing it), the incomplete command is cut off and the rest of the file is loaded. A transaction cut off before its
+ * EXEC is dropped whole, none of its commands run.
+ *
+ * Returns the number of commands replayed, -1 if there is no such file and -2 if it is corrupt or unreadable.
+ */
+int aof_load(const char *filename){
+    struct stat file_stat;
+    int fd = open(filename, O_RDWR);
+
+    if (fd == -1)
+        return errno == ENOENT ? -1 : -2;
+    if (fstat(fd, &file_stat) == -1){
+        close(fd);
+        return -2;
+    }
+    size_t size = file_stat.st_size;
+    if (size == 0){
+        close(fd);
+        return 0;
+    }
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED){
+        close(fd);
+        return -2;
+    }
+
+    int num_commands = 0;
+    size_t pos = 0;
+    size_t transaction_start = 0;
+    int in_transaction = 0;
+    long parsed = 0;
+    aof_status.loading = 1;
+    db = &dbs[0]; // until a SELECT in the file picks another one
+    while (pos < size){
+        char **argv;
+        size_t *argv_len;
+        int argc;
+
+        parsed = parse_resp_command(data + pos, size - pos, &argv, &argv_len, &argc);
+        if (parsed <= 0)
+            break;
+        if (argc > 0 && strcmp(argv[0], "MULTI") == 0 && !in_transaction){
+            in_transaction = 1;
+            transaction_start = pos;
+        } else if (argc > 0 && strcmp(argv[0], "EXEC") == 0 && in_transaction){
+            num_commands += replay_commands(data, transaction_start, pos);
+            in_transaction = 0;
+        } else if (argc > 0 && !in_transaction){
+            free(handle_resp_command((const char **)argv, argc));
+            num_commands++;
+        }
+        free_command_args(argv, argv_len, argc);
+        pos += parsed;
+    }
+    if (in_transaction && parsed != -1) // the file ends before its EXEC, the transaction goes with the incomplete tail
+        pos = transaction_start;
+    aof_status.loading = 0;
+    db = &dbs[0];
+    munmap((void *)data, size);
+
+    if (parsed == -1){
+        fprintf(stderr, "Redis server: Bad command in the append only file at offset %zu\n", pos);
+        close(fd);
+        return -2;
+    }
+    if (pos < size){
+        fprintf(stderr, "Redis server: The append only file ends with an incomplete command, dropping its last %zu bytes\n",
+                size - pos);
+        if (ftruncate(fd, (off_t)pos) == -1){
+            perror("Error truncating the append only file");
+            close(fd);
+            return -2;
+        }
+    }
+    close(fd);
+    return num_commands;
+}
+
+/*
+ * Writes the commands that rebuild one object: SET or RPUSH (in batches of AOF_REWRITE_ITEMS_PER_CMD items), then
+ * PEXPIREAT if it has an expiry.
+ */
+void aof_rewrite_object(aof_buffer *buffer, redis_object *obj){
+    if (obj->array_size > 0){
+        const char *argv[2 + AOF_REWRITE_ITEMS_PER_CMD];
+        size_t argv_len[2 + AOF_REWRITE_ITEMS_PER_CMD];
+        const char *item = obj->value;
+        int argc = 2;
+
+        argv[0] = "RPUSH";
+        argv_len[0] = 5;
+        argv[1] = obj->key;
+        argv_len[1] = strlen(obj->key);
+        for (;;) {
+            const char *item_end = strchr(item, '^');
+            size_t item_len = item_end == NULL ? strlen(item) : (size_t)(item_end - item);
+
+            argv[argc] = item;
+            argv_len[argc] = item_len;
+            argc++;
+            if (argc == 2 + AOF_REWRITE_ITEMS_PER_CMD || item_end == NULL){
+                buffer_append_command(buffer, argv, argv_len, argc);
+                argc = 2;
+            }
+            if (item_end == NULL)
+                break;
+            item = item_end + 1;
+        }
+    }
+    else {
+        const char *argv[] = {"SET", obj->key, obj->value};
+        buffer_append_command(buffer, argv, NULL, 3);
+    }
+
+    if (obj->expire_list_index != -1){
+        char timestamp[24];
+        snprintf(timestamp, sizeof timestamp, "%lu", obj->exp_milliseconds);
+        const char *argv[] = {"PEXPIREAT", obj->key, timestamp};
+        buffer_append_command(buffer, argv, NULL, 3);
+    }
+}
+
+/*
+ * Appends a SELECT of database index to buffer, unless the commands before it in there already selected it.
+ */
+static void buffer_append_select(aof_buffer *buffer, int *selected_db, int index){
+    char index_str[12];
+
+    if (*selected_db == index)
+        return;
+    snprintf(index_str, sizeof index_str, "%d", index);
+    const char *argv[] = {"SELECT", index_str};
+    buffer_append_command(buffer, argv, NULL, 2);
+    *selected_db = index;
+}
+
+/*
+ * Writes the shortest list of commands that rebuilds the keyspace to fd, every database after a SELECT of it. Returns
+ * -1 on failure.
+ */
+int aof_rewrite_to_fd(int fd){
+    aof_buffer buffer = {NULL, 0, 0};
+    int selected_db = -1;
+    int ret_val = 0;
+
+    for (int i = 0; i < server_config.databases && ret_val == 0; i++){
+        for (redis_object *obj = dbs[i].objects_map; obj != NULL && ret_val == 0; obj = obj->hh.next){
+            buffer_append_select(&buffer, &selected_db, i);
+            aof_rewrite_object(&buffer, obj);
+            if (buffer.len >= AOF_REWRITE_BUFFER_SIZE){
+                ret_val = write_all(fd, buffer.data, buffer.len);
+                buffer.len = 0;
+            }
+        }
+    }
+    if (ret_val == 0 && buffer.len > 0)
+        ret_val = write_all(fd, buffer.data, buffer.len);
+    free(buffer.data);
+    return ret_val;
+}
+
+/*
+ * Replaces the append only file with one rebuilt from the keyspace. Returns -1 on failure.
+ */
+int aof_rewrite(const char *filename){
+    char temp_filename[64];
+    snprintf(temp_filename, sizeof temp_filename, "temp-rewriteaof-%d.aof", (int)getpid());
+
+    int fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        perror("Error opening the append only file");
+        return -1;
+    }
+    if (aof_rewrite_to_fd(fd) == -1 || fsync(fd) == -1){
+        perror("Error writing the append only file");
+        close(fd);
+        unlink(temp_filename);
+        return -1;
+    }
+    close(fd);
+    if (rename(temp_filename, filename) == -1){
+        perror("Error renaming the append only file");
+        unlink(temp_filename);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Logs a command that changed the selected database. It is written out by the next aof_flush().
+ */
+void aof_feed_command(const char *argv[], int argc){
+    int index = (int)(db - dbs);
+
+    if (aof_status.loading)
+        return;
+    if (aof_status.fd != -1){
+        buffer_append_select(&aof_status.buffer, &aof_status.selected_db, index);
+        buffer_append_command(&aof_status.buffer, argv, NULL, argc);
+    }
+    if (aof_status.rewrite_child_pid != -1){
+        buffer_append_select(&aof_status.rewrite_buffer, &aof_status.rewrite_selected_db, index);
+        buffer_append_command(&aof_status.rewrite_buffer, argv, NULL, argc);
+    }
+}
+
+/*
+ * Like aof_feed_command() for commands that are already in RESP format.
+ */
+void aof_feed_raw(const char *data, size_t len){
+    if (aof_status.loading)
+        return;
+    if (aof_status.fd != -1)
+        buffer_append(&aof_status.buffer, data, len);
+    if (aof_status.rewrite_child_pid != -1)
+        buffer_append(&aof_status.rewrite_buffer, data, len);
+}
+
+/*
+ * Writes the commands logged during this event loop iteration with a single write(), then syncs the file according
+ * to appendfsync. Must run before the replies of the iteration are sent: with appendfsync always, a client never
+ * sees a reply for a write that is not on disk yet, and all the clients served by the iteration share one fsync.
+ */
+void aof_flush(void){
+    if (aof_status.fd == -1)
+        return;
+
+    if (aof_status.buffer.len > 0){
+        if (write_all(aof_status.fd, aof_status.buffer.data, aof_status.buffer.len) == -1){
+            perror("Error writing to the append only file");
+            if (server_config.appendfsync == APPENDFSYNC_ALWAYS){
+                fprintf(stderr, "Redis server: Can't persist writes with appendfsync always. Exiting.\n");
+                exit(1);
+            }
+            // drop the part of the batch that made it, the whole batch is written again on the next iteration
+            if (ftruncate(aof_status.fd, aof_status.current_size) == -1)
+                perror("Error truncating the append only file");
+            aof_status.last_write_ok = 0;
+            return;
+        }
+        aof_status.current_size += (off_t)aof_status.buffer.len;
+        aof_status.buffer.len = 0;
+        aof_status.last_write_ok = 1;
+
+        if (server_config.appendfsync == APPENDFSYNC_ALWAYS){
+            if (fdatasync(aof_status.fd) == -1){
+                perror("Error syncing the append only file");
+                fprintf(stderr, "Redis server: Can't persist writes with appendfsync always. Exiting.\n");
+                exit(1);
+            }
+            pthread_mutex_lock(&aof_status.fsync_mutex);
+            aof_status.fsynced_size = aof_status.current_size;
+            aof_status.fsync_count++;
+            pthread_mutex_unlock(&aof_status.fsync_mutex);
+            fsync_requested_size = aof_status.current_size;
+            aof_status.last_fsync_ms = get_current_time_ms();
+        }
+    }
+
+    if (server_config.appendfsync == APPENDFSYNC_EVERYSEC && aof_status.current_size > fsync_requested_size){
+        long current_time_ms = get_current_time_ms();
+        if (current_time_ms - aof_status.last_fsync_ms < 1000)
+            return;
+        pthread_mutex_lock(&aof_status.fsync_mutex);
+        if (!aof_status.fsync_in_progress && !aof_status.fsync_requested){
+            fsync_fd = aof_status.fd;
+            fsync_size = aof_status.current_size;
+            aof_status.fsync_requested = 1;
+            pthread_cond_signal(&aof_status.fsync_cond);
+            fsync_requested_size = aof_status.current_size;
+            aof_status.last_fsync_ms = current_time_ms;
+        }
+        pthread_mutex_unlock(&aof_status.fsync_mutex);
+    }
+}
+
+static void rewrite_temp_filename(char *out, size_t len, pid_t child_pid){
+    snprintf(out, len, "temp-rewriteaof-bg-%d.aof", (int)child_pid);
+}
+
+/*
+ * Starts rewriting the append only file in a forked child. Returns -1 if the child could not be started and -2 if a
+ * rewrite is already running.
+ */
+int aof_bgrewrite(const char *filename){
+    if (aof_status.rewrite_child_pid != -1)
+        return -2;
+
+    aof_status.rewrite_start = time(NULL); // also when the fork fails, automatic rewrites wait a bit before retrying
+    pid_t pid = fork();
+    if (pid == -1){
+        perror("Error forking BGREWRITEAOF child");
+        aof_status.last_bgrewrite_ok = 0;
+        return -1;
+    }
+    if (pid == 0){ // child
+        char temp_filename[64];
+        rewrite_temp_filename(temp_filename, sizeof temp_filename, getpid());
+        int fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            _exit(1);
+        int ret_val = aof_rewrite_to_fd(fd) == -1 || fsync(fd) == -1 ? -1 : 0;
+        close(fd);
+        _exit(ret_val == 0 ? 0 : 1);
+    }
+    aof_status.rewrite_child_pid = pid;
+    aof_status.rewrite_filename = filename;
+    aof_status.rewrite_scheduled = 0;
+    aof_status.rewrite_buffer.len = 0;
+    aof_status.rewrite_selected_db = -1; // the child's file may end in any database
+    printf("Redis server: Background append only file rewriting started by pid %d\n", (int)pid);
+    return 0;
+}
+
+/*
+ * Appends the commands logged since the fork to the rewritten file and renames it over the old one. If the append
+ * only file is on, logging continues in the new file. Returns -1 on failure, the old file is then left untouched.
+ */
+static int aof_swap_rewritten_file(const char *temp_filename){
+    int new_fd = open(temp_filename, O_WRONLY | O_APPEND);
+    struct stat file_stat;
+
+    // the old file must hold everything that is still buffered in case the swap fails
+    aof_flush();
+    if (aof_status.buffer.len > 0){
+        fprintf(stderr, "Redis server: Can't swap the append only file while writing to it fails\n");
+        if (new_fd != -1)
+            close(new_fd);
+        return -1;
+    }
+    if (new_fd == -1 ||
+        write_all(new_fd, aof_status.rewrite_buffer.data, aof_status.rewrite_buffer.len) == -1 ||
+        fsync(new_fd) == -1 || fstat(new_fd, &file_stat) == -1){
+        perror("Error writing the rewritten append only file");
+        if (new_fd != -1)
+            close(new_fd);
+        return -1;
+    }
+    if (rename(temp_filename, aof_status.rewrite_filename) == -1){
+        perror("Error renaming the rewritten append only file");
+        close(new_fd);
+        return -1;
+    }
+    if (aof_status.fd == -1){
+        close(new_fd);
+        return 0;
+    }
+
+    pthread_mutex_lock(&aof_status.fsync_mutex);
+    if (num_pending_closes == pending_closes_capacity){
+        pending_closes_capacity = pending_closes_capacity == 0 ? 4 : pending_closes_capacity * 2;
+        pending_closes = realloc(pending_closes, sizeof *pending_closes * pending_closes_capacity);
+    }
+    pending_closes[num_pending_closes++] = aof_status.fd;
+    pthread_cond_signal(&aof_status.fsync_cond);
+    aof_status.fd = new_fd;
+    aof_status.selected_db = aof_status.rewrite_buffer.len > 0 ? aof_status.rewrite_selected_db : -1;
+    aof_status.current_size = file_stat.st_size;
+    aof_status.fsynced_size = file_stat.st_size;
+    aof_status.base_size = file_stat.st_size;
+    fsync_requested_size = file_stat.st_size;
+    pthread_mutex_unlock(&aof_status.fsync_mutex);
+    return 0;
+}
+
+/*
+ * Reaps the BGREWRITEAOF child if it has exited and swaps in the rewritten file. Called from the server cron.
+ */
+void aof_check_bgrewrite_done(void){
+    char temp_filename[64];
+    int status;
+
+    if (aof_status.rewrite_child_pid == -1)
+        return;
+    if (waitpid(aof_status.rewrite_child_pid, &status, WNOHANG) != aof_status.rewrite_child_pid)
+        return;
+
+    rewrite_temp_filename(temp_filename, sizeof temp_filename, aof_status.rewrite_child_pid);
+    aof_status.rewrite_child_pid = -1;
+    aof_status.last_bgrewrite_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            aof_swap_rewritten_file(temp_filename) == 0;
+    aof_status.last_rewrite_time_sec = time(NULL) - aof_status.rewrite_start;
+
+    // the buffer can get big on a busy server, don't hold on to it until the next rewrite
+    free(aof_status.rewrite_buffer.data);
+    aof_status.rewrite_buffer = (aof_buffer){NULL, 0, 0};
+
+    if (aof_status.last_bgrewrite_ok)
+        printf("Redis server: Background append only file rewriting terminated with success (%lld bytes)\n",
+               (long long)aof_status.base_size);
+    else {
+        unlink(temp_filename);
+        fprintf(stderr, "Redis server: Background append only file rewriting failed\n");
+    }
+}
@@ -0,0 +1,79 @@
+//
+// Append only file (AOF) header file
+//
+// Every command that changes the keyspace is appended to the file as an RESP array, the same way clients send it.
+// Commands with a relative expiry are logged with the absolute time instead, so that replaying the file later gives
+// the same result. Replaying the file on startup rebuilds the keyspace. A command is preceded by a SELECT whenever it
+// works on another database than the one before it.
+//
+// Commands are collected in a buffer while the event loop handles a batch of clients and written with one write()
+// per loop iteration, before any reply of that iteration is sent. With appendfsync always that write is followed by a
+// single fsync (group commit), with everysec a background thread fsyncs at most once per second.
+//
+// BGREWRITEAOF compacts the file: a forked child writes the shortest list of commands that rebuilds the keyspace to
+// a temporary file while the parent keeps a copy of every command logged since the fork in a rewrite buffer. Once the
+// child is done, the parent appends the rewrite buffer to the new file and renames it over the old one, so the swap
+// is atomic and no write is lost. A rewrite starts by itself when the file has grown by auto-aof-rewrite-percentage
+// since the last rewrite.
+//
+
+#ifndef REDIS_AOF_H
+#define REDIS_AOF_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include "redis.h"
+
+#define AOF_FILE_NAME "appendonly.aof"
+#define AOF_REWRITE_ITEMS_PER_CMD 64 // list items per RPUSH when the keyspace is written out as commands
+#define AOF_REWRITE_BUFFER_SIZE (1024 * 1024) // bytes of commands buffered before they are written out
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} aof_buffer;
+
+typedef struct {
+    int fd; // -1 when the append only file is off
+    aof_buffer buffer; // commands logged during the current event loop iteration
+    int selected_db; // database the file is at, as the last SELECT in it left it. -1 if not known
+    off_t current_size;
+    off_t fsynced_size; // bytes known to be on disk
+    off_t base_size; // size after the last rewrite (or on startup), automatic rewrites compare the growth to it
+    int loading; // set while the file is replayed, so the replayed commands are not logged again
+    int last_write_ok;
+    long last_fsync_ms;
+    long long fsync_count;
+    pthread_t fsync_thread;
+    pthread_mutex_t fsync_mutex;
+    pthread_cond_t fsync_cond;
+    int fsync_requested; // guarded by fsync_mutex
+    int fsync_in_progress; // guarded by fsync_mutex
+    pid_t rewrite_child_pid; // -1 if no BGREWRITEAOF is running
+    const char *rewrite_filename; // file the running rewrite replaces
+    aof_buffer rewrite_buffer; // commands logged since the rewrite child was forked
+    int rewrite_selected_db; // like selected_db, for the rewrite buffer
+    int rewrite_scheduled; // BGREWRITEAOF was asked for while a BGSAVE was running
+    time_t rewrite_start;
+    int last_bgrewrite_ok;
+    long last_rewrite_time_sec; // -1 if no rewrite has finished yet
+} aof_state;
+
+extern aof_state aof_status;
+
+int aof_open(const char *);
+int aof_load(const char *);
+int aof_rewrite_to_fd(int);
+int aof_rewrite(const char *);
+void buffer_append_command(aof_buffer *, const char *[], const size_t [], int);
+void aof_rewrite_object(aof_buffer *, redis_object *);
+void aof_feed_command(const char *[], int);
+void aof_feed_raw(const char *, size_t);
+void aof_flush(void);
+int aof_bgrewrite(const char *);
+void aof_check_bgrewrite_done(void);
+
+#endif //REDIS_AOF_H
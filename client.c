@@ -0,0 +1,346 @@
+//
+// Client connection state source file
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "client.h"
+#include "serde.h"
+#include "config.h"
+#include "multi.h"
+#include "pubsub.h"
+#include "tracking.h"
+
+static atomic_ullong next_client_id = 1;
+static atomic_llong output_limit_disconnections = 0;
+
+/*
+ * Makes sure a buffer can hold at least needed bytes, growing it geometrically.
+ */
+static void reserve_buffer(char **buffer, size_t *capacity, size_t needed){
+    if (needed <= *capacity)
+        return;
+    size_t new_capacity = *capacity == 0 ? READ_CHUNK_SIZE : *capacity;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    *buffer = realloc(*buffer, new_capacity);
+    *capacity = new_capacity;
+}
+
+/*
+ * Allocates a shared reply of len bytes, to be filled in by the caller, which holds a reference to it until it calls
+ * release_shared_reply().
+ */
+shared_reply * create_shared_reply(size_t len){
+    shared_reply *reply = malloc(sizeof *reply + len);
+
+    atomic_init(&reply->refcount, 1);
+    reply->len = len;
+    return reply;
+}
+
+/*
+ * Drops a reference to a shared reply. The clients holding the others may be written to by the I/O threads.
+ */
+void release_shared_reply(shared_reply *reply){
+    if (atomic_fetch_sub(&reply->refcount, 1) == 1)
+        free(reply);
+}
+
+static void drop_shared_replies(redis_client *client){
+    for (int i = 0; i < client->num_shared_replies; i++)
+        release_shared_reply(client->shared_replies[i].reply);
+    client->num_shared_replies = 0;
+    client->shared_reply_sent = 0;
+    client->shared_reply_bytes = 0;
+}
+
+/*
+ * Creates the state for a newly accepted connection and puts its socket in non-blocking mode, so a slow reader can
+ * never stall the event loop.
+ */
+redis_client * create_client(int fd){
+    redis_client *client = calloc(1, sizeof *client);
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags != -1)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    client->fd = fd;
+    client->id = atomic_fetch_add(&next_client_id, 1);
+    client->repl_rdb_fd = -1;
+    client->resp = 2;
+    return client;
+}
+
+void free_client(redis_client *client){
+    close(client->fd);
+    if (client->repl_rdb_fd != -1)
+        close(client->repl_rdb_fd);
+    for (int i = 0; i < client->num_commands; i++)
+        free_command_args(client->commands[i].argv, client->commands[i].argv_len, client->commands[i].argc);
+    free(client->commands);
+    if (client->flags & CLIENT_RUNNING_SLICES)
+        free_command_args(client->sliced_command.argv, client->sliced_command.argv_len, client->sliced_command.argc);
+    discard_transaction(client);
+    unwatch_all_keys(client);
+    free(client->multi_commands);
+    free(client->watched_keys);
+    pubsub_unsubscribe_all(client);
+    tracking_disable(client);
+    free(client->channels);
+    free(client->patterns);
+    drop_shared_replies(client);
+    free(client->shared_replies);
+    free(client->shard_reply);
+    if (client->shard_key_owners != NULL){ // hung up during a split MGET, the parts received so far
+        for (int i = 0; i < client->shard_num_keys; i++){
+            free(client->shard_parts[client->shard_key_owners[i]]);
+            client->shard_parts[client->shard_key_owners[i]] = NULL;
+        }
+        free(client->shard_parts);
+        free(client->shard_key_owners);
+    }
+    free(client->query_buffer);
+    free(client->reply_buffer);
+    free(client);
+}
+
+/*
+ * Appends whatever is available on the socket to the query buffer.
+ *
+ * Returns the number of bytes read, 0 if nothing was available and -1 if the client hung up, the read failed or the
+ * query buffer grew past MAX_QUERY_BUFFER_SIZE.
+ */
+int read_from_client(redis_client *client){
+    reserve_buffer(&client->query_buffer, &client->query_capacity, client->query_len + READ_CHUNK_SIZE);
+    ssize_t num_bytes_recv = recv(client->fd, client->query_buffer + client->query_len, READ_CHUNK_SIZE, 0);
+
+    if (num_bytes_recv == 0){
+        printf("Redis server: socket %d hung up\n", client->fd);
+        return -1;
+    }
+    if (num_bytes_recv < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("Error receiving from socket");
+        return -1;
+    }
+    client->query_len += num_bytes_recv;
+    if (client->query_len > MAX_QUERY_BUFFER_SIZE){
+        fprintf(stderr, "Redis server: socket %d query buffer is too big, closing it\n", client->fd);
+        return -1;
+    }
+    return (int)num_bytes_recv;
+}
+
+/*
+ * Parses the complete commands of the query buffer that were not parsed yet into client->commands, where they wait to
+ * be executed. Clients can send several commands without waiting for the replies (pipelining), and a command may
+ * arrive over several reads. It only touches the client, so the I/O threads run it for many clients at once.
+ */
+void parse_client_input(redis_client *client){
+    while (client->query_parsed < client->query_len && !client->protocol_error && !client->close_after_reply){
+        client_command command;
+
+        long parsed = parse_resp_command(client->query_buffer + client->query_parsed,
+                                         client->query_len - client->query_parsed,
+                                         &command.argv, &command.argv_len, &command.argc);
+        if (parsed == 0) // wait for the rest of the command
+            break;
+        if (parsed == -1){
+            client->protocol_error = 1;
+            break;
+        }
+        if (client->num_commands == client->commands_capacity){
+            client->commands_capacity = client->commands_capacity == 0 ? 16 : client->commands_capacity * 2;
+            client->commands = realloc(client->commands, sizeof *client->commands * client->commands_capacity);
+        }
+        command.len = parsed;
+        client->commands[client->num_commands++] = command;
+        client->query_parsed += parsed;
+    }
+}
+
+/*
+ * Drops the first num_bytes of the query buffer once they have been parsed.
+ */
+void consume_query_buffer(redis_client *client, size_t num_bytes){
+    memmove(client->query_buffer, client->query_buffer + num_bytes, client->query_len - num_bytes);
+    client->query_len -= num_bytes;
+}
+
+/*
+ * Closes a client whose replies pile up because it reads them too slowly, or not at all: over the hard limit right
+ * away, over the soft limit once it stayed there for the soft seconds. Its replies are dropped on the spot, they could
+ * take up any amount of memory otherwise. Replicas get the stream of writes through their replies and are not limited,
+ * nor are the clients without a connection that run the commands of other shards.
+ */
+static void enforce_output_buffer_limits(redis_client *client){
+    size_t pending = client->reply_len - client->reply_sent + client->shared_reply_bytes - client->shared_reply_sent;
+    long hard_limit = server_config.client_output_buffer_hard_limit;
+    long soft_limit = server_config.client_output_buffer_soft_limit;
+
+    if (client->fd == -1 || client->flags & (CLIENT_MASTER | CLIENT_REPLICA | CLIENT_CLOSE_ASAP))
+        return;
+    if (soft_limit == 0 || pending <= (size_t)soft_limit)
+        client->reply_soft_limit_since = 0;
+    else if (client->reply_soft_limit_since == 0)
+        client->reply_soft_limit_since = time(NULL);
+
+    if (!(hard_limit > 0 && pending > (size_t)hard_limit) && !(client->reply_soft_limit_since != 0 &&
+        time(NULL) - client->reply_soft_limit_since >= server_config.client_output_buffer_soft_seconds))
+        return;
+    fprintf(stderr, "Redis server: socket %d has %zu bytes of replies waiting, over the output buffer limit, "
+                    "closing it\n", client->fd, pending);
+    client->flags |= CLIENT_CLOSE_ASAP;
+    free(client->reply_buffer);
+    client->reply_buffer = NULL;
+    client->reply_capacity = 0;
+    client->reply_len = 0;
+    client->reply_sent = 0;
+    client->reply_hold = 0;
+    drop_shared_replies(client);
+    atomic_fetch_add(&output_limit_disconnections, 1);
+}
+
+/*
+ * Queues a serialized reply. Replies are only sent by write_to_client(), after the append only file is flushed.
+ */
+void add_reply(redis_client *client, const char *reply, size_t len){
+    if (client->flags & CLIENT_CLOSE_ASAP) // its replies are never sent
+        return;
+    reserve_buffer(&client->reply_buffer, &client->reply_capacity, client->reply_len + len);
+    memcpy(client->reply_buffer + client->reply_len, reply, len);
+    client->reply_len += len;
+    enforce_output_buffer_limits(client);
+}
+
+/*
+ * Queues a shared reply by reference, after the replies queued so far, instead of copying it. Replicas and the
+ * clients of other shards get a copy, their replies are read straight from reply_buffer.
+ */
+void add_shared_reply(redis_client *client, shared_reply *reply){
+    if (client->flags & CLIENT_CLOSE_ASAP)
+        return;
+    if (client->fd == -1 || client->flags & (CLIENT_REPLICA | CLIENT_REPLY_HELD)){
+        add_reply(client, reply->data, reply->len);
+        return;
+    }
+    if (client->num_shared_replies == client->shared_replies_capacity){
+        client->shared_replies_capacity = client->shared_replies_capacity == 0 ? 8 :
+                                          client->shared_replies_capacity * 2;
+        client->shared_replies = realloc(client->shared_replies,
+                                         sizeof *client->shared_replies * client->shared_replies_capacity);
+    }
+    atomic_fetch_add(&reply->refcount, 1);
+    client->shared_replies[client->num_shared_replies].reply = reply;
+    client->shared_replies[client->num_shared_replies].at = client->reply_len;
+    client->num_shared_replies++;
+    client->shared_reply_bytes += reply->len;
+    enforce_output_buffer_limits(client);
+}
+
+/*
+ * Checks if there are replies that can be sent right now (held back replies don't count).
+ */
+int client_has_pending_replies(const redis_client *client){
+    size_t end = (client->flags & CLIENT_REPLY_HELD) ? client->reply_hold : client->reply_len;
+    return end > client->reply_sent || client->num_shared_replies > 0;
+}
+
+/*
+ * Marks n more bytes as sent, first the ones of reply_buffer up to the next shared reply, then that shared reply, and
+ * so on. Shared replies sent whole are released.
+ */
+static void consume_sent_bytes(redis_client *client, size_t n){
+    int num_done = 0;
+
+    while (n > 0){
+        size_t flat_end = num_done < client->num_shared_replies ? client->shared_replies[num_done].at :
+                          client->reply_len;
+        if (client->reply_sent < flat_end){
+            size_t len = n < flat_end - client->reply_sent ? n : flat_end - client->reply_sent;
+            client->reply_sent += len;
+            n -= len;
+            continue;
+        }
+        shared_reply *reply = client->shared_replies[num_done].reply;
+        size_t len = n < reply->len - client->shared_reply_sent ? n : reply->len - client->shared_reply_sent;
+        client->shared_reply_sent += len;
+        n -= len;
+        if (client->shared_reply_sent == reply->len){
+            client->shared_reply_bytes -= reply->len;
+            client->shared_reply_sent = 0;
+            release_shared_reply(reply);
+            num_done++;
+        }
+    }
+    client->num_shared_replies -= num_done;
+    if (client->num_shared_replies > 0)
+        memmove(client->shared_replies, client->shared_replies + num_done,
+                sizeof *client->shared_replies * client->num_shared_replies);
+}
+
+/*
+ * Checks if the event loop should wait for the socket to become writable.
+ */
+int client_wants_write(const redis_client *client){
+    return client_has_pending_replies(client) || (client->flags & CLIENT_CONNECTING) ||
+           ((client->flags & CLIENT_REPLICA) && client->repl_state == REPLICA_SEND_BULK);
+}
+
+/*
+ * Sends as much of the queued replies as the socket accepts without blocking, the shared ones straight from where
+ * they are, with the bytes of reply_buffer around them in the same call.
+ *
+ * Returns 0 on success (even if some bytes are left for the next time the socket is writable) and -1 on failure.
+ */
+int write_to_client(redis_client *client){
+    while (client_has_pending_replies(client)){
+        struct iovec iov[WRITE_IOVECS];
+        struct msghdr message = {.msg_iov = iov};
+        size_t end = (client->flags & CLIENT_REPLY_HELD) ? client->reply_hold : client->reply_len;
+        size_t pos = client->reply_sent;
+        int i = 0;
+
+        for (; i < client->num_shared_replies && message.msg_iovlen < WRITE_IOVECS - 1; i++){
+            shared_reply_ref *ref = &client->shared_replies[i];
+            size_t skip = i == 0 ? client->shared_reply_sent : 0;
+            if (ref->at > pos){
+                iov[message.msg_iovlen++] = (struct iovec){client->reply_buffer + pos, ref->at - pos};
+                pos = ref->at;
+            }
+            iov[message.msg_iovlen++] = (struct iovec){ref->reply->data + skip, ref->reply->len - skip};
+        }
+        if (i == client->num_shared_replies && end > pos)
+            iov[message.msg_iovlen++] = (struct iovec){client->reply_buffer + pos, end - pos};
+        ssize_t n = sendmsg(client->fd, &message, MSG_NOSIGNAL);
+        if (n == -1){
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            perror("Error sending to client");
+            return -1;
+        }
+        consume_sent_bytes(client, n);
+    }
+    if (client->reply_sent == client->reply_len && client->num_shared_replies == 0){ // reuse the buffer from the start
+        client->reply_len = 0;
+        client->reply_sent = 0;
+        client->reply_hold = 0;
+    }
+    return 0;
+}
+
+/*
+ * Clients closed by enforce_output_buffer_limits() since the server started, for INFO.
+ */
+long long client_output_limit_disconnections(void){
+    return atomic_load(&output_limit_disconnections);
+}
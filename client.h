@@ -0,0 +1,153 @@
+//
+// Client connection state header file
+//
+
+#ifndef REDIS_CLIENT_H
+#define REDIS_CLIENT_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define READ_CHUNK_SIZE 16384 // bytes read from a client socket at a time
+#define MAX_QUERY_BUFFER_SIZE (1024L * 1024 * 1024) // drop clients that send 1 GB without completing a command
+#define WRITE_IOVECS 64 // buffers sent by a single writev() call
+
+// redis_client.flags
+#define CLIENT_MASTER 1 // our connection to the primary we replicate
+#define CLIENT_REPLICA 2 // a replica of this server
+#define CLIENT_CONNECTING 4 // outgoing connection, non-blocking connect() in progress
+#define CLIENT_REPLY_HELD 8 // replies past reply_hold are held back, see replication.c
+#define CLIENT_CLOSE_ASAP 16 // close without sending the pending replies
+#define CLIENT_ASKING 32 // sent ASKING, the next command may use a slot this cluster node is importing
+#define CLIENT_WAITING_SHARD 64 // waiting for the replies of commands sent to other shards, see shard.h
+#define CLIENT_RUNNING_SLICES 128 // running a long command one slice per event loop iteration, see redis.c
+#define CLIENT_OVER_BUDGET 256 // used up its command budget with commands left, see process_client_input()
+#define CLIENT_MULTI 512 // sent MULTI, its commands are queued until EXEC, see multi.h
+#define CLIENT_DIRTY_EXEC 1024 // a command could not be queued, EXEC fails
+#define CLIENT_TRACKING 2048 // told about changes of the keys it may have cached, see tracking.h
+#define CLIENT_TRACKING_BCAST 4096 // of every key starting with one of its prefixes
+#define CLIENT_TRACKING_OPTIN 8192 // only of the keys read right after CLIENT CACHING yes
+#define CLIENT_TRACKING_OPTOUT 16384 // of the keys read, but right after CLIENT CACHING no
+#define CLIENT_TRACKING_NOLOOP 32768 // but not of its own changes
+#define CLIENT_TRACKING_CACHING 65536 // sent CLIENT CACHING, for its next command
+
+enum replica_state {
+    REPLICA_WAIT_BGSAVE_START, // needs a full resync, waiting for a BGSAVE to start
+    REPLICA_WAIT_BGSAVE_END, // the stream of writes is buffered while the snapshot is saved
+    REPLICA_SEND_BULK, // sending the snapshot
+    REPLICA_ONLINE // receiving the stream of writes
+};
+
+typedef struct {
+    char **argv;
+    size_t *argv_len;
+    int argc;
+    size_t len; // bytes of the query buffer it was parsed from
+} client_command;
+
+// a reply queued as it is for many clients, e.g. a published message, freed when the last of them sent it
+typedef struct {
+    atomic_int refcount;
+    size_t len;
+    char data[];
+} shared_reply;
+
+typedef struct {
+    shared_reply *reply;
+    size_t at; // the bytes of reply_buffer before this offset are sent first
+} shared_reply_ref;
+
+struct pubsub_channel;
+struct pubsub_pattern;
+
+typedef struct {
+    int db;
+    unsigned slot; // of the version stamp of the key, see multi.h
+    unsigned stamp; // the version stamp when it was watched
+    unsigned db_stamp; // the one of its database, bumped by FLUSHDB, FLUSHALL and SWAPDB
+} watched_key;
+
+typedef struct {
+    int fd;
+    unsigned long long id; // unique for the lifetime of the server, unlike fd
+    int flags;
+    int db; // index of the database its commands work on, picked with SELECT
+    int resp; // version of the protocol of its replies, picked with HELLO, see resp_protocol
+    char *query_buffer; // bytes received but not parsed into commands yet
+    size_t query_len;
+    size_t query_capacity;
+    size_t query_parsed; // bytes at the start of query_buffer already parsed into commands
+    client_command *commands; // parsed but not executed yet
+    int num_commands;
+    int commands_capacity;
+    int protocol_error; // what follows the parsed commands is not valid RESP
+    int io_result; // what read_from_client() or write_to_client() returned on an I/O thread
+    int shard_replies_pending; // with CLIENT_WAITING_SHARD, replies still expected from the other shards
+    int shard_combine_replies; // the replies are parts of one split command, combined into a single one
+    long shard_reply_sum; // integer replies of the parts, added up
+    char *shard_reply; // first error (or non integer reply) of the parts, NULL if none
+    size_t shard_reply_len;
+    int *shard_key_owners; // for a split MGET, the shard of every key, in order
+    int shard_num_keys;
+    char **shard_parts; // for a split MGET, the array replied by each shard
+    client_command sliced_command; // with CLIENT_RUNNING_SLICES, the long command, whose arguments it owns
+    int sliced_next_arg; // first argument the slices did not get to yet
+    int sliced_result; // keys deleted or found by the slices so far
+    client_command *multi_commands; // with CLIENT_MULTI, the commands queued for EXEC
+    int num_multi_commands;
+    int multi_commands_capacity;
+    watched_key *watched_keys; // keys sent with WATCH since the last EXEC
+    int num_watched_keys;
+    int watched_keys_capacity;
+    char *reply_buffer; // replies waiting to be sent
+    size_t reply_len;
+    size_t reply_sent; // bytes at the start of reply_buffer that were already sent
+    size_t reply_capacity;
+    size_t reply_hold; // with CLIENT_REPLY_HELD, only the bytes before this offset may be sent
+    shared_reply_ref *shared_replies; // queued between the replies of reply_buffer, in order
+    int num_shared_replies;
+    int shared_replies_capacity;
+    size_t shared_reply_sent; // bytes of the first shared reply that were already sent
+    size_t shared_reply_bytes; // bytes of the shared replies that were not sent yet
+    struct pubsub_channel **channels; // channels it subscribed to, see pubsub.h
+    int num_channels;
+    int channels_capacity;
+    struct pubsub_pattern **patterns; // and patterns
+    int num_patterns;
+    int patterns_capacity;
+    int tracking_redirect_fd; // with CLIENT_TRACKING, the client its invalidation messages are sent to
+    unsigned long long tracking_redirect_id; // 0 if they are sent to itself
+    char **tracking_prefixes; // with CLIENT_TRACKING_BCAST
+    int num_tracking_prefixes;
+    time_t reply_soft_limit_since; // when the replies waiting to be sent went over the soft limit, 0 if they are not
+    int close_after_reply; // set on protocol errors, the connection is closed once the replies are sent
+    enum replica_state repl_state; // for CLIENT_REPLICA
+    int repl_rdb_fd; // snapshot being sent to a replica, -1 if none
+    off_t repl_rdb_offset;
+    off_t repl_rdb_size;
+    char repl_bulk_header[32]; // "$<snapshot size>\r\n", sent right before the snapshot
+    size_t repl_bulk_header_len;
+    size_t repl_bulk_header_sent;
+    time_t repl_sync_requested; // when the replica asked for a full resync
+    long long repl_ack_offset; // last offset the replica said it processed
+    time_t repl_ack_time;
+    long repl_listening_port;
+} redis_client;
+
+redis_client * create_client(int);
+void free_client(redis_client *);
+int read_from_client(redis_client *);
+void parse_client_input(redis_client *);
+void consume_query_buffer(redis_client *, size_t);
+void add_reply(redis_client *, const char *, size_t);
+shared_reply * create_shared_reply(size_t);
+void release_shared_reply(shared_reply *);
+void add_shared_reply(redis_client *, shared_reply *);
+int client_has_pending_replies(const redis_client *);
+int client_wants_write(const redis_client *);
+int write_to_client(redis_client *);
+long long client_output_limit_disconnections(void);
+
+#endif //REDIS_CLIENT_H
@@ -0,0 +1,1186 @@
+//
+// Cluster source file
+//
+#include <ctype.h>
+#include <fcntl.h>
+#include "cluster.h"
+#include "rdb.h"
+#include "aof.h"
+
+typedef struct {
+    char *host;
+    long port;
+    int fd;
+    time_t last_use;
+} migrate_socket;
+
+cluster_state cluster_status;
+
+static migrate_socket migrate_sockets[MIGRATE_MAX_CACHED_SOCKETS]; // connections kept open for the next MIGRATE
+static int num_migrate_sockets = 0;
+static aof_buffer migrate_buffer; // the RESTORE commands of a MIGRATE are formatted here
+
+static uint16_t crc16_table[256];
+
+/*
+ * Builds the table of the CRC16 used for hash slots (CCITT/XMODEM: polynomial 0x1021, initial value 0).
+ */
+static void crc16_init_table(void){
+    for (int i = 0; i < 256; i++){
+        uint16_t crc = (uint16_t)(i << 8);
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        crc16_table[i] = crc;
+    }
+}
+
+static uint16_t crc16(const char *data, size_t len){
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+        crc = (uint16_t)((crc << 8) ^ crc16_table[((crc >> 8) ^ (unsigned char)data[i]) & 0xff]);
+    return crc;
+}
+
+/*
+ * Gets the hash slot of a key. Only the part between the first '{' and the next '}' is hashed if it isn't empty.
+ */
+unsigned int key_hash_slot(const char *key, size_t key_len){
+    const char *open_brace = memchr(key, '{', key_len);
+
+    if (open_brace != NULL){
+        const char *tag = open_brace + 1;
+        const char *close_brace = memchr(tag, '}', key_len - (tag - key));
+        if (close_brace != NULL && close_brace > tag)
+            return crc16(tag, close_brace - tag) & (CLUSTER_SLOTS - 1);
+    }
+    return crc16(key, key_len) & (CLUSTER_SLOTS - 1);
+}
+
+static const char * config_file_name(void){
+    return server_config.cluster_config_file != NULL ? server_config.cluster_config_file : CLUSTER_CONFIG_FILE_NAME;
+}
+
+static cluster_node * find_node(const char *id){
+    for (int i = 0; i < cluster_status.num_nodes; i++)
+        if (strcmp(cluster_status.nodes[i]->id, id) == 0)
+            return cluster_status.nodes[i];
+    return NULL;
+}
+
+/*
+ * Adds a node to the ones we know, or updates the address of a known one.
+ */
+static cluster_node * add_node(const char *id, const char *host, long port){
+    cluster_node *node = find_node(id);
+
+    if (node == NULL){
+        node = calloc(1, sizeof *node);
+        snprintf(node->id, sizeof node->id, "%s", id);
+        cluster_status.nodes = realloc(cluster_status.nodes, sizeof *cluster_status.nodes *
+                                       (cluster_status.num_nodes + 1));
+        cluster_status.nodes[cluster_status.num_nodes++] = node;
+    }
+    free(node->host);
+    node->host = strdup(host);
+    node->port = port;
+    return node;
+}
+
+static void set_slot_node(int slot, cluster_node *node){
+    if (cluster_status.slots[slot] != NULL)
+        cluster_status.slots[slot]->num_slots--;
+    cluster_status.slots[slot] = node;
+    if (node != NULL)
+        node->num_slots++;
+}
+
+/*
+ * Writes the slots a node serves as "<start>-<end>" ranges (or "<slot>" for single slots) separated by spaces.
+ */
+static void write_node_slots(FILE *stream, const cluster_node *node){
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++){
+        if (cluster_status.slots[slot] != node)
+            continue;
+        int start = slot;
+        while (slot + 1 < CLUSTER_SLOTS && cluster_status.slots[slot + 1] == node)
+            slot++;
+        if (start == slot)
+            fprintf(stream, " %d", start);
+        else fprintf(stream, " %d-%d", start, slot);
+    }
+}
+
+/*
+ * Writes our view of the cluster in the format of CLUSTER NODES, one line per node:
+ *
+ *   <id> <host>:<port>@<bus port> <flags> <primary> <ping sent> <pong received> <epoch> <link state> <slots>...
+ *
+ * There is no cluster bus, so the bus port, the primary, the pings and the epoch are always 0 or "-". Our line ends
+ * with the slots being moved, as "[<slot>->-<target id>]" and "[<slot>-<-<source id>]".
+ */
+static void write_nodes(FILE *stream){
+    for (int i = 0; i < cluster_status.num_nodes; i++){
+        cluster_node *node = cluster_status.nodes[i];
+        fprintf(stream, "%s %s:%ld@0 %s - 0 0 0 connected", node->id, node->host, node->port,
+                node == cluster_status.myself ? "myself,master" : "master");
+        write_node_slots(stream, node);
+        for (int slot = 0; node == cluster_status.myself && slot < CLUSTER_SLOTS; slot++){
+            if (cluster_status.migrating_to[slot] != NULL)
+                fprintf(stream, " [%d->-%s]", slot, cluster_status.migrating_to[slot]->id);
+            if (cluster_status.importing_from[slot] != NULL)
+                fprintf(stream, " [%d-<-%s]", slot, cluster_status.importing_from[slot]->id);
+        }
+        fprintf(stream, "\n");
+    }
+}
+
+/*
+ * Saves our view of the cluster to cluster-config-file. The file is replaced atomically.
+ */
+static int save_config(void){
+    char temp_file_name[256];
+    char *nodes = NULL;
+    size_t nodes_len = 0;
+    FILE *stream = open_memstream(&nodes, &nodes_len);
+
+    write_nodes(stream);
+    fclose(stream);
+    snprintf(temp_file_name, sizeof temp_file_name, "temp-%d-%s", getpid(), config_file_name());
+    int fd = open(temp_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ret_val = fd == -1 || write_all(fd, nodes, nodes_len) == -1 || fsync(fd) == -1 ? -1 : 0;
+    if (fd != -1)
+        close(fd);
+    if (ret_val == 0 && rename(temp_file_name, config_file_name()) == -1)
+        ret_val = -1;
+    if (ret_val == -1){
+        perror("Error saving the cluster configuration");
+        unlink(temp_file_name);
+    }
+    free(nodes);
+    return ret_val;
+}
+
+/*
+ * Parses a "<start>-<end>" or "<slot>" token. Returns -1 if it is something else (e.g. the state of a slot being
+ * migrated).
+ */
+static int parse_slot_range(const char *token, int *start, int *end){
+    char *end_ptr;
+
+    *start = (int)strtol(token, &end_ptr, 10);
+    if (end_ptr == token)
+        return -1;
+    if (*end_ptr == '-')
+        *end = (int)strtol(end_ptr + 1, &end_ptr, 10);
+    else *end = *start;
+    if (*end_ptr != '\0' || *start < 0 || *end >= CLUSTER_SLOTS || *start > *end)
+        return -1;
+    return 0;
+}
+
+/*
+ * Splits one line in the format of CLUSTER NODES into tokens, the slot ranges start at the ninth one. The host of the
+ * node is copied to host (at least 256 bytes).
+ *
+ * Returns the number of tokens, or -1 if the line is invalid.
+ */
+static int parse_node_line(char *line, char *tokens[], int max_tokens, char *host, long *port){
+    int num_tokens = 0;
+    char *save_ptr;
+
+    for (char *token = strtok_r(line, " \r", &save_ptr); token != NULL && num_tokens < max_tokens;
+         token = strtok_r(NULL, " \r", &save_ptr))
+        tokens[num_tokens++] = token;
+    if (num_tokens < 8 || strlen(tokens[0]) != CLUSTER_NODE_ID_LEN)
+        return -1;
+
+    char *port_sep = strrchr(tokens[1], ':');
+    if (port_sep == NULL || port_sep - tokens[1] >= 256)
+        return -1;
+    memcpy(host, tokens[1], port_sep - tokens[1]);
+    host[port_sep - tokens[1]] = '\0';
+    *port = strtol(port_sep + 1, NULL, 10);
+    return *port > 0 && *port <= 65535 ? num_tokens : -1;
+}
+
+/*
+ * Loads our view of the cluster from cluster-config-file. Returns -1 if there is no such file.
+ */
+static int load_config(void){
+    FILE *file_ptr = fopen(config_file_name(), "r");
+    char line[CLUSTER_SLOTS * 6 + 512];
+    char *tokens[CLUSTER_SLOTS + 8];
+    char host[256];
+    long port;
+    struct {
+        int slot;
+        char direction[4];
+        char id[CLUSTER_NODE_ID_LEN + 1];
+    } *moving = NULL; // slots being moved, resolved once every node is known
+    int num_moving = 0;
+
+    if (file_ptr == NULL)
+        return -1;
+    while (fgets(line, sizeof line, file_ptr) != NULL){
+        line[strcspn(line, "\n")] = '\0';
+        int num_tokens = parse_node_line(line, tokens, CLUSTER_SLOTS + 8, host, &port);
+        if (num_tokens == -1)
+            continue;
+        cluster_node *node = cluster_status.myself;
+        if (strstr(tokens[2], "myself") != NULL) // keep the id we had before the restart
+            memcpy(node->id, tokens[0], CLUSTER_NODE_ID_LEN);
+        else node = add_node(tokens[0], host, port);
+        for (int i = 8; i < num_tokens; i++){
+            int start, end;
+            if (parse_slot_range(tokens[i], &start, &end) == 0){
+                for (int slot = start; slot <= end; slot++)
+                    set_slot_node(slot, node);
+                continue;
+            }
+            moving = realloc(moving, sizeof *moving * (num_moving + 1));
+            if (sscanf(tokens[i], "[%d%3[-<>]%40[0-9a-f]]", &moving[num_moving].slot, moving[num_moving].direction,
+                       moving[num_moving].id) == 3 && moving[num_moving].slot >= 0 &&
+                moving[num_moving].slot < CLUSTER_SLOTS)
+                num_moving++;
+        }
+    }
+    fclose(file_ptr);
+
+    for (int i = 0; i < num_moving; i++){
+        if (strcmp(moving[i].direction, "->-") == 0)
+            cluster_status.migrating_to[moving[i].slot] = find_node(moving[i].id);
+        else if (strcmp(moving[i].direction, "-<-") == 0)
+            cluster_status.importing_from[moving[i].slot] = find_node(moving[i].id);
+    }
+    free(moving);
+    return 0;
+}
+
+/*
+ * Sets up cluster mode. Has to run before the keyspace is loaded, so that the loaded keys are indexed by slot.
+ */
+void cluster_init(void){
+    char id[CLUSTER_NODE_ID_LEN + 1];
+
+    crc16_init_table();
+    if (!server_config.cluster_enabled)
+        return;
+    get_random_hex(id, CLUSTER_NODE_ID_LEN);
+    cluster_status.myself = add_node(id, server_config.cluster_announce_ip != NULL ?
+                                     server_config.cluster_announce_ip : CLUSTER_DEFAULT_ANNOUNCE_IP,
+                                     server_config.port);
+    if (load_config() == -1)
+        printf("Redis server: No cluster configuration found, starting as node %s\n", cluster_status.myself->id);
+    else printf("Redis server: Loaded the cluster configuration, this is node %s\n", cluster_status.myself->id);
+    if (save_config() == -1){
+        fprintf(stderr, "Redis server: Can't save the cluster configuration. Exiting.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Adds a key that was just linked to the keyspace to the index of its slot.
+ */
+void cluster_add_key(redis_object *obj){
+    unsigned int slot = key_hash_slot(obj->key, strlen(obj->key));
+
+    obj->slot_prev = NULL;
+    obj->slot_next = cluster_status.slot_keys[slot];
+    if (obj->slot_next != NULL)
+        obj->slot_next->slot_prev = obj;
+    cluster_status.slot_keys[slot] = obj;
+    cluster_status.slot_key_counts[slot]++;
+}
+
+void cluster_remove_key(redis_object *obj){
+    unsigned int slot = key_hash_slot(obj->key, strlen(obj->key));
+
+    if (obj->slot_prev != NULL)
+        obj->slot_prev->slot_next = obj->slot_next;
+    else cluster_status.slot_keys[slot] = obj->slot_next;
+    if (obj->slot_next != NULL)
+        obj->slot_next->slot_prev = obj->slot_prev;
+    cluster_status.slot_key_counts[slot]--;
+}
+
+/*
+ * Empties the slot index, when the whole keyspace is detached.
+ */
+void cluster_clear_keys(void){
+    memset(cluster_status.slot_keys, 0, sizeof cluster_status.slot_keys);
+    memset(cluster_status.slot_key_counts, 0, sizeof cluster_status.slot_key_counts);
+}
+
+/*
+ * Gets the arguments of a command that are keys: from first to the last argument (or to last if it is positive),
+ * every step arguments. Returns 0 for commands without keys.
+ */
+int get_command_keys(const char *cmd[], int args, int *first, int *last, int *step){
+    static const struct {
+        const char *name;
+        int first, last, step; // last is 0 for "up to the last argument"
+    } key_specs[] = {
+            {"GET", 1, 1, 1}, {"SET", 1, 1, 1}, {"INCR", 1, 1, 1}, {"DECR", 1, 1, 1}, {"EXPIRE", 1, 1, 1},
+            {"PEXPIRE", 1, 1, 1}, {"EXPIREAT", 1, 1, 1}, {"PEXPIREAT", 1, 1, 1}, {"TTL", 1, 1, 1},
+            {"PTTL", 1, 1, 1}, {"EXPIRETIME", 1, 1, 1}, {"PEXPIRETIME", 1, 1, 1}, {"PERSIST", 1, 1, 1},
+            {"LPUSH", 1, 1, 1}, {"RPUSH", 1, 1, 1}, {"DEL", 1, 0, 1}, {"UNLINK", 1, 0, 1}, {"EXISTS", 1, 0, 1},
+            {"DUMP", 1, 1, 1}, {"RESTORE", 1, 1, 1}, {"RESTORE-ASKING", 1, 1, 1}, {"MGET", 1, 0, 1},
+            {"MSET", 1, 0, 2}, {"MSETNX", 1, 0, 2}, {"WATCH", 1, 0, 1},
+            {NULL, 0, 0, 0} // MIGRATE runs on the source of a slot being moved, where its keys may already be gone
+    };
+
+    for (int i = 0; key_specs[i].name != NULL; i++){
+        if (strcmp(key_specs[i].name, cmd[0]) != 0)
+            continue;
+        *first = key_specs[i].first;
+        *last = key_specs[i].last > 0 ? key_specs[i].last : args - 1;
+        *step = key_specs[i].step;
+        return *first < args;
+    }
+    return 0;
+}
+
+static char * error_reply(const char *message){
+    return (char *)serialize((char *)message, strlen(message), SIMPLE_ERROR);
+}
+
+/*
+ * Checks that this node serves the keys of a command. Returns NULL if it does, otherwise the error to reply with:
+ * -MOVED to the node serving their slot, -CROSSSLOT if the keys are in different slots or -CLUSTERDOWN if nobody
+ * serves the slot. While the slot is being moved, keys we don't have (anymore) are sent to the target with -ASK, and
+ * the target only serves the slot to clients that sent ASKING. A command on several keys of which only some were
+ * moved yet gets -TRYAGAIN.
+ */
+char * cluster_redirect(redis_client *client, const char *cmd[], int args){
+    int first, last, step;
+    int slot = -1;
+    int num_keys = 0, missing_keys = 0;
+    char message[512];
+
+    if (!server_config.cluster_enabled || !get_command_keys(cmd, args, &first, &last, &step))
+        return NULL;
+    for (int i = first; i <= last; i += step){
+        int key_slot = (int)key_hash_slot(cmd[i], strlen(cmd[i]));
+        if (slot != -1 && key_slot != slot)
+            return error_reply("CROSSSLOT Keys in request don't hash to the same slot");
+        slot = key_slot;
+
+        redis_object *obj;
+        HASH_FIND_STR(db->objects_map, cmd[i], obj);
+        num_keys++;
+        missing_keys += obj == NULL;
+    }
+
+    cluster_node *node = cluster_status.slots[slot];
+    int asking = (client->flags & CLIENT_ASKING) || strcmp(cmd[0], "RESTORE-ASKING") == 0;
+    if (node == cluster_status.myself && cluster_status.migrating_to[slot] != NULL && missing_keys > 0){
+        if (missing_keys < num_keys)
+            return error_reply("TRYAGAIN Multiple keys request during rehashing of slot");
+        node = cluster_status.migrating_to[slot];
+        snprintf(message, sizeof message, "ASK %d %s:%ld", slot, node->host, node->port);
+        return error_reply(message);
+    }
+    if (node != cluster_status.myself && cluster_status.importing_from[slot] != NULL && asking){
+        if (num_keys > 1 && missing_keys > 0)
+            return error_reply("TRYAGAIN Multiple keys request during rehashing of slot");
+        return NULL;
+    }
+    if (node == cluster_status.myself)
+        return NULL;
+    if (node == NULL){
+        snprintf(message, sizeof message, "CLUSTERDOWN Hash slot %d not served", slot);
+        return error_reply(message);
+    }
+    snprintf(message, sizeof message, "MOVED %d %s:%ld", slot, node->host, node->port);
+    return error_reply(message);
+}
+
+/*
+ * Starts a non-blocking connection to another server and waits at most timeout_ms for it to be established. Returns
+ * the socket, or -1 on failure.
+ */
+static int connect_with_timeout(const char *host, long port, int timeout_ms){
+    int fd = connect_to_server(host, port);
+    int error = 0;
+    socklen_t error_len = sizeof error;
+
+    if (fd == -1)
+        return -1;
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    if (poll(&pfd, 1, timeout_ms) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 ||
+        error != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Connects to another node and fetches its CLUSTER NODES, waiting at most CLUSTER_MEET_TIMEOUT_MS for each step.
+ * Returns a newly allocated string, or NULL on failure.
+ */
+static char * fetch_nodes(const char *host, long port){
+    static const char request[] = "*2\r\n$7\r\nCLUSTER\r\n$5\r\nNODES\r\n";
+    char *reply = NULL;
+    size_t reply_len = 0;
+    long expected_len = -1; // size of the whole reply once its header was received
+    int fd = connect_with_timeout(host, port, CLUSTER_MEET_TIMEOUT_MS);
+
+    if (fd == -1)
+        return NULL;
+    if (write_all(fd, request, sizeof request - 1) == -1){
+        close(fd);
+        return NULL;
+    }
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (expected_len == -1 || (long)reply_len < expected_len){
+        if (poll(&pfd, 1, CLUSTER_MEET_TIMEOUT_MS) != 1)
+            break;
+        reply = realloc(reply, reply_len + READ_CHUNK_SIZE + 1);
+        ssize_t num_bytes = recv(fd, reply + reply_len, READ_CHUNK_SIZE, 0);
+        if (num_bytes <= 0)
+            break;
+        reply_len += num_bytes;
+        reply[reply_len] = '\0';
+        char *header_end = strstr(reply, "\r\n");
+        if (header_end == NULL)
+            continue;
+        if (reply[0] != '$')
+            break;
+        expected_len = (header_end + 2 - reply) + strtol(reply + 1, NULL, 10) + 2;
+    }
+    close(fd);
+    if (expected_len == -1 || (long)reply_len < expected_len){
+        free(reply);
+        return NULL;
+    }
+    size_t header_len = strstr(reply, "\r\n") + 2 - reply;
+    reply[expected_len - 2] = '\0';
+    memmove(reply, reply + header_len, expected_len - 1 - header_len);
+    return reply;
+}
+
+/*
+ * CLUSTER MEET: learns the id of another node and the slots it serves. Slots we already think are served by
+ * some node are left alone. Returns 0 on success, -1 if the node can't be reached and -2 if it isn't a cluster node.
+ */
+static int meet_node(const char *host, long port){
+    char *tokens[CLUSTER_SLOTS + 8];
+    char node_host[256];
+    long node_port;
+    char *save_ptr;
+
+    if (port == cluster_status.myself->port && strcmp(host, cluster_status.myself->host) == 0)
+        return 0; // we would wait for our own reply
+    char *nodes = fetch_nodes(host, port);
+    if (nodes == NULL)
+        return -1;
+    int ret_val = -2;
+    for (char *line = strtok_r(nodes, "\n", &save_ptr); line != NULL; line = strtok_r(NULL, "\n", &save_ptr)){
+        int num_tokens = parse_node_line(line, tokens, CLUSTER_SLOTS + 8, node_host, &node_port);
+        if (num_tokens == -1 || strstr(tokens[2], "myself") == NULL || find_node(tokens[0]) == cluster_status.myself)
+            continue;
+        cluster_node *node = add_node(tokens[0], host, port); // the address we reached it with
+        for (int i = 8; i < num_tokens; i++){
+            int start, end;
+            if (parse_slot_range(tokens[i], &start, &end) == -1)
+                continue;
+            for (int slot = start; slot <= end; slot++)
+                if (cluster_status.slots[slot] == NULL)
+                    set_slot_node(slot, node);
+        }
+        printf("Redis server: Met cluster node %s at %s:%ld\n", node->id, host, port);
+        ret_val = 0;
+    }
+    free(nodes);
+    return ret_val;
+}
+
+/*
+ * CLUSTER FORGET: drops a node and leaves its slots unassigned.
+ */
+static int forget_node(const char *id){
+    cluster_node *node = find_node(id);
+
+    if (node == NULL)
+        return -1;
+    if (node == cluster_status.myself)
+        return -2;
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++){
+        if (cluster_status.slots[slot] == node)
+            set_slot_node(slot, NULL);
+        if (cluster_status.migrating_to[slot] == node)
+            cluster_status.migrating_to[slot] = NULL;
+        if (cluster_status.importing_from[slot] == node)
+            cluster_status.importing_from[slot] = NULL;
+    }
+    for (int i = 0; i < cluster_status.num_nodes; i++){
+        if (cluster_status.nodes[i] == node){
+            cluster_status.nodes[i] = cluster_status.nodes[--cluster_status.num_nodes];
+            break;
+        }
+    }
+    free(node->host);
+    free(node);
+    return 0;
+}
+
+static int parse_slot(const char *value){
+    char *end_ptr;
+    long slot = strtol(value, &end_ptr, 10);
+
+    if (end_ptr == value || *end_ptr != '\0' || slot < 0 || slot >= CLUSTER_SLOTS)
+        return -1;
+    return (int)slot;
+}
+
+/*
+ * CLUSTER ADDSLOTS, DELSLOTS, ADDSLOTSRANGE and DELSLOTSRANGE. Slots are only added if nobody serves them and only
+ * removed if we do, and nothing changes unless every slot can be.
+ *
+ * Returns 0 on success, -1 for an invalid slot, -2 if a slot is served by someone else (or not by us when deleting)
+ * and -3 if a range has an odd number of bounds.
+ */
+static int change_own_slots(const char *cmd[], int args, int add, int ranges){
+    static unsigned char requested[CLUSTER_SLOTS];
+
+    if (ranges && (args - 2) % 2 != 0)
+        return -3;
+    memset(requested, 0, sizeof requested);
+    for (int i = 2; i < args; i += ranges ? 2 : 1){
+        int start = parse_slot(cmd[i]);
+        int end = ranges ? parse_slot(cmd[i + 1]) : start;
+        if (start == -1 || end == -1 || start > end)
+            return -1;
+        for (int slot = start; slot <= end; slot++){
+            if (add ? cluster_status.slots[slot] != NULL : cluster_status.slots[slot] != cluster_status.myself)
+                return -2;
+            requested[slot] = 1;
+        }
+    }
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+        if (requested[slot])
+            set_slot_node(slot, add ? cluster_status.myself : NULL);
+    return 0;
+}
+
+/*
+ * CLUSTER SETSLOT <slot> MIGRATING|IMPORTING <node id>, STABLE or NODE <node id>. Giving the slot to a node ends its
+ * migration.
+ *
+ * Returns 0 on success, -1 for an unknown state (or a missing node id), -2 for an unknown node, -3 if we are asked to
+ * migrate a slot we don't serve, -4 if we are asked to import one we do serve, -5 if we'd give away a slot that
+ * still has keys and -6 if we are asked to migrate a slot to or import it from ourselves.
+ */
+static int set_slot_state(int slot, const char *state, const char *id){
+    cluster_node *node = NULL;
+
+    if (strcasecmp(state, "STABLE") == 0){
+        cluster_status.migrating_to[slot] = NULL;
+        cluster_status.importing_from[slot] = NULL;
+        return 0;
+    }
+    if (id == NULL)
+        return -1;
+    if ((node = find_node(id)) == NULL)
+        return -2;
+    if (strcasecmp(state, "MIGRATING") == 0){
+        if (cluster_status.slots[slot] != cluster_status.myself)
+            return -3;
+        if (node == cluster_status.myself)
+            return -6;
+        cluster_status.migrating_to[slot] = node;
+        return 0;
+    }
+    if (strcasecmp(state, "IMPORTING") == 0){
+        if (cluster_status.slots[slot] == cluster_status.myself)
+            return -4;
+        if (node == cluster_status.myself)
+            return -6;
+        cluster_status.importing_from[slot] = node;
+        return 0;
+    }
+    if (strcasecmp(state, "NODE") == 0){
+        if (cluster_status.slots[slot] == cluster_status.myself && node != cluster_status.myself &&
+            cluster_status.slot_key_counts[slot] > 0)
+            return -5;
+        if (node == cluster_status.myself && cluster_status.importing_from[slot] != NULL)
+            printf("Redis server: Imported slot %d from %s\n", slot, cluster_status.importing_from[slot]->id);
+        set_slot_node(slot, node);
+        cluster_status.migrating_to[slot] = NULL;
+        cluster_status.importing_from[slot] = NULL;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Writes one node of CLUSTER SLOTS: host, port and id.
+ */
+static void write_slots_node(FILE *stream, const cluster_node *node){
+    fprintf(stream, "*3\r\n$%zu\r\n%s\r\n:%ld\r\n$%d\r\n%s\r\n", strlen(node->host), node->host, node->port,
+            CLUSTER_NODE_ID_LEN, node->id);
+}
+
+/*
+ * CLUSTER SLOTS: one entry per range of consecutive slots served by the same node.
+ */
+static char * cluster_slots_reply(void){
+    char *body = NULL, *reply = NULL;
+    size_t body_len = 0, reply_len = 0;
+    FILE *stream = open_memstream(&body, &body_len);
+    int num_ranges = 0;
+
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++){
+        cluster_node *node = cluster_status.slots[slot];
+        if (node == NULL)
+            continue;
+        int start = slot;
+        while (slot + 1 < CLUSTER_SLOTS && cluster_status.slots[slot + 1] == node)
+            slot++;
+        fprintf(stream, "*3\r\n:%d\r\n:%d\r\n", start, slot);
+        write_slots_node(stream, node);
+        num_ranges++;
+    }
+    fclose(stream);
+    stream = open_memstream(&reply, &reply_len);
+    fprintf(stream, "*%d\r\n", num_ranges);
+    fwrite(body, 1, body_len, stream);
+    fclose(stream);
+    free(body);
+    return reply;
+}
+
+/*
+ * CLUSTER SHARDS: one entry per node serving slots, with its slot ranges as pairs of bounds and the node itself. The
+ * entries and the node are maps (arrays of names and values in RESP2).
+ */
+static char * cluster_shards_reply(void){
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *stream = open_memstream(&reply, &reply_len);
+    char header[RESP_HEADER_SIZE];
+    int num_shards = 0;
+
+    for (int i = 0; i < cluster_status.num_nodes; i++)
+        num_shards += cluster_status.nodes[i]->num_slots > 0;
+    fprintf(stream, "*%d\r\n", num_shards);
+    for (int i = 0; i < cluster_status.num_nodes; i++){
+        cluster_node *node = cluster_status.nodes[i];
+        int num_ranges = 0;
+        if (node->num_slots == 0)
+            continue;
+        for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+            num_ranges += cluster_status.slots[slot] == node &&
+                          (slot == 0 || cluster_status.slots[slot - 1] != node);
+
+        serialize_header(header, MAP, 2);
+        fprintf(stream, "%s$5\r\nslots\r\n*%d\r\n", header, num_ranges * 2);
+        for (int slot = 0; slot < CLUSTER_SLOTS; slot++){
+            if (cluster_status.slots[slot] != node)
+                continue;
+            int start = slot;
+            while (slot + 1 < CLUSTER_SLOTS && cluster_status.slots[slot + 1] == node)
+                slot++;
+            fprintf(stream, ":%d\r\n:%d\r\n", start, slot);
+        }
+        serialize_header(header, MAP, 6);
+        fprintf(stream, "$5\r\nnodes\r\n*1\r\n%s", header);
+        fprintf(stream, "$2\r\nid\r\n$%d\r\n%s\r\n", CLUSTER_NODE_ID_LEN, node->id);
+        fprintf(stream, "$4\r\nport\r\n:%ld\r\n", node->port);
+        fprintf(stream, "$2\r\nip\r\n$%zu\r\n%s\r\n", strlen(node->host), node->host);
+        fprintf(stream, "$8\r\nendpoint\r\n$%zu\r\n%s\r\n", strlen(node->host), node->host);
+        fprintf(stream, "$4\r\nrole\r\n$6\r\nmaster\r\n");
+        fprintf(stream, "$6\r\nhealth\r\n$6\r\nonline\r\n");
+    }
+    fclose(stream);
+    return reply;
+}
+
+/*
+ * CLUSTER GETKEYSINSLOT: up to count keys of a slot, straight from the slot index.
+ */
+static char * keys_in_slot_reply(int slot, long count){
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *stream = open_memstream(&reply, &reply_len);
+
+    if (count > cluster_status.slot_key_counts[slot])
+        count = cluster_status.slot_key_counts[slot];
+    fprintf(stream, "*%ld\r\n", count);
+    for (redis_object *obj = cluster_status.slot_keys[slot]; obj != NULL && count > 0; obj = obj->slot_next, count--)
+        fprintf(stream, "$%zu\r\n%s\r\n", strlen(obj->key), obj->key);
+    fclose(stream);
+    return reply;
+}
+
+/*
+ * Writes the cluster section of INFO.
+ */
+void cluster_info(FILE *info_stream){
+    fprintf(info_stream, "# Cluster\r\n");
+    fprintf(info_stream, "cluster_enabled:%d\r\n\r\n", server_config.cluster_enabled);
+}
+
+/*
+ * CLUSTER INFO: whether every slot is served, and how many nodes we know.
+ */
+static char * cluster_info_reply(void){
+    char *info = NULL;
+    size_t info_len = 0;
+    FILE *stream = open_memstream(&info, &info_len);
+    int slots_assigned = 0;
+    int cluster_size = 0;
+
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+        slots_assigned += cluster_status.slots[slot] != NULL;
+    for (int i = 0; i < cluster_status.num_nodes; i++)
+        cluster_size += cluster_status.nodes[i]->num_slots > 0;
+    fprintf(stream, "cluster_state:%s\r\n", slots_assigned == CLUSTER_SLOTS ? "ok" : "fail");
+    fprintf(stream, "cluster_slots_assigned:%d\r\n", slots_assigned);
+    fprintf(stream, "cluster_known_nodes:%d\r\n", cluster_status.num_nodes);
+    fprintf(stream, "cluster_size:%d\r\n", cluster_size);
+    fprintf(stream, "cluster_my_slots:%d\r\n", cluster_status.myself->num_slots);
+    fclose(stream);
+
+    char *reply = (char *)serialize(info, info_len, VERBATIM_STRING);
+    free(info);
+    return reply;
+}
+
+/*
+ * Callback when CLUSTER is received.
+ */
+char * handle_cluster_command(const char *cmd[], int args){
+    char *response;
+    char *resp_response;
+
+    if (!server_config.cluster_enabled)
+        return error_reply("Failed: This instance has cluster support disabled");
+    if (args < 2)
+        return error_reply("Failed: Incomplete argument list");
+
+    if (strcasecmp(cmd[1], "MYID") == 0)
+        return (char *)serialize(cluster_status.myself->id, CLUSTER_NODE_ID_LEN, BULK_STRING);
+    if (strcasecmp(cmd[1], "INFO") == 0)
+        return cluster_info_reply();
+    if (strcasecmp(cmd[1], "SLOTS") == 0)
+        return cluster_slots_reply();
+    if (strcasecmp(cmd[1], "SHARDS") == 0)
+        return cluster_shards_reply();
+    if (strcasecmp(cmd[1], "NODES") == 0){
+        char *nodes = NULL;
+        size_t nodes_len = 0;
+        FILE *stream = open_memstream(&nodes, &nodes_len);
+        write_nodes(stream);
+        fclose(stream);
+        resp_response = (char *)serialize(nodes, nodes_len, VERBATIM_STRING);
+        free(nodes);
+        return resp_response;
+    }
+    if (strcasecmp(cmd[1], "KEYSLOT") == 0){
+        if (args < 3)
+            return error_reply("Failed: Incomplete argument list");
+        int slot = (int)key_hash_slot(cmd[2], strlen(cmd[2]));
+        return (char *)serialize(&slot, 0, INTEGER);
+    }
+    if (strcasecmp(cmd[1], "COUNTKEYSINSLOT") == 0 || strcasecmp(cmd[1], "GETKEYSINSLOT") == 0){
+        int is_count = strcasecmp(cmd[1], "COUNTKEYSINSLOT") == 0;
+        if (args < (is_count ? 3 : 4))
+            return error_reply("Failed: Incomplete argument list");
+        int slot = parse_slot(cmd[2]);
+        if (slot == -1)
+            return error_reply("Failed: Invalid slot");
+        if (is_count){
+            int count = (int)cluster_status.slot_key_counts[slot];
+            return (char *)serialize(&count, 0, INTEGER);
+        }
+        char *end_ptr;
+        long count = strtol(cmd[3], &end_ptr, 10);
+        if (end_ptr == cmd[3] || *end_ptr != '\0' || count < 0)
+            return error_reply("Failed: Invalid number of keys");
+        return keys_in_slot_reply(slot, count);
+    }
+
+    int ret_val;
+    if (strcasecmp(cmd[1], "ADDSLOTS") == 0 || strcasecmp(cmd[1], "DELSLOTS") == 0 ||
+        strcasecmp(cmd[1], "ADDSLOTSRANGE") == 0 || strcasecmp(cmd[1], "DELSLOTSRANGE") == 0){
+        if (args < 3)
+            return error_reply("Failed: Incomplete argument list");
+        ret_val = change_own_slots(cmd, args, toupper((unsigned char)cmd[1][0]) == 'A', strlen(cmd[1]) > 8);
+        switch (ret_val) {
+            case 0:
+                response = NULL;
+                break;
+            case -1:
+                response = "Failed: Invalid slot";
+                break;
+            case -2:
+                response = toupper((unsigned char)cmd[1][0]) == 'A' ? "Failed: Slot is already busy" :
+                           "Failed: Slot is not served by this node";
+                break;
+            case -3:
+                response = "Failed: Slot ranges need a start and an end";
+                break;
+            default:
+                response = "Failed: Unknown Error";
+        }
+        if (response != NULL)
+            return error_reply(response);
+    }
+    else if (strcasecmp(cmd[1], "SETSLOT") == 0){
+        if (args < 4)
+            return error_reply("Failed: Usage CLUSTER SETSLOT <slot> NODE|MIGRATING|IMPORTING <node id>|STABLE");
+        int slot = parse_slot(cmd[2]);
+        if (slot == -1)
+            return error_reply("Failed: Invalid slot");
+        ret_val = set_slot_state(slot, cmd[3], args > 4 ? cmd[4] : NULL);
+        switch (ret_val) {
+            case 0:
+                response = NULL;
+                break;
+            case -1:
+                response = "Failed: Usage CLUSTER SETSLOT <slot> NODE|MIGRATING|IMPORTING <node id>|STABLE";
+                break;
+            case -2:
+                response = "Failed: Unknown node";
+                break;
+            case -3:
+                response = "Failed: I'm not the owner of this slot";
+                break;
+            case -4:
+                response = "Failed: I'm already the owner of this slot";
+                break;
+            case -5:
+                response = "Failed: I still hold keys in this slot, migrate them first";
+                break;
+            case -6:
+                response = "Failed: Can't migrate a slot to or import it from myself";
+                break;
+            default:
+                response = "Failed: Unknown Error";
+        }
+        if (response != NULL)
+            return error_reply(response);
+    }
+    else if (strcasecmp(cmd[1], "MEET") == 0){
+        if (args < 4)
+            return error_reply("Failed: Incomplete argument list");
+        char *end_ptr;
+        long port = strtol(cmd[3], &end_ptr, 10);
+        if (end_ptr == cmd[3] || *end_ptr != '\0' || port <= 0 || port > 65535)
+            return error_reply("Failed: Invalid port");
+        ret_val = meet_node(cmd[2], port);
+        if (ret_val == -1)
+            return error_reply("Failed: Can't reach the node");
+        if (ret_val == -2)
+            return error_reply("Failed: Not a cluster node");
+    }
+    else if (strcasecmp(cmd[1], "FORGET") == 0){
+        if (args < 3)
+            return error_reply("Failed: Incomplete argument list");
+        ret_val = forget_node(cmd[2]);
+        if (ret_val == -1)
+            return error_reply("Failed: Unknown node");
+        if (ret_val == -2)
+            return error_reply("Failed: I tried hard but I can't forget myself");
+    }
+    else return error_reply("Failed: Unknown CLUSTER subcommand");
+
+    if (save_config() == -1)
+        return error_reply("Failed: Can't save the cluster configuration");
+    response = "OK";
+    return (char *)serialize(response, strlen(response), SIMPLE_STRING);
+}
+
+/*
+ * Callback when DUMP is received: the value of a key as a binary payload RESTORE takes.
+ */
+char * handle_dump_command(const char *cmd[], int args){
+    size_t payload_len;
+
+    if (args < 2)
+        return error_reply("Failed: Incomplete argument list");
+    redis_object *obj = handle_get(cmd[1]);
+    if (obj == NULL)
+        return error_reply("Failed: Key does not exist");
+    unsigned char *payload = rdb_dump_value(obj, &payload_len);
+    char *resp_response = (char *)serialize(payload, payload_len, BULK_STRING);
+    free(payload);
+    return resp_response;
+}
+
+/*
+ * Callback when RESTORE or RESTORE-ASKING is received: RESTORE <key> <ttl> <payload> [REPLACE] [ABSTTL]. The ttl is
+ * in milliseconds, 0 for none, or a unix time in milliseconds with ABSTTL. The payload may hold any byte, so it comes
+ * with its length.
+ */
+char * handle_restore_command(const char *cmd[], const size_t cmd_len[], int args){
+    int replace = 0, absolute_ttl = 0;
+    char *value;
+    int array_size;
+
+    if (args < 4)
+        return error_reply("Failed: Incomplete argument list");
+    for (int i = 4; i < args; i++){
+        if (strcasecmp(cmd[i], "REPLACE") == 0)
+            replace = 1;
+        else if (strcasecmp(cmd[i], "ABSTTL") == 0)
+            absolute_ttl = 1;
+        else return error_reply("Failed: Unsupported option");
+    }
+    char *end_ptr;
+    long ttl = strtol(cmd[2], &end_ptr, 10);
+    if (end_ptr == cmd[2] || *end_ptr != '\0' || ttl < 0)
+        return error_reply("Failed: Invalid TTL value, must be >= 0");
+
+    redis_object *obj;
+    HASH_FIND_STR(db->objects_map, cmd[1], obj);
+    if (obj != NULL && !replace)
+        return error_reply("Failed: Target key name is busy");
+    if (rdb_restore_value((const unsigned char *)cmd[3], cmd_len[3], &value, &array_size) == -1)
+        return error_reply("Failed: DUMP payload version or checksum are wrong");
+    if (obj != NULL){
+        if (server_config.lazyfree_lazy_server_del)
+            retire_object_lazy(obj);
+        else retire_object(obj);
+        dirty++;
+    }
+
+    long expiry_ms = ttl == 0 ? 0 : absolute_ttl ? ttl : get_current_time_ms() + ttl;
+    if (expiry_ms > 0 && expiry_ms <= get_current_time_ms()) // already expired, the key is just gone
+        free(value);
+    else if (keyspace_full()){
+        free(value);
+        return error_reply("Failed: Max data size reached");
+    }
+    else {
+        obj = malloc(sizeof *obj);
+        obj->key = strdup(cmd[1]);
+        obj->value = value;
+        obj->exp_milliseconds = 0;
+        obj->expire_list_index = -1;
+        obj->array_size = array_size;
+        obj->mapped = 0;
+        link_object(obj);
+        if (expiry_ms > 0)
+            set_object_expiry(obj, expiry_ms);
+        dirty++;
+    }
+    char *response = "OK";
+    return (char *)serialize(response, strlen(response), SIMPLE_STRING);
+}
+
+static void close_migrate_socket(int idx){
+    close(migrate_sockets[idx].fd);
+    free(migrate_sockets[idx].host);
+    migrate_sockets[idx] = migrate_sockets[--num_migrate_sockets];
+}
+
+/*
+ * Gets the cached connection to a MIGRATE target, connecting if there is none. Returns its index in
+ * migrate_sockets, or -1 if the target can't be reached within timeout_ms.
+ */
+static int get_migrate_socket(const char *host, long port, int timeout_ms){
+    for (int i = 0; i < num_migrate_sockets; i++){
+        if (migrate_sockets[i].port == port && strcmp(migrate_sockets[i].host, host) == 0){
+            migrate_sockets[i].last_use = time(NULL);
+            return i;
+        }
+    }
+    int fd = connect_with_timeout(host, port, timeout_ms);
+    if (fd == -1)
+        return -1;
+    if (num_migrate_sockets == MIGRATE_MAX_CACHED_SOCKETS)
+        close_migrate_socket(0);
+    migrate_sockets[num_migrate_sockets] = (migrate_socket){strdup(host), port, fd, time(NULL)};
+    return num_migrate_sockets++;
+}
+
+/*
+ * Closes the MIGRATE connections that were not used for MIGRATE_SOCKET_IDLE_SEC.
+ */
+void cluster_cron(void){
+    time_t now = time(NULL);
+
+    for (int i = num_migrate_sockets - 1; i >= 0; i--)
+        if (now - migrate_sockets[i].last_use > MIGRATE_SOCKET_IDLE_SEC)
+            close_migrate_socket(i);
+}
+
+/*
+ * Writes a batch of commands to a MIGRATE target and reads the num_replies one line replies, giving up if the target
+ * is silent for timeout_ms. Returns the replies, one per line, or NULL on failure.
+ */
+static char * exchange_with_target(int fd, const char *data, size_t len, int num_replies, int timeout_ms){
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    size_t sent = 0;
+
+    while (sent < len){
+        if (poll(&pfd, 1, timeout_ms) != 1)
+            return NULL;
+        ssize_t num_bytes = send(fd, data + sent, len - sent, 0);
+        if (num_bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return NULL;
+        if (num_bytes > 0)
+            sent += num_bytes;
+    }
+
+    char *replies = NULL;
+    size_t replies_len = 0;
+    int lines = 0;
+    pfd.events = POLLIN;
+    while (lines < num_replies){
+        if (poll(&pfd, 1, timeout_ms) != 1)
+            break;
+        replies = realloc(replies, replies_len + READ_CHUNK_SIZE + 1);
+        ssize_t num_bytes = recv(fd, replies + replies_len, READ_CHUNK_SIZE, 0);
+        if (num_bytes == 0 || (num_bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            break;
+        for (ssize_t i = 0; i < num_bytes; i++)
+            lines += replies[replies_len + i] == '\n';
+        if (num_bytes > 0)
+            replies_len += num_bytes;
+        replies[replies_len] = '\0';
+    }
+    if (lines < num_replies){
+        free(replies);
+        return NULL;
+    }
+    return replies;
+}
+
+/*
+ * Callback when MIGRATE is received:
+ *
+ *   MIGRATE <host> <port> <key>|"" <destination db> <timeout> [COPY] [REPLACE] [KEYS <key> [<key> ...]]
+ *
+ * Moves the keys to another server: every existing key is sent as a RESTORE (RESTORE-ASKING in cluster mode) of its
+ * DUMP payload, all in one write, and deleted here once the target accepted it (unless COPY is given). The event loop
+ * is blocked while the target answers, for at most timeout milliseconds of silence, so slots are moved in batches of
+ * keys, e.g. those returned by CLUSTER GETKEYSINSLOT.
+ */
+char * handle_migrate_command(const char *cmd[], int args){
+    int copy = 0, replace = 0, first_key = 3, num_keys = 1;
+    char message[512];
+
+    if (args < 6)
+        return error_reply("Failed: Incomplete argument list");
+    for (int i = 6; i < args; i++){
+        if (strcasecmp(cmd[i], "COPY") == 0)
+            copy = 1;
+        else if (strcasecmp(cmd[i], "REPLACE") == 0)
+            replace = 1;
+        else if (strcasecmp(cmd[i], "KEYS") == 0 && cmd[3][0] == '\0'){
+            first_key = i + 1;
+            num_keys = args - i - 1;
+            break;
+        }
+        else return error_reply("Failed: Unsupported option");
+    }
+    char *end_ptr;
+    long port = strtol(cmd[2], &end_ptr, 10);
+    if (end_ptr == cmd[2] || *end_ptr != '\0' || port <= 0 || port > 65535)
+        return error_reply("Failed: Invalid port");
+    long timeout = strtol(cmd[5], &end_ptr, 10);
+    if (end_ptr == cmd[5] || *end_ptr != '\0' || timeout < 0)
+        return error_reply("Failed: Invalid timeout");
+    if (timeout == 0)
+        timeout = 1000;
+    long destination_db = strtol(cmd[4], &end_ptr, 10);
+    if (end_ptr == cmd[4] || *end_ptr != '\0' || destination_db < 0)
+        return error_reply("Failed: Invalid destination database");
+    if (destination_db != 0 && server_config.cluster_enabled)
+        return error_reply("Failed: Only database 0 exists in cluster mode");
+
+    // only the keys that exist are sent, once each even if listed twice
+    redis_object **objects = malloc(sizeof *objects * (num_keys > 0 ? num_keys : 1));
+    int num_objects = 0;
+    for (int i = 0; i < num_keys; i++){
+        redis_object *obj = handle_get(cmd[first_key + i]);
+        for (int j = 0; j < num_objects && obj != NULL; j++)
+            if (objects[j] == obj)
+                obj = NULL;
+        if (obj != NULL)
+            objects[num_objects++] = obj;
+    }
+    if (num_objects == 0){
+        free(objects);
+        char *response = "NOKEY";
+        return (char *)serialize(response, strlen(response), SIMPLE_STRING);
+    }
+
+    int socket_idx = get_migrate_socket(cmd[1], port, (int)timeout);
+    if (socket_idx == -1){
+        free(objects);
+        snprintf(message, sizeof message, "Failed: IOERR error or timeout connecting to %s:%ld", cmd[1], port);
+        return error_reply(message);
+    }
+
+    long current_time_ms = get_current_time_ms();
+    migrate_buffer.len = 0;
+    const char *select_argv[] = {"SELECT", cmd[4]};
+    buffer_append_command(&migrate_buffer, select_argv, NULL, 2); // a cached connection may be at another database
+    for (int i = 0; i < num_objects; i++){
+        size_t payload_len;
+        char ttl[24];
+        unsigned char *payload = rdb_dump_value(objects[i], &payload_len);
+        long ttl_ms = 0;
+        if (objects[i]->expire_list_index != -1){
+            ttl_ms = (long)objects[i]->exp_milliseconds - current_time_ms;
+            if (ttl_ms < 1) // expires this very millisecond, 0 would mean never
+                ttl_ms = 1;
+        }
+        snprintf(ttl, sizeof ttl, "%ld", ttl_ms);
+        const char *argv[] = {server_config.cluster_enabled ? "RESTORE-ASKING" : "RESTORE", objects[i]->key, ttl,
+                              (const char *)payload, "REPLACE"};
+        size_t argv_len[] = {strlen(argv[0]), strlen(objects[i]->key), strlen(ttl), payload_len, 7};
+        buffer_append_command(&migrate_buffer, argv, argv_len, replace ? 5 : 4);
+        free(payload);
+    }
+
+    char *replies = exchange_with_target(migrate_sockets[socket_idx].fd, migrate_buffer.data, migrate_buffer.len,
+                                         num_objects + 1, (int)timeout);
+    if (replies == NULL){
+        free(objects);
+        close_migrate_socket(socket_idx); // replies may still be on the way, the connection can't be reused
+        snprintf(message, sizeof message, "Failed: IOERR error or timeout talking to %s:%ld", cmd[1], port);
+        return error_reply(message);
+    }
+
+    // keys the target accepted are deleted, the first error is reported. If the SELECT failed, the keys were restored
+    // to whatever database the connection was at, so none of them is deleted.
+    char *error = NULL;
+    char *line = replies;
+    int select_failed = 0;
+    for (int i = -1; i < num_objects; i++){
+        char *line_end = strchr(line, '\n');
+        *line_end = '\0';
+        if (line_end > line && line_end[-1] == '\r')
+            line_end[-1] = '\0';
+        if (line[0] == '-' && i == -1)
+            select_failed = 1;
+        if (line[0] == '-' && error == NULL)
+            error = line + 1;
+        else if (line[0] != '-' && !copy && !select_failed && i >= 0){
+            if (server_config.lazyfree_lazy_server_del)
+                retire_object_lazy(objects[i]);
+            else retire_object(objects[i]);
+            dirty++;
+        }
+        line = line_end + 1;
+    }
+    char *resp_response;
+    if (error != NULL){
+        snprintf(message, sizeof message, "Failed: Target instance replied with error: %s", error);
+        resp_response = error_reply(message);
+    }
+    else {
+        char *response = "OK";
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+    }
+    free(replies);
+    free(objects);
+    return resp_response;
+}
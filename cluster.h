@@ -0,0 +1,74 @@
+//
+// Cluster header file
+//
+// With cluster-enabled on, the keyspace is split in CLUSTER_SLOTS hash slots and every node serves some of them. The
+// slot of a key is CRC16(key) % CLUSTER_SLOTS; when the key contains a non-empty "{...}", only the part between the
+// first braces is hashed, so keys sharing a hash tag always live on the same node. Commands on keys of a slot that
+// another node serves are answered with
+//
+//   -MOVED <slot> <host>:<port>
+//
+// and clients retry on that node. Every node keeps its view of the cluster (the known nodes and the slots they serve)
+// in cluster-config-file, in the same format as CLUSTER NODES. There is no gossip between nodes: a node learns the
+// slots of another one when it is introduced to it with CLUSTER MEET, and later changes are applied to every node with
+// CLUSTER SETSLOT.
+//
+// A slot is moved while it is in use. The target is told it is IMPORTING the slot, the source that it is MIGRATING it,
+// then the keys are moved in batches with MIGRATE, and finally every node is told the new owner with SETSLOT NODE.
+// Meanwhile the source serves the keys it still has and sends the others to the target with
+//
+//   -ASK <slot> <host>:<port>
+//
+// which a client follows for that one command, sending ASKING first so that the target serves the slot it doesn't own
+// yet. MIGRATE sends the keys as RESTORE-ASKING commands carrying the DUMP payload of their value, all of a batch in
+// one write, over a connection that is kept open for the next batch.
+//
+
+#ifndef REDIS_CLUSTER_H
+#define REDIS_CLUSTER_H
+
+#include "redis.h"
+
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_NODE_ID_LEN 40
+#define CLUSTER_CONFIG_FILE_NAME "nodes.conf" // used when cluster-config-file is not set
+#define CLUSTER_DEFAULT_ANNOUNCE_IP "127.0.0.1" // used when cluster-announce-ip is not set
+#define CLUSTER_MEET_TIMEOUT_MS 1000
+#define MIGRATE_SOCKET_IDLE_SEC 10 // cached MIGRATE connections unused this long are closed
+#define MIGRATE_MAX_CACHED_SOCKETS 16
+
+typedef struct {
+    char id[CLUSTER_NODE_ID_LEN + 1];
+    char *host;
+    long port;
+    int num_slots;
+} cluster_node;
+
+typedef struct {
+    cluster_node *myself;
+    cluster_node **nodes; // myself included
+    int num_nodes;
+    cluster_node *slots[CLUSTER_SLOTS]; // node serving each slot, NULL if unassigned
+    cluster_node *migrating_to[CLUSTER_SLOTS]; // for our slots being moved to another node
+    cluster_node *importing_from[CLUSTER_SLOTS]; // for slots being moved to us
+    redis_object *slot_keys[CLUSTER_SLOTS]; // keys of each slot, linked through slot_next
+    unsigned int slot_key_counts[CLUSTER_SLOTS];
+} cluster_state;
+
+extern cluster_state cluster_status;
+
+unsigned int key_hash_slot(const char *, size_t);
+int get_command_keys(const char *[], int, int *, int *, int *);
+void cluster_init(void);
+void cluster_add_key(redis_object *);
+void cluster_remove_key(redis_object *);
+void cluster_clear_keys(void);
+char * cluster_redirect(redis_client *, const char *[], int);
+char * handle_cluster_command(const char *[], int);
+char * handle_dump_command(const char *[], int);
+char * handle_restore_command(const char *[], const size_t [], int);
+char * handle_migrate_command(const char *[], int);
+void cluster_cron(void);
+void cluster_info(FILE *);
+
+#endif //REDIS_CLUSTER_H
@@ -0,0 +1,174 @@
+//
+// Block compression source file
+//
+#include <stdint.h>
+#include <string.h>
+#include "compress.h"
+
+static uint32_t read_u32(const unsigned char *ptr){
+    uint32_t val;
+    memcpy(&val, ptr, sizeof val);
+    return val;
+}
+
+static uint32_t hash_sequence(uint32_t sequence){
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/*
+ * Writes a length that did not fit in a token nibble as a run of 255s and a final byte below 255.
+ */
+static unsigned char * write_extra_length(unsigned char *out, size_t len){
+    while (len >= 255){
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+/*
+ * Writes one sequence: the literals in [anchor, anchor + num_literals) followed by a match of match_len bytes at
+ * offset bytes back (match_len 0 for the last sequence, which has no match). Returns NULL if it does not fit.
+ */
+static unsigned char * write_sequence(unsigned char *out, const unsigned char *out_end, const unsigned char *anchor,
+                                      size_t num_literals, size_t offset, size_t match_len){
+    size_t worst_case = 1 + num_literals / 255 + 1 + num_literals + 2 + match_len / 255 + 1;
+    if ((size_t)(out_end - out) < worst_case)
+        return NULL;
+
+    unsigned char *token = out++;
+    *token = (unsigned char)((num_literals >= 15 ? 15 : num_literals) << 4);
+    if (num_literals >= 15)
+        out = write_extra_length(out, num_literals - 15);
+    memcpy(out, anchor, num_literals);
+    out += num_literals;
+    if (match_len == 0)
+        return out;
+
+    *out++ = (unsigned char)(offset & 0xff);
+    *out++ = (unsigned char)(offset >> 8);
+    size_t len_code = match_len - LZ_MIN_MATCH;
+    *token |= (unsigned char)(len_code >= 15 ? 15 : len_code);
+    if (len_code >= 15)
+        out = write_extra_length(out, len_code - 15);
+    return out;
+}
+
+/*
+ * Compresses src into dst.
+ *
+ * Returns the compressed size, or 0 if it would not fit in dst_capacity bytes (e.g. the data doesn't compress and
+ * dst is no bigger than src).
+ */
+size_t lz_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_capacity){
+    uint32_t table[1 << LZ_HASH_LOG];
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *src_end = src + src_len;
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + dst_capacity;
+
+    if (src_len > LZ_MATCH_FIND_LIMIT){
+        const unsigned char *match_find_end = src_end - LZ_MATCH_FIND_LIMIT;
+        const unsigned char *match_end_limit = src_end - LZ_LAST_LITERALS;
+
+        memset(table, 0, sizeof table);
+        ip++; // the table starts out pointing at position 0
+        while (ip < match_find_end){
+            uint32_t sequence = read_u32(ip);
+            uint32_t h = hash_sequence(sequence);
+            const unsigned char *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ip - ref > LZ_MAX_OFFSET || read_u32(ref) != sequence){
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]){ // the match may start before ip
+                ip--;
+                ref--;
+            }
+            const unsigned char *match_end = ip + LZ_MIN_MATCH;
+            const unsigned char *ref_end = ref + LZ_MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == *ref_end){
+                match_end++;
+                ref_end++;
+            }
+
+            op = write_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_end - ip);
+            if (op == NULL)
+                return 0;
+            ip = match_end;
+            anchor = ip;
+            if (ip - 2 > src) // cheap way to find more matches inside repetitive data
+                table[hash_sequence(read_u32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    op = write_sequence(op, op_end, anchor, src_end - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+/*
+ * Reads a length that continues past a token nibble. Returns -1 if it runs past the end of the input.
+ */
+static int read_extra_length(const unsigned char **ip, const unsigned char *ip_end, size_t *len){
+    unsigned char byte;
+    do {
+        if (*ip >= ip_end)
+            return -1;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/*
+ * Decompresses src into dst, which must be exactly the size of the original data. Every offset and length is checked
+ * against the buffers, so corrupt input can't read or write out of bounds.
+ *
+ * Returns 0 on success and -1 if src is corrupt or does not decompress to exactly dst_len bytes.
+ */
+int lz_decompress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_len){
+    const unsigned char *ip = src;
+    const unsigned char *ip_end = src + src_len;
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + dst_len;
+
+    while (ip < ip_end){
+        unsigned char token = *ip++;
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && read_extra_length(&ip, ip_end, &num_literals) == -1)
+            return -1;
+        if ((size_t)(ip_end - ip) < num_literals || (size_t)(op_end - op) < num_literals)
+            return -1;
+        memcpy(op, ip, num_literals);
+        ip += num_literals;
+        op += num_literals;
+        if (ip == ip_end) // the last sequence has no match
+            break;
+
+        if (ip_end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && read_extra_length(&ip, ip_end, &match_len) == -1)
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(op_end - op) < match_len)
+            return -1;
+
+        const unsigned char *match = op - offset;
+        if (offset >= match_len){
+            memcpy(op, match, match_len);
+            op += match_len;
+        }
+        else { // the match overlaps the bytes it produces (a repeated pattern), copy one byte at a time
+            for (size_t i = 0; i < match_len; i++)
+                *op++ = match[i];
+        }
+    }
+    return op == op_end ? 0 : -1;
+}
@@ -0,0 +1,24 @@
+//
+// Block compression header file
+//
+// A small LZ77 codec producing the LZ4 block format: a list of sequences, each made of a token (high nibble: number
+// of literals, low nibble: match length - 4, 15 meaning more length bytes follow), the literals, a 2 byte little
+// endian offset back into the output and the extra match length bytes. It is built for speed rather than ratio, so
+// compressing a snapshot block costs less than writing the bytes it saves.
+//
+
+#ifndef REDIS_COMPRESS_H
+#define REDIS_COMPRESS_H
+
+#include <stddef.h>
+
+#define LZ_HASH_LOG 12 // the match finder remembers the last position of 2^LZ_HASH_LOG 4 byte sequences
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // the format requires the last 5 bytes to be literals
+#define LZ_MATCH_FIND_LIMIT 12 // and the last match to start at least 12 bytes before the end
+#define LZ_MAX_OFFSET 65535
+
+size_t lz_compress(const unsigned char *, size_t, unsigned char *, size_t);
+int lz_decompress(const unsigned char *, size_t, unsigned char *, size_t);
+
+#endif //REDIS_COMPRESS_H
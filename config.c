@@ -0,0 +1,194 @@
+//
+// Server configuration source file
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "config.h"
+
+redis_config server_config = {
+        .lazyfree_lazy_expire = 0,
+        .lazyfree_lazy_server_del = 0,
+        .lazyfree_lazy_user_del = 0,
+        .lazyfree_lazy_user_flush = 0,
+        .num_save_params = 0, // automatic snapshots are off unless a save policy is configured
+        .maxkeys = 4096,
+        .databases = 16,
+        .command_slice_time_us = 1000,
+        .client_command_budget = 1000,
+        .client_output_buffer_hard_limit = 0,
+        .client_output_buffer_soft_limit = 0,
+        .client_output_buffer_soft_seconds = 0,
+        .tracking_table_slots = 1 << 16,
+        .load_threads = 0,
+        .rdbcompression = 1,
+        .mmap_snapshot = 0,
+        .save_threads = 0,
+        .appendonly = 0,
+        .appendfsync = APPENDFSYNC_EVERYSEC,
+        .auto_aof_rewrite_percentage = 100,
+        .auto_aof_rewrite_min_size = 64 * 1024 * 1024,
+        .port = 6379,
+        .io_threads = 1,
+        .shards = 1,
+        .read_threads = 1,
+        .replicaof = NULL,
+        .repl_backlog_size = 1024 * 1024,
+        .repl_diskless_sync = 0,
+        .repl_diskless_sync_delay = 5,
+        .repl_diskless_load = 0,
+        .cluster_enabled = 0,
+        .cluster_config_file = NULL,
+        .cluster_announce_ip = NULL
+};
+
+static const char *appendfsync_values[] = {"no", "everysec", "always", NULL}; // in appendfsync_policy order
+
+static config_option config_options[] = {
+        {"lazyfree-lazy-expire", CONFIG_BOOL, &server_config.lazyfree_lazy_expire},
+        {"lazyfree-lazy-server-del", CONFIG_BOOL, &server_config.lazyfree_lazy_server_del},
+        {"lazyfree-lazy-user-del", CONFIG_BOOL, &server_config.lazyfree_lazy_user_del},
+        {"lazyfree-lazy-user-flush", CONFIG_BOOL, &server_config.lazyfree_lazy_user_flush},
+        {"save", CONFIG_SAVE_PARAMS, &server_config.save_params},
+        {"maxkeys", CONFIG_INT, &server_config.maxkeys},
+        {"databases", CONFIG_INT, &server_config.databases, NULL, 1},
+        {"command-slice-time-us", CONFIG_INT, &server_config.command_slice_time_us},
+        {"client-command-budget", CONFIG_INT, &server_config.client_command_budget},
+        {"client-output-buffer-hard-limit", CONFIG_INT, &server_config.client_output_buffer_hard_limit},
+        {"client-output-buffer-soft-limit", CONFIG_INT, &server_config.client_output_buffer_soft_limit},
+        {"client-output-buffer-soft-seconds", CONFIG_INT, &server_config.client_output_buffer_soft_seconds},
+        {"tracking-table-slots", CONFIG_INT, &server_config.tracking_table_slots, NULL, 1},
+        {"load-threads", CONFIG_INT, &server_config.load_threads},
+        {"rdbcompression", CONFIG_BOOL, &server_config.rdbcompression},
+        {"save-threads", CONFIG_INT, &server_config.save_threads},
+        {"mmap-snapshot", CONFIG_BOOL, &server_config.mmap_snapshot, NULL, 1},
+        {"appendonly", CONFIG_BOOL, &server_config.appendonly, NULL, 1},
+        {"appendfsync", CONFIG_ENUM, &server_config.appendfsync, appendfsync_values},
+        {"auto-aof-rewrite-percentage", CONFIG_INT, &server_config.auto_aof_rewrite_percentage},
+        {"auto-aof-rewrite-min-size", CONFIG_INT, &server_config.auto_aof_rewrite_min_size},
+        {"port", CONFIG_INT, &server_config.port, NULL, 1},
+        {"io-threads", CONFIG_INT, &server_config.io_threads, NULL, 1},
+        {"shards", CONFIG_INT, &server_config.shards, NULL, 1},
+        {"read-threads", CONFIG_INT, &server_config.read_threads, NULL, 1},
+        {"replicaof", CONFIG_STRING, &server_config.replicaof, NULL, 1},
+        {"repl-backlog-size", CONFIG_INT, &server_config.repl_backlog_size, NULL, 1},
+        {"repl-diskless-sync", CONFIG_BOOL, &server_config.repl_diskless_sync},
+        {"repl-diskless-sync-delay", CONFIG_INT, &server_config.repl_diskless_sync_delay},
+        {"repl-diskless-load", CONFIG_BOOL, &server_config.repl_diskless_load},
+        {"cluster-enabled", CONFIG_BOOL, &server_config.cluster_enabled, NULL, 1},
+        {"cluster-config-file", CONFIG_STRING, &server_config.cluster_config_file, NULL, 1},
+        {"cluster-announce-ip", CONFIG_STRING, &server_config.cluster_announce_ip, NULL, 1},
+};
+
+/*
+ * Parses a save policy made of "<seconds> <changes>" pairs, e.g. "900 1 300 10". An empty string disables automatic
+ * snapshots. Returns -1 if the policy is invalid.
+ */
+static int parse_save_params(const char *value){
+    save_param params[MAX_SAVE_PARAMS];
+    int num_params = 0;
+    const char *ptr = value;
+    char *end_ptr;
+
+    for (;;) {
+        while (*ptr == ' ')
+            ptr++;
+        if (*ptr == '\0')
+            break;
+        if (num_params == MAX_SAVE_PARAMS)
+            return -1;
+
+        long seconds = strtol(ptr, &end_ptr, 10);
+        if (end_ptr == ptr || seconds <= 0)
+            return -1;
+        ptr = end_ptr;
+        long changes = strtol(ptr, &end_ptr, 10);
+        if (end_ptr == ptr || changes < 0)
+            return -1;
+        ptr = end_ptr;
+
+        params[num_params].seconds = seconds;
+        params[num_params].changes = changes;
+        num_params++;
+    }
+    memcpy(server_config.save_params, params, sizeof(save_param) * num_params);
+    server_config.num_save_params = num_params;
+    return 0;
+}
+
+/*
+ * Sets a configuration option by name. at_startup is set when the option comes from the command line.
+ *
+ * Returns 0 on success, -1 if the option does not exist, -2 if the value is invalid for the option and -3 if the
+ * option can't be changed while the server is running.
+ */
+int set_config_option(const char *name, const char *value, int at_startup){
+    int num_options = sizeof config_options / sizeof config_options[0];
+
+    for (int i = 0; i < num_options; i++){
+        if (strcasecmp(config_options[i].name, name) != 0)
+            continue;
+        if (config_options[i].startup_only && !at_startup)
+            return -3;
+
+        switch (config_options[i].type) {
+            case CONFIG_BOOL:
+                if (strcasecmp(value, "yes") == 0)
+                    *(int *)config_options[i].value = 1;
+                else if (strcasecmp(value, "no") == 0)
+                    *(int *)config_options[i].value = 0;
+                else return -2;
+                return 0;
+            case CONFIG_INT: {
+                char *end_ptr = NULL;
+                long int_value = strtol(value, &end_ptr, 10);
+                if (end_ptr == value || *end_ptr != '\0' || int_value < 0)
+                    return -2;
+                *(long *)config_options[i].value = int_value;
+                return 0;
+            }
+            case CONFIG_SAVE_PARAMS:
+                return parse_save_params(value) == -1 ? -2 : 0;
+            case CONFIG_ENUM:
+                for (int j = 0; config_options[i].enum_values[j] != NULL; j++){
+                    if (strcasecmp(config_options[i].enum_values[j], value) == 0){
+                        *(int *)config_options[i].value = j;
+                        return 0;
+                    }
+                }
+                return -2;
+            case CONFIG_STRING:
+                free(*(char **)config_options[i].value);
+                *(char **)config_options[i].value = strdup(value);
+                return 0;
+            default:
+                return -2;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Loads configuration options passed on the command line as "--<option> <value>" pairs.
+ *
+ * Returns 0 on success and -1 if an option is unknown or has an invalid value.
+ */
+int load_config_from_args(int argc, char *argv[]){
+    for (int i = 1; i < argc; i += 2){
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc){
+            fprintf(stderr, "Redis server: Expected \"--<option> <value>\", got \"%s\"\n", argv[i]);
+            return -1;
+        }
+        int ret_val = set_config_option(argv[i] + 2, argv[i + 1], 1);
+        if (ret_val == -1){
+            fprintf(stderr, "Redis server: Unknown option \"%s\"\n", argv[i] + 2);
+            return -1;
+        }
+        if (ret_val == -2){
+            fprintf(stderr, "Redis server: Invalid value \"%s\" for option \"%s\"\n", argv[i + 1], argv[i] + 2);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+//
+// Server configuration header file
+//
+
+#ifndef REDIS_CONFIG_H
+#define REDIS_CONFIG_H
+
+#define MAX_SAVE_PARAMS 16
+
+enum config_type {
+    CONFIG_BOOL,
+    CONFIG_INT,
+    CONFIG_SAVE_PARAMS,
+    CONFIG_ENUM, // int holding the index of the value in config_option.enum_values
+    CONFIG_STRING // heap allocated copy of the value, NULL if unset
+};
+
+enum appendfsync_policy {
+    APPENDFSYNC_NO, // leave flushing to the OS
+    APPENDFSYNC_EVERYSEC, // fsync once per second from a background thread
+    APPENDFSYNC_ALWAYS // fsync before replying, once per event loop iteration
+};
+
+typedef struct {
+    long seconds;
+    long changes;
+} save_param;
+
+typedef struct {
+    int lazyfree_lazy_expire; // free expired objects in the background
+    int lazyfree_lazy_server_del; // free objects overwritten by SET in the background
+    int lazyfree_lazy_user_del; // make DEL behave like UNLINK
+    int lazyfree_lazy_user_flush; // make FLUSHALL and FLUSHDB default to ASYNC
+    save_param save_params[MAX_SAVE_PARAMS]; // BGSAVE after <seconds> if at least <changes> keys changed
+    int num_save_params;
+    long maxkeys; // maximum number of keys, 0 for no limit
+    long databases; // number of databases SELECT can pick from
+    long command_slice_time_us; // a long command yields to the other clients after running this long, 0 to disable
+    long client_command_budget; // commands a client may run per event loop iteration, 0 for no limit
+    long client_output_buffer_hard_limit; // bytes of replies waiting to be sent that close the client, 0 for no limit
+    long client_output_buffer_soft_limit; // same, once it stays over this many bytes for soft_seconds
+    long client_output_buffer_soft_seconds;
+    long tracking_table_slots; // of the table of the keys read by tracking clients, rounded up to a power of 2
+    long load_threads; // threads used to load the snapshot, 0 to use one per core
+    int rdbcompression; // compress the blocks of the snapshot
+    int mmap_snapshot; // serve keys and values straight from the mapped snapshot until they are written to
+    long save_threads; // threads used to compress the snapshot, 0 to use one per core
+    int appendonly; // log every write command to the append only file
+    int appendfsync; // an appendfsync_policy
+    long auto_aof_rewrite_percentage; // rewrite once the file grew this much since the last rewrite, 0 to disable
+    long auto_aof_rewrite_min_size; // bytes, smaller files are never rewritten automatically
+    long port; // TCP port the server listens on
+    long io_threads; // threads reading from and writing to the clients, the main thread included. 1 to only use it
+    long shards; // event loops, each on its own thread with its own part of the keyspace, see shard.h
+    long read_threads; // event loops sharing the keyspace of the main one, which they only read. The main one included
+    char *replicaof; // "<host> <port>" of the primary to replicate on startup, NULL to start as a primary
+    long repl_backlog_size; // bytes of the replication stream kept for replicas that reconnect
+    int repl_diskless_sync; // stream full resync snapshots straight to the replica sockets
+    long repl_diskless_sync_delay; // seconds to wait for more replicas to share a diskless transfer
+    int repl_diskless_load; // replicas load the snapshot from memory instead of saving it to disk first
+    int cluster_enabled; // split the keyspace in hash slots served by several nodes, see cluster.h
+    char *cluster_config_file; // where the node keeps its view of the cluster, NULL for CLUSTER_CONFIG_FILE_NAME
+    char *cluster_announce_ip; // host other nodes and clients reach this one at, NULL for CLUSTER_DEFAULT_ANNOUNCE_IP
+} redis_config;
+
+typedef struct {
+    const char *name;
+    enum config_type type;
+    void *value;
+    const char **enum_values; // NULL terminated names of the values of a CONFIG_ENUM
+    int startup_only; // can only be set on the command line
+} config_option;
+
+extern redis_config server_config;
+
+int set_config_option(const char *, const char *, int);
+int load_config_from_args(int, char *[]);
+
+#endif //REDIS_CONFIG_H
@@ -0,0 +1,108 @@
+//
+// Epoch based reclamation source file
+//
+// Memory deferred at epoch e is freed once every reader is either outside of a read or in an epoch after e. A reader
+// in a later epoch loaded it after the main thread moved the epoch on, which it only does after unlinking what it
+// deferred, so that reader can't have found it. The epochs of the readers and the global one are sequentially
+// consistent, so a reader seen outside of a read by epoch_reclaim() only starts its next one after it.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "epoch.h"
+
+typedef struct {
+    epoch_free_fn free_fn;
+    void *ptr;
+    unsigned long epoch;
+} deferred_free;
+
+typedef struct {
+    _Alignas(64) atomic_ulong epoch; // 0 outside of a read; a cache line each, readers write it on every read
+} epoch_reader;
+
+static atomic_ulong global_epoch = 1;
+static epoch_reader *readers = NULL;
+static int num_readers = 0;
+static _Thread_local int is_owner = 0; // the thread that called epoch_init(), the only one deferring
+static int reclaiming = 0; // what the deferred frees free in turn goes right away
+static deferred_free *deferred = NULL; // in the order they were deferred, so by epoch
+static size_t num_deferred = 0;
+static size_t deferred_capacity = 0;
+
+/*
+ * Sets up the epochs of num readers, numbered from 0. Called by the thread that changes the data the readers read;
+ * until then (and on every other thread) epoch_defer() frees right away.
+ */
+void epoch_init(int num){
+    if (num > EPOCH_READERS_MAX)
+        num = EPOCH_READERS_MAX;
+    readers = aligned_alloc(_Alignof(epoch_reader), sizeof *readers * num);
+    for (int i = 0; i < num; i++)
+        atomic_init(&readers[i].epoch, 0);
+    num_readers = num;
+    is_owner = 1;
+}
+
+void epoch_enter(int reader){
+    atomic_store(&readers[reader].epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(int reader){
+    atomic_store_explicit(&readers[reader].epoch, 0, memory_order_release);
+}
+
+/*
+ * Calls free_fn(ptr) once no reader can hold ptr anymore. The caller must have unlinked it from everything the
+ * readers can reach.
+ */
+void epoch_defer(epoch_free_fn free_fn, void *ptr){
+    if (num_readers == 0 || !is_owner || reclaiming){
+        free_fn(ptr);
+        return;
+    }
+    if (num_deferred == deferred_capacity){
+        deferred_capacity = deferred_capacity == 0 ? 1024 : deferred_capacity * 2;
+        deferred = realloc(deferred, sizeof *deferred * deferred_capacity);
+    }
+    deferred[num_deferred].free_fn = free_fn;
+    deferred[num_deferred].ptr = ptr;
+    deferred[num_deferred].epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    num_deferred++;
+}
+
+void epoch_free(void *ptr){
+    epoch_defer(free, ptr);
+}
+
+/*
+ * Moves the epoch on and frees what no reader can hold anymore. Called by the owner once per event loop iteration.
+ */
+void epoch_reclaim(void){
+    if (!is_owner || num_deferred == 0)
+        return;
+
+    unsigned long oldest = atomic_fetch_add(&global_epoch, 1) + 1;
+    for (int i = 0; i < num_readers; i++) {
+        unsigned long epoch = atomic_load(&readers[i].epoch);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    size_t num_freed = 0;
+    reclaiming = 1;
+    while (num_freed < num_deferred && deferred[num_freed].epoch < oldest) {
+        deferred[num_freed].free_fn(deferred[num_freed].ptr);
+        num_freed++;
+    }
+    reclaiming = 0;
+    num_deferred -= num_freed;
+    memmove(deferred, deferred + num_freed, sizeof *deferred * num_deferred);
+}
+
+/*
+ * The number of frees waiting for the readers, for INFO on the owner thread.
+ */
+size_t epoch_pending(void){
+    return num_deferred;
+}
@@ -0,0 +1,28 @@
+//
+// Epoch based reclamation header file
+//
+// With read-threads, the other event loop threads look keys up in the keyspace while the main thread changes it, so
+// memory the main thread unlinks from the keyspace may still be read by one of them. Instead of being freed right
+// away, it is deferred with the current epoch. A reader publishes the epoch it started at for as long as it reads,
+// and the main thread regularly moves the epoch on and frees what was deferred before the oldest epoch a reader is
+// still in. Readers never wait for anything; the main thread never waits for a reader either, it only frees later.
+//
+
+#ifndef REDIS_EPOCH_H
+#define REDIS_EPOCH_H
+
+#include <stddef.h>
+
+#define EPOCH_READERS_MAX 128
+
+typedef void (*epoch_free_fn)(void *);
+
+void epoch_init(int);
+void epoch_enter(int);
+void epoch_exit(int);
+void epoch_defer(epoch_free_fn, void *);
+void epoch_free(void *);
+void epoch_reclaim(void);
+size_t epoch_pending(void);
+
+#endif //REDIS_EPOCH_H
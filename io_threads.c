@@ -0,0 +1,111 @@
+//
+// I/O threads source file
+//
+// A batch is split round-robin: thread i handles the clients i, i + n, i + 2n... of the batch, the main thread being
+// thread 0. Every worker sleeps on its own semaphore until the main thread posts it for a batch, and posts done_jobs
+// once it went through its share. The semaphores also make the client state written by one side visible to the other.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "io_threads.h"
+#include "config.h"
+
+static int num_threads = 1; // the main thread included
+static sem_t *start_jobs = NULL; // one per worker, the main thread doesn't use its own
+static sem_t done_jobs;
+static redis_client **jobs = NULL; // the batch being handled, only written by the main thread between batches
+static int num_jobs = 0;
+static int jobs_stride = 1;
+static enum io_threads_op jobs_op;
+static long long threaded_reads = 0; // clients read in batches split between the threads
+static long long threaded_writes = 0;
+
+static void handle_jobs(redis_client **clients, int count, int first, int stride, enum io_threads_op op){
+    for (int i = first; i < count; i += stride) {
+        redis_client *client = clients[i];
+
+        if (op == IO_THREADS_OP_READ){
+            client->io_result = read_from_client(client);
+            if (client->io_result > 0)
+                parse_client_input(client);
+        }
+        else client->io_result = write_to_client(client);
+    }
+}
+
+static void * io_thread_main(void *arg){
+    int thread_idx = (int)(long)arg;
+
+    for (;;) {
+        if (sem_wait(&start_jobs[thread_idx]) == -1)
+            continue; // interrupted by a signal
+        handle_jobs(jobs, num_jobs, thread_idx, jobs_stride, jobs_op);
+        sem_post(&done_jobs);
+    }
+    return NULL;
+}
+
+/*
+ * Starts io-threads - 1 worker threads (none with the default of 1). Returns -1 if a thread could not be created.
+ */
+int io_threads_init(void){
+    long wanted = server_config.io_threads;
+
+    if (wanted > IO_THREADS_MAX){
+        fprintf(stderr, "Redis server: io-threads is limited to %d\n", IO_THREADS_MAX);
+        wanted = IO_THREADS_MAX;
+    }
+    if (wanted <= 1)
+        return 0;
+    if (sem_init(&done_jobs, 0, 0) == -1)
+        return -1;
+    start_jobs = malloc(sizeof *start_jobs * wanted);
+    for (int i = 1; i < wanted; i++) {
+        pthread_t thread;
+
+        if (sem_init(&start_jobs[i], 0, 0) == -1 ||
+            pthread_create(&thread, NULL, io_thread_main, (void *)(long)i) != 0)
+            return -1;
+        pthread_detach(thread);
+        num_threads = i + 1;
+    }
+    printf("Redis server: Started %d I/O threads\n", num_threads - 1);
+    return 0;
+}
+
+/*
+ * Reads from (and parses the commands of) or writes to every client of the batch, and returns once they are all
+ * done. The result of read_from_client() or write_to_client() is left in client->io_result.
+ */
+void io_threads_run(redis_client **clients, int count, enum io_threads_op op){
+    if (num_threads == 1 || count < num_threads * IO_THREADS_MIN_CLIENTS_PER_THREAD){
+        handle_jobs(clients, count, 0, 1, op); // leaves the shared batch alone, as every shard thread comes through here
+        return;
+    }
+
+    jobs = clients;
+    num_jobs = count;
+    jobs_op = op;
+    jobs_stride = num_threads;
+    if (op == IO_THREADS_OP_READ)
+        threaded_reads += count;
+    else threaded_writes += count;
+    for (int i = 1; i < num_threads; i++)
+        sem_post(&start_jobs[i]);
+    handle_jobs(clients, count, 0, num_threads, op);
+    for (int i = 1; i < num_threads; i++) {
+        while (sem_wait(&done_jobs) == -1)
+            ; // interrupted by a signal
+    }
+}
+
+/*
+ * Writes the I/O threads part of the clients section of INFO.
+ */
+void io_threads_info(FILE *stream){
+    fprintf(stream, "io_threads_active:%d\r\n", num_threads);
+    fprintf(stream, "io_threaded_reads_processed:%lld\r\n", threaded_reads);
+    fprintf(stream, "io_threaded_writes_processed:%lld\r\n", threaded_writes);
+}
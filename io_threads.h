@@ -0,0 +1,29 @@
+//
+// I/O threads header file
+//
+// With io-threads set above 1, reading from the sockets of the clients that became readable, parsing their commands
+// and sending their replies are split between the main thread and io-threads - 1 worker threads. Only the I/O is
+// parallel: every thread handles its own clients while the main thread waits for the batch to finish, then the main
+// thread executes the parsed commands alone, so the keyspace is never touched by two threads at once and needs no
+// locks. Small batches are handled by the main thread alone, since waking the workers would cost more than it saves.
+//
+
+#ifndef REDIS_IO_THREADS_H
+#define REDIS_IO_THREADS_H
+
+#include <stdio.h>
+#include "client.h"
+
+#define IO_THREADS_MAX 128
+#define IO_THREADS_MIN_CLIENTS_PER_THREAD 2 // smaller batches are handled by the main thread alone
+
+enum io_threads_op {
+    IO_THREADS_OP_READ, // read_from_client() then parse_client_input()
+    IO_THREADS_OP_WRITE // write_to_client()
+};
+
+int io_threads_init(void);
+void io_threads_run(redis_client **, int, enum io_threads_op);
+void io_threads_info(FILE *);
+
+#endif //REDIS_IO_THREADS_H
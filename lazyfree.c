@@ -0,0 +1,97 @@
+//
+// Background freeing of deleted objects source file
+//
+// Deleted objects are pushed onto a lock-free multi-producer/single-consumer queue (see mpsc_queue.h) and freed by a
+// background thread, so deleting a big value or flushing the whole keyspace costs the event loop a single push. A
+// semaphore counts the queued jobs so the free thread can sleep while the queue is empty.
+//
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <malloc.h>
+#include "lazyfree.h"
+#include "mpsc_queue.h"
+
+typedef struct {
+    mpsc_node node; // first, so that a popped node is the job
+    redis_object *obj; // a single unlinked object, or
+    redis_object *objects_map; // a whole detached keyspace
+    size_t num_objects;
+} lazyfree_job;
+
+static mpsc_queue queue;
+static sem_t queued_jobs;
+static atomic_size_t pending_objects = 0;
+
+static void * lazyfree_thread_main(void *arg){
+    (void)arg;
+    for (;;) {
+        if (sem_wait(&queued_jobs) == -1)
+            continue; // interrupted by a signal
+
+        lazyfree_job *job;
+        while ((job = (lazyfree_job *)mpsc_queue_pop(&queue)) == NULL)
+            sched_yield(); // the semaphore says a job is queued, its producer just hasn't linked it yet
+
+        if (job->obj != NULL)
+            free_object(job->obj);
+        else free_objects_map(job->objects_map);
+        atomic_fetch_sub(&pending_objects, job->num_objects);
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+ * Starts the background free thread. Returns -1 if the thread could not be created.
+ */
+int lazyfree_init(void){
+    pthread_t thread;
+
+    mpsc_queue_init(&queue);
+    if (sem_init(&queued_jobs, 0, 0) == -1)
+        return -1;
+    if (pthread_create(&thread, NULL, lazyfree_thread_main, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static void queue_job(redis_object *obj, redis_object *objects_map, size_t num_objects){
+    lazyfree_job *job = malloc(sizeof *job);
+    job->obj = obj;
+    job->objects_map = objects_map;
+    job->num_objects = num_objects;
+    atomic_fetch_add(&pending_objects, num_objects);
+    mpsc_queue_push(&queue, &job->node);
+    sem_post(&queued_jobs);
+}
+
+/*
+ * Frees an object that has already been unlinked from the keyspace. Big values are handed to the free thread, small
+ * ones (and values in the memory mapped snapshot, which are not freed at all) are freed inline.
+ */
+void lazyfree_free_object(redis_object *obj){
+    if ((obj->mapped & OBJECT_VALUE_MAPPED) || malloc_usable_size(obj->value) < LAZYFREE_THRESHOLD){
+        free_object(obj);
+        return;
+    }
+    queue_job(obj, NULL, 1);
+}
+
+/*
+ * Frees a keyspace that has already been detached in the background.
+ */
+void lazyfree_free_objects_map(redis_object *objects_map){
+    if (objects_map == NULL)
+        return;
+    queue_job(NULL, objects_map, HASH_COUNT(objects_map));
+}
+
+/*
+ * Number of objects waiting to be freed by the free thread.
+ */
+size_t lazyfree_pending_objects(void){
+    return atomic_load(&pending_objects);
+}
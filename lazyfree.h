@@ -0,0 +1,19 @@
+//
+// Background freeing of deleted objects header file
+//
+
+#ifndef REDIS_LAZYFREE_H
+#define REDIS_LAZYFREE_H
+
+#include <stddef.h>
+#include "redis.h"
+
+// Values smaller than this (in bytes) are cheaper to free inline than to hand over to the free thread.
+#define LAZYFREE_THRESHOLD 65536
+
+int lazyfree_init(void);
+void lazyfree_free_object(redis_object *);
+void lazyfree_free_objects_map(redis_object *);
+size_t lazyfree_pending_objects(void);
+
+#endif //REDIS_LAZYFREE_H
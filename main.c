@@ -1,6 +1,6 @@
 #include "redis.h"
 
-int main() {
+int main(int argc, char *argv[]) {
     // Tests:
     // 1. Serialize, deserialize and print an RESP Integer - Done
     // 2. Serialize, deserialize and print an RESP simple string - Done
@@ -14,6 +14,8 @@ int main() {
     // 9. Improve error checking
     //
 
+    if (load_config_from_args(argc, argv) == -1)
+        return 1;
     redis_server_listen();
     return 0;
 }
@@ -0,0 +1,48 @@
+//
+// Lock-free multi-producer/single-consumer queue source file
+//
+#include <stddef.h>
+#include <stdatomic.h>
+#include "mpsc_queue.h"
+
+void mpsc_queue_init(mpsc_queue *queue){
+    atomic_store(&queue->stub.next, NULL);
+    atomic_store(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(mpsc_queue *queue, mpsc_node *node){
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node *prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/*
+ * Pops the oldest node. Returns NULL if the queue is empty or a producer is half-way through a push.
+ */
+mpsc_node * mpsc_queue_pop(mpsc_queue *queue){
+    mpsc_node *tail = queue->tail;
+    mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub){ // skip the stub
+        if (next == NULL)
+            return NULL;
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL){
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+        return NULL; // a push is in progress
+
+    mpsc_queue_push(queue, &queue->stub); // re-insert the stub so the last node can be detached
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL){
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
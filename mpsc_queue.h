@@ -0,0 +1,26 @@
+//
+// Lock-free multi-producer/single-consumer queue header file
+//
+// Dmitry Vyukov's intrusive MPSC queue: any thread pushes with a single atomic exchange, without waiting for the other
+// producers or for the consumer, and one thread pops. The nodes are embedded in the items that are queued, so neither
+// side allocates anything.
+//
+
+#ifndef REDIS_MPSC_QUEUE_H
+#define REDIS_MPSC_QUEUE_H
+
+typedef struct mpsc_node {
+    struct mpsc_node *_Atomic next;
+} mpsc_node;
+
+typedef struct {
+    mpsc_node *_Atomic head; // producers push here
+    mpsc_node *tail; // only touched by the consumer
+    mpsc_node stub; // the queue always holds at least this node
+} mpsc_queue;
+
+void mpsc_queue_init(mpsc_queue *);
+void mpsc_queue_push(mpsc_queue *, mpsc_node *);
+mpsc_node * mpsc_queue_pop(mpsc_queue *);
+
+#endif //REDIS_MPSC_QUEUE_H
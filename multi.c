@@ -0,0 +1,227 @@
+//
+// Transactions source file
+//
+// The stamps are shared by every shard, so that a client can watch keys of another shard and the shard running the
+// transaction checks them. A shard changing a key only bumps its stamp after the change; a client starting to watch
+// counts itself in num_watching_clients before it reads the stamps, so a change it didn't see bump the stamp was done
+// before its WATCH.
+//
+#include <stdatomic.h>
+#include "multi.h"
+#include "shard.h"
+
+static atomic_uint watch_stamps[WATCH_STAMPS];
+static atomic_uint *db_stamps = NULL; // one per database
+static atomic_int num_watching_clients = 0; // clients with watched keys
+
+// commands that can't be part of a transaction
+static const char *unqueued_commands[] = {"PSYNC", "REPLCONF", "SUBSCRIBE", "PSUBSCRIBE", "UNSUBSCRIBE",
+                                          "PUNSUBSCRIBE", NULL};
+
+/*
+ * Sets up the version stamps of the databases, once their number is known.
+ */
+void multi_init(void){
+    db_stamps = calloc(server_config.databases, sizeof *db_stamps);
+}
+
+static unsigned stamp_slot(int db_index, unsigned hashv){
+    return (hashv ^ (unsigned)db_index * 0x9e3779b9U) & (WATCH_STAMPS - 1);
+}
+
+/*
+ * Bumps the version stamp of a key of the current database that was just changed, given the hash of the key.
+ */
+void touch_watched_key(unsigned hashv){
+    if (atomic_load(&num_watching_clients) > 0)
+        atomic_fetch_add(&watch_stamps[stamp_slot((int)(db - dbs), hashv)], 1);
+}
+
+/*
+ * Bumps the version stamp of a whole database, for changes of all of its keys like FLUSHDB.
+ */
+void touch_watched_db(int db_index){
+    if (atomic_load(&num_watching_clients) > 0)
+        atomic_fetch_add(&db_stamps[db_index], 1);
+}
+
+static void reply_with(redis_client *client, const char *response, enum resp_type type){
+    if (client->flags & CLIENT_MASTER) // our primary isn't answered
+        return;
+    char *resp_response = (char *)serialize((char *)response, strlen(response), type);
+    add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+    free(resp_response);
+}
+
+static void watch_keys(redis_client *client, client_command *command){
+    if (client->num_watched_keys == 0)
+        atomic_fetch_add(&num_watching_clients, 1);
+    for (int i = 1; i < command->argc; i++){
+        unsigned hashv;
+        HASH_VALUE(command->argv[i], command->argv_len[i], hashv);
+        if (client->num_watched_keys == client->watched_keys_capacity){
+            client->watched_keys_capacity = client->watched_keys_capacity == 0 ? 8 : client->watched_keys_capacity * 2;
+            client->watched_keys = realloc(client->watched_keys,
+                                           sizeof *client->watched_keys * client->watched_keys_capacity);
+        }
+        watched_key *watched = &client->watched_keys[client->num_watched_keys++];
+        watched->db = client->db;
+        watched->slot = stamp_slot(client->db, hashv);
+        watched->stamp = atomic_load(&watch_stamps[watched->slot]);
+        watched->db_stamp = atomic_load(&db_stamps[client->db]);
+    }
+}
+
+/*
+ * Checks if one of the watched keys (or another key sharing its stamp) changed since it was watched.
+ */
+int watched_keys_changed(const watched_key *watched, int num_watched){
+    for (int i = 0; i < num_watched; i++)
+        if (atomic_load(&watch_stamps[watched[i].slot]) != watched[i].stamp ||
+            atomic_load(&db_stamps[watched[i].db]) != watched[i].db_stamp)
+            return 1;
+    return 0;
+}
+
+void unwatch_all_keys(redis_client *client){
+    if (client->num_watched_keys == 0)
+        return;
+    client->num_watched_keys = 0;
+    atomic_fetch_sub(&num_watching_clients, 1);
+}
+
+/*
+ * Drops the queued commands of a client and takes it out of its transaction.
+ */
+void discard_transaction(redis_client *client){
+    for (int i = 0; i < client->num_multi_commands; i++)
+        free_command_args(client->multi_commands[i].argv, client->multi_commands[i].argv_len,
+                          client->multi_commands[i].argc);
+    client->num_multi_commands = 0;
+    client->flags &= ~(CLIENT_MULTI | CLIENT_DIRTY_EXEC);
+}
+
+/*
+ * Queues a command for EXEC, which now owns its arguments. A command that would be refused (e.g. redirected in cluster
+ * mode) is answered with its error right away and makes EXEC fail.
+ */
+static void queue_command(redis_client *client, client_command *command){
+    const char **cmd = (const char **)command->argv;
+    char *resp_response = NULL;
+
+    db = &dbs[client->db];
+    for (int i = 0; unqueued_commands[i] != NULL && resp_response == NULL; i++)
+        if (strcmp(unqueued_commands[i], cmd[0]) == 0){
+            char *response = "Failed: Command not allowed in a transaction";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
+    if (resp_response == NULL)
+        resp_response = refuse_command(client, cmd, command->argc, is_write_command(cmd[0]));
+    if (resp_response != NULL){
+        client->flags |= CLIENT_DIRTY_EXEC;
+        if (!(client->flags & CLIENT_MASTER))
+            add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+        free_command_args(command->argv, command->argv_len, command->argc);
+        return;
+    }
+    if (client->num_multi_commands == client->multi_commands_capacity){
+        client->multi_commands_capacity = client->multi_commands_capacity == 0 ? 8 :
+                                          client->multi_commands_capacity * 2;
+        client->multi_commands = realloc(client->multi_commands,
+                                         sizeof *client->multi_commands * client->multi_commands_capacity);
+    }
+    client->multi_commands[client->num_multi_commands++] = *command;
+    reply_with(client, "QUEUED", SIMPLE_STRING);
+}
+
+/*
+ * Runs the commands of a transaction one after the other and replies with an array of their replies, or with a null
+ * array if a watched key changed, in which case none of them runs. Frees their arguments.
+ */
+void exec_commands(redis_client *client, client_command *commands, int num_commands, const watched_key *watched,
+                   int num_watched){
+    int aborted = watched_keys_changed(watched, num_watched);
+
+    if (!(client->flags & CLIENT_MASTER)){
+        char header[RESP_HEADER_SIZE];
+        add_reply(client, header, serialize_header(header, ARRAY, aborted ? -1 : num_commands));
+    }
+    if (!aborted)
+        transaction_begin();
+    for (int i = 0; i < num_commands; i++){
+        if (!aborted && commands[i].argc > 0)
+            execute_command(client, (const char **)commands[i].argv, commands[i].argv_len, commands[i].argc);
+        free_command_args(commands[i].argv, commands[i].argv_len, commands[i].argc);
+    }
+    if (!aborted)
+        transaction_end();
+}
+
+static void exec_transaction(redis_client *client){
+    if (client->flags & CLIENT_DIRTY_EXEC){
+        discard_transaction(client);
+        unwatch_all_keys(client);
+        reply_with(client, "Failed: Transaction discarded because of previous errors", SIMPLE_ERROR);
+        return;
+    }
+    client->flags &= ~CLIENT_MULTI;
+    if (num_shards == 1 || !shard_dispatch_transaction(client))
+        exec_commands(client, client->multi_commands, client->num_multi_commands, client->watched_keys,
+                      client->num_watched_keys);
+    client->num_multi_commands = 0;
+    unwatch_all_keys(client);
+}
+
+/*
+ * Runs MULTI, EXEC, DISCARD, WATCH and UNWATCH, and queues the other commands of a client in a transaction. Returns 1
+ * if it took the command (and its arguments), 0 if the command runs as usual.
+ */
+int handle_transaction_command(redis_client *client, client_command *command){
+    const char *name = command->argv[0];
+    int in_multi = client->flags & CLIENT_MULTI;
+
+    if (strcmp(name, "MULTI") == 0){
+        if (in_multi)
+            reply_with(client, "Failed: MULTI calls can not be nested", SIMPLE_ERROR);
+        else {
+            client->flags |= CLIENT_MULTI;
+            reply_with(client, "OK", SIMPLE_STRING);
+        }
+    } else if (strcmp(name, "EXEC") == 0){
+        if (!in_multi)
+            reply_with(client, "Failed: EXEC without MULTI", SIMPLE_ERROR);
+        else exec_transaction(client);
+    } else if (strcmp(name, "DISCARD") == 0){
+        if (!in_multi)
+            reply_with(client, "Failed: DISCARD without MULTI", SIMPLE_ERROR);
+        else {
+            discard_transaction(client);
+            unwatch_all_keys(client);
+            reply_with(client, "OK", SIMPLE_STRING);
+        }
+    } else if (strcmp(name, "WATCH") == 0){
+        char *resp_response = NULL;
+        db = &dbs[client->db];
+        if (in_multi)
+            reply_with(client, "Failed: WATCH inside MULTI is not allowed", SIMPLE_ERROR);
+        else if (command->argc < 2)
+            reply_with(client, "Failed: Incomplete argument list", SIMPLE_ERROR);
+        else if ((resp_response = refuse_command(client, (const char **)command->argv, command->argc, 0)) != NULL){
+            add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+            free(resp_response);
+        } else {
+            watch_keys(client, command);
+            reply_with(client, "OK", SIMPLE_STRING);
+        }
+    } else if (strcmp(name, "UNWATCH") == 0){
+        unwatch_all_keys(client);
+        reply_with(client, "OK", SIMPLE_STRING);
+    } else if (in_multi && strcmp(name, "ASKING") != 0){ // ASKING is for the command queued right after it
+        queue_command(client, command);
+        return 1;
+    } else return 0;
+
+    free_command_args(command->argv, command->argv_len, command->argc);
+    return 1;
+}
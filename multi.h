@@ -0,0 +1,32 @@
+//
+// Transactions header file
+//
+// MULTI starts queueing the commands of a client instead of running them, and EXEC runs the queue back-to-back,
+// without another client's command in between, replying with an array of their replies. DISCARD drops the queue.
+//
+// WATCH makes the next EXEC fail (with a null reply) if one of the watched keys changed since. Instead of a list of
+// watchers per key, every change of a key bumps a version stamp in a fixed table indexed by the hash of the key and
+// its database, and WATCH remembers the stamps of its keys: EXEC only compares them, O(watched keys). Two keys can
+// share a stamp, so a change of an unwatched key may fail an EXEC it didn't have to, never the other way around. The
+// stamps are only bumped while a client watches keys.
+//
+// With shards, the queued commands have to work on keys of a single shard, where EXEC sends them to run in one go.
+//
+
+#ifndef REDIS_MULTI_H
+#define REDIS_MULTI_H
+
+#include "redis.h"
+
+#define WATCH_STAMPS (1 << 16) // version stamps of the keys, a power of 2
+
+void multi_init(void);
+void touch_watched_key(unsigned);
+void touch_watched_db(int);
+int handle_transaction_command(redis_client *, client_command *);
+int watched_keys_changed(const watched_key *, int);
+void exec_commands(redis_client *, client_command *, int, const watched_key *, int);
+void discard_transaction(redis_client *);
+void unwatch_all_keys(redis_client *);
+
+#endif //REDIS_MULTI_H
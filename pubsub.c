@@ -0,0 +1,334 @@
+//
+// Publish/subscribe source file
+//
+// A channel knows its subscribers and every subscriber knows its channels, so that a client hanging up leaves all of
+// them without a scan of the others. The same goes for the patterns, which also know their node of the trie: a
+// pattern left without subscribers is removed from it, along with the nodes left without patterns below them.
+//
+#include "pubsub.h"
+
+static _Thread_local pubsub_channel *channels = NULL; // by name
+static _Thread_local pattern_node *pattern_trie = NULL; // the empty prefix
+
+static void add_subscriber(redis_client ***subscribers, int *num, int *capacity, redis_client *client){
+    if (*num == *capacity){
+        *capacity = *capacity == 0 ? 4 : *capacity * 2;
+        *subscribers = realloc(*subscribers, sizeof **subscribers * *capacity);
+    }
+    (*subscribers)[(*num)++] = client;
+}
+
+static void remove_subscriber(redis_client **subscribers, int *num, redis_client *client){
+    for (int i = 0; i < *num; i++)
+        if (subscribers[i] == client){
+            subscribers[i] = subscribers[--(*num)];
+            return;
+        }
+}
+
+/*
+ * Replies to a change of the subscriptions of a client with the kind of change, the channel or pattern (NULL when
+ * there was none to unsubscribe from) and the number of subscriptions it has left. It is a push message in RESP3.
+ */
+static void reply_subscription(redis_client *client, const char *kind, const char *name){
+    char *resp_response = NULL;
+    size_t resp_len = 0;
+    FILE *stream = open_memstream(&resp_response, &resp_len);
+    char header[RESP_HEADER_SIZE];
+
+    serialize_header(header, PUSH, 3);
+    fprintf(stream, "%s$%zu\r\n%s\r\n", header, strlen(kind), kind);
+    if (name == NULL){
+        serialize_header(header, NULL_VALUE, 0);
+        fputs(header, stream);
+    } else fprintf(stream, "$%zu\r\n%s\r\n", strlen(name), name);
+    fprintf(stream, ":%d\r\n", client->num_channels + client->num_patterns);
+    fclose(stream);
+    add_reply(client, resp_response, resp_len);
+    free(resp_response);
+}
+
+static void subscribe_channel(redis_client *client, const char *name){
+    pubsub_channel *channel;
+
+    for (int i = 0; i < client->num_channels; i++)
+        if (strcmp(client->channels[i]->name, name) == 0)
+            return;
+    HASH_FIND_STR(channels, name, channel);
+    if (channel == NULL){
+        channel = calloc(1, sizeof *channel);
+        channel->name = strdup(name);
+        HASH_ADD_KEYPTR(hh, channels, channel->name, strlen(channel->name), channel);
+    }
+    add_subscriber(&channel->subscribers, &channel->num_subscribers, &channel->subscribers_capacity, client);
+    if (client->num_channels == client->channels_capacity){
+        client->channels_capacity = client->channels_capacity == 0 ? 4 : client->channels_capacity * 2;
+        client->channels = realloc(client->channels, sizeof *client->channels * client->channels_capacity);
+    }
+    client->channels[client->num_channels++] = channel;
+}
+
+static void unsubscribe_channel(redis_client *client, int idx){
+    pubsub_channel *channel = client->channels[idx];
+
+    client->channels[idx] = client->channels[--client->num_channels];
+    remove_subscriber(channel->subscribers, &channel->num_subscribers, client);
+    if (channel->num_subscribers > 0)
+        return;
+    HASH_DEL(channels, channel);
+    free(channel->subscribers);
+    free(channel->name);
+    free(channel);
+}
+
+static pattern_node * find_child(pattern_node *node, unsigned char c){
+    for (int i = 0; i < node->num_children; i++)
+        if (node->children[i]->c == c)
+            return node->children[i];
+    return NULL;
+}
+
+/*
+ * Finds the node of the literal prefix of a pattern, the characters before its first wildcard, adding the missing
+ * nodes. Returns where the rest of the pattern starts in rest.
+ */
+static pattern_node * prefix_node(const char *pattern, const char **rest){
+    const char *p = pattern;
+
+    if (pattern_trie == NULL)
+        pattern_trie = calloc(1, sizeof *pattern_trie);
+    pattern_node *node = pattern_trie;
+    while (*p != '\0' && *p != '*' && *p != '?' && *p != '['){
+        unsigned char c = *p == '\\' && p[1] != '\0' ? p[1] : *p;
+        pattern_node *child = find_child(node, c);
+        if (child == NULL){
+            child = calloc(1, sizeof *child);
+            child->c = c;
+            child->parent = node;
+            node->children = realloc(node->children, sizeof *node->children * (node->num_children + 1));
+            node->children[node->num_children++] = child;
+        }
+        node = child;
+        p += *p == '\\' && p[1] != '\0' ? 2 : 1;
+    }
+    *rest = p;
+    return node;
+}
+
+static void subscribe_pattern(redis_client *client, const char *pattern){
+    pubsub_pattern *pat = NULL;
+    const char *rest;
+
+    for (int i = 0; i < client->num_patterns; i++)
+        if (strcmp(client->patterns[i]->pattern, pattern) == 0)
+            return;
+    pattern_node *node = prefix_node(pattern, &rest);
+    for (int i = 0; i < node->num_patterns && pat == NULL; i++)
+        if (strcmp(node->patterns[i]->pattern, pattern) == 0)
+            pat = node->patterns[i];
+    if (pat == NULL){
+        pat = calloc(1, sizeof *pat);
+        pat->pattern = strdup(pattern);
+        pat->rest = pat->pattern + (rest - pattern);
+        pat->node = node;
+        node->patterns = realloc(node->patterns, sizeof *node->patterns * (node->num_patterns + 1));
+        node->patterns[node->num_patterns++] = pat;
+    }
+    add_subscriber(&pat->subscribers, &pat->num_subscribers, &pat->subscribers_capacity, client);
+    if (client->num_patterns == client->patterns_capacity){
+        client->patterns_capacity = client->patterns_capacity == 0 ? 4 : client->patterns_capacity * 2;
+        client->patterns = realloc(client->patterns, sizeof *client->patterns * client->patterns_capacity);
+    }
+    client->patterns[client->num_patterns++] = pat;
+}
+
+static void unsubscribe_pattern(redis_client *client, int idx){
+    pubsub_pattern *pat = client->patterns[idx];
+    pattern_node *node = pat->node;
+
+    client->patterns[idx] = client->patterns[--client->num_patterns];
+    remove_subscriber(pat->subscribers, &pat->num_subscribers, client);
+    if (pat->num_subscribers > 0)
+        return;
+    for (int i = 0; i < node->num_patterns; i++)
+        if (node->patterns[i] == pat){
+            node->patterns[i] = node->patterns[--node->num_patterns];
+            break;
+        }
+    free(pat->subscribers);
+    free(pat->pattern);
+    free(pat);
+
+    while (node->parent != NULL && node->num_patterns == 0 && node->num_children == 0){
+        pattern_node *parent = node->parent;
+        for (int i = 0; i < parent->num_children; i++)
+            if (parent->children[i] == node){
+                parent->children[i] = parent->children[--parent->num_children];
+                break;
+            }
+        free(node->children);
+        free(node->patterns);
+        free(node);
+        node = parent;
+    }
+}
+
+/*
+ * Encodes a message once for all of its receivers: "message", the channel and the message, or "pmessage" and the
+ * pattern first when it was matched by a pattern. type_symbol is '>' for a push message, '*' for an array.
+ */
+static shared_reply * encode_message(const char *pattern, const char *channel, const char *message, char type_symbol){
+    size_t channel_len = strlen(channel), message_len = strlen(message);
+    int len;
+
+    if (pattern == NULL)
+        len = snprintf(NULL, 0, "%c3\r\n$7\r\nmessage\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n", type_symbol, channel_len,
+                       channel, message_len, message);
+    else len = snprintf(NULL, 0, "%c4\r\n$8\r\npmessage\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n", type_symbol,
+                        strlen(pattern), pattern, channel_len, channel, message_len, message);
+    shared_reply *reply = create_shared_reply(len + 1); // room for the NUL snprintf() ends with
+    if (pattern == NULL)
+        snprintf(reply->data, len + 1, "%c3\r\n$7\r\nmessage\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n", type_symbol,
+                 channel_len, channel, message_len, message);
+    else snprintf(reply->data, len + 1, "%c4\r\n$8\r\npmessage\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
+                  type_symbol, strlen(pattern), pattern, channel_len, channel, message_len, message);
+    reply->len = len;
+    return reply;
+}
+
+/*
+ * Queues a message for subscribers, as a push message for the RESP3 ones and as an array for the others, each
+ * encoded the first time a subscriber needs it.
+ */
+static void deliver(redis_client **subscribers, int num_subscribers, const char *pattern, const char *channel,
+                    const char *message){
+    shared_reply *replies[2] = {NULL, NULL}; // RESP2, RESP3
+
+    for (int i = 0; i < num_subscribers; i++){
+        int resp3 = subscribers[i]->resp == 3;
+        if (replies[resp3] == NULL)
+            replies[resp3] = encode_message(pattern, channel, message, resp3 ? '>' : '*');
+        add_shared_reply(subscribers[i], replies[resp3]);
+    }
+    for (int i = 0; i < 2; i++)
+        if (replies[i] != NULL)
+            release_shared_reply(replies[i]);
+}
+
+/*
+ * Callback for PUBLISH, sends a message to the subscribers of a channel and of the patterns matching it. The trie is
+ * walked along the characters of the channel, and at every node the patterns whose literal prefix ends there are
+ * matched against the rest of the channel. Returns the number of subscribers that got the message.
+ */
+long pubsub_publish(const char *name, const char *message){
+    pubsub_channel *channel;
+    pattern_node *node = pattern_trie;
+    const char *rest = name;
+    long receivers = 0;
+
+    HASH_FIND_STR(channels, name, channel);
+    if (channel != NULL){
+        deliver(channel->subscribers, channel->num_subscribers, NULL, name, message);
+        receivers += channel->num_subscribers;
+    }
+    while (node != NULL){
+        for (int i = 0; i < node->num_patterns; i++){
+            pubsub_pattern *pat = node->patterns[i];
+            if (!glob_match(pat->rest, rest))
+                continue;
+            deliver(pat->subscribers, pat->num_subscribers, pat->pattern, name, message);
+            receivers += pat->num_subscribers;
+        }
+        if (*rest == '\0')
+            break;
+        node = find_child(node, *rest++);
+    }
+    return receivers;
+}
+
+/*
+ * Drops every subscription of a client that hung up.
+ */
+void pubsub_unsubscribe_all(redis_client *client){
+    while (client->num_channels > 0)
+        unsubscribe_channel(client, client->num_channels - 1);
+    while (client->num_patterns > 0)
+        unsubscribe_pattern(client, client->num_patterns - 1);
+}
+
+/*
+ * Unsubscribes a client from the channels (or patterns) named, or from all of them if none is, replying for each.
+ */
+static void unsubscribe(redis_client *client, client_command *command, int patterns){
+    const char *kind = patterns ? "punsubscribe" : "unsubscribe";
+
+    if (command->argc == 1 && (patterns ? client->num_patterns : client->num_channels) == 0){
+        reply_subscription(client, kind, NULL);
+        return;
+    }
+    if (command->argc == 1){
+        while (patterns && client->num_patterns > 0){
+            char *pattern = strdup(client->patterns[client->num_patterns - 1]->pattern);
+            unsubscribe_pattern(client, client->num_patterns - 1);
+            reply_subscription(client, kind, pattern);
+            free(pattern);
+        }
+        while (!patterns && client->num_channels > 0){
+            char *name = strdup(client->channels[client->num_channels - 1]->name);
+            unsubscribe_channel(client, client->num_channels - 1);
+            reply_subscription(client, kind, name);
+            free(name);
+        }
+        return;
+    }
+    for (int i = 1; i < command->argc; i++){
+        for (int j = 0; patterns && j < client->num_patterns; j++)
+            if (strcmp(client->patterns[j]->pattern, command->argv[i]) == 0){
+                unsubscribe_pattern(client, j);
+                break;
+            }
+        for (int j = 0; !patterns && j < client->num_channels; j++)
+            if (strcmp(client->channels[j]->name, command->argv[i]) == 0){
+                unsubscribe_channel(client, j);
+                break;
+            }
+        reply_subscription(client, kind, command->argv[i]);
+    }
+}
+
+/*
+ * Runs SUBSCRIBE, PSUBSCRIBE, UNSUBSCRIBE and PUNSUBSCRIBE, and refuses the other commands (but PING) of an RESP2
+ * client in subscribed mode (an RESP3 one tells the messages apart from the replies, they are push messages). Returns
+ * 1 if it took the command (and its arguments), 0 if the command runs as usual. In a transaction they are left to
+ * handle_transaction_command(), which doesn't queue them.
+ */
+int handle_pubsub_command(redis_client *client, client_command *command){
+    const char *name = command->argv[0];
+    const char *error = NULL;
+
+    if (client->flags & (CLIENT_MULTI | CLIENT_MASTER))
+        return 0;
+    if (strcmp(name, "SUBSCRIBE") == 0 || strcmp(name, "PSUBSCRIBE") == 0){
+        int patterns = name[0] == 'P';
+        if (command->argc < 2)
+            error = "Failed: Incomplete argument list";
+        for (int i = 1; i < command->argc; i++){
+            if (patterns)
+                subscribe_pattern(client, command->argv[i]);
+            else subscribe_channel(client, command->argv[i]);
+            reply_subscription(client, patterns ? "psubscribe" : "subscribe", command->argv[i]);
+        }
+    } else if (strcmp(name, "UNSUBSCRIBE") == 0 || strcmp(name, "PUNSUBSCRIBE") == 0)
+        unsubscribe(client, command, name[0] == 'P');
+    else if (client->resp == 2 && client->num_channels + client->num_patterns > 0 && strcmp(name, "PING") != 0)
+        error = "Failed: Only SUBSCRIBE, PSUBSCRIBE, UNSUBSCRIBE, PUNSUBSCRIBE and PING are allowed while subscribed";
+    else return 0;
+
+    if (error != NULL){
+        char *resp_response = (char *)serialize((char *)error, strlen(error), SIMPLE_ERROR);
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+    }
+    free_command_args(command->argv, command->argv_len, command->argc);
+    return 1;
+}
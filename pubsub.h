@@ -0,0 +1,52 @@
+//
+// Publish/subscribe header file
+//
+// SUBSCRIBE and PSUBSCRIBE put a client in subscribed mode, where it receives the messages PUBLISH sends to its
+// channels, or to channels matching its glob-style patterns, and may only send the commands that change its
+// subscriptions (and PING).
+//
+// A published message is encoded once, into a shared reply that every subscriber queues by reference (see
+// add_shared_reply()), so the cost of a message sent to thousands of subscribers is a pointer per subscriber. The
+// patterns are kept in a trie of their literal prefixes, the characters before their first wildcard: a channel only
+// walks the trie along its own characters, and only the patterns whose prefix it starts with are matched against it.
+//
+// With shards, every shard has its own subscribers and PUBLISH runs on every one of them.
+//
+
+#ifndef REDIS_PUBSUB_H
+#define REDIS_PUBSUB_H
+
+#include "redis.h"
+
+typedef struct pubsub_channel {
+    char *name;
+    redis_client **subscribers;
+    int num_subscribers;
+    int subscribers_capacity;
+    UT_hash_handle hh;
+} pubsub_channel;
+
+typedef struct pubsub_pattern {
+    char *pattern;
+    const char *rest; // what follows its literal prefix
+    struct pattern_node *node; // where it is in the trie
+    redis_client **subscribers;
+    int num_subscribers;
+    int subscribers_capacity;
+} pubsub_pattern;
+
+// a literal prefix of patterns: the children add one character to it
+typedef struct pattern_node {
+    unsigned char c;
+    struct pattern_node *parent;
+    struct pattern_node **children;
+    int num_children;
+    pubsub_pattern **patterns; // whose literal prefix ends here
+    int num_patterns;
+} pattern_node;
+
+int handle_pubsub_command(redis_client *, client_command *);
+long pubsub_publish(const char *, const char *);
+void pubsub_unsubscribe_all(redis_client *);
+
+#endif //REDIS_PUBSUB_H
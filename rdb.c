@@ -0,0 +1,1028 @@
+//
+// Binary snapshot (RDB) source file
+//
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "rdb.h"
+#include "compress.h"
+#include "shard.h"
+
+rdb_state rdb_status = {
+        .child_pid = -1,
+        .cow_pipe = {-1, -1},
+        .last_bgsave_ok = 1,
+        .last_bgsave_time_sec = -1
+};
+
+// snapshot kept mapped because objects point into it, released by whichever thread frees the last of them
+static const unsigned char *_Atomic mapped_snapshot = NULL;
+static size_t mapped_snapshot_size = 0;
+static atomic_long mapped_snapshot_refs = 0; // objects pointing into the mapping
+
+static void put_u32(unsigned char *out, uint32_t val){
+    for (int i = 0; i < 4; i++)
+        out[i] = (unsigned char)(val >> (8 * i));
+}
+
+static void put_u64(unsigned char *out, uint64_t val){
+    for (int i = 0; i < 8; i++)
+        out[i] = (unsigned char)(val >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *in){
+    uint32_t val = 0;
+    for (int i = 3; i >= 0; i--)
+        val = (val << 8) | in[i];
+    return val;
+}
+
+static uint64_t get_u64(const unsigned char *in){
+    uint64_t val = 0;
+    for (int i = 7; i >= 0; i--)
+        val = (val << 8) | in[i];
+    return val;
+}
+
+/*
+ * Writes data to every target. A target that fails is dropped (e.g. a replica that went away during a diskless sync),
+ * the save only fails once no target is left.
+ */
+static void writer_output(rdb_writer *writer, const void *data, size_t len){
+    int num_left = 0;
+
+    for (int i = 0; i < writer->num_fds; i++){
+        if (writer->fds[i] == -1)
+            continue;
+        if (write_all(writer->fds[i], data, len) == -1)
+            writer->fds[i] = -1;
+        else num_left++;
+    }
+    if (num_left == 0)
+        writer->error = 1;
+}
+
+/*
+ * Writes data straight to the targets, bypassing the block buffer.
+ */
+static void writer_write_direct(rdb_writer *writer, const void *data, size_t len){
+    if (writer->error)
+        return;
+    writer->crc = crc64(writer->crc, data, len);
+    writer_output(writer, data, len);
+}
+
+/*
+ * Compresses the records of a job. Blocks that don't get smaller are written out as they are.
+ */
+static void compress_job(rdb_block_job *job){
+    size_t compressed_len = 0;
+    unsigned char *header;
+
+    if (job->records_len > RDB_COMPRESSED_BLOCK_HEADER_LEN) // must at least make up for the bigger header
+        compressed_len = lz_compress(job->records + RDB_BLOCK_HEADER_LEN, job->records_len,
+                                     job->compressed + RDB_COMPRESSED_BLOCK_HEADER_LEN,
+                                     job->records_len - (RDB_COMPRESSED_BLOCK_HEADER_LEN - RDB_BLOCK_HEADER_LEN));
+    if (compressed_len > 0){
+        header = job->compressed;
+        header[0] = RDB_OPCODE_COMPRESSED_BLOCK;
+        put_u64(header + 13, job->records_len);
+        job->out_len = RDB_COMPRESSED_BLOCK_HEADER_LEN + compressed_len;
+    }
+    else {
+        header = job->records;
+        header[0] = RDB_OPCODE_BLOCK;
+        compressed_len = job->records_len;
+        job->out_len = RDB_BLOCK_HEADER_LEN + job->records_len;
+    }
+    put_u32(header + 1, job->num_records);
+    put_u64(header + 5, compressed_len);
+    job->out = header;
+    job->crc = crc64(0, job->out, job->out_len);
+}
+
+/*
+ * Thread entry point that compresses the queued blocks in the order they were submitted.
+ */
+static void * compress_thread(void *arg){
+    rdb_compressor *compressor = arg;
+
+    pthread_mutex_lock(&compressor->mutex);
+    for (;;) {
+        while (!compressor->shutdown && compressor->next_compress == compressor->next_submit)
+            pthread_cond_wait(&compressor->job_queued, &compressor->mutex);
+        if (compressor->next_compress == compressor->next_submit) // shutting down and nothing left to do
+            break;
+        rdb_block_job *job = &compressor->jobs[compressor->next_compress++ % compressor->num_jobs];
+        pthread_mutex_unlock(&compressor->mutex);
+
+        compress_job(job);
+
+        pthread_mutex_lock(&compressor->mutex);
+        job->state = RDB_JOB_DONE;
+        pthread_cond_broadcast(&compressor->job_done);
+    }
+    pthread_mutex_unlock(&compressor->mutex);
+    return NULL;
+}
+
+static rdb_compressor * compressor_create(void){
+    rdb_compressor *compressor = calloc(1, sizeof *compressor);
+    long num_threads = server_config.save_threads > 0 ? server_config.save_threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > RDB_MAX_SAVE_THREADS)
+        num_threads = RDB_MAX_SAVE_THREADS;
+    compressor->num_jobs = (int)num_threads * RDB_BLOCKS_PER_SAVE_THREAD;
+    for (int i = 0; i < compressor->num_jobs; i++){
+        compressor->jobs[i].records = malloc(RDB_BLOCK_SIZE);
+        compressor->jobs[i].compressed = malloc(RDB_BLOCK_SIZE + RDB_COMPRESSED_BLOCK_HEADER_LEN);
+    }
+    pthread_mutex_init(&compressor->mutex, NULL);
+    pthread_cond_init(&compressor->job_queued, NULL);
+    pthread_cond_init(&compressor->job_done, NULL);
+    for (long t = 0; t < num_threads; t++){
+        if (pthread_create(&compressor->threads[compressor->num_threads], NULL, compress_thread, compressor) != 0)
+            break;
+        compressor->num_threads++;
+    }
+    return compressor;
+}
+
+static void compressor_destroy(rdb_compressor *compressor){
+    pthread_mutex_lock(&compressor->mutex);
+    compressor->shutdown = 1;
+    pthread_cond_broadcast(&compressor->job_queued);
+    pthread_mutex_unlock(&compressor->mutex);
+    for (int t = 0; t < compressor->num_threads; t++)
+        pthread_join(compressor->threads[t], NULL);
+
+    for (int i = 0; i < compressor->num_jobs; i++){
+        free(compressor->jobs[i].records);
+        free(compressor->jobs[i].compressed);
+    }
+    pthread_mutex_destroy(&compressor->mutex);
+    pthread_cond_destroy(&compressor->job_queued);
+    pthread_cond_destroy(&compressor->job_done);
+    free(compressor);
+}
+
+/*
+ * Waits for the oldest block in flight to be compressed and writes it out, so blocks land in the file in the order
+ * they were filled.
+ */
+static void writer_write_job(rdb_writer *writer){
+    rdb_compressor *compressor = writer->compressor;
+    rdb_block_job *job = &compressor->jobs[compressor->next_write % compressor->num_jobs];
+
+    pthread_mutex_lock(&compressor->mutex);
+    while (job->state != RDB_JOB_DONE)
+        pthread_cond_wait(&compressor->job_done, &compressor->mutex);
+    pthread_mutex_unlock(&compressor->mutex);
+
+    if (!writer->error){
+        writer->crc = crc64_combine(writer->crc, job->crc, job->out_len);
+        writer_output(writer, job->out, job->out_len);
+    }
+    job->state = RDB_JOB_FREE;
+    compressor->next_write++;
+}
+
+/*
+ * Writes out every block in flight.
+ */
+static void writer_drain(rdb_writer *writer){
+    if (writer->compressor == NULL)
+        return;
+    while (writer->compressor->next_write != writer->compressor->next_submit)
+        writer_write_job(writer);
+}
+
+/*
+ * Hands the buffered records to the compression threads. The buffer is swapped with the one of a free job, so filling
+ * the next block starts right away.
+ */
+static void writer_submit_block(rdb_writer *writer){
+    rdb_compressor *compressor = writer->compressor;
+
+    if (compressor->next_submit - compressor->next_write == (unsigned long)compressor->num_jobs)
+        writer_write_job(writer); // every job is in flight, make room
+    rdb_block_job *job = &compressor->jobs[compressor->next_submit % compressor->num_jobs];
+    unsigned char *records = job->records;
+    job->records = writer->buffer;
+    writer->buffer = records;
+    job->records_len = writer->used - RDB_BLOCK_HEADER_LEN;
+    job->num_records = writer->block_records;
+
+    if (compressor->num_threads == 0){
+        compress_job(job);
+        job->state = RDB_JOB_DONE;
+        compressor->next_submit++;
+        return;
+    }
+    pthread_mutex_lock(&compressor->mutex);
+    job->state = RDB_JOB_QUEUED;
+    compressor->next_submit++;
+    pthread_cond_signal(&compressor->job_queued);
+    pthread_mutex_unlock(&compressor->mutex);
+}
+
+/*
+ * Writes the buffered records out as one block. The block header is filled into the space reserved at the start of
+ * the buffer so the whole block goes out in a single write.
+ */
+static void writer_flush_block(rdb_writer *writer){
+    if (writer->block_records == 0)
+        return;
+    if (writer->compressor != NULL)
+        writer_submit_block(writer);
+    else {
+        writer->buffer[0] = RDB_OPCODE_BLOCK;
+        put_u32(writer->buffer + 1, writer->block_records);
+        put_u64(writer->buffer + 5, writer->used - RDB_BLOCK_HEADER_LEN);
+        writer_write_direct(writer, writer->buffer, writer->used);
+    }
+    writer->used = RDB_BLOCK_HEADER_LEN;
+    writer->block_records = 0;
+}
+
+static void writer_append(rdb_writer *writer, const void *data, size_t len){
+    if (writer->direct){
+        writer_write_direct(writer, data, len);
+        return;
+    }
+    memcpy(writer->buffer + writer->used, data, len);
+    writer->used += len;
+}
+
+/*
+ * Checks if a string is the canonical representation of a long (no leading zeros, no '+') so that it can be stored
+ * as an RDB_TYPE_INT and turned back into the exact same string on load.
+ */
+static int is_int_encodable(const char *value, size_t len, long *out){
+    char *end_ptr = NULL;
+    char canonical[24];
+
+    if (len == 0 || len > 20 || !(value[0] == '-' || (value[0] >= '0' && value[0] <= '9')))
+        return 0;
+    errno = 0;
+    *out = strtol(value, &end_ptr, 10);
+    if (errno != 0 || *end_ptr != '\0')
+        return 0;
+    snprintf(canonical, sizeof canonical, "%ld", *out);
+    return strcmp(canonical, value) == 0;
+}
+
+static void write_object(rdb_writer *writer, redis_object *obj, int db_index){
+    unsigned char header[1 + 8 + 4 + 4];
+    unsigned char len_buffer[4 + 8];
+    size_t header_len = db_index != 0 ? sizeof header : sizeof header - 4;
+    size_t key_len = strlen(obj->key);
+    size_t value_len = strlen(obj->value);
+    size_t record_len = header_len + key_len + 1;
+    unsigned char type;
+    long int_value;
+
+    if (obj->array_size > 0){
+        type = RDB_TYPE_LIST;
+        record_len += 12 + value_len + 1;
+    }
+    else if (is_int_encodable(obj->value, value_len, &int_value)){
+        type = RDB_TYPE_INT;
+        record_len += 8;
+    }
+    else {
+        type = RDB_TYPE_STRING;
+        record_len += 8 + value_len + 1;
+    }
+    header[0] = db_index != 0 ? type | RDB_TYPE_DB_FLAG : type;
+    put_u64(header + 1, obj->expire_list_index == -1 ? 0 : obj->exp_milliseconds);
+    put_u32(header + 9, (uint32_t)key_len);
+    put_u32(header + 13, (uint32_t)db_index);
+
+    if (writer->used + record_len > RDB_BLOCK_SIZE)
+        writer_flush_block(writer);
+    if (RDB_BLOCK_HEADER_LEN + record_len > RDB_BLOCK_SIZE){ // too big to buffer, give it a block of its own
+        unsigned char block_header[RDB_BLOCK_HEADER_LEN];
+        writer_drain(writer); // the blocks before it go out first
+        block_header[0] = RDB_OPCODE_BLOCK;
+        put_u32(block_header + 1, 1);
+        put_u64(block_header + 5, record_len);
+        writer_write_direct(writer, block_header, sizeof block_header);
+        writer->direct = 1;
+    }
+    else writer->block_records++;
+
+    writer_append(writer, header, header_len);
+    writer_append(writer, obj->key, key_len + 1); // with the terminator
+    switch (type) {
+        case RDB_TYPE_INT:
+            put_u64(len_buffer, (uint64_t)int_value);
+            writer_append(writer, len_buffer, 8);
+            break;
+        case RDB_TYPE_LIST:
+            put_u32(len_buffer, (uint32_t)obj->array_size);
+            put_u64(len_buffer + 4, value_len);
+            writer_append(writer, len_buffer, 12);
+            writer_append(writer, obj->value, value_len + 1);
+            break;
+        default:
+            put_u64(len_buffer, value_len);
+            writer_append(writer, len_buffer, 8);
+            writer_append(writer, obj->value, value_len + 1);
+    }
+    writer->direct = 0;
+}
+
+/*
+ * Serializes the value of an object into a newly allocated DUMP payload (see rdb.h) of *len bytes.
+ */
+unsigned char * rdb_dump_value(const redis_object *obj, size_t *len){
+    size_t value_len = strlen(obj->value);
+    unsigned char *payload = malloc(1 + 4 + 8 + value_len + RDB_DUMP_TRAILER_LEN);
+    size_t p = 1;
+    long int_value;
+
+    if (obj->array_size > 0){
+        payload[0] = RDB_TYPE_LIST;
+        put_u32(payload + p, (uint32_t)obj->array_size);
+        p += 4;
+    }
+    else if (is_int_encodable(obj->value, value_len, &int_value)){
+        payload[0] = RDB_TYPE_INT;
+        put_u64(payload + p, (uint64_t)int_value);
+        p += 8;
+    }
+    else payload[0] = RDB_TYPE_STRING;
+    if (payload[0] != RDB_TYPE_INT){
+        put_u64(payload + p, value_len);
+        memcpy(payload + p + 8, obj->value, value_len);
+        p += 8 + value_len;
+    }
+    payload[p] = RDB_VERSION & 0xff;
+    payload[p + 1] = (RDB_VERSION >> 8) & 0xff;
+    put_u64(payload + p + 2, crc64(0, payload, p + 2));
+    *len = p + RDB_DUMP_TRAILER_LEN;
+    return payload;
+}
+
+/*
+ * Checks a DUMP payload and turns it back into a newly allocated value and its number of list items (0 for strings).
+ * Returns -1 if the payload is truncated, corrupt or from a version we can't read.
+ */
+int rdb_restore_value(const unsigned char *payload, size_t len, char **value, int *array_size){
+    size_t p = 1;
+    uint64_t value_len;
+
+    if (len < 1 + RDB_DUMP_TRAILER_LEN)
+        return -1;
+    size_t end = len - RDB_DUMP_TRAILER_LEN;
+    unsigned version = payload[end] | (unsigned)payload[end + 1] << 8;
+    if (version < RDB_MIN_VERSION || version > RDB_VERSION || crc64(0, payload, end + 2) != get_u64(payload + end + 2))
+        return -1;
+
+    *array_size = 0;
+    switch (payload[0]) {
+        case RDB_TYPE_INT: {
+            if (end - p != 8)
+                return -1;
+            long int_value = (long)get_u64(payload + p);
+            int int_len = snprintf(NULL, 0, "%ld", int_value);
+            *value = malloc(int_len + 1);
+            snprintf(*value, int_len + 1, "%ld", int_value);
+            return 0;
+        }
+        case RDB_TYPE_LIST:
+            if (end - p < 4)
+                return -1;
+            *array_size = (int)get_u32(payload + p);
+            p += 4;
+            if (*array_size <= 0)
+                return -1;
+            // fall through, the items are stored like a string
+        case RDB_TYPE_STRING:
+            if (end - p < 8)
+                return -1;
+            value_len = get_u64(payload + p);
+            p += 8;
+            if (end - p != value_len || memchr(payload + p, '\0', value_len) != NULL)
+                return -1;
+            *value = malloc(value_len + 1);
+            memcpy(*value, payload + p, value_len);
+            (*value)[value_len] = '\0';
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Writes a snapshot of the keyspace to every one of fds in a single pass over the keyspace. The fds that failed are
+ * set to -1. Returns -1 if all of them failed. With shards, the keyspaces of all of them are saved, so they have to be
+ * paused (or this has to run in a forked child).
+ */
+int rdb_save_to_fds(int *fds, int num_fds){
+    rdb_writer writer = {fds, num_fds, malloc(RDB_BLOCK_SIZE), RDB_BLOCK_HEADER_LEN, 0, 0, 0, 0, NULL};
+    unsigned char header[RDB_HEADER_LEN];
+    unsigned char crc_buffer[8];
+    unsigned char eof = RDB_OPCODE_EOF;
+    redis_object *obj;
+    uint64_t num_keys = 0;
+
+    if (writer.buffer == NULL)
+        return -1;
+    if (server_config.rdbcompression)
+        writer.compressor = compressor_create();
+
+    memcpy(header, RDB_MAGIC, RDB_MAGIC_LEN);
+    put_u32(header + RDB_MAGIC_LEN, RDB_VERSION);
+    for (int i = 0; i < num_shards; i++){
+        long shard_keys, shard_expires;
+        count_keys(shard_dbs(i), &shard_keys, &shard_expires);
+        num_keys += shard_keys;
+    }
+    put_u64(header + RDB_MAGIC_LEN + 4, num_keys);
+    writer_write_direct(&writer, header, sizeof header);
+
+    for (int i = 0; i < num_shards; i++){
+        redis_db *shard_databases = shard_dbs(i);
+        for (int d = 0; d < server_config.databases; d++)
+            for (obj = shard_databases[d].objects_map; obj != NULL; obj = obj->hh.next)
+                write_object(&writer, obj, d);
+    }
+
+    writer_flush_block(&writer);
+    writer_drain(&writer);
+    if (writer.compressor != NULL)
+        compressor_destroy(writer.compressor);
+    writer_write_direct(&writer, &eof, 1);
+    put_u64(crc_buffer, writer.crc); // the checksum itself is not part of the checksum
+    if (!writer.error)
+        writer_output(&writer, crc_buffer, 8);
+
+    free(writer.buffer);
+    return writer.error ? -1 : 0;
+}
+
+/*
+ * Writes a snapshot of the keyspace to fd. Returns -1 on failure.
+ */
+int rdb_save_to_fd(int fd){
+    return rdb_save_to_fds(&fd, 1);
+}
+
+/*
+ * Saves a snapshot of the keyspace to filename. The snapshot is written to a temporary file first and renamed over
+ * filename once it is safely on disk, so a crash never leaves a half-written snapshot behind.
+ *
+ * Returns -1 on failure.
+ */
+int rdb_save(const char *filename){
+    char temp_filename[64];
+    snprintf(temp_filename, sizeof temp_filename, "temp-%d.rdb", (int)getpid());
+
+    int fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        perror("Error opening RDB file");
+        return -1;
+    }
+    if (rdb_save_to_fd(fd) == -1 || fsync(fd) == -1){
+        perror("Error writing RDB file");
+        close(fd);
+        unlink(temp_filename);
+        return -1;
+    }
+    close(fd);
+    if (rename(temp_filename, filename) == -1){
+        perror("Error renaming RDB file");
+        unlink(temp_filename);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parses a single record at data[*pos] into a new object that is not linked into the keyspace yet, and the index of
+ * its database into *db_index. The hash of its key is computed here as well, so that linking it later is only a
+ * matter of updating pointers. *out is set to NULL if the record's expiry has passed.
+ *
+ * If map_values is set, the key and value of the new object point into data instead of being copied.
+ *
+ * Returns -1 if the record runs past end, has an unknown type or is in a database past the databases option.
+ */
+static int parse_object(const unsigned char *data, size_t *pos, size_t end, long current_time_ms, int map_values,
+                        redis_object **out, int *db_index){
+    size_t p = *pos;
+    uint64_t value_len;
+    uint32_t array_size = 0;
+    long int_value = 0;
+
+    *out = NULL;
+    *db_index = 0;
+    if (end - p < 1 + 8 + 4)
+        return -1;
+    unsigned char type = data[p];
+    uint64_t expiry_ms = get_u64(data + p + 1);
+    uint32_t key_len = get_u32(data + p + 9);
+    p += 13;
+    if (type & RDB_TYPE_DB_FLAG){
+        if (end - p < 4)
+            return -1;
+        uint32_t index = get_u32(data + p);
+        if (index >= (uint32_t)server_config.databases)
+            return -1;
+        *db_index = (int)index;
+        type &= ~RDB_TYPE_DB_FLAG;
+        p += 4;
+    }
+    if (end - p < (size_t)key_len + 1)
+        return -1;
+    const char *key = (const char *)data + p;
+    p += key_len + 1;
+
+    const char *value = NULL;
+    switch (type) {
+        case RDB_TYPE_INT:
+            if (end - p < 8)
+                return -1;
+            int_value = (long)get_u64(data + p);
+            p += 8;
+            value_len = snprintf(NULL, 0, "%ld", int_value);
+            break;
+        case RDB_TYPE_LIST:
+            if (end - p < 4)
+                return -1;
+            array_size = get_u32(data + p);
+            p += 4;
+            // fall through, the items are stored like a string
+        case RDB_TYPE_STRING:
+            if (end - p < 8)
+                return -1;
+            value_len = get_u64(data + p);
+            p += 8;
+            if (end - p < value_len + 1)
+                return -1;
+            value = (const char *)data + p;
+            p += value_len + 1;
+            break;
+        default:
+            return -1;
+    }
+    *pos = p;
+
+    if (expiry_ms > 0 && (long)expiry_ms <= current_time_ms)
+        return 0;
+
+    redis_object *obj = malloc(sizeof *obj);
+    obj->mapped = 0;
+    if (map_values && key[key_len] == '\0'){
+        obj->key = (char *)key;
+        obj->mapped |= OBJECT_KEY_MAPPED;
+    }
+    else {
+        obj->key = malloc(key_len + 1);
+        memcpy(obj->key, key, key_len + 1);
+    }
+    if (map_values && type != RDB_TYPE_INT && value[value_len] == '\0'){
+        obj->value = (char *)value;
+        obj->mapped |= OBJECT_VALUE_MAPPED;
+    }
+    else {
+        obj->value = malloc(value_len + 1);
+        if (type == RDB_TYPE_INT)
+            snprintf(obj->value, value_len + 1, "%ld", int_value);
+        else memcpy(obj->value, value, value_len + 1);
+    }
+    obj->exp_milliseconds = expiry_ms; // moved into the expiry index once the object is linked
+    obj->expire_list_index = -1;
+    obj->array_size = (int)array_size;
+    HASH_VALUE(obj->key, key_len, obj->hh.hashv);
+    obj->hh.keylen = key_len;
+    *out = obj;
+    return 0;
+}
+
+/*
+ * Thread entry point that checksums and parses the blocks in [chunk->start, chunk->end).
+ */
+static void * load_chunk(void *arg){
+    rdb_load_chunk *chunk = arg;
+    const unsigned char *data = chunk->data;
+    size_t pos = chunk->start;
+    redis_object *obj;
+    int db_index;
+
+    unsigned char *decompressed = NULL;
+
+    chunk->crc = crc64(0, data + chunk->start, chunk->end - chunk->start);
+    while (pos < chunk->end){
+        uint32_t num_records = get_u32(data + pos + 1); // block headers were validated by the caller
+        uint64_t stored_len = get_u64(data + pos + 5);
+        const unsigned char *records = data;
+        size_t records_pos;
+        size_t records_end;
+        int map_values = chunk->map_values;
+
+        if (data[pos] == RDB_OPCODE_COMPRESSED_BLOCK){
+            uint64_t records_len = get_u64(data + pos + 13);
+            if (decompressed == NULL)
+                decompressed = malloc(RDB_BLOCK_SIZE);
+            if (lz_decompress(data + pos + RDB_COMPRESSED_BLOCK_HEADER_LEN, stored_len, decompressed,
+                              records_len) == -1){
+                chunk->error = 1;
+                break;
+            }
+            records = decompressed;
+            map_values = 0; // the buffer is reused for the next block
+            records_pos = 0;
+            records_end = records_len;
+            pos += RDB_COMPRESSED_BLOCK_HEADER_LEN + stored_len;
+        }
+        else {
+            records_pos = pos + RDB_BLOCK_HEADER_LEN;
+            records_end = records_pos + stored_len;
+            pos = records_end;
+        }
+
+        for (uint32_t i = 0; i < num_records && !chunk->error; i++){
+            if (parse_object(records, &records_pos, records_end, chunk->current_time_ms, map_values, &obj,
+                             &db_index) == -1)
+                chunk->error = 1;
+            else if (obj != NULL){
+                chunk->object_dbs[chunk->num_objects] = db_index;
+                chunk->objects[chunk->num_objects++] = obj;
+                chunk->num_mapped += obj->mapped != 0;
+            }
+        }
+        if (chunk->error || records_pos != records_end){
+            chunk->error = 1;
+            break;
+        }
+    }
+    free(decompressed);
+    return NULL;
+}
+
+/*
+ * Loads a snapshot held in memory into the keyspace. mapped is set when data is a mapping of the snapshot file: it is
+ * unmapped when done, or kept for the objects pointing into it with mmap-snapshot on. Otherwise the caller owns data
+ * and every key and value is copied out of it.
+ *
+ * The blocks are split into one contiguous chunk per thread. Each thread checksums its chunk and turns its records
+ * into objects (including hashing their keys) in parallel. The checksums of the chunks are then combined and verified
+ * before any key is added, so a corrupt snapshot never leaves a partially loaded keyspace behind. Finally, the hash
+ * table is grown once to fit the number of keys stored in the header and the objects are linked in, which only takes
+ * a few pointer updates per key.
+ *
+ * Returns the number of keys loaded or -2 if the snapshot is corrupt.
+ */
+static int load_snapshot(const unsigned char *data, size_t size, int mapped){
+    int load_count = 0;
+
+    if (size < RDB_HEADER_LEN + RDB_TRAILER_LEN){
+        if (mapped)
+            munmap((void *)data, size);
+        return -2;
+    }
+    size_t end = size - RDB_TRAILER_LEN;
+    uint32_t version = get_u32(data + RDB_MAGIC_LEN);
+    if (memcmp(data, RDB_MAGIC, RDB_MAGIC_LEN) != 0 || version < RDB_MIN_VERSION || version > RDB_VERSION ||
+        data[end] != RDB_OPCODE_EOF){
+        if (mapped)
+            munmap((void *)data, size);
+        return -2;
+    }
+    uint64_t num_keys = get_u64(data + RDB_MAGIC_LEN + 4);
+    int map_values = mapped && server_config.mmap_snapshot && atomic_load(&mapped_snapshot) == NULL;
+
+    // find the blocks, only their headers are touched here
+    size_t num_blocks = 0;
+    size_t blocks_capacity = 64;
+    size_t *block_offsets = malloc(sizeof(size_t) * blocks_capacity);
+    size_t pos = RDB_HEADER_LEN;
+    while (pos < end){
+        size_t header_len = RDB_BLOCK_HEADER_LEN;
+        if (end - pos >= RDB_COMPRESSED_BLOCK_HEADER_LEN && data[pos] == RDB_OPCODE_COMPRESSED_BLOCK)
+            header_len = RDB_COMPRESSED_BLOCK_HEADER_LEN;
+        // the number of records isn't checksummed yet, it must at least fit in the records before it sizes anything
+        if (end - pos < header_len || (data[pos] != RDB_OPCODE_BLOCK && data[pos] != RDB_OPCODE_COMPRESSED_BLOCK) ||
+            get_u64(data + pos + 5) > end - pos - header_len ||
+            (header_len == RDB_COMPRESSED_BLOCK_HEADER_LEN && get_u64(data + pos + 13) > RDB_BLOCK_SIZE) ||
+            get_u32(data + pos + 1) > get_u64(data + pos + header_len - 8) / RDB_MIN_RECORD_LEN){
+            free(block_offsets);
+            if (mapped)
+                munmap((void *)data, size);
+            return -2;
+        }
+        if (num_blocks == blocks_capacity){
+            blocks_capacity *= 2;
+            block_offsets = realloc(block_offsets, sizeof(size_t) * blocks_capacity);
+        }
+        block_offsets[num_blocks++] = pos;
+        pos += header_len + get_u64(data + pos + 5);
+    }
+
+    long num_threads = server_config.load_threads > 0 ? server_config.load_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > RDB_MAX_LOAD_THREADS)
+        num_threads = RDB_MAX_LOAD_THREADS;
+    if ((size_t)num_threads > num_blocks)
+        num_threads = (long)num_blocks;
+
+    // split the blocks into chunks of about the same number of bytes
+    rdb_load_chunk chunks[RDB_MAX_LOAD_THREADS];
+    pthread_t threads[RDB_MAX_LOAD_THREADS];
+    long current_time_ms = get_current_time_ms();
+    size_t block_idx = 0;
+    for (long t = 0; t < num_threads; t++){
+        size_t target_end = RDB_HEADER_LEN + (end - RDB_HEADER_LEN) / num_threads * (t + 1);
+        size_t num_records = 0;
+        chunks[t] = (rdb_load_chunk){data, block_offsets[block_idx], 0, current_time_ms, NULL, NULL, 0, 0, 0,
+                                     map_values, 0};
+        do {
+            num_records += get_u32(data + block_offsets[block_idx] + 1);
+            block_idx++;
+        } while (block_idx < num_blocks && (t == num_threads - 1 || block_offsets[block_idx] < target_end));
+        chunks[t].end = block_idx < num_blocks ? block_offsets[block_idx] : end;
+        chunks[t].objects = malloc(sizeof(redis_object *) * (num_records > 0 ? num_records : 1));
+        chunks[t].object_dbs = malloc(sizeof(int) * (num_records > 0 ? num_records : 1));
+        if (chunks[t].objects == NULL || chunks[t].object_dbs == NULL){ // too many records for a real snapshot
+            for (long i = 0; i <= t; i++){
+                free(chunks[i].objects);
+                free(chunks[i].object_dbs);
+            }
+            free(block_offsets);
+            if (mapped)
+                munmap((void *)data, size);
+            return -2;
+        }
+        if (block_idx == num_blocks) // ran out of blocks, the remaining threads have nothing to do
+            num_threads = t + 1;
+    }
+    free(block_offsets);
+
+    for (long t = 1; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, load_chunk, &chunks[t]);
+    if (num_threads > 0)
+        load_chunk(&chunks[0]); // the main thread takes the first chunk
+    for (long t = 1; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+
+    uint64_t crc = crc64(0, data, RDB_HEADER_LEN);
+    int error = 0;
+    for (long t = 0; t < num_threads; t++){
+        crc = crc64_combine(crc, chunks[t].crc, chunks[t].end - chunks[t].start);
+        error |= chunks[t].error;
+    }
+    crc = crc64(crc, data + end, 1); // the EOF opcode
+    if (crc != get_u64(data + size - 8))
+        error = 1;
+    if (map_values){
+        // keep the mapping for as long as objects point into it, plus one reference held until the load is done
+        long num_mapped = 1;
+        for (long t = 0; t < num_threads; t++)
+            num_mapped += (long)chunks[t].num_mapped;
+        mapped_snapshot_size = size;
+        atomic_store(&mapped_snapshot, data);
+        atomic_store(&mapped_snapshot_refs, num_mapped);
+        madvise((void *)data, size, MADV_RANDOM); // values are now read one at a time, don't read ahead
+    }
+    else if (mapped)
+        munmap((void *)data, size);
+
+    // the keys of each database, its hash table is grown to fit them once its first key is in
+    long *db_keys = calloc(server_config.databases, sizeof *db_keys);
+    for (long t = 0; t < num_threads; t++)
+        for (size_t i = 0; i < chunks[t].num_objects; i++)
+            db_keys[chunks[t].object_dbs[i]]++;
+
+    redis_db *selected_db = db;
+    for (long t = 0; t < num_threads; t++){
+        for (size_t i = 0; i < chunks[t].num_objects; i++){
+            redis_object *obj = chunks[t].objects[i];
+            if (error || keyspace_full()){
+                free_object(obj);
+                continue;
+            }
+            if (i + RDB_LOAD_PREFETCH_DISTANCE < chunks[t].num_objects){
+                redis_object *next_map = dbs[chunks[t].object_dbs[i + RDB_LOAD_PREFETCH_DISTANCE]].objects_map;
+                if (next_map != NULL){
+                    UT_hash_table *tbl = next_map->hh.tbl;
+                    unsigned hashv = chunks[t].objects[i + RDB_LOAD_PREFETCH_DISTANCE]->hh.hashv;
+                    __builtin_prefetch(&tbl->buckets[hashv & (tbl->num_buckets - 1)], 1);
+                }
+            }
+            unsigned long expiry_ms = obj->exp_milliseconds;
+            obj->exp_milliseconds = 0;
+            db = &dbs[chunks[t].object_dbs[i]];
+            link_object_by_hash(obj, obj->hh.hashv);
+            if (db_keys[chunks[t].object_dbs[i]] > 0){
+                presize_objects_map(db_keys[chunks[t].object_dbs[i]] + db->objects_count);
+                db_keys[chunks[t].object_dbs[i]] = 0;
+            }
+            if (expiry_ms > 0)
+                set_object_expiry(obj, expiry_ms);
+            load_count++;
+        }
+        free(chunks[t].objects);
+        free(chunks[t].object_dbs);
+    }
+    db = selected_db;
+    free(db_keys);
+    if (map_values)
+        rdb_mapping_release();
+    if (!error && (uint64_t)load_count < num_keys && keyspace_full())
+        fprintf(stderr, "Redis server: Max number of keys reached, not every key was loaded\n");
+    return error ? -2 : load_count;
+}
+
+/*
+ * Loads the snapshot in filename into the keyspace. The file is mapped into memory rather than read.
+ *
+ * Returns the number of keys loaded, -1 if the file does not exist and -2 if it could not be read or is corrupt.
+ */
+int rdb_load(const char *filename){
+    struct stat file_stat;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size < RDB_HEADER_LEN + RDB_TRAILER_LEN){
+        close(fd);
+        return -2;
+    }
+    size_t size = file_stat.st_size;
+    const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -2;
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    return load_snapshot(data, size, 1);
+}
+
+/*
+ * Loads a snapshot received into memory, e.g. from a primary during a diskless sync. Keys and values are copied, the
+ * caller keeps ownership of data.
+ *
+ * Returns the number of keys loaded or -2 if the snapshot is corrupt.
+ */
+int rdb_load_from_buffer(const unsigned char *data, size_t size){
+    return load_snapshot(data, size, 0);
+}
+
+/*
+ * Forks a BGSAVE child. Returns 0 in the child, the pid of the child in the parent, -1 if the fork failed and -2 if a
+ * child is already running.
+ */
+static pid_t fork_bgsave_child(enum rdb_child_type type){
+    if (rdb_status.child_pid != -1)
+        return -2;
+    if (pipe(rdb_status.cow_pipe) == -1)
+        return -1;
+
+    rdb_status.last_bgsave_try = time(NULL);
+    shards_pause(); // the child has to find every keyspace in a consistent state
+    shard_stats stats;
+    shards_get_stats(&stats);
+    pid_t pid = fork();
+    if (pid != 0)
+        shards_resume();
+    if (pid == -1){
+        perror("Error forking BGSAVE child");
+        close(rdb_status.cow_pipe[0]);
+        close(rdb_status.cow_pipe[1]);
+        rdb_status.last_bgsave_ok = 0;
+        return -1;
+    }
+    if (pid == 0){
+        close(rdb_status.cow_pipe[0]);
+        return 0;
+    }
+    close(rdb_status.cow_pipe[1]);
+    rdb_status.child_pid = pid;
+    rdb_status.child_type = type;
+    rdb_status.bgsave_start = time(NULL);
+    rdb_status.dirty_before_bgsave = stats.dirty;
+    printf("Redis server: Background saving started by pid %d\n", (int)pid);
+    return pid;
+}
+
+/*
+ * Forks a child that saves a snapshot of the keyspace to filename while the parent keeps serving clients. Pages of the
+ * keyspace are shared between both processes and only copied when the parent modifies them.
+ *
+ * Returns -1 if the child could not be forked and -2 if a BGSAVE is already running.
+ */
+int rdb_bgsave(const char *filename){
+    pid_t pid = fork_bgsave_child(RDB_CHILD_TYPE_DISK);
+    if (pid != 0)
+        return pid < 0 ? (int)pid : 0;
+
+    int ret_val = rdb_save(filename);
+    uint64_t cow_size = get_private_dirty_bytes();
+    write(rdb_status.cow_pipe[1], &cow_size, sizeof cow_size);
+    _exit(ret_val == 0 ? 0 : 1);
+}
+
+/*
+ * Forks a child that streams a snapshot straight into the sockets of replicas doing a full resync, so nothing is
+ * written to or read back from the disk. Each socket first gets its preamble, then the snapshot, then eof_mark: the
+ * size of the snapshot is not known up front, so the replica reads until the mark.
+ *
+ * The snapshot is serialized once for all the sockets. A socket that fails is dropped without stopping the others;
+ * the child reports which sockets got everything, see rdb_status.socket_ok.
+ *
+ * Returns -1 if the child could not be forked and -2 if a BGSAVE is already running.
+ */
+int rdb_bgsave_to_sockets(int *fds, const char **preambles, const size_t *preamble_lens, int num_fds,
+                          const char *eof_mark, size_t eof_mark_len){
+    pid_t pid = fork_bgsave_child(RDB_CHILD_TYPE_SOCKET);
+    if (pid < 0)
+        return (int)pid;
+    if (pid > 0){
+        free(rdb_status.socket_fds);
+        free(rdb_status.socket_ok);
+        rdb_status.socket_fds = malloc(sizeof(int) * num_fds);
+        rdb_status.socket_ok = calloc(num_fds, sizeof(int));
+        memcpy(rdb_status.socket_fds, fds, sizeof(int) * num_fds);
+        rdb_status.num_sockets = num_fds;
+        return 0;
+    }
+
+    int num_ok = 0;
+    for (int i = 0; i < num_fds; i++)
+        if (write_all(fds[i], preambles[i], preamble_lens[i]) == -1)
+            fds[i] = -1;
+    rdb_save_to_fds(fds, num_fds);
+    unsigned char ok[num_fds];
+    for (int i = 0; i < num_fds; i++){
+        ok[i] = fds[i] != -1 && write_all(fds[i], eof_mark, eof_mark_len) == 0;
+        num_ok += ok[i];
+    }
+    uint64_t cow_size = get_private_dirty_bytes();
+    write(rdb_status.cow_pipe[1], &cow_size, sizeof cow_size);
+    write(rdb_status.cow_pipe[1], ok, num_fds);
+    _exit(num_ok > 0 ? 0 : 1);
+}
+
+/*
+ * Reaps the BGSAVE child if it has exited and records how the save went. Called from the server cron. Returns 1 if
+ * the child was reaped (rdb_status.last_bgsave_ok tells how it went), 0 otherwise.
+ */
+int rdb_check_bgsave_done(void){
+    int status;
+    uint64_t cow_size = 0;
+
+    if (rdb_status.child_pid == -1)
+        return 0;
+    if (waitpid(rdb_status.child_pid, &status, WNOHANG) != rdb_status.child_pid)
+        return 0;
+
+    if (read(rdb_status.cow_pipe[0], &cow_size, sizeof cow_size) == sizeof cow_size)
+        rdb_status.last_cow_size = cow_size;
+    if (rdb_status.child_type == RDB_CHILD_TYPE_SOCKET){
+        unsigned char ok[rdb_status.num_sockets];
+        if (read(rdb_status.cow_pipe[0], ok, sizeof ok) == (ssize_t)sizeof ok)
+            for (int i = 0; i < rdb_status.num_sockets; i++)
+                rdb_status.socket_ok[i] = ok[i];
+    }
+    close(rdb_status.cow_pipe[0]);
+
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    rdb_status.child_pid = -1;
+    if (rdb_status.child_type == RDB_CHILD_TYPE_SOCKET){ // no file was written, the save state is unchanged
+        printf("Redis server: Diskless sync terminated %s\n", ok ? "with success" : "with an error");
+        return 1;
+    }
+    rdb_status.last_bgsave_ok = ok;
+    rdb_status.last_bgsave_time_sec = time(NULL) - rdb_status.bgsave_start;
+    if (rdb_status.last_bgsave_ok){
+        dirty -= rdb_status.dirty_before_bgsave; // keep the changes made while the child was saving
+        rdb_status.lastsave = time(NULL);
+        printf("Redis server: Background saving terminated with success (%zu bytes copied on write)\n",
+               (size_t)cow_size);
+    }
+    else fprintf(stderr, "Redis server: Background saving failed\n");
+    return 1;
+}
+
+/*
+ * Drops a reference to the mapped snapshot, unmapping it when no object points into it anymore. Called by
+ * free_object(), possibly from the lazy free thread.
+ */
+void rdb_mapping_release(void){
+    if (atomic_fetch_sub(&mapped_snapshot_refs, 1) != 1)
+        return;
+    munmap((void *)atomic_exchange(&mapped_snapshot, NULL), mapped_snapshot_size);
+}
+
+/*
+ * Number of objects whose key or value still points into the mapped snapshot.
+ */
+long rdb_mapped_objects(void){
+    return atomic_load(&mapped_snapshot) == NULL ? 0 : atomic_load(&mapped_snapshot_refs);
+}
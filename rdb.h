@@ -0,0 +1,156 @@
+//
+// Binary snapshot (RDB) header file
+//
+// File layout (all integers little endian):
+// header  - magic "CREDISDB", u32 version, u64 number of keys
+// blocks  - u8 RDB_OPCODE_BLOCK, u32 number of records, u64 length of the records, records
+//           or u8 RDB_OPCODE_COMPRESSED_BLOCK, u32 number of records, u64 compressed length, u64 length of the
+//           records, the records compressed as one LZ4 block (see compress.h)
+// records - u8 type, u64 absolute expiry in ms (0 if none), u32 key length, then if the type has RDB_TYPE_DB_FLAG
+//           set, u32 index of the database the key is in (otherwise it is in database 0), key, '\0', then by type:
+//           RDB_TYPE_STRING - u64 length, value, '\0'
+//           RDB_TYPE_INT    - i64 value
+//           RDB_TYPE_LIST   - u32 number of items, u64 length, '^' delimited items, '\0'
+// trailer - u8 RDB_OPCODE_EOF, u64 CRC-64 of every byte before it
+//
+// DUMP payloads hold the value of a single object, encoded like a record without the expiry and the key: u8 type,
+// then the value by type, then u16 RDB_VERSION and the CRC-64 of every byte before it.
+//
+// Records are grouped into blocks of up to RDB_BLOCK_SIZE bytes so that a loader can split the file between threads
+// by only reading the block headers. With mmap-snapshot on, the snapshot stays mapped after loading and the keys and
+// values of uncompressed blocks point straight into it, which works because every key and value is followed by a
+// '\0' in the file. The mapping is released once no object points into it anymore. With rdbcompression on, full
+// blocks are handed to a pool of threads that compress them in parallel while the next block is filled. Only a fixed
+// number of blocks are in flight, so the memory used for a save doesn't grow with the keyspace.
+//
+
+#ifndef REDIS_RDB_H
+#define REDIS_RDB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "redis.h"
+
+#define RDB_MAGIC "CREDISDB"
+#define RDB_MAGIC_LEN 8
+#define RDB_VERSION 4 // 4 added RDB_TYPE_DB_FLAG and 3 compressed blocks, version 2 files can still be loaded
+#define RDB_MIN_VERSION 2
+#define RDB_HEADER_LEN (RDB_MAGIC_LEN + 4 + 8)
+#define RDB_BLOCK_HEADER_LEN (1 + 4 + 8)
+#define RDB_COMPRESSED_BLOCK_HEADER_LEN (1 + 4 + 8 + 8)
+#define RDB_TRAILER_LEN (1 + 8)
+#define RDB_MIN_RECORD_LEN (1 + 8 + 4 + 1) // type, expiry, key length and the terminator of an empty key
+#define RDB_BLOCK_SIZE (1024 * 1024) // records are buffered and written out in blocks of this size
+#define RDB_MAX_LOAD_THREADS 64
+#define RDB_MAX_SAVE_THREADS 64
+#define RDB_BLOCKS_PER_SAVE_THREAD 2 // blocks in flight per compression thread
+#define RDB_LOAD_PREFETCH_DISTANCE 8 // how many objects ahead the loader prefetches hash buckets
+#define RDB_BGSAVE_RETRY_DELAY 5 // seconds to wait before an automatic BGSAVE is retried after a failure
+#define RDB_DUMP_TRAILER_LEN (2 + 8)
+
+enum rdb_type {
+    RDB_TYPE_STRING = 0,
+    RDB_TYPE_INT = 1,
+    RDB_TYPE_LIST = 2,
+    RDB_TYPE_DB_FLAG = 128, // or'ed into the type of a record whose key is in a database other than 0
+    RDB_OPCODE_COMPRESSED_BLOCK = 253,
+    RDB_OPCODE_BLOCK = 254,
+    RDB_OPCODE_EOF = 255
+};
+
+enum rdb_block_job_state {
+    RDB_JOB_FREE,
+    RDB_JOB_QUEUED, // waiting for (or being handled by) a compression thread
+    RDB_JOB_DONE // ready to be written out
+};
+
+typedef struct {
+    unsigned char *records; // block to compress, after space reserved for the block header
+    size_t records_len;
+    uint32_t num_records;
+    unsigned char *compressed; // header and compressed records
+    const unsigned char *out; // what to write: compressed, or records with their header if they didn't compress
+    size_t out_len;
+    uint64_t crc; // CRC-64 of out, combined into the file checksum by the writer
+    enum rdb_block_job_state state;
+} rdb_block_job;
+
+typedef struct {
+    rdb_block_job jobs[RDB_MAX_SAVE_THREADS * RDB_BLOCKS_PER_SAVE_THREAD]; // ring, written out in order
+    int num_jobs;
+    unsigned long next_write; // oldest job not written out yet
+    unsigned long next_submit;
+    unsigned long next_compress; // next job a thread picks up
+    pthread_t threads[RDB_MAX_SAVE_THREADS];
+    int num_threads; // 0 if no thread could be started, blocks are then compressed by the writer itself
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_queued;
+    pthread_cond_t job_done;
+} rdb_compressor;
+
+typedef struct {
+    int *fds; // every target gets the same bytes, failed targets are set to -1
+    int num_fds;
+    unsigned char *buffer; // records of the current block, after space reserved for the block header
+    size_t used;
+    uint32_t block_records;
+    uint64_t crc;
+    int direct; // write straight to the targets, used for records that don't fit in a block
+    int error; // set once no target is left
+    rdb_compressor *compressor; // NULL if rdbcompression is off
+} rdb_writer;
+
+typedef struct {
+    const unsigned char *data; // the mapped snapshot
+    size_t start; // offset of the first block of the chunk
+    size_t end; // offset right after the last block of the chunk
+    long current_time_ms;
+    redis_object **objects; // parsed objects, in file order
+    int *object_dbs; // the database of each of them
+    size_t num_objects;
+    uint64_t crc; // CRC-64 of the bytes in [start, end)
+    int error;
+    int map_values; // point keys and values of uncompressed blocks into the mapping instead of copying them
+    size_t num_mapped; // objects that point into the mapping
+} rdb_load_chunk;
+
+enum rdb_child_type {
+    RDB_CHILD_TYPE_DISK, // BGSAVE to a file
+    RDB_CHILD_TYPE_SOCKET // diskless sync, the snapshot is written straight to replica sockets
+};
+
+typedef struct {
+    pid_t child_pid; // -1 if no BGSAVE is running
+    enum rdb_child_type child_type; // of the running child, or of the last one once it is reaped
+    int cow_pipe[2]; // the child reports its copy-on-write bytes through this pipe
+    long long dirty_before_bgsave; // changes made before the running BGSAVE started
+    time_t bgsave_start;
+    time_t last_bgsave_try;
+    int last_bgsave_ok;
+    long last_bgsave_time_sec; // -1 if no BGSAVE has finished yet
+    size_t last_cow_size;
+    time_t lastsave; // time of the last successful SAVE or BGSAVE
+    int *socket_fds; // sockets of a RDB_CHILD_TYPE_SOCKET child
+    int *socket_ok; // set once the child is reaped: 1 if the socket got the whole snapshot
+    int num_sockets;
+} rdb_state;
+
+extern rdb_state rdb_status;
+
+int rdb_save_to_fds(int *, int);
+int rdb_save_to_fd(int);
+int rdb_save(const char *);
+int rdb_load(const char *);
+int rdb_load_from_buffer(const unsigned char *, size_t);
+int rdb_bgsave(const char *);
+int rdb_bgsave_to_sockets(int *, const char **, const size_t *, int, const char *, size_t);
+int rdb_check_bgsave_done(void);
+unsigned char * rdb_dump_value(const redis_object *, size_t *);
+int rdb_restore_value(const unsigned char *, size_t, char **, int *);
+void rdb_mapping_release(void);
+long rdb_mapped_objects(void);
+
+#endif //REDIS_RDB_H
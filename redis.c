@@ -1,12 +1,68 @@
 //
 // Created by timothy on 3/29/24.
 //
+#include <stdatomic.h>
 #include "redis.h"
+#include "lazyfree.h"
+#include "rdb.h"
+#include "aof.h"
+#include "client.h"
+#include "replication.h"
+#include "cluster.h"
+#include "io_threads.h"
+#include "shard.h"
+#include "multi.h"
+#include "pubsub.h"
+#include "tracking.h"
+
+// the keyspace and the event loop state belong to the thread running them, every shard has its own (see shard.h)
+_Thread_local redis_db *dbs = NULL;
+_Thread_local redis_db *db = NULL;
+_Thread_local long long dirty = 0; // number of changes since the last successful save
+_Thread_local redis_client *current_client = NULL;
+static _Thread_local redis_client **clients = NULL; // indexed by socket
+static _Thread_local int clients_capacity = 0;
+static _Thread_local struct pollfd *sockets_arr = NULL; // the listener comes first, then one socket per client
+static _Thread_local int sockets_count = 0;
+static _Thread_local int num_sockets_allowed = 5; // start-off with 5 maximum connections
+static _Thread_local int first_client_socket = 1; // index of the first client in sockets_arr, after the shard's pipe
+static _Thread_local redis_client **pending_clients = NULL; // clients to read from or write to in one batch
+static _Thread_local int num_pending_clients = 0;
+static _Thread_local int pending_clients_capacity = 0;
+// with read-threads, bumped before and after every change of the keyspace, so it is odd during one (a seqlock)
+static atomic_ulong keyspace_version = 0;
+static _Thread_local int keyspace_write_depth = 0;
+static _Thread_local int num_sliced_clients = 0; // clients with CLIENT_RUNNING_SLICES
+static _Thread_local int num_over_budget_clients = 0; // clients with CLIENT_OVER_BUDGET
+static _Thread_local int next_served_client = 0; // the clients with work left take turns being served first
+// objects of keyspaces dropped by FLUSHALL, freed a slice per event loop iteration: the first not freed of each
+static _Thread_local redis_object **dropped_objects = NULL;
+static _Thread_local int num_dropped_objects = 0;
+static _Thread_local int dropped_objects_capacity = 0;
+static _Thread_local int running_transaction = 0; // EXEC is running its commands, see transaction_begin()
+static _Thread_local int transaction_propagated = 0; // and MULTI was propagated before the first one that wrote
+
+// commands that change the keyspace, refused on a replica
+static const char *write_commands[] = {"SET", "DEL", "UNLINK", "FLUSHALL", "FLUSHDB", "INCR", "DECR", "EXPIRE",
+                                       "PEXPIRE", "EXPIREAT", "PEXPIREAT", "PERSIST", "LPUSH", "RPUSH", "RESTORE",
+                                       "RESTORE-ASKING", "MIGRATE", "MSET", "MSETNX", "SWAPDB", NULL};
 
-redis_object *objects_map = NULL;
-int objects_count = 0; // holds the count of items that have been set.
-redis_object *timestamped_objects[MAX_MEM_CAPACITY]; // array of pointers
-int timed_objects_count = 0;
+/*
+ * Allocates an object holding a copy of key and value, without expiry, to be added with link_object().
+ */
+static redis_object * new_object(const char *key, const char *value){
+    redis_object *obj = (redis_object *) malloc(sizeof *obj);
+
+    obj->key = malloc(sizeof(char) * (strlen(key) + 1));
+    obj->value = malloc(sizeof(char) * (strlen(value) + 1));
+    strcpy(obj->key, key);
+    strcpy(obj->value, value);
+    obj->exp_milliseconds = 0;
+    obj->expire_list_index = -1;
+    obj->array_size = 0;
+    obj->mapped = 0;
+    return obj;
+}
 
 /*
  * Callback when SET is received.
@@ -16,7 +72,7 @@ int handle_set(const char *cmd[], int n_args){
     long expiration_timestamp; // can also be of type time_t
     enum redis_exp_type exp_type = NONE; // NONE by default
     long exp_val = 0; // set to 0 by default
-    if (objects_count == MAX_MEM_CAPACITY)
+    if (keyspace_full())
         return -1;
 
     const char *key = cmd[1];
@@ -55,77 +111,463 @@ int handle_set(const char *cmd[], int n_args){
         }
     }
     redis_object *obj = NULL;
-    HASH_FIND_STR(objects_map, key, obj);
-    if (obj != NULL){ // key exists, replace
-        HASH_DEL(objects_map, obj);
-        free(obj); // optional
+    HASH_FIND_STR(db->objects_map, key, obj);
+    if (obj != NULL){ // key exists, replace. Retiring also drops its slot in the expiry index.
+        if (server_config.lazyfree_lazy_server_del)
+            retire_object_lazy(obj);
+        else retire_object(obj);
     }
-    obj = (redis_object *) malloc(sizeof *obj);
-
-    // TODO: Remember to free key and value of obj upon deletion.
-    obj->key = malloc(sizeof(char) * strlen(key));
-    obj->value = malloc(sizeof(char) * strlen(value));
-    strcpy(obj->key, key);
-    strcpy(obj->value, value);
+    obj = new_object(key, value);
     if (exp_type == EX) // convert to ms and then timestamp if EX is used
         expiration_timestamp = convert_exp_time_to_timestamp(exp_val * 1000);
     else if (exp_type == PX)
         expiration_timestamp = convert_exp_time_to_timestamp(exp_val);
     else expiration_timestamp = exp_val; // either it is 0 (never expire) or in a timestamp format already (PXAT, EXAT)
 
-    obj->exp_milliseconds = expiration_timestamp;
-    obj->array_size = 0;
+    link_object(obj);
+    if (expiration_timestamp > 0)
+        set_object_expiry(obj, expiration_timestamp);
+    dirty++;
+    return 0;
+}
 
-    if (expiration_timestamp > 0){
-        timed_objects_count++;
-        timestamped_objects[timed_objects_count - 1] = obj;
-        obj->expire_list_index = timed_objects_count - 1;
-    }
-    else obj->expire_list_index = -1;
+/*
+ * Lets the transactions watching a key that was just changed, and the clients that may have cached it, know.
+ */
+static void key_changed(const redis_object *obj){
+    touch_watched_key(obj->hh.hashv);
+    tracking_invalidate_key(obj->key, obj->hh.hashv);
+}
 
-    HASH_ADD_STR(objects_map, key, obj);
-    objects_count++;
+/*
+ * Sets the absolute expiry (unix time in ms) of an object, adding it to the expiry index if it isn't there yet.
+ * Returns -1 if the expiry index could not be grown.
+ */
+int set_object_expiry(redis_object *obj, unsigned long timestamp_ms){
+    if (obj->expire_list_index == -1){
+        if (db->timed_objects_count == db->timed_objects_capacity){
+            int new_capacity = db->timed_objects_capacity == 0 ? 1024 : db->timed_objects_capacity * 2;
+            redis_object **new_objects = realloc(db->timestamped_objects, sizeof(redis_object *) * new_capacity);
+            if (new_objects == NULL)
+                return -1;
+            db->timestamped_objects = new_objects;
+            db->timed_objects_capacity = new_capacity;
+        }
+        db->timestamped_objects[db->timed_objects_count] = obj;
+        obj->expire_list_index = db->timed_objects_count;
+        db->timed_objects_count++;
+    }
+    obj->exp_milliseconds = timestamp_ms;
+    key_changed(obj);
     return 0;
 }
 
+/*
+ * Removes an object from the expiry index by moving the last element of the index into its slot.
+ */
+void remove_object_expiry(redis_object *obj){
+    if (obj->expire_list_index == -1)
+        return;
+
+    redis_object *last_obj = db->timestamped_objects[db->timed_objects_count - 1];
+    db->timestamped_objects[obj->expire_list_index] = last_obj;
+    last_obj->expire_list_index = obj->expire_list_index;
+    db->timestamped_objects[db->timed_objects_count - 1] = NULL;
+    db->timed_objects_count--;
+
+    obj->expire_list_index = -1;
+    obj->exp_milliseconds = 0;
+    key_changed(obj);
+}
+
+/*
+ * Checks if num_keys more keys would take the keyspace past the maximum number of keys allowed by the maxkeys option.
+ */
+int keyspace_has_room(long num_keys){
+    if (server_config.maxkeys <= 0)
+        return 1;
+    return shards_count_keys() + num_keys <= server_config.maxkeys; // the keys of every shard count
+}
+
+/*
+ * Checks if the keyspace holds the maximum number of keys allowed by the maxkeys option.
+ */
+int keyspace_full(void){
+    return !keyspace_has_room(1);
+}
+
+/*
+ * Sets up the databases of the shard running on this thread, with the first one selected.
+ */
+void init_databases(void){
+    dbs = calloc(server_config.databases, sizeof *dbs);
+    db = &dbs[0];
+}
+
+/*
+ * Adds up the keys, and the keys with an expiry, of every database in an array of them.
+ */
+void count_keys(const redis_db *databases, long *keys, long *expires){
+    *keys = 0;
+    *expires = 0;
+    for (int i = 0; i < server_config.databases; i++){
+        *keys += databases[i].objects_count;
+        *expires += databases[i].timed_objects_count;
+    }
+}
+
+/*
+ * Grows the hash table of a non-empty keyspace to at least num_keys buckets, so that adding num_keys keys never has to
+ * rehash the table. Only cheap while the keyspace is small, e.g. right after the first key of a snapshot is loaded.
+ */
+void presize_objects_map(size_t num_keys){
+    int oomed = 0;
+
+    if (db->objects_map == NULL)
+        return;
+    UT_hash_table *tbl = db->objects_map->hh.tbl;
+    while (tbl->num_buckets < num_keys && tbl->num_buckets < (1U << 31))
+        HASH_EXPAND_BUCKETS(hh, tbl, oomed);
+    (void)oomed;
+}
+
+/*
+ * Adds a new object to the keyspace. Its expiry, if any, has to be set afterwards with set_object_expiry().
+ */
+void link_object(redis_object *obj){
+    unsigned hashv;
+    size_t key_len = strlen(obj->key);
+
+    HASH_VALUE(obj->key, key_len, hashv);
+    HASH_ADD_KEYPTR_BYHASHVALUE(hh, db->objects_map, obj->key, key_len, hashv, obj);
+    db->objects_count++;
+    key_changed(obj);
+    if (server_config.cluster_enabled)
+        cluster_add_key(obj);
+}
+
+/*
+ * Like link_object() for objects whose key has already been hashed (e.g. by a snapshot loading thread).
+ */
+void link_object_by_hash(redis_object *obj, unsigned hashv){
+    HASH_ADD_KEYPTR_BYHASHVALUE(hh, db->objects_map, obj->key, strlen(obj->key), hashv, obj);
+    db->objects_count++;
+    key_changed(obj);
+    if (server_config.cluster_enabled)
+        cluster_add_key(obj);
+}
+
+/*
+ * Removes an object from the keyspace and the expiry index without freeing it.
+ */
+void unlink_object(redis_object *obj){
+    remove_object_expiry(obj);
+    HASH_DEL(db->objects_map, obj);
+    db->objects_count--;
+    key_changed(obj);
+    if (server_config.cluster_enabled)
+        cluster_remove_key(obj);
+}
+
+/*
+ * Frees an object that is no longer part of the keyspace.
+ */
+void free_object(redis_object *obj){
+    if (!(obj->mapped & OBJECT_KEY_MAPPED))
+        free(obj->key);
+    if (!(obj->mapped & OBJECT_VALUE_MAPPED))
+        free(obj->value);
+    if (obj->mapped)
+        rdb_mapping_release();
+    free(obj);
+}
+
+/*
+ * Replaces the value of an object with a heap allocated one. Values loaded from a memory mapped snapshot are never
+ * written to in place, every write goes through here and leaves the mapped copy alone.
+ */
+void replace_object_value(redis_object *obj, char *value){
+    if (!(obj->mapped & OBJECT_VALUE_MAPPED))
+        epoch_free(obj->value);
+    obj->value = value;
+    obj->mapped &= ~OBJECT_VALUE_MAPPED;
+    key_changed(obj);
+}
+
+/*
+ * Frees every object of a keyspace that has been detached from its database.
+ */
+void free_objects_map(redis_object *map){
+    redis_object *obj = map;
+    HASH_CLEAR(hh, map); // frees the buckets but leaves the objects (and their next pointers) alone
+    while (obj != NULL){
+        redis_object *next_obj = obj->hh.next;
+        free_object(obj);
+        obj = next_obj;
+    }
+}
+
+static void free_object_deferred(void *obj){
+    free_object(obj);
+}
+
+static void lazyfree_object_deferred(void *obj){
+    lazyfree_free_object(obj);
+}
+
+/*
+ * Queues the objects of a keyspace detached from its database, for free_dropped_objects() to free in slices.
+ */
+static void drop_objects_map(redis_object *map){
+    redis_object *first = map;
+
+    if (map == NULL)
+        return;
+    HASH_CLEAR(hh, map); // frees the buckets but leaves the objects (and their next pointers) alone
+    if (num_dropped_objects == dropped_objects_capacity){
+        dropped_objects_capacity = dropped_objects_capacity == 0 ? 8 : dropped_objects_capacity * 2;
+        dropped_objects = realloc(dropped_objects, sizeof *dropped_objects * dropped_objects_capacity);
+    }
+    dropped_objects[num_dropped_objects++] = first;
+}
+
+/*
+ * Returns 1 if a slice that handled done items so far used up its time. The clock is only read every few items.
+ */
+static int slice_time_up(int done, long deadline_us){
+    return done > 0 && done % SLICE_CHECK_INTERVAL == 0 && get_monotonic_time_us() >= deadline_us;
+}
+
+/*
+ * Frees the objects of dropped keyspaces until deadline_us.
+ */
+static void free_dropped_objects(long deadline_us){
+    int done = 0;
+
+    while (num_dropped_objects > 0){
+        redis_object *obj = dropped_objects[0];
+        while (obj != NULL && !slice_time_up(done, deadline_us)){
+            redis_object *next_obj = obj->hh.next;
+            free_object(obj);
+            obj = next_obj;
+            done++;
+        }
+        if (obj != NULL){
+            dropped_objects[0] = obj;
+            return;
+        }
+        num_dropped_objects--;
+        memmove(dropped_objects, dropped_objects + 1, sizeof *dropped_objects * num_dropped_objects);
+    }
+}
+
+static void free_objects_map_deferred(void *map){
+    if (server_config.command_slice_time_us > 0)
+        drop_objects_map(map);
+    else free_objects_map(map);
+}
+
+static void lazyfree_objects_map_deferred(void *map){
+    lazyfree_free_objects_map(map);
+}
+
 int retire_object(redis_object *obj){
     if (obj == NULL)
         return -1;
 
-    if (obj->expire_list_index != -1){ // has expiry
-        // copy last into index and set last to NULL
-        timestamped_objects[obj->expire_list_index] = timestamped_objects[timed_objects_count - 1];
-        timestamped_objects[timed_objects_count - 1]->expire_list_index = obj->expire_list_index;
-        timestamped_objects[timed_objects_count - 1] = NULL;
-        timed_objects_count--;
-    }
-    free(obj->key);
-    free(obj->value);
-    HASH_DEL(objects_map, obj);
-    free(obj); // extra step as HASH_DEL should free the object. TODO: Check this in debugger!
+    unlink_object(obj);
+    epoch_defer(free_object_deferred, obj); // frees right away unless read threads may hold it
+    return 0;
+}
+
+/*
+ * Like retire_object() but big values are freed by the background free thread.
+ */
+int retire_object_lazy(redis_object *obj){
+    if (obj == NULL)
+        return -1;
+
+    unlink_object(obj);
+    epoch_defer(lazyfree_object_deferred, obj);
+    return 0;
+}
+
+/*
+ * Sends a command that changed the keyspace to the append only file and to the replicas. A replica forwards the
+ * stream of its primary as it is received instead, so its own changes (keys it found expired) are only logged.
+ */
+static void propagate_command(const char *cmd[], int args){
+    if (running_transaction && !transaction_propagated){
+        const char *multi_cmd[] = {"MULTI"};
+        transaction_propagated = 1;
+        propagate_command(multi_cmd, 1);
+    }
+    aof_feed_command(cmd, args);
+    if (repl_status.master_host == NULL)
+        replication_feed_command(cmd, args);
+}
+
+/*
+ * Sends the commands that rebuild an object from scratch, for writes whose own arguments can't be logged (e.g. the
+ * binary payload of RESTORE).
+ */
+static void propagate_object(redis_object *obj){
+    static _Thread_local aof_buffer object_buffer;
+    const char *del_cmd[] = {"DEL", obj->key};
+
+    propagate_command(del_cmd, 2);
+    object_buffer.len = 0;
+    aof_rewrite_object(&object_buffer, obj);
+    aof_feed_raw(object_buffer.data, object_buffer.len);
+    if (repl_status.master_host == NULL && repl_status.backlog != NULL)
+        replication_feed(object_buffer.data, object_buffer.len);
+}
+
+int is_write_command(const char *name){
+    for (int i = 0; write_commands[i] != NULL; i++)
+        if (strcmp(write_commands[i], name) == 0)
+            return 1;
     return 0;
 }
 
 /*
- * Go through all objects with expiry set and retire expired objects.
+ * Brackets a change of the keyspace for the read threads, see handle_concurrent_read(). Brackets can nest, only the
+ * outer one counts.
+ */
+static void keyspace_write_begin(void){
+    if (concurrent_reads && keyspace_write_depth++ == 0)
+        atomic_fetch_add(&keyspace_version, 1);
+}
+
+static void keyspace_write_end(void){
+    if (concurrent_reads && --keyspace_write_depth == 0)
+        atomic_fetch_add(&keyspace_version, 1);
+}
+
+/*
+ * Brackets the commands run by EXEC: the read threads see either none or all of their changes, and the writes among
+ * them are propagated between MULTI and EXEC, so that the append only file and the replicas apply them at once too.
+ */
+void transaction_begin(void){
+    keyspace_write_begin();
+    running_transaction = 1;
+    transaction_propagated = 0;
+}
+
+void transaction_end(void){
+    running_transaction = 0;
+    if (transaction_propagated){
+        const char *exec_cmd[] = {"EXEC"};
+        transaction_propagated = 0;
+        propagate_command(exec_cmd, 1);
+    }
+    keyspace_write_end();
+}
+
+/*
+ * Retires an object whose expiry time has passed. The deletion is propagated as a DEL so that replaying the append
+ * only file, or a replica, removes the key as well.
+ */
+void expire_object(redis_object *obj){
+    const char *del_cmd[] = {"DEL", obj->key};
+    propagate_command(del_cmd, 2);
+
+    keyspace_write_begin(); // reads can expire keys too
+    if (server_config.lazyfree_lazy_expire)
+        retire_object_lazy(obj);
+    else retire_object(obj);
+    keyspace_write_end();
+}
+
+/*
+ * Go through all objects with expiry set, in every database, and retire expired objects.
  */
 void active_objects_expire(){
     long current_timestamp_ms = get_current_time_ms();
     redis_object *obj;
 
-    int exp_count = 0; // todo: For debugging, remove!
+    int exp_count = 0;
+
+    for (int i = 0; i < server_config.databases; i++){
+        db = &dbs[i]; // the DEL it propagates has to go to this database
+        int objects_pointer = db->timed_objects_count - 1; // look from end of array
+        while (objects_pointer >= 0 && db->timed_objects_count > 0){
+            obj = db->timestamped_objects[objects_pointer];
+            if ((current_timestamp_ms > obj->exp_milliseconds) && (obj->exp_milliseconds > 0)){
+                exp_count++;
+                printf("Found expired data! Key (%s)\n", obj->key);
+                expire_object(obj); // decreases timed_objects_count
+            }
+            objects_pointer--;
+        }
+    }
+    if (exp_count > 0)
+        printf("Found %d expired objects\n", exp_count);
+}
 
-    int objects_pointer = timed_objects_count - 1; // look from end of array
-    while (objects_pointer >= 0 && timed_objects_count > 0){
-        obj = timestamped_objects[objects_pointer];
-        if ((current_timestamp_ms > obj->exp_milliseconds) && (obj->exp_milliseconds > 0)){
-            exp_count++;
-            printf("Found expired data! Key (%s)\n", obj->key);
-            retire_object(obj); // this decreases timed_objects_count
+/*
+ * Starts a BGSAVE if one of the configured save policies is met.
+ */
+void check_save_policy(){
+    time_t now = time(NULL);
+    shard_stats stats;
+
+    if (rdb_status.child_pid != -1 || aof_status.rewrite_child_pid != -1)
+        return;
+    if (!rdb_status.last_bgsave_ok && now - rdb_status.last_bgsave_try < RDB_BGSAVE_RETRY_DELAY)
+        return;
+    shards_get_stats(&stats);
+    for (int i = 0; i < server_config.num_save_params; i++){
+        save_param *param = &server_config.save_params[i];
+        if (stats.dirty >= param->changes && now - rdb_status.lastsave >= param->seconds){
+            printf("Redis server: %ld changes in %ld seconds. Saving...\n", param->changes, param->seconds);
+            rdb_bgsave(SAVE_FILE_NAME);
+            return;
         }
-        objects_pointer--;
     }
-    printf("Found %d expired objects\n", exp_count);
+}
+
+/*
+ * Starts a BGREWRITEAOF that was scheduled while a BGSAVE was running, or one because the append only file grew by
+ * auto-aof-rewrite-percentage since the last rewrite.
+ */
+void check_aof_rewrite_policy(){
+    if (rdb_status.child_pid != -1 || aof_status.rewrite_child_pid != -1)
+        return;
+    if (aof_status.rewrite_scheduled){
+        aof_bgrewrite(AOF_FILE_NAME);
+        return;
+    }
+    if (aof_status.fd == -1 || server_config.auto_aof_rewrite_percentage == 0)
+        return;
+    if (aof_status.current_size < server_config.auto_aof_rewrite_min_size)
+        return;
+    if (!aof_status.last_bgrewrite_ok && time(NULL) - aof_status.rewrite_start < RDB_BGSAVE_RETRY_DELAY)
+        return;
+
+    off_t base_size = aof_status.base_size > 0 ? aof_status.base_size : 1;
+    long long growth = (long long)(aof_status.current_size - base_size) * 100 / base_size;
+    if (growth >= server_config.auto_aof_rewrite_percentage){
+        printf("Redis server: Append only file grew by %lld%%. Rewriting...\n", growth);
+        aof_bgrewrite(AOF_FILE_NAME);
+    }
+}
+
+/*
+ * Periodic tasks, run SERVER_CRON_HZ times per second.
+ */
+void server_cron(){
+    if (repl_status.master_host == NULL) // replicas wait for the DEL of their primary
+        active_objects_expire();
+    if (current_shard_id() != 0) // the rest is about the whole server and done by shard 0
+        return;
+    if (rdb_check_bgsave_done())
+        replication_bgsave_done(rdb_status.last_bgsave_ok);
+    aof_check_bgrewrite_done();
+    check_save_policy();
+    check_aof_rewrite_policy();
+    replication_cron();
+    cluster_cron();
 }
 
 /*
@@ -133,16 +575,351 @@ void active_objects_expire(){
  */
 redis_object * handle_get(const char *key) {
     redis_object *obj;
-    HASH_FIND_STR(objects_map, key, obj);
+    HASH_FIND_STR(db->objects_map, key, obj);
 
     long current_timestamp_ms = get_current_time_ms();
     if (obj != NULL && (current_timestamp_ms > obj->exp_milliseconds) && (obj->exp_milliseconds > 0)){
-        retire_object(obj);
+        expire_object(obj);
         return NULL;
     }
     return obj;
 }
 
+/*
+ * Looks up the keys cmd[first], cmd[first + step], ... up to cmd[args - 1] in one pass, into found (one entry per
+ * key). Every key is hashed first, then the hash bucket of each key is prefetched KEY_PREFETCH_DISTANCE keys ahead of
+ * its lookup, and the value of each object found right after it, so that the cache misses of the lookups overlap
+ * instead of coming one after the other. Expired keys are expired and not found, like with handle_get(). Returns the
+ * number of keys.
+ */
+static int find_objects(const char *cmd[], int args, int first, int step, redis_object *found[]){
+    int num_keys = (args - first + step - 1) / step;
+    unsigned *hashes = malloc(sizeof *hashes * num_keys);
+    size_t *key_lens = malloc(sizeof *key_lens * num_keys);
+    long current_timestamp_ms = get_current_time_ms();
+
+    for (int i = 0; i < num_keys; i++){
+        key_lens[i] = strlen(cmd[first + i * step]);
+        HASH_VALUE(cmd[first + i * step], key_lens[i], hashes[i]);
+    }
+    for (int i = 0; i < num_keys; i++){
+        redis_object *obj = NULL;
+        if (db->objects_map == NULL){ // empty, or emptied by expiring the last key
+            found[i] = NULL;
+            continue;
+        }
+        UT_hash_table *tbl = db->objects_map->hh.tbl;
+        if (i == 0)
+            for (int j = 0; j < KEY_PREFETCH_DISTANCE && j < num_keys; j++)
+                __builtin_prefetch(&tbl->buckets[hashes[j] & (tbl->num_buckets - 1)]);
+        else if (i + KEY_PREFETCH_DISTANCE - 1 < num_keys)
+            __builtin_prefetch(&tbl->buckets[hashes[i + KEY_PREFETCH_DISTANCE - 1] & (tbl->num_buckets - 1)]);
+
+        HASH_FIND_BYHASHVALUE(hh, db->objects_map, cmd[first + i * step], key_lens[i], hashes[i], obj);
+        if (obj != NULL && obj->exp_milliseconds > 0 && current_timestamp_ms > obj->exp_milliseconds){
+            expire_object(obj); // a key that comes again is not found the second time
+            obj = NULL;
+        }
+        if (obj != NULL)
+            __builtin_prefetch(obj->value);
+        found[i] = obj;
+    }
+    free(hashes);
+    free(key_lens);
+    return num_keys;
+}
+
+/*
+ * Callback when MGET is received. Returns the reply: an array with the value of every key, null for the keys that
+ * don't exist.
+ */
+char * handle_mget(const char *cmd[], int n_args){
+    redis_object **found = malloc(sizeof *found * (n_args - 1));
+    int num_keys = find_objects(cmd, n_args, 1, 1, found);
+    char *resp_response = NULL;
+    size_t resp_len = 0;
+    FILE *stream = open_memstream(&resp_response, &resp_len);
+    char null[RESP_HEADER_SIZE];
+
+    serialize_header(null, NULL_VALUE, 0);
+    fprintf(stream, "*%d\r\n", num_keys);
+    for (int i = 0; i < num_keys; i++){
+        if (found[i] == NULL)
+            fputs(null, stream);
+        else fprintf(stream, "$%zu\r\n%s\r\n", strlen(found[i]->value), found[i]->value);
+    }
+    fclose(stream);
+    free(found);
+    return resp_response;
+}
+
+/*
+ * Callback when MSET or MSETNX is received: sets every key to the value after it, and removes their expiry like SET.
+ * With nx set, nothing is set if any of the keys exists. Returns 1 if the keys were set, 0 if one existed, and -1 if
+ * the new keys would take the keyspace past maxkeys, then nothing is set either.
+ */
+int handle_mset(const char *cmd[], int n_args, int nx){
+    redis_object **found = malloc(sizeof *found * (n_args / 2));
+    int num_keys = find_objects(cmd, n_args, 1, 2, found);
+    int num_new_keys = 0;
+
+    for (int i = 0; i < num_keys; i++)
+        num_new_keys += found[i] == NULL;
+    if ((nx && num_new_keys < num_keys) || !keyspace_has_room(num_new_keys)){
+        free(found);
+        return nx && num_new_keys < num_keys ? 0 : -1;
+    }
+    for (int i = 0; i < num_keys; i++){
+        const char *key = cmd[1 + i * 2];
+        const char *value = cmd[2 + i * 2];
+        redis_object *obj = found[i];
+
+        if (obj == NULL) // the key may have been added by this command already
+            HASH_FIND_STR(db->objects_map, key, obj);
+        if (obj != NULL){ // set in place, the other lookups may point to it
+            char *new_value = malloc(strlen(value) + 1);
+            strcpy(new_value, value);
+            replace_object_value(obj, new_value);
+            remove_object_expiry(obj);
+            obj->array_size = 0;
+        } else link_object(new_object(key, value));
+        dirty++;
+    }
+    free(found);
+    return 1;
+}
+
+static unsigned long reverse_bits(unsigned long v){
+    unsigned long reversed = 0;
+
+    for (int i = 0; i < (int)(sizeof v * 8); i++, v >>= 1)
+        reversed = (reversed << 1) | (v & 1);
+    return reversed;
+}
+
+/*
+ * Callback when SCAN is received. Returns the reply: the cursor to pass to the next call, 0 once every key was
+ * returned, and the keys of the buckets visited (those that match the MATCH pattern and the TYPE, if given).
+ *
+ * The buckets of the hash table are visited in the order of their index with its bits reversed. The table only ever
+ * grows by doubling, and the keys of bucket i then go to bucket i or i + the old size, which come right after one
+ * another in that order: a scan going on while the table grows still returns every key that was there all along,
+ * without any state kept between calls. A key may be returned twice. Every call visits buckets until it went through
+ * COUNT keys (10 by default), or through ten times as many buckets. With shards, the cursor also holds the shard the
+ * scan is at, which goes through the shards one after the other.
+ */
+char * handle_scan(const char *cmd[], int n_args){
+    char *end_ptr;
+    unsigned long long cursor = strtoull(cmd[1], &end_ptr, 10);
+    const char *pattern = NULL;
+    const char *type = NULL;
+    long count = 10;
+    char *error = NULL;
+
+    if (end_ptr == cmd[1] || *end_ptr != '\0' || cmd[1][0] == '-')
+        error = "Failed: Invalid cursor";
+    for (int i = 2; i < n_args && error == NULL; i += 2) {
+        if (i + 1 == n_args)
+            error = "Failed: Incomplete argument list";
+        else if (strcasecmp(cmd[i], "MATCH") == 0)
+            pattern = strcmp(cmd[i + 1], "*") == 0 ? NULL : cmd[i + 1];
+        else if (strcasecmp(cmd[i], "COUNT") == 0){
+            count = strtol(cmd[i + 1], &end_ptr, 10);
+            if (end_ptr == cmd[i + 1] || *end_ptr != '\0' || count < 1)
+                error = "Failed: COUNT must be a positive integer";
+        }
+        else if (strcasecmp(cmd[i], "TYPE") == 0){
+            type = cmd[i + 1];
+            if (strcasecmp(type, "string") != 0 && strcasecmp(type, "list") != 0)
+                error = "Failed: Unknown type, expected string or list";
+        }
+        else error = "Failed: Unsupported option";
+    }
+    if (error != NULL)
+        return (char *)serialize(error, strlen(error), SIMPLE_ERROR);
+
+    unsigned long long scan_shard = cursor % num_keyspace_shards; // the one running this, see shard_route()
+    unsigned long v = cursor / num_keyspace_shards;
+    long current_timestamp_ms = get_current_time_ms();
+    char *keys = NULL;
+    size_t keys_len = 0;
+    FILE *stream = open_memstream(&keys, &keys_len);
+    int num_keys = 0;
+
+    if (db->objects_map == NULL)
+        v = 0;
+    else {
+        UT_hash_table *tbl = db->objects_map->hh.tbl;
+        unsigned long mask = tbl->num_buckets - 1;
+        long num_visited = 0;
+        long max_buckets = count * 10; // bounds the work on a sparse table too
+
+        do {
+            for (UT_hash_handle *hh = tbl->buckets[v & mask].hh_head; hh != NULL; hh = hh->hh_next) {
+                redis_object *obj = (redis_object *)((char *)hh - tbl->hho);
+                num_visited++;
+                if (obj->exp_milliseconds > 0 && current_timestamp_ms > obj->exp_milliseconds)
+                    continue; // expired, the next lookup or the active expiry deletes it
+                if (type != NULL && (obj->array_size > 0) != (strcasecmp(type, "list") == 0))
+                    continue;
+                if (pattern != NULL && !glob_match(pattern, obj->key))
+                    continue;
+                fprintf(stream, "$%zu\r\n%s\r\n", strlen(obj->key), obj->key);
+                num_keys++;
+            }
+            // increment the reversed index: the bits above the mask are set so that the carry goes out the top
+            v = reverse_bits(reverse_bits(v | ~mask) + 1);
+        } while (v != 0 && num_visited < count && --max_buckets > 0);
+    }
+    fclose(stream);
+
+    unsigned long long next_cursor = v * num_keyspace_shards + scan_shard;
+    if (v == 0) // this shard is done, the next one starts from its first bucket
+        next_cursor = scan_shard + 1 < (unsigned long long)num_keyspace_shards ? scan_shard + 1 : 0;
+    char cursor_str[24];
+    int cursor_len = snprintf(cursor_str, sizeof cursor_str, "%llu", next_cursor);
+    char *resp_response = NULL;
+    size_t resp_len = 0;
+    stream = open_memstream(&resp_response, &resp_len);
+    fprintf(stream, "*2\r\n$%d\r\n%s\r\n*%d\r\n", cursor_len, cursor_str, num_keys);
+    fwrite(keys, 1, keys_len, stream);
+    fclose(stream);
+    free(keys);
+    return resp_response;
+}
+
+/*
+ * Returns 1 if the keyspace changed (or is changing) since version was read.
+ */
+static int keyspace_changed(unsigned long version){
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&keyspace_version, memory_order_relaxed) != version;
+}
+
+/*
+ * Finds a key in database db_index of shard 0 from a read thread, while the main thread may be changing it. Every
+ * pointer loaded is checked against version before being followed, so only pointers to objects (or tables) that were
+ * part of the keyspace at some point are followed, and the epoch of the reader keeps them from being freed. Returns -1
+ * if the keyspace changed on the way, then *found may be stale.
+ */
+static int find_object_concurrent(int db_index, const char *key, size_t key_len, unsigned long version,
+                                  redis_object **found){
+    redis_object *head = *(redis_object *volatile *)&shards[0].dbs[db_index].objects_map;
+    unsigned hashv;
+
+    *found = NULL;
+    if (keyspace_changed(version))
+        return -1;
+    if (head == NULL)
+        return 0;
+
+    UT_hash_table *tbl = head->hh.tbl;
+    UT_hash_bucket *buckets = tbl->buckets;
+    unsigned num_buckets = tbl->num_buckets;
+    ptrdiff_t hho = tbl->hho;
+    if (keyspace_changed(version)) // buckets and num_buckets may not match while the table grows
+        return -1;
+
+    HASH_VALUE(key, key_len, hashv);
+    UT_hash_handle *hh = buckets[hashv & (num_buckets - 1)].hh_head;
+    while (hh != NULL) {
+        if (keyspace_changed(version)) // chains are relinked while the table grows, they could even loop
+            return -1;
+        if (hh->hashv == hashv && hh->keylen == key_len && memcmp(hh->key, key, key_len) == 0){
+            *found = (redis_object *)((char *)hh - hho);
+            return 0;
+        }
+        hh = hh->hh_next;
+    }
+    return 0;
+}
+
+/*
+ * Runs GET, MGET or EXISTS on a read thread, against database db_index of the main thread and without taking any
+ * lock: the lookup is optimistic and retried if the main thread changed the keyspace meanwhile (see
+ * keyspace_version). Returns the reply, or NULL if the command has to run on the main thread instead: the keyspace
+ * kept changing, or the key has expired and has to be deleted.
+ */
+char * handle_concurrent_read(int db_index, const char *cmd[], const size_t cmd_len[], int args){
+    char *resp_response = NULL;
+    int reader = current_shard_id();
+
+    if (args < 2)
+        return NULL; // the main thread answers with the usual error
+    epoch_enter(reader);
+    for (int attempt = 0; attempt < CONCURRENT_READ_ATTEMPTS && resp_response == NULL; attempt++) {
+        unsigned long version = atomic_load(&keyspace_version);
+        redis_object *obj;
+        int changed = version & 1;
+
+        if (strcmp(cmd[0], "GET") == 0){
+            if (!changed)
+                changed = find_object_concurrent(db_index, cmd[1], cmd_len[1], version, &obj) == -1;
+            if (changed)
+                continue;
+            if (obj == NULL){
+                char *response = "Failed: Key does not exist";
+                resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+                break;
+            }
+            unsigned long exp_milliseconds = obj->exp_milliseconds;
+            char *value = obj->value;
+            if (keyspace_changed(version))
+                continue;
+            if (exp_milliseconds > 0 && get_current_time_ms() > exp_milliseconds)
+                break;
+            resp_response = (char *)serialize(value, strlen(value), BULK_STRING);
+        }
+        else if (strcmp(cmd[0], "MGET") == 0){
+            long current_timestamp_ms = get_current_time_ms();
+            size_t resp_len = 0;
+            int expired = 0;
+            FILE *stream = open_memstream(&resp_response, &resp_len);
+            char null[RESP_HEADER_SIZE];
+
+            serialize_header(null, NULL_VALUE, 0);
+            fprintf(stream, "*%d\r\n", args - 1);
+            for (int i = 1; i < args && !changed && !expired; i++) {
+                changed = find_object_concurrent(db_index, cmd[i], cmd_len[i], version, &obj) == -1;
+                if (changed || obj == NULL){
+                    fputs(null, stream);
+                    continue;
+                }
+                unsigned long exp_milliseconds = obj->exp_milliseconds;
+                char *value = obj->value;
+                changed = keyspace_changed(version);
+                expired = exp_milliseconds > 0 && current_timestamp_ms > exp_milliseconds;
+                if (!changed && !expired)
+                    fprintf(stream, "$%zu\r\n%s\r\n", strlen(value), value);
+            }
+            fclose(stream);
+            if (changed || expired){
+                free(resp_response);
+                resp_response = NULL;
+                if (expired)
+                    break;
+                continue;
+            }
+        }
+        else {
+            int num_existing_keys = 0;
+            for (int i = 1; i < args && !changed; i++) {
+                changed = find_object_concurrent(db_index, cmd[i], cmd_len[i], version, &obj) == -1;
+                num_existing_keys += obj != NULL;
+            }
+            if (changed)
+                continue;
+            resp_response = (char *)serialize(&num_existing_keys, 0, INTEGER);
+        }
+        if (keyspace_changed(version)){ // the value may have been replaced while it was copied
+            free(resp_response);
+            resp_response = NULL;
+        }
+    }
+    epoch_exit(reader);
+    return resp_response;
+}
+
 /*
  * Callback when EXISTS is received.
  */
@@ -153,7 +930,7 @@ int handle_exists(const char *cmd[], int n_args){
 
     for (int i = 1; i < n_args; i++){
         key = cmd[i]; // works because I'm not changing the data stored in memory, only pointing to a different address
-        HASH_FIND_STR(objects_map, key, obj);
+        HASH_FIND_STR(db->objects_map, key, obj);
 
         // check if object doesn't exist or is expired
         if (obj != NULL){
@@ -164,23 +941,205 @@ int handle_exists(const char *cmd[], int n_args){
 }
 
 /*
- * Callback when DEL is received.
+ * Deletes a key if it exists. Returns 1 if it did.
+ */
+static int delete_key(const char *key, int lazy){
+    redis_object *obj;
+
+    HASH_FIND_STR(db->objects_map, key, obj);
+    if (obj == NULL)
+        return 0;
+    if (lazy)
+        retire_object_lazy(obj);
+    else retire_object(obj);
+    dirty++;
+    return 1;
+}
+
+/*
+ * Callback when DEL or UNLINK is received. If lazy is set, big values are freed by the background free thread.
  */
-int handle_delete(const char *cmd[], int n_args){
+int handle_delete(const char *cmd[], int n_args, int lazy){
     int num_deleted_keys = 0;
+
+    for (int i = 1; i < n_args; i++)
+        num_deleted_keys += delete_key(cmd[i], lazy);
+    return num_deleted_keys;
+}
+
+/*
+ * Empties a database. Its keyspace is detached in O(1) and, if lazy is set, freed by the background free thread,
+ * otherwise a slice per event loop iteration.
+ */
+static void empty_db(redis_db *target, int lazy){
+    redis_object *old_objects_map = target->objects_map;
+
+    if (old_objects_map == NULL)
+        return;
+    target->objects_map = NULL;
+    dirty += target->objects_count;
+    target->objects_count = 0;
+    target->timed_objects_count = 0; // every object in the expiry index belonged to the detached keyspace
+    if (server_config.cluster_enabled)
+        cluster_clear_keys();
+    touch_watched_db((int)(target - dbs));
+    epoch_defer(lazy ? lazyfree_objects_map_deferred : free_objects_map_deferred, old_objects_map);
+}
+
+/*
+ * Callback for FLUSHDB, empties the selected database.
+ */
+void handle_flushdb(int lazy){
+    empty_db(db, lazy);
+    tracking_invalidate_all();
+}
+
+/*
+ * Callback for FLUSHALL, empties every database.
+ */
+void handle_flushall(int lazy){
+    for (int i = 0; i < server_config.databases; i++)
+        empty_db(&dbs[i], lazy);
+    tracking_invalidate_all();
+}
+
+/*
+ * Parses the index of a database, -1 if it is not the index of one.
+ */
+static long parse_db_index(const char *arg){
+    char *end_ptr = NULL;
+
+    errno = 0;
+    long index = strtol(arg, &end_ptr, 10);
+    if (end_ptr == arg || *end_ptr != '\0' || errno == ERANGE || index < 0 || index >= server_config.databases)
+        return -1;
+    return index;
+}
+
+/*
+ * Callback for SWAPDB. The two databases trade their keys and expiry indexes, so the clients that selected one of
+ * them see the other dataset from their next command on. Returns -1 if an index is out of range.
+ */
+int handle_swapdb(const char *cmd[]){
+    long first = parse_db_index(cmd[1]);
+    long second = parse_db_index(cmd[2]);
+
+    if (first == -1 || second == -1)
+        return -1;
+    redis_db swapped = dbs[first];
+    dbs[first] = dbs[second];
+    dbs[second] = swapped;
+    touch_watched_db((int)first);
+    touch_watched_db((int)second);
+    tracking_invalidate_all();
+    dirty++;
+    return 0;
+}
+
+/*
+ * Callback for EXPIRE, PEXPIRE, EXPIREAT and PEXPIREAT.
+ *
+ * Args:
+ * unit_ms - the number of milliseconds in one unit of the supplied time (1000 for seconds, 1 for milliseconds)
+ * absolute - 1 if the supplied time is a unix timestamp, 0 if it is relative to now
+ *
+ * Returns 1 if the expiry was set (or the key was deleted because the time is in the past), 0 if the key does not
+ * exist or an NX/XX/GT/LT condition was not met and a negative value on error.
+ */
+int handle_expire(const char *cmd[], int n_args, long unit_ms, int absolute){
+    int nx = 0, xx = 0, gt = 0, lt = 0;
+    char *end_ptr = NULL;
     redis_object *obj;
-    const char *key;
 
-    for (int i = 1; i < n_args; i++){
-        key = cmd[i];
-        HASH_FIND_STR(objects_map, key, obj);
+    errno = 0;
+    long exp_val = strtol(cmd[2], &end_ptr, 10);
+    if (end_ptr == cmd[2] || *end_ptr != '\0' || errno == ERANGE)
+        return -1;
+    if (exp_val > LONG_MAX / unit_ms || exp_val < LONG_MIN / unit_ms)
+        return -1;
 
-        if (obj != NULL){
-            retire_object(obj);
-            num_deleted_keys++;
-        }
+    for (int i = 3; i < n_args; i++){
+        if (strcmp(cmd[i], "NX") == 0)
+            nx = 1;
+        else if (strcmp(cmd[i], "XX") == 0)
+            xx = 1;
+        else if (strcmp(cmd[i], "GT") == 0)
+            gt = 1;
+        else if (strcmp(cmd[i], "LT") == 0)
+            lt = 1;
+        else return -2;
     }
-    return num_deleted_keys;
+    if (nx && (xx || gt || lt))
+        return -3;
+    if (gt && lt)
+        return -4;
+
+    obj = handle_get(cmd[1]); // also retires the key if it has already expired
+    if (obj == NULL)
+        return 0;
+
+    long current_time_ms = get_current_time_ms();
+    long when = exp_val * unit_ms;
+    if (!absolute){
+        if (when > 0 && current_time_ms > LONG_MAX - when)
+            return -1;
+        when += current_time_ms;
+    }
+
+    int has_expiry = obj->expire_list_index != -1;
+    if (nx && has_expiry)
+        return 0;
+    if (xx && !has_expiry)
+        return 0;
+    if (gt && (!has_expiry || when <= (long)obj->exp_milliseconds)) // no expiry counts as an infinite ttl
+        return 0;
+    if (lt && has_expiry && when >= (long)obj->exp_milliseconds)
+        return 0;
+
+    if (when <= current_time_ms){ // expiry in the past deletes the key
+        if (server_config.lazyfree_lazy_expire)
+            retire_object_lazy(obj);
+        else retire_object(obj);
+        dirty++;
+        return 1;
+    }
+    if (set_object_expiry(obj, when) == -1)
+        return -5;
+    dirty++;
+    return 1;
+}
+
+/*
+ * Callback for TTL, PTTL, EXPIRETIME and PEXPIRETIME.
+ *
+ * Returns -2 if the key does not exist, -1 if it has no expiry. Otherwise, returns the remaining time to live or,
+ * if absolute is set, the unix timestamp at which the key expires, in units of unit_ms.
+ */
+long handle_ttl(const char *key, long unit_ms, int absolute){
+    redis_object *obj = handle_get(key);
+    if (obj == NULL)
+        return -2;
+    if (obj->expire_list_index == -1)
+        return -1;
+    if (absolute)
+        return (long)obj->exp_milliseconds / unit_ms;
+
+    long remaining_ms = (long)obj->exp_milliseconds - get_current_time_ms();
+    if (remaining_ms < 0)
+        remaining_ms = 0;
+    return (remaining_ms + unit_ms / 2) / unit_ms; // round to the nearest unit
+}
+
+/*
+ * Callback when PERSIST is received. Returns 1 if an expiry was removed, 0 otherwise.
+ */
+int handle_persist(const char *key){
+    redis_object *obj = handle_get(key);
+    if (obj == NULL || obj->expire_list_index == -1)
+        return 0;
+    remove_object_expiry(obj);
+    dirty++;
+    return 1;
 }
 
 /*
@@ -211,10 +1170,10 @@ long handle_incr_decr(const char *key, const int value, char **error_msg){
 
     data += value; // increment or decrement
     size_t data_length = snprintf(NULL, 0, "%li", data);
-    free(obj->value);
     char *updated_data = malloc((sizeof(char) * (int)data_length) + 1);
     snprintf(updated_data, data_length + 1, "%li", data);
-    strcpy(obj->value, updated_data);
+    replace_object_value(obj, updated_data);
+    dirty++;
     return data;
 }
 
@@ -230,11 +1189,13 @@ int handle_left_push(const char *cmd[], int n_args){
         total_char_size += strlen(cmd[i]);
     }
 
-    HASH_FIND_STR(objects_map, key, obj);
+    HASH_FIND_STR(db->objects_map, key, obj);
     if (obj == NULL){
+        if (keyspace_full())
+            return -2;
         obj = (redis_object *) malloc(sizeof *obj);
 
-        char *value = malloc(sizeof(char) * (total_char_size + num_strings - 1)); // n chars need n - 1 seps
+        char *value = malloc(sizeof(char) * (total_char_size + num_strings)); // n chars need n - 1 seps + terminator
 
         for (i = n_args - 1; i > 1; i--){
             const char *str_data = cmd[i];
@@ -248,22 +1209,25 @@ int handle_left_push(const char *cmd[], int n_args){
                 start_copy_index++;
             }
         }
+        value[start_copy_index] = '\0';
 
-        obj->key = malloc(sizeof(char) * strlen(key));
+        obj->key = malloc(sizeof(char) * (strlen(key) + 1));
         strcpy(obj->key, key);
         obj->value = value;
         obj->expire_list_index = -1;
+        obj->mapped = 0;
         obj->exp_milliseconds = 0;
         obj->array_size = n_args - 2;
-        HASH_ADD_STR(objects_map, key, obj);
+        link_object(obj);
     }
     else {
         if (obj->array_size == 0) // not a list
             return -1;
 
         unsigned long old_length = strlen(obj->value);
-        unsigned long new_length = old_length + total_char_size + num_strings - 1;
-        char *value = malloc(sizeof(char) * new_length); // space for new string
+        unsigned long new_length = old_length + total_char_size + num_strings; // one more sep for the old data
+        char *value = malloc(sizeof(char) * (new_length + 1)); // space for new string and terminator
+        value[new_length] = '\0';
 
         //  new additions first
         for (i = n_args - 1; i > 1; i--){
@@ -281,10 +1245,10 @@ int handle_left_push(const char *cmd[], int n_args){
         for (i = 0; i < old_length; i++)
             value[start_copy_index + i] = obj->value[i];
 
-        free(obj->value);
-        obj->value = value;
+        replace_object_value(obj, value);
         obj->array_size += n_args - 2;
     }
+    dirty += n_args - 2;
     return obj->array_size;
 }
 
@@ -300,11 +1264,13 @@ int handle_right_push(const char *cmd[], int n_args){
         total_char_size += strlen(cmd[i]);
     }
 
-    HASH_FIND_STR(objects_map, key, obj);
+    HASH_FIND_STR(db->objects_map, key, obj);
     if (obj == NULL){
+        if (keyspace_full())
+            return -2;
         obj = (redis_object *) malloc(sizeof *obj);
 
-        char *value = malloc(sizeof(char) * (total_char_size + num_strings - 1)); // n chars need n - 1 seps
+        char *value = malloc(sizeof(char) * (total_char_size + num_strings)); // n chars need n - 1 seps + terminator
 
         for (i = 2; i < n_args; i++){
             const char *str_data = cmd[i];
@@ -318,22 +1284,25 @@ int handle_right_push(const char *cmd[], int n_args){
                 start_copy_index++;
             }
         }
+        value[start_copy_index] = '\0';
 
-        obj->key = malloc(sizeof(char) * strlen(key));
+        obj->key = malloc(sizeof(char) * (strlen(key) + 1));
         strcpy(obj->key, key);
         obj->value = value;
         obj->expire_list_index = -1;
+        obj->mapped = 0;
         obj->exp_milliseconds = 0;
         obj->array_size = n_args - 2;
-        HASH_ADD_STR(objects_map, key, obj);
+        link_object(obj);
     }
     else {
         if (obj->array_size == 0) // not a list
             return -1;
 
         unsigned long old_length = strlen(obj->value);
-        unsigned long new_length = old_length + total_char_size + num_strings - 1;
-        char *value = malloc(sizeof(char) * new_length); // space for new string
+        unsigned long new_length = old_length + total_char_size + num_strings; // one more sep for the old data
+        char *value = malloc(sizeof(char) * (new_length + 1)); // space for new string and terminator
+        value[new_length] = '\0';
 
         // add existing data first
         for (i = 0; i < old_length; i++)
@@ -356,81 +1325,146 @@ int handle_right_push(const char *cmd[], int n_args){
                 start_copy_index++;
             }
         }
-        free(obj->value);
-        obj->value = value;
+        replace_object_value(obj, value);
         obj->array_size += n_args - 2;
     }
+    dirty += n_args - 2;
     return obj->array_size;
 }
 
+/*
+ * Callback when SAVE is received. Returns -1 if the snapshot could not be written and -2 if a BGSAVE is running.
+ */
 int handle_save(){
-    FILE *file_ptr;
-    redis_object *obj;
-
-    file_ptr = fopen(SAVE_FILE_NAME, "a");
-    if (file_ptr == NULL) {
-        fprintf(stderr, "Error opening RDB file");
+    shard_stats stats;
+
+    if (rdb_status.child_pid != -1)
+        return -2;
+    shards_pause(); // the other shards wait until their keyspaces are saved
+    shards_get_stats(&stats);
+    int ret_val = rdb_save(SAVE_FILE_NAME);
+    shards_resume();
+    if (ret_val == -1)
         return -1;
+    dirty -= stats.dirty; // what every shard changed is on disk now, the same as dirty = 0 with a single shard
+    rdb_status.lastsave = time(NULL);
+    return 0;
+}
+
+/*
+ * Callback when INFO is received. Returns a newly allocated string with the requested section (or all sections if
+ * section is NULL).
+ */
+char * handle_info(const char *section){
+    char *info = NULL;
+    size_t info_len = 0;
+    FILE *info_stream = open_memstream(&info, &info_len);
+    time_t now = time(NULL);
+    shard_stats stats;
+
+    shards_get_stats(&stats);
+    if (section == NULL || strcasecmp(section, "clients") == 0){
+        fprintf(info_stream, "# Clients\r\n");
+        fprintf(info_stream, "connected_clients:%ld\r\n", stats.clients);
+        fprintf(info_stream, "shards:%d\r\n", concurrent_reads ? 1 : num_shards);
+        fprintf(info_stream, "read_threads:%d\r\n", concurrent_reads ? num_shards - 1 : 0);
+        fprintf(info_stream, "concurrent_reads_processed:%lld\r\n", stats.reads_processed);
+        fprintf(info_stream, "concurrent_reads_forwarded:%lld\r\n", stats.reads_forwarded);
+        fprintf(info_stream, "clients_running_slices:%d\r\n", num_sliced_clients); // of this shard
+        fprintf(info_stream, "clients_over_command_budget:%d\r\n", num_over_budget_clients);
+        fprintf(info_stream, "tracking_clients:%d\r\n", tracking_num_clients());
+        fprintf(info_stream, "client_output_limit_disconnections:%lld\r\n", client_output_limit_disconnections());
+        io_threads_info(info_stream);
+        fprintf(info_stream, "\r\n");
     }
-    for (obj = objects_map; obj != NULL; obj = obj->hh.next) {
-        fprintf(
-                file_ptr,
-                "%s %s %lu %d %d\n",
-                obj->key, obj->value, obj->exp_milliseconds, obj->expire_list_index, obj->array_size
-                );
+    if (section == NULL || strcasecmp(section, "keyspace") == 0){
+        fprintf(info_stream, "# Keyspace\r\n");
+        for (int i = 0; i < server_config.databases; i++){
+            long db_keys, db_expires;
+            shards_count_db_keys(i, &db_keys, &db_expires);
+            if (db_keys > 0)
+                fprintf(info_stream, "db%d:keys=%ld,expires=%ld\r\n", i, db_keys, db_expires);
+        }
+        fprintf(info_stream, "\r\n");
     }
-    fclose(file_ptr);
-    return 0;
+    if (section == NULL || strcasecmp(section, "memory") == 0){
+        fprintf(info_stream, "# Memory\r\n");
+        fprintf(info_stream, "lazyfree_pending_objects:%zu\r\n", lazyfree_pending_objects());
+        fprintf(info_stream, "epoch_pending_frees:%zu\r\n", epoch_pending());
+        fprintf(info_stream, "dropped_keyspaces_pending:%d\r\n", num_dropped_objects);
+        fprintf(info_stream, "mapped_snapshot_objects:%ld\r\n\r\n", rdb_mapped_objects());
+    }
+    if (section == NULL || strcasecmp(section, "persistence") == 0){
+        fprintf(info_stream, "# Persistence\r\n");
+        fprintf(info_stream, "rdb_changes_since_last_save:%lld\r\n", stats.dirty);
+        fprintf(info_stream, "rdb_bgsave_in_progress:%d\r\n", rdb_status.child_pid != -1);
+        fprintf(info_stream, "rdb_last_save_time:%ld\r\n", (long)rdb_status.lastsave);
+        fprintf(info_stream, "rdb_last_bgsave_status:%s\r\n", rdb_status.last_bgsave_ok ? "ok" : "err");
+        fprintf(info_stream, "rdb_last_bgsave_time_sec:%ld\r\n", rdb_status.last_bgsave_time_sec);
+        fprintf(info_stream, "rdb_current_bgsave_time_sec:%ld\r\n",
+                rdb_status.child_pid != -1 ? (long)(now - rdb_status.bgsave_start) : -1);
+        fprintf(info_stream, "rdb_last_cow_size:%zu\r\n", rdb_status.last_cow_size);
+        pthread_mutex_lock(&aof_status.fsync_mutex);
+        fprintf(info_stream, "aof_enabled:%d\r\n", aof_status.fd != -1);
+        fprintf(info_stream, "aof_rewrite_in_progress:%d\r\n", aof_status.rewrite_child_pid != -1);
+        fprintf(info_stream, "aof_rewrite_scheduled:%d\r\n", aof_status.rewrite_scheduled);
+        fprintf(info_stream, "aof_last_rewrite_time_sec:%ld\r\n", aof_status.last_rewrite_time_sec);
+        fprintf(info_stream, "aof_last_bgrewrite_status:%s\r\n", aof_status.last_bgrewrite_ok ? "ok" : "err");
+        fprintf(info_stream, "aof_current_size:%lld\r\n", (long long)aof_status.current_size);
+        fprintf(info_stream, "aof_base_size:%lld\r\n", (long long)aof_status.base_size);
+        fprintf(info_stream, "aof_rewrite_buffer_length:%zu\r\n", aof_status.rewrite_buffer.len);
+        fprintf(info_stream, "aof_pending_fsync_bytes:%lld\r\n",
+                (long long)(aof_status.current_size - aof_status.fsynced_size));
+        fprintf(info_stream, "aof_fsyncs:%lld\r\n", aof_status.fsync_count);
+        fprintf(info_stream, "aof_last_write_status:%s\r\n\r\n", aof_status.last_write_ok ? "ok" : "err");
+        pthread_mutex_unlock(&aof_status.fsync_mutex);
+    }
+    if (section == NULL || strcasecmp(section, "replication") == 0)
+        replication_info(info_stream);
+    if (section == NULL || strcasecmp(section, "cluster") == 0)
+        cluster_info(info_stream);
+    fclose(info_stream);
+    if (info_len >= 4 && strcmp(info + info_len - 4, "\r\n\r\n") == 0) // every section ends with a blank line
+        info[info_len - 2] = '\0'; // but the last one
+    return info;
 }
 
 void load_database_from_disk(){
-    FILE *file_ptr;
-    char *line = NULL;
-    size_t len = 0;
-    int load_count = 0;
-
-    char *key_val = malloc(sizeof(char) * MAX_SIMPLE_STRING_SIZE);
-    char *value = malloc(sizeof(char) * MAX_SIMPLE_STRING_SIZE);
-    unsigned long exp_milliseconds = 0;
-    int expire_list_index = -1;
-    int array_size = 0;
-    redis_object *obj = NULL;
+    int load_count = rdb_load(SAVE_FILE_NAME);
 
-    file_ptr = fopen(SAVE_FILE_NAME, "r");
-    if (file_ptr == NULL){
-        fprintf(stdout, "No state file found, skipping load.");
+    if (load_count == -1){
+        fprintf(stdout, "No state file found, skipping load.\n");
         return;
     }
+    if (load_count == -2){
+        fprintf(stderr, "Redis server: %s is corrupt or unreadable. Exiting.\n", SAVE_FILE_NAME);
+        exit(1);
+    }
+    printf("Loaded %d objects from disk.\n", load_count);
+}
 
-    while ( getline(&line, &len, file_ptr) != -1) {
-        obj = (redis_object *) malloc(sizeof *obj);
-        sscanf(line, "%s %s %lu %d %d\n", key_val, value, &exp_milliseconds, &expire_list_index, &array_size);
-        obj->key = malloc(sizeof(char) * strlen(key_val));
-        obj->value = malloc(sizeof(char) * strlen(value));
-        strcpy(obj->key, key_val);
-        strcpy(obj->value, value);
-
+/*
+ * With appendonly on, the keyspace is rebuilt from the append only file instead of the snapshot. The first time the
+ * file is turned on there is no log yet, so it is started from the snapshot to not lose the data in it.
+ */
+void load_append_only_file(){
+    int num_commands = aof_load(AOF_FILE_NAME);
 
-        obj->exp_milliseconds = exp_milliseconds;
-        obj->array_size = array_size;
-        if (exp_milliseconds > 0){
-            timed_objects_count++;
-            timestamped_objects[timed_objects_count - 1] = obj;
-            obj->expire_list_index = timed_objects_count - 1;
+    if (num_commands == -2){
+        fprintf(stderr, "Redis server: %s is corrupt or unreadable. Exiting.\n", AOF_FILE_NAME);
+        exit(1);
+    }
+    if (num_commands == -1){
+        load_database_from_disk();
+        if (aof_rewrite(AOF_FILE_NAME) == -1){
+            fprintf(stderr, "Redis server: Could not create %s. Exiting.\n", AOF_FILE_NAME);
+            exit(1);
         }
-        else obj->expire_list_index = -1;
-
-        char *key = obj->key; // we need the special name 'key' to hash our data
-        // TODO: Test this!
-        HASH_ADD_STR(objects_map, key, obj);
-
-        load_count++;
-        objects_count++;
     }
-    free(key_val);
-    free(value);
-    fclose(file_ptr);
-    printf("Loaded %d objects from disk.\n", load_count);
+    else printf("Replayed %d commands from the append only file.\n", num_commands);
+
+    if (aof_open(AOF_FILE_NAME) == -1)
+        exit(1);
 }
 
 /*
@@ -497,45 +1531,220 @@ char * handle_resp_command(const char *cmd[], int args){
         resp_response = (char *) serialize(obj_data->value, strlen(obj_data->value), BULK_STRING); // n_bytes - 1 to exclude null terminator
         return resp_response;
     }
+    if (strcmp(cmd[0], "SCAN") == 0){
+        if (args < 2){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        return handle_scan(cmd, args);
+    }
+    if (strcmp(cmd[0], "MGET") == 0){
+        if (args < 2){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        return handle_mget(cmd, args);
+    }
+    if (strcmp(cmd[0], "MSET") == 0 || strcmp(cmd[0], "MSETNX") == 0){
+        int nx = strcmp(cmd[0], "MSETNX") == 0;
+        if (args < 3 || args % 2 == 0){
+            response = "Failed: Expected key value pairs";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        int ret_val = handle_mset(cmd, args, nx);
+        if (ret_val == -1){
+            response = "Failed: Max data size reached";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        if (nx)
+            return (char *)serialize(&ret_val, 0, INTEGER);
+        response = "OK";
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        return resp_response;
+    }
     if (strcmp(cmd[0], "EXISTS") == 0){
         if (args < 2){
             response = "Failed: Incomplete argument list";
             resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
             return resp_response;
         }
-        int exists_data = handle_exists(cmd, args);
-        resp_response = (char *) serialize(&exists_data, 0, INTEGER);
+        int exists_data = handle_exists(cmd, args);
+        resp_response = (char *) serialize(&exists_data, 0, INTEGER);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "DEL") == 0 || strcmp(cmd[0], "UNLINK") == 0){
+        if (args < 2){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        int lazy = strcmp(cmd[0], "UNLINK") == 0 || server_config.lazyfree_lazy_user_del;
+        int delete_data = handle_delete(cmd, args, lazy);
+        resp_response = (char *) serialize(&delete_data, 0, INTEGER);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "FLUSHALL") == 0 || strcmp(cmd[0], "FLUSHDB") == 0){
+        int lazy = server_config.lazyfree_lazy_user_flush;
+        if (args > 1 && strcmp(cmd[1], "ASYNC") == 0)
+            lazy = 1;
+        else if (args > 1 && strcmp(cmd[1], "SYNC") == 0)
+            lazy = 0;
+        else if (args > 1){
+            response = "Failed: Unsupported option";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        if (strcmp(cmd[0], "FLUSHALL") == 0)
+            handle_flushall(lazy);
+        else handle_flushdb(lazy);
+        response = "OK";
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "SELECT") == 0){
+        if (args < 2){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        long index = parse_db_index(cmd[1]);
+        if (index == -1)
+            response = "Failed: DB index is out of range";
+        else if (index != 0 && server_config.cluster_enabled)
+            response = "Failed: SELECT is not allowed in cluster mode";
+        else {
+            db = &dbs[index]; // execute_command() keeps it for the client's next commands
+            response = "OK";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+            return resp_response;
+        }
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "SWAPDB") == 0){
+        if (args < 3)
+            response = "Failed: Incomplete argument list";
+        else if (server_config.cluster_enabled)
+            response = "Failed: SWAPDB is not allowed in cluster mode";
+        else if (handle_swapdb(cmd) == -1)
+            response = "Failed: DB index is out of range";
+        else {
+            response = "OK";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+            return resp_response;
+        }
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "PUBLISH") == 0){
+        if (args < 3){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        long receivers = pubsub_publish(cmd[1], cmd[2]);
+        resp_response = (char *) serialize_integer(receivers);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "CONFIG") == 0){
+        if (args < 4 || strcmp(cmd[1], "SET") != 0){
+            response = "Failed: Usage CONFIG SET <option> <value>";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        int ret_val = set_config_option(cmd[2], cmd[3], 0);
+        if (ret_val == -1)
+            response = "Failed: Unknown option";
+        else if (ret_val == -2)
+            response = "Failed: Invalid value for option";
+        else if (ret_val == -3)
+            response = "Failed: Option can only be set on startup";
+        else response = "OK";
+        resp_response = (char *)serialize(response, strlen(response), ret_val == 0 ? SIMPLE_STRING : SIMPLE_ERROR);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "INCR") == 0 || strcmp(cmd[0], "DECR") == 0){
+        if (args < 2){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        long result;
+        int value;
+        char *error_message = "";
+
+        if (strcmp(cmd[0], "INCR") == 0)
+            value = 1;
+        else value = -1;
+
+        result = handle_incr_decr(cmd[1], value, &error_message);
+        if (error_message != NULL){
+            resp_response = (char *)serialize(error_message, strlen(error_message), SIMPLE_ERROR);
+        }
+        else resp_response = (char *) serialize_integer(result);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "EXPIRE") == 0 || strcmp(cmd[0], "PEXPIRE") == 0 ||
+        strcmp(cmd[0], "EXPIREAT") == 0 || strcmp(cmd[0], "PEXPIREAT") == 0){
+        if (args < 3){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        long unit_ms = cmd[0][0] == 'P' ? 1 : 1000;
+        int absolute = strstr(cmd[0], "AT") != NULL;
+        int value = handle_expire(cmd, args, unit_ms, absolute);
+        if (value >= 0){
+            resp_response = (char *) serialize(&value, 0, INTEGER);
+            return resp_response;
+        }
+        switch (value) {
+            case -1:
+                response = "Failed: Value is not an integer or out of range";
+                break;
+            case -2:
+                response = "Failed: Unsupported option";
+                break;
+            case -3:
+                response = "Failed: NX and XX, GT or LT options at the same time are not compatible";
+                break;
+            case -4:
+                response = "Failed: GT and LT options at the same time are not compatible";
+                break;
+            case -5:
+                response = "Failed: Max expiry capacity reached";
+                break;
+            default:
+                response = "Failed: Unknown Error";
+        }
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
         return resp_response;
     }
-    if (strcmp(cmd[0], "DEL") == 0){
+    if (strcmp(cmd[0], "TTL") == 0 || strcmp(cmd[0], "PTTL") == 0 ||
+        strcmp(cmd[0], "EXPIRETIME") == 0 || strcmp(cmd[0], "PEXPIRETIME") == 0){
         if (args < 2){
             response = "Failed: Incomplete argument list";
             resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
             return resp_response;
         }
-        int delete_data = handle_delete(cmd, args);
-        resp_response = (char *) serialize(&delete_data, 0, INTEGER);
+        long unit_ms = cmd[0][0] == 'P' ? 1 : 1000;
+        int absolute = strstr(cmd[0], "EXPIRETIME") != NULL;
+        long value = handle_ttl(cmd[1], unit_ms, absolute);
+        resp_response = (char *) serialize_integer(value);
         return resp_response;
     }
-    if (strcmp(cmd[0], "INCR") == 0 || strcmp(cmd[0], "DECR") == 0){
+    if (strcmp(cmd[0], "PERSIST") == 0){
         if (args < 2){
             response = "Failed: Incomplete argument list";
             resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
             return resp_response;
         }
-        long result;
-        int value;
-        char *error_message = "";
-
-        if (strcmp(cmd[0], "INCR") == 0)
-            value = 1;
-        else value = -1;
-
-        result = handle_incr_decr(cmd[1], value, &error_message);
-        if (error_message != NULL){
-            resp_response = (char *)serialize(error_message, strlen(error_message), SIMPLE_ERROR);
-        }
-        else resp_response = (char *) serialize(&result, 0, INTEGER);
+        int value = handle_persist(cmd[1]);
+        resp_response = (char *) serialize(&value, 0, INTEGER);
         return resp_response;
     }
     if ((strcmp(cmd[0], "LPUSH") == 0) || (strcmp(cmd[0], "RPUSH") == 0) ){
@@ -549,7 +1758,11 @@ char * handle_resp_command(const char *cmd[], int args){
             value = handle_left_push(cmd, args);
         else value = handle_right_push(cmd, args);
 
-        if (value < 0){
+        if (value == -2){
+            response = "Failed: Max data size reached";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
+        else if (value < 0){
             response = "Failed: Value of key not a list";
             resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
         }
@@ -562,10 +1775,97 @@ char * handle_resp_command(const char *cmd[], int args){
             response = "Failed: Error saving to file";
             resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
         }
+        else if (value == -2){
+            response = "Failed: Background save already in progress";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
+        else {
+            response = "OK";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        }
+        return resp_response;
+    }
+
+    if (strcmp(cmd[0], "BGSAVE") == 0){
+        if (aof_status.rewrite_child_pid != -1){
+            response = "Failed: Background append only file rewriting in progress";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        int value = rdb_bgsave(SAVE_FILE_NAME);
+        if (value == -1){
+            response = "Failed: Could not start background save";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
+        else if (value == -2){
+            response = "Failed: Background save already in progress";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
+        else {
+            response = "Background saving started";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        }
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "BGREWRITEAOF") == 0){
+        if (aof_status.rewrite_child_pid != -1){
+            response = "Failed: Background append only file rewriting already in progress";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
+        else if (rdb_status.child_pid != -1){ // one child at a time, start it once the BGSAVE is done
+            aof_status.rewrite_scheduled = 1;
+            response = "Background append only file rewriting scheduled";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        }
+        else if (aof_bgrewrite(AOF_FILE_NAME) == -1){
+            response = "Failed: Could not start background append only file rewriting";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        }
         else {
+            response = "Background append only file rewriting started";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        }
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "REPLICAOF") == 0 || strcmp(cmd[0], "SLAVEOF") == 0){
+        if (args < 3){
+            response = "Failed: Incomplete argument list";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
+        }
+        if (strcasecmp(cmd[1], "NO") == 0 && strcasecmp(cmd[2], "ONE") == 0){
+            replication_unset_master();
             response = "OK";
             resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+            return resp_response;
+        }
+        char *end_ptr = NULL;
+        long port = strtol(cmd[2], &end_ptr, 10);
+        if (end_ptr == cmd[2] || *end_ptr != '\0' || port <= 0 || port > 65535){
+            response = "Failed: Invalid port";
+            resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+            return resp_response;
         }
+        replication_set_master(cmd[1], port);
+        response = "OK";
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_STRING);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "CLUSTER") == 0)
+        return handle_cluster_command(cmd, args);
+    if (strcmp(cmd[0], "DUMP") == 0)
+        return handle_dump_command(cmd, args);
+    if (strcmp(cmd[0], "MIGRATE") == 0)
+        return handle_migrate_command(cmd, args);
+    if (strcmp(cmd[0], "LASTSAVE") == 0){
+        long value = (long)rdb_status.lastsave;
+        resp_response = (char *) serialize_integer(value);
+        return resp_response;
+    }
+    if (strcmp(cmd[0], "INFO") == 0){
+        char *info = handle_info(args > 1 ? cmd[1] : NULL);
+        resp_response = (char *) serialize(info, strlen(info), VERBATIM_STRING);
+        free(info);
         return resp_response;
     }
 
@@ -597,124 +1897,682 @@ int handle_new_connection(const int *listener){
     return client_socket;
 }
 
-void handle_message(char *message_buffer, const int *sender_socket){
-    char *resp_response;
-    int ser_de_error = 0; // error if there's a serialization/deserialization problem
+/*
+ * Propagates a command that changed the keyspace. Relative expiry times are sent as absolute timestamps, otherwise
+ * replaying the log later (or applying it on a replica) would extend them. A restored key is sent as the commands
+ * that rebuild it, and MIGRATE as the DEL of the keys it moved away.
+ */
+void propagate_write_command(const char *cmd[], int args){
+    redis_object *obj;
+
+    if (strcmp(cmd[0], "RESTORE") == 0 || strcmp(cmd[0], "RESTORE-ASKING") == 0){
+        HASH_FIND_STR(db->objects_map, cmd[1], obj);
+        if (obj != NULL)
+            propagate_object(obj);
+        else {
+            const char *del_cmd[] = {"DEL", cmd[1]};
+            propagate_command(del_cmd, 2);
+        }
+        return;
+    }
+    if (strcmp(cmd[0], "MIGRATE") == 0){
+        const char **del_cmd = malloc(sizeof *del_cmd * args);
+        int del_args = 1;
+        int first_key = 3, last_key = 3; // a single key, or every argument after KEYS
+        del_cmd[0] = "DEL";
+        for (int i = 6; i < args && cmd[3][0] == '\0'; i++){
+            if (strcasecmp(cmd[i], "KEYS") == 0){
+                first_key = i + 1;
+                last_key = args - 1;
+                break;
+            }
+        }
+        for (int i = first_key; i <= last_key; i++){
+            HASH_FIND_STR(db->objects_map, cmd[i], obj);
+            if (obj == NULL)
+                del_cmd[del_args++] = cmd[i];
+        }
+        if (del_args > 1)
+            propagate_command(del_cmd, del_args);
+        free(del_cmd);
+        return;
+    }
+
+    int sets_expiry = strcmp(cmd[0], "SET") == 0 && args > 4 &&
+            (strcmp(cmd[3], "EX") == 0 || strcmp(cmd[3], "PX") == 0 || strcmp(cmd[3], "EXAT") == 0 ||
+             strcmp(cmd[3], "PXAT") == 0);
+    int is_expire = strcmp(cmd[0], "EXPIRE") == 0 || strcmp(cmd[0], "PEXPIRE") == 0 ||
+            strcmp(cmd[0], "EXPIREAT") == 0 || strcmp(cmd[0], "PEXPIREAT") == 0;
+
+    if (!sets_expiry && !is_expire){
+        propagate_command(cmd, args);
+        return;
+    }
+    if (sets_expiry){
+        const char *set_cmd[] = {"SET", cmd[1], cmd[2]};
+        propagate_command(set_cmd, 3);
+    }
+
+    HASH_FIND_STR(db->objects_map, cmd[1], obj);
+    if (obj == NULL){ // an expiry in the past deleted the key
+        const char *del_cmd[] = {"DEL", cmd[1]};
+        propagate_command(del_cmd, 2);
+        return;
+    }
+    char timestamp[24];
+    snprintf(timestamp, sizeof timestamp, "%lu", obj->exp_milliseconds);
+    const char *expire_cmd[] = {"PEXPIREAT", cmd[1], timestamp};
+    propagate_command(expire_cmd, 3);
+}
+
+/*
+ * Returns the error (or redirection) a command gets instead of running, NULL if it can run here.
+ */
+char * refuse_command(redis_client *client, const char *cmd[], int args, int is_write){
+    char *resp_response = client->flags & CLIENT_MASTER ? NULL : cluster_redirect(client, cmd, args);
+    client->flags &= ~CLIENT_ASKING; // only good for one command
+    if (resp_response == NULL && repl_status.master_host != NULL && !(client->flags & CLIENT_MASTER) &&
+        is_write){
+        char *response = "Failed: You can't write against a read only replica";
+        resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    }
+    return resp_response;
+}
+
+/*
+ * Callback for CLIENT ID, CLIENT GETREDIR and the client side caching ones, CLIENT TRACKING and CLIENT CACHING.
+ */
+static char * handle_client_command(redis_client *client, const char *cmd[], int args){
+    char *response;
+
+    if (args >= 2 && strcasecmp(cmd[1], "TRACKING") == 0)
+        return handle_tracking_command(client, cmd, args);
+    if (args >= 2 && strcasecmp(cmd[1], "CACHING") == 0)
+        return handle_caching_command(client, cmd, args);
+    if (args == 2 && strcasecmp(cmd[1], "ID") == 0){
+        long id = (long)client->id;
+        return (char *)serialize_integer(id);
+    }
+    if (args == 2 && strcasecmp(cmd[1], "GETREDIR") == 0){ // -1 if not tracking, 0 if not redirecting
+        long id = client->flags & CLIENT_TRACKING ? (long)client->tracking_redirect_id : -1;
+        return (char *)serialize_integer(id);
+    }
+    response = "Failed: Usage CLIENT ID|GETREDIR|TRACKING|CACHING";
+    return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+}
+
+/*
+ * Callback for HELLO [2|3], which picks the protocol version of the client's replies. Replies with a map describing
+ * the server, in the new version.
+ */
+static char * handle_hello_command(redis_client *client, const char *cmd[], int args){
+    char *response;
+    char header[RESP_HEADER_SIZE];
+
+    if (args > 2){
+        response = "Failed: Usage HELLO [2|3]";
+        return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    }
+    if (args == 2 && strcmp(cmd[1], "2") != 0 && strcmp(cmd[1], "3") != 0){
+        response = "Failed: Unsupported protocol version";
+        return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    }
+    if (args == 2){
+        client->resp = cmd[1][0] - '0';
+        resp_protocol = client->resp;
+    }
+
+    const char *mode = server_config.cluster_enabled ? "cluster" : "standalone";
+    const char *role = repl_status.master_host == NULL ? "master" : "replica";
+    char *resp_response = NULL;
+    size_t resp_len = 0;
+    FILE *stream = open_memstream(&resp_response, &resp_len);
+    serialize_header(header, MAP, 7);
+    fputs(header, stream);
+    fprintf(stream, "$6\r\nserver\r\n$5\r\nredis\r\n");
+    fprintf(stream, "$7\r\nversion\r\n$%zu\r\n%s\r\n", strlen(REDIS_VERSION), REDIS_VERSION);
+    fprintf(stream, "$5\r\nproto\r\n:%d\r\n", client->resp);
+    fprintf(stream, "$2\r\nid\r\n:%llu\r\n", client->id);
+    fprintf(stream, "$4\r\nmode\r\n$%zu\r\n%s\r\n", strlen(mode), mode);
+    fprintf(stream, "$4\r\nrole\r\n$%zu\r\n%s\r\n", strlen(role), role);
+    fprintf(stream, "$7\r\nmodules\r\n*0\r\n");
+    fclose(stream);
+    return resp_response;
+}
+
+/*
+ * Runs a parsed command for a client and queues its reply. Commands streamed by our primary are not answered. In
+ * cluster mode, commands on keys this node doesn't serve are redirected instead of run.
+ */
+void execute_command(redis_client *client, const char *cmd[], const size_t cmd_len[], int args){
+    resp_protocol = client->resp;
+    if (strcmp(cmd[0], "ASKING") == 0){
+        char *response = server_config.cluster_enabled ? "OK" : "Failed: This instance has cluster support disabled";
+        char *resp_response = (char *)serialize(response, strlen(response),
+                                                server_config.cluster_enabled ? SIMPLE_STRING : SIMPLE_ERROR);
+        client->flags |= CLIENT_ASKING;
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+        return;
+    }
+    if (strcmp(cmd[0], "PSYNC") == 0){
+        replication_psync(client, cmd, args);
+        return;
+    }
+    if (strcmp(cmd[0], "REPLCONF") == 0){
+        replication_replconf(client, cmd, args);
+        return;
+    }
+    if (strcmp(cmd[0], "CLIENT") == 0 || strcmp(cmd[0], "HELLO") == 0){
+        char *resp_response = cmd[0][0] == 'C' ? handle_client_command(client, cmd, args) :
+                              handle_hello_command(client, cmd, args);
+        if (!(client->flags & CLIENT_MASTER))
+            add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+        return;
+    }
 
-    if (message_buffer[0] == '*'){
-        int arr_size = get_size_from_resp_data(message_buffer, 1);
-        char *cmd_string[(int)arr_size];
+    long long dirty_before = dirty;
+    int is_write = is_write_command(cmd[0]);
+    db = &dbs[client->db];
+    current_client = client;
+    if (is_write)
+        keyspace_write_begin();
+    char *resp_response = refuse_command(client, cmd, args, is_write);
+    int refused = resp_response != NULL;
+    if (resp_response == NULL && (strcmp(cmd[0], "RESTORE") == 0 || strcmp(cmd[0], "RESTORE-ASKING") == 0))
+        resp_response = handle_restore_command(cmd, cmd_len, args); // the payload is binary, it needs its length
+    if (resp_response == NULL)
+        resp_response = handle_resp_command(cmd, args);
+    if (is_write)
+        keyspace_write_end();
+    tracking_flush_invalidations();
+    current_client = NULL;
+    client->db = (int)(db - dbs); // SELECT picked another one
+    if (client->flags & CLIENT_TRACKING){
+        if (!refused)
+            tracking_remember_keys(client, cmd, args);
+        client->flags &= ~CLIENT_TRACKING_CACHING; // only good for one command
+    }
+    if (client->flags & CLIENT_MASTER)
+        repl_status.stream_db = client->db;
+
+    if (dirty > dirty_before)
+        propagate_write_command(cmd, args);
+    else if (strcmp(cmd[0], "PUBLISH") == 0 && repl_status.master_host == NULL) // for the replicas' subscribers
+        replication_feed_command(cmd, args);
+    if (!(client->flags & CLIENT_MASTER))
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+    free(resp_response);
+}
 
-        int num_cmds = deserialize_redis_command(message_buffer, cmd_string, arr_size);
+/*
+ * Returns 1 if a command is run in slices: DEL, UNLINK and EXISTS of many keys from a regular client. The commands
+ * from the primary always run to completion, its stream has to be applied in order.
+ */
+static int is_sliceable_command(redis_client *client, client_command *command){
+    if (server_config.command_slice_time_us <= 0 || client->flags & CLIENT_MASTER || command->argc - 1 <
+        SLICED_COMMAND_MIN_KEYS)
+        return 0;
+    return strcmp(command->argv[0], "DEL") == 0 || strcmp(command->argv[0], "UNLINK") == 0 ||
+           strcmp(command->argv[0], "EXISTS") == 0;
+}
 
-        if (num_cmds != arr_size) {
-            fprintf(stderr,
-                    "Redis server: Deserialization failed. At least one invalid RESP message received.\n"
-            );
-            resp_response = (char *)serialize("Error", strlen("Error"), SIMPLE_STRING);
-            ser_de_error = 1;
+/*
+ * Runs the client's sliced command for at most command-slice-time-us, then lets the event loop serve the other clients
+ * before the next slice. Every slice of DEL and UNLINK is propagated on its own as a DEL of the keys it deleted, so
+ * the append only file and the replicas see the deletes in the same order as the keyspace. Returns 1 once the command
+ * is done and replied to.
+ */
+static int run_command_slice(redis_client *client){
+    client_command *command = &client->sliced_command;
+    long deadline_us = get_monotonic_time_us() + server_config.command_slice_time_us;
+    int is_exists = strcmp(command->argv[0], "EXISTS") == 0;
+    int lazy = strcmp(command->argv[0], "UNLINK") == 0 || server_config.lazyfree_lazy_user_del;
+    int first_arg = client->sliced_next_arg;
+    const char **deleted = NULL;
+    int num_deleted = 0;
+
+    db = &dbs[client->db];
+    current_client = client;
+
+    if (!is_exists){
+        deleted = malloc(sizeof *deleted * (command->argc - first_arg + 1));
+        deleted[num_deleted++] = "DEL";
+        keyspace_write_begin();
+    }
+    while (client->sliced_next_arg < command->argc && !slice_time_up(client->sliced_next_arg - first_arg,
+                                                                     deadline_us)){
+        const char *key = command->argv[client->sliced_next_arg++];
+        if (is_exists){
+            redis_object *obj;
+            HASH_FIND_STR(db->objects_map, key, obj);
+            client->sliced_result += obj != NULL;
+        } else if (delete_key(key, lazy)){
+            deleted[num_deleted++] = key;
+            client->sliced_result++;
         }
-        else resp_response = handle_resp_command((const char **) cmd_string, arr_size);
+    }
+    if (!is_exists){
+        keyspace_write_end();
+        if (num_deleted > 1)
+            propagate_write_command(deleted, num_deleted);
+        free(deleted);
+    }
+    tracking_flush_invalidations();
+    current_client = NULL;
+    if (client->sliced_next_arg < command->argc)
+        return 0;
 
-        int packet_length = get_size_of_resp_command(resp_response);
-        int num_bytes_sent = sendall(*sender_socket, resp_response, &packet_length);
-        if (num_bytes_sent == -1)
-            perror("Error sending to client");
+    char *resp_response = (char *)serialize(&client->sliced_result, 0, INTEGER);
+    add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+    free(resp_response);
+    free_command_args(command->argv, command->argv_len, command->argc);
+    client->flags &= ~CLIENT_RUNNING_SLICES;
+    num_sliced_clients--;
+    return 1;
+}
+
+/*
+ * Starts running a sliced command, the client's next commands wait for it to be done. Returns 1 if it is done
+ * already.
+ */
+static int start_sliced_command(redis_client *client, client_command *command){
+    char *resp_response = refuse_command(client, (const char **)command->argv, command->argc,
+                                         strcmp(command->argv[0], "EXISTS") != 0);
+    if (resp_response != NULL){
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
         free(resp_response);
+        free_command_args(command->argv, command->argv_len, command->argc);
+        return 1;
+    }
+    if (client->flags & CLIENT_TRACKING){
+        tracking_remember_keys(client, (const char **)command->argv, command->argc);
+        client->flags &= ~CLIENT_TRACKING_CACHING;
+    }
+    client->sliced_command = *command;
+    client->sliced_next_arg = 1;
+    client->sliced_result = 0;
+    client->flags |= CLIENT_RUNNING_SLICES;
+    num_sliced_clients++;
+    return run_command_slice(client);
+}
 
-        if (!ser_de_error){ // no need to free anything
-            for (int k = 0; k < arr_size; k++)
-                free(cmd_string[k]);
+/*
+ * Serves the clients that have work left from the last iteration: the next slice of every sliced command (a client
+ * whose command is done goes on with the commands it sent after it) and the next commands of the clients that used up
+ * their budget. They are served round-robin, starting one client further every iteration. Then frees the next slice
+ * of the keyspaces FLUSHALL dropped.
+ */
+static void serve_clients_with_work_left(void){
+    int num_clients = sockets_count - first_client_socket;
+
+    if (num_sliced_clients + num_over_budget_clients > 0 && num_clients > 0){
+        next_served_client = (next_served_client + 1) % num_clients;
+        for (int n = 0; n < num_clients; n++){
+            redis_client *client = clients[sockets_arr[first_client_socket + (next_served_client + n) % num_clients].fd];
+            if (client->flags & CLIENT_CLOSE_ASAP)
+                continue;
+            if (client->flags & CLIENT_RUNNING_SLICES){
+                if (run_command_slice(client))
+                    process_client_input(client);
+            } else if (client->flags & CLIENT_OVER_BUDGET)
+                process_client_input(client);
         }
     }
+    if (num_dropped_objects > 0)
+        free_dropped_objects(get_monotonic_time_us() + server_config.command_slice_time_us);
 }
 
-void redis_server_listen() {
-    int listener;
-    int client_socket;
+/*
+ * Runs every complete command in the client's query buffer, in the order they were sent. They were already parsed if
+ * the client was read on an I/O thread. With shards, commands on keys of another shard are sent there and the client
+ * waits for their replies, its next commands stay queued until then. The commands of a client in a transaction are
+ * queued until EXEC instead, see multi.h.
+ *
+ * A client runs at most client-command-budget commands at a time, so that one sending a huge pipeline can't hold up
+ * the others: the rest wait for the next event loop iteration, and the client isn't read from until they ran.
+ */
+void process_client_input(redis_client *client){
+    size_t pos = 0;
+    int i = 0;
+    int budget = client->flags & CLIENT_MASTER ? 0 : (int)server_config.client_command_budget;
+
+    parse_client_input(client);
+    while (i < client->num_commands && !(client->flags & (CLIENT_WAITING_SHARD | CLIENT_RUNNING_SLICES |
+                                                         CLIENT_CLOSE_ASAP)) && (budget == 0 || i < budget)) {
+        client_command *command = &client->commands[i];
+        resp_protocol = client->resp; // its replies are serialized for it, HELLO may have changed it
+        int taken = command->argc > 0 && (handle_pubsub_command(client, command) ||
+                                           handle_transaction_command(client, command));
+        int num_sent = 0;
+
+        if (num_shards > 1 && !taken)
+            num_sent = shard_dispatch(client, command, client->num_commands - i);
+
+        if (num_sent > 0){
+            for (int j = 0; j < num_sent; j++)
+                pos += command[j].len;
+            i += num_sent;
+            continue;
+        }
+        if (taken)
+            ; // queued for EXEC, or MULTI, EXEC, SUBSCRIBE and the like ran
+        else if (command->argc > 0 && is_sliceable_command(client, command))
+            start_sliced_command(client, command); // owns the arguments from now on
+        else {
+            if (command->argc > 0)
+                execute_command(client, (const char **)command->argv, command->argv_len, command->argc);
+            free_command_args(command->argv, command->argv_len, command->argc);
+        }
+        if (client->flags & CLIENT_MASTER) // forward the stream as received, offsets must match the primary's
+            replication_feed(client->query_buffer + pos, command->len);
+        pos += command->len;
+        i++;
+    }
+    client->num_commands -= i;
+    memmove(client->commands, client->commands + i, sizeof *client->commands * client->num_commands);
+    int over_budget = budget > 0 && i >= budget && client->num_commands > 0 &&
+                      !(client->flags & (CLIENT_WAITING_SHARD | CLIENT_RUNNING_SLICES | CLIENT_CLOSE_ASAP));
+    if (over_budget != !!(client->flags & CLIENT_OVER_BUDGET)){
+        client->flags ^= CLIENT_OVER_BUDGET;
+        num_over_budget_clients += over_budget ? 1 : -1;
+    }
+    if (client->protocol_error && client->num_commands == 0 && !client->close_after_reply){
+        fprintf(stderr, "Redis server: Invalid RESP message received on socket %d.\n", client->fd);
+        char *response = "Failed: Protocol error";
+        char *resp_response = (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+        client->close_after_reply = 1;
+    }
+    if (client->close_after_reply){ // nothing it sends from now on is executed
+        consume_query_buffer(client, client->query_len);
+        client->query_parsed = 0;
+        return;
+    }
+    consume_query_buffer(client, pos);
+    client->query_parsed -= pos;
+}
 
-    char message_buffer[MAX_INPUT_CMD_SIZE];
+/*
+ * Creates the state of a connection and adds its socket to the event loop.
+ */
+redis_client * add_client(int client_socket){
+    if (client_socket >= clients_capacity){
+        int new_capacity = clients_capacity == 0 ? 64 : clients_capacity;
+        while (new_capacity <= client_socket)
+            new_capacity *= 2;
+        clients = realloc(clients, sizeof *clients * new_capacity);
+        memset(clients + clients_capacity, 0, sizeof *clients * (new_capacity - clients_capacity));
+        clients_capacity = new_capacity;
+    }
+    clients[client_socket] = create_client(client_socket);
+    add_socket(&sockets_arr, client_socket, &sockets_count, &num_sockets_allowed);
+    return clients[client_socket];
+}
 
-    int sockets_count = 0;
-    int num_sockets_allowed = 5; // start-off with 5 maximum connections
+static void close_client(int socket_idx){
+    int client_socket = sockets_arr[socket_idx].fd;
+
+    replication_client_closed(clients[client_socket]);
+    if (clients[client_socket]->flags & CLIENT_RUNNING_SLICES)
+        num_sliced_clients--;
+    if (clients[client_socket]->flags & CLIENT_OVER_BUDGET)
+        num_over_budget_clients--;
+    free_client(clients[client_socket]);
+    clients[client_socket] = NULL;
+    remove_socket(sockets_arr, socket_idx, &sockets_count);
+}
 
-    // allocate sizeof (1 pollfd * num_sockets_allowed) bytes
-    struct pollfd *sockets_arr = malloc(sizeof *sockets_arr * num_sockets_allowed);
+/*
+ * Makes room in pending_clients for every connection and empties it.
+ */
+static void reserve_pending_clients(void){
+    if (pending_clients_capacity < sockets_count) {
+        pending_clients_capacity = num_sockets_allowed;
+        pending_clients = realloc(pending_clients, sizeof *pending_clients * pending_clients_capacity);
+    }
+    num_pending_clients = 0;
+}
 
-    listener = get_listening_socket();
+/*
+ * Finds a client of this thread's event loop by its socket and id, NULL if it hung up.
+ */
+redis_client * find_client(int client_socket, unsigned long long id){
+    if (client_socket < 0 || client_socket >= clients_capacity || clients[client_socket] == NULL)
+        return NULL;
+    return clients[client_socket]->id == id ? clients[client_socket] : NULL;
+}
 
-    if (listener == -1) {
-        fprintf(stderr, "Redis server: error getting listening socket\n");
-        exit(1);
+/*
+ * Finds a client of this thread's event loop by its id, NULL if there is none.
+ */
+redis_client * find_client_by_id(unsigned long long id){
+    for (int i = first_client_socket; i < sockets_count; i++){
+        redis_client *client = find_client(sockets_arr[i].fd, id);
+        if (client != NULL)
+            return client;
     }
-    printf("Redis server: (127.0.0.1) listening on port %s\n", REDIS_PORT);
+    return NULL;
+}
+
+/*
+ * Sets up the sockets of this thread's event loop: its listener and, with shards, its wakeup pipe.
+ */
+static void init_event_loop(int listener){
+    int wakeup_fd = shard_wakeup_fd();
+
+    // allocate sizeof (1 pollfd * num_sockets_allowed) bytes
+    sockets_arr = malloc(sizeof *sockets_arr * num_sockets_allowed);
     // Add the listener to set
     sockets_arr[0].fd = listener;
     sockets_arr[0].events = POLLIN; // Report ready to read on incoming connection
 
     sockets_count = 1; // For the listener
+    if (wakeup_fd != -1) { // the other shards write to it when they send a message
+        add_socket(&sockets_arr, wakeup_fd, &sockets_count, &num_sockets_allowed);
+        first_client_socket = 2;
+    }
+}
 
-    load_database_from_disk();
+void redis_server_listen() {
+    int listener;
+
+    if (server_config.databases < 1){
+        fprintf(stderr, "Redis server: databases must be at least 1. Exiting.\n");
+        exit(1);
+    }
+    init_databases();
+    multi_init();
+    shards_init();
+    listener = get_listening_socket(server_config.port, num_shards > 1);
+
+    if (listener == -1) {
+        fprintf(stderr, "Redis server: error getting listening socket\n");
+        exit(1);
+    }
+    printf("Redis server: (127.0.0.1) listening on port %ld\n", server_config.port);
+    signal(SIGPIPE, SIG_IGN); // a replica hanging up while the snapshot is sent with sendfile()
+
+    if (lazyfree_init() == -1) {
+        fprintf(stderr, "Redis server: error starting the lazy free thread\n");
+        exit(1);
+    }
+    if (io_threads_init() == -1) {
+        fprintf(stderr, "Redis server: error starting the I/O threads\n");
+        exit(1);
+    }
+    cluster_init(); // before loading, so that the keys are indexed by slot
+    if (server_config.appendonly)
+        load_append_only_file();
+    else load_database_from_disk();
+    rdb_status.lastsave = time(NULL);
+    replication_init();
+    init_event_loop(listener); // the connection to the primary is one of its sockets
+    if (server_config.replicaof != NULL){
+        char master_host[256];
+        long master_port;
+        if (sscanf(server_config.replicaof, "%255s %ld", master_host, &master_port) != 2){
+            fprintf(stderr, "Redis server: Expected \"<host> <port>\" for replicaof. Exiting.\n");
+            exit(1);
+        }
+        replication_set_master(master_host, master_port);
+    }
+    shards_start();
+    run_event_loop(listener);
+}
+
+/*
+ * Serves the clients of one listening socket forever. Every shard runs its own loop, on its own thread.
+ */
+void run_event_loop(int listener) {
+    int client_socket;
+    int wakeup_fd = shard_wakeup_fd();
+
+    if (sockets_arr == NULL) // the main thread sets its sockets up earlier, see redis_server_listen()
+        init_event_loop(listener);
+    long last_cron_ms = get_current_time_ms();
 
     for(;;) {
-        // sleep until for 10 secs or until there is data to be received. We use the poll() function
+        // let the other shards know how this one is doing, and wait here if shard 0 is saving
+        shard_publish_stats(sockets_count - first_client_socket);
+        shard_check_pause();
+        epoch_reclaim(); // frees what the read threads can't hold anymore, only does anything on the main thread
+
+        // only wait for a client to become writable when it has replies that did not fit in the socket buffer (or a
+        // snapshot to send, or a connection to finish)
+        for (int i = first_client_socket; i < sockets_count; i++) {
+            redis_client *client = clients[sockets_arr[i].fd];
+            sockets_arr[i].events = (client->flags & CLIENT_OVER_BUDGET ? 0 : POLLIN) |
+                                    (client_wants_write(client) ? POLLOUT : 0);
+        }
+
+        // sleep until there is data to be received or it is time for the periodic tasks. We use the poll() function
         // poll() hands over sleeping and waiting for data to the OS. Maybe at the OS level this is handled by
         // interrupts. I'm not sure!
-        int poll_count = poll(sockets_arr, sockets_count, 20000); // -1 means never timeout
+        // don't sleep at all while clients have work left
+        int poll_timeout = num_sliced_clients + num_over_budget_clients > 0 || num_dropped_objects > 0 ? 0 :
+                           1000 / SERVER_CRON_HZ;
+        int poll_count = poll(sockets_arr, sockets_count, poll_timeout);
         if (poll_count == -1) {
+            if (errno == EINTR)
+                continue;
             perror("poll error"); // notice we use perror for os level function calls
             exit(1);
         }
+        reserve_pending_clients();
 
         for (int i = 0; i < sockets_count; i++) {
-            // Guard clause: If the event is not POLLIN (data to be received or read), move to next socket.
-            if (!(sockets_arr[i].revents & POLLIN))
+            if (sockets_arr[i].fd == wakeup_fd) {
+                if (sockets_arr[i].revents & POLLIN)
+                    shard_drain_wakeup();
+                continue;
+            }
+            redis_client *client = sockets_arr[i].fd == listener ? NULL : clients[sockets_arr[i].fd];
+
+            if (client != NULL && (client->flags & CLIENT_CLOSE_ASAP))
+                continue;
+            // our connection to the primary is done connecting once it is writable
+            if (client != NULL && (client->flags & CLIENT_CONNECTING)) {
+                if ((sockets_arr[i].revents & (POLLOUT | POLLHUP | POLLERR)) &&
+                    replication_master_connected(client) == -1) {
+                    close_client(i);
+                    i--;
+                }
+                continue;
+            }
+
+            // Guard clause: If there is nothing to read (data, a hang up or an error), move to next socket.
+            if (!(sockets_arr[i].revents & (POLLIN | POLLHUP | POLLERR)))
                 continue;
 
             if (sockets_arr[i].fd == listener) {
                 // if the listener is the socket ready to receive data, then there is a new connection.
-
-                // handle callback
                 client_socket = handle_new_connection(&listener);
                 if (client_socket != -1)
-                    add_socket(&sockets_arr, client_socket, &sockets_count, &num_sockets_allowed);
+                    add_client(client_socket);
+                continue;
             }
-            else { // if ready socket is not the listener, it is a client that sent out data
-                int num_bytes_recv = (int)recv(sockets_arr[i].fd, message_buffer, sizeof message_buffer, 0);
-
-                int sender_socket = sockets_arr[i].fd;
-                if (num_bytes_recv == 0) {
-                    printf("Redis server: socket %d hung up\n", sender_socket);
-                    close(sender_socket);
-                    remove_socket(sockets_arr, i, &sockets_count);
-                }
-                    // repetition here to prevent too much nesting
-                else if (num_bytes_recv < 0) {
-                    perror("Error receiving from socket");
-                    close(sender_socket);
-                    remove_socket(sockets_arr, i, &sockets_count);
-                }
-                else { // there's actual data received
-                    printf("Redis server: Received from socket %d <", sender_socket);
-                    for (int j = 0; j < num_bytes_recv; j++){
-                        if (message_buffer[j] == '\r')
-                            printf("/r");
-                        else if (message_buffer[j] == '\n')
-                            printf("/n");
-                        else
-                            printf("%c", message_buffer[j]);
-                    }
-                    printf(">\n");
-
-                    // REDIS SER-DE here
-                    handle_message(message_buffer, &sender_socket);
-                    memset(message_buffer, 0, MAX_INPUT_CMD_SIZE);
-                }
-            } // end when ready socket is a client
 
+            // if ready socket is not the listener, it is a client that sent out data. Regular clients are read in one
+            // batch below, the connection to the primary right away
+            if (!(client->flags & CLIENT_MASTER)) {
+                pending_clients[num_pending_clients++] = client;
+                continue;
+            }
+            if (read_from_client(client) == -1) {
+                close_client(i);
+                i--; // the last socket was moved into this slot
+                continue;
+            }
+            int ret_val = replication_process_master_input(client); // the reply to PSYNC and the snapshot come first
+            if (ret_val == -1) {
+                close_client(i);
+                i--;
+                continue;
+            }
+            if (ret_val == 1)
+                process_client_input(client);
         } // end sockets iteration
 
-        // remove expired objects after every 10 secs or after a new connection has been established.
-        active_objects_expire();
+        // requests from the other shards, and the replies to the ones this shard sent
+        shard_process_messages();
+
+        // the next slice of the long commands and the rest of the big pipelines, before the clients that sent something
+        serve_clients_with_work_left();
+
+        // read and parse on the I/O threads, then execute the commands here, one client after the other
+        io_threads_run(pending_clients, num_pending_clients, IO_THREADS_OP_READ);
+        for (int i = 0; i < num_pending_clients; i++) {
+            redis_client *client = pending_clients[i];
+
+            if (client->io_result == -1)
+                client->flags |= CLIENT_CLOSE_ASAP; // hung up, closed below
+            if (!(client->flags & (CLIENT_CLOSE_ASAP | CLIENT_OVER_BUDGET))) // served above for this iteration
+                process_client_input(client);
+        }
+
+        // one write (and with appendfsync always, one fsync) for the writes of every client served above. This has
+        // to happen before any of their replies goes out.
+        aof_flush();
+
+        // send the replies on the I/O threads
+        reserve_pending_clients(); // connections may have been accepted since
+        for (int i = first_client_socket; i < sockets_count; i++) {
+            redis_client *client = clients[sockets_arr[i].fd];
+            if (!(client->flags & (CLIENT_CLOSE_ASAP | CLIENT_CONNECTING)) && client_has_pending_replies(client))
+                pending_clients[num_pending_clients++] = client;
+        }
+        io_threads_run(pending_clients, num_pending_clients, IO_THREADS_OP_WRITE);
+        for (int i = 0; i < num_pending_clients; i++) {
+            if (pending_clients[i]->io_result == -1)
+                pending_clients[i]->flags |= CLIENT_CLOSE_ASAP;
+        }
+
+        // walk backwards so that removing a socket only moves one that was already handled
+        for (int i = sockets_count - 1; i >= first_client_socket; i--) {
+            redis_client *client = clients[sockets_arr[i].fd];
+            if (client->flags & CLIENT_CLOSE_ASAP) {
+                close_client(i);
+                continue;
+            }
+            if (client->flags & CLIENT_CONNECTING)
+                continue;
+            if ((client->flags & CLIENT_REPLICA) && client->repl_state == REPLICA_SEND_BULK &&
+                replication_send_bulk(client) == -1) {
+                close_client(i);
+                continue;
+            }
+            if (client->close_after_reply && !client_has_pending_replies(client))
+                close_client(i);
+        }
+
+        // run the periodic tasks (expiring objects, checking on BGSAVE, ...) SERVER_CRON_HZ times per second
+        long current_time_ms = get_current_time_ms();
+        if (current_time_ms - last_cron_ms >= 1000 / SERVER_CRON_HZ){
+            server_cron();
+            last_cron_ms = current_time_ms;
+        }
     } // end loop-forever
-} // end server listening function
+} // end event loop function
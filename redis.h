@@ -5,15 +5,17 @@
 #ifndef REDIS_REDIS_H
 #define REDIS_REDIS_H
 
-#endif //REDIS_REDIS_H
-
-// max number of connections that can wait to be accepted.
-// Most systems silently limit this number to about 20; you can probably get away with setting it to 5 or 10.
-
-#define MAX_INPUT_CMD_SIZE 1024
-#define MAX_MEM_CAPACITY 4096 // how many items can be held in memory at one time
-
 # define SAVE_FILE_NAME "state.rdb"
+#define REDIS_VERSION "7.2.0" // of the Redis commands and protocol this server follows, reported by HELLO
+#define SERVER_CRON_HZ 10 // how many times per second the periodic tasks run
+#define SLICED_COMMAND_MIN_KEYS 128 // DEL, UNLINK and EXISTS of fewer keys always run to completion
+#define SLICE_CHECK_INTERVAL 64 // items handled by a slice between two looks at the clock
+#define KEY_PREFETCH_DISTANCE 8 // keys a multi-key lookup prefetches the hash bucket of ahead of the one it looks up
+#define CONCURRENT_READ_ATTEMPTS 4 // optimistic reads on a read thread before the command goes to the main thread
+
+// redis_object.mapped flags, set when the key or value points into the memory mapped snapshot instead of the heap
+#define OBJECT_KEY_MAPPED 1
+#define OBJECT_VALUE_MAPPED 2
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,19 +26,29 @@
 #include <sys/socket.h>
 #include <poll.h>
 #include <time.h>
+#include <signal.h>
 #include <limits.h>
 #include <errno.h>
+#include <strings.h>
+#include "epoch.h"
+// the buckets of the keyspace may still be read by the read threads when uthash drops them, see epoch.h
+#define uthash_free(ptr, sz) epoch_free(ptr)
 #include "uthash.h"
 #include "serde.h"
 #include "utils.h"
 #include "socket_utils.h"
+#include "config.h"
+#include "client.h"
 
-typedef struct {
+typedef struct redis_object {
     char *key;
     char *value;
     unsigned long exp_milliseconds;
     int expire_list_index; // -1 if expiry was never set.
     int array_size; // 0 for non-arrays, number of items for arrays
+    int mapped; // OBJECT_KEY_MAPPED and OBJECT_VALUE_MAPPED flags, 0 if both are on the heap
+    struct redis_object *slot_prev; // the other keys of the same cluster slot, see cluster.h
+    struct redis_object *slot_next;
     UT_hash_handle hh; /* makes this structure hashable */
 } redis_object;
 
@@ -49,6 +61,56 @@ enum redis_exp_type {
     NONE
 };
 
-int get_listening_socket(void);
+// one of the databases SELECT picks from, each with its own keys and expiry index
+typedef struct {
+    redis_object *objects_map;
+    int objects_count; // holds the count of items that have been set.
+    redis_object **timestamped_objects; // the objects with an expiry, array of pointers, grown as needed
+    int timed_objects_count;
+    int timed_objects_capacity;
+} redis_db;
+
+extern _Thread_local redis_db *dbs; // the databases of the shard running on this thread, see shard.h
+extern _Thread_local redis_db *db; // the one the command being run works on, selected by its client
+extern _Thread_local long long dirty;
+extern _Thread_local redis_client *current_client; // the one whose command is running, NULL if none is
+
 void redis_server_listen(void);
-void load_database_from_disk();
\ No newline at end of file
+void run_event_loop(int);
+void load_database_from_disk();
+void init_databases(void);
+void count_keys(const redis_db *, long *, long *);
+int set_object_expiry(redis_object *, unsigned long);
+void remove_object_expiry(redis_object *);
+int keyspace_has_room(long);
+int keyspace_full(void);
+void presize_objects_map(size_t);
+void link_object(redis_object *);
+void link_object_by_hash(redis_object *, unsigned);
+void unlink_object(redis_object *);
+void free_object(redis_object *);
+void replace_object_value(redis_object *, char *);
+void free_objects_map(redis_object *);
+int retire_object(redis_object *);
+int retire_object_lazy(redis_object *);
+void expire_object(redis_object *);
+redis_object * handle_get(const char *);
+char * handle_mget(const char *[], int);
+char * handle_scan(const char *[], int);
+int handle_mset(const char *[], int, int);
+void handle_flushdb(int);
+void handle_flushall(int);
+int handle_swapdb(const char *[]);
+int is_write_command(const char *);
+void transaction_begin(void);
+void transaction_end(void);
+char * handle_resp_command(const char *[], int);
+char * handle_concurrent_read(int, const char *[], const size_t [], int);
+char * refuse_command(redis_client *, const char *[], int, int);
+void execute_command(redis_client *, const char *[], const size_t [], int);
+void process_client_input(redis_client *);
+redis_client * add_client(int);
+redis_client * find_client(int, unsigned long long);
+redis_client * find_client_by_id(unsigned long long);
+
+#endif //REDIS_REDIS_H
@@ -0,0 +1,777 @@
+//
+// Replication source file
+//
+#define _GNU_SOURCE // memmem
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "replication.h"
+#include "redis.h"
+#include "rdb.h"
+#include "aof.h"
+
+replication_state repl_status = {
+        .second_replid_offset = -1,
+        .state = REPL_STATE_NONE,
+        .transfer_fd = -1,
+        .stream_db = -1
+};
+
+static aof_buffer command_buffer; // commands are formatted here before they are fed to the replicas
+
+void replication_init(void){
+    get_random_hex(repl_status.replid, REPL_ID_LEN);
+}
+
+static void reply_error(redis_client *client, const char *message){
+    char *resp_response = (char *)serialize((char *)message, strlen(message), SIMPLE_ERROR);
+    add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+    free(resp_response);
+}
+
+static void reply_command(redis_client *client, const char *argv[], int argc){
+    command_buffer.len = 0;
+    buffer_append_command(&command_buffer, argv, NULL, argc);
+    add_reply(client, command_buffer.data, command_buffer.len);
+}
+
+static void create_backlog(void){
+    if (repl_status.backlog != NULL)
+        return;
+    repl_status.backlog_size = server_config.repl_backlog_size < REPL_MIN_BACKLOG_SIZE ?
+            REPL_MIN_BACKLOG_SIZE : server_config.repl_backlog_size;
+    repl_status.backlog = malloc(repl_status.backlog_size);
+    repl_status.backlog_idx = 0;
+    repl_status.backlog_histlen = 0;
+}
+
+/*
+ * Appends bytes to the replication stream: they go to the backlog and to every replica that has been given the
+ * snapshot the bytes apply to.
+ */
+void replication_feed(const char *data, size_t len){
+    repl_status.master_repl_offset += len;
+
+    if (repl_status.backlog != NULL){
+        const char *ptr = data;
+        long long left = len;
+        if (left > repl_status.backlog_size){ // only the tail fits
+            ptr += left - repl_status.backlog_size;
+            left = repl_status.backlog_size;
+        }
+        while (left > 0){
+            long long chunk = repl_status.backlog_size - repl_status.backlog_idx;
+            if (chunk > left)
+                chunk = left;
+            memcpy(repl_status.backlog + repl_status.backlog_idx, ptr, chunk);
+            repl_status.backlog_idx = (repl_status.backlog_idx + chunk) % repl_status.backlog_size;
+            ptr += chunk;
+            left -= chunk;
+        }
+        repl_status.backlog_histlen += len;
+        if (repl_status.backlog_histlen > repl_status.backlog_size)
+            repl_status.backlog_histlen = repl_status.backlog_size;
+    }
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        if (replica->repl_state != REPLICA_WAIT_BGSAVE_START)
+            add_reply(replica, data, len);
+    }
+}
+
+/*
+ * Feeds a command that changed the selected database of a primary to the replication stream, after a SELECT if the
+ * stream was at another one. Nothing is kept before the first replica asks for a sync.
+ */
+void replication_feed_command(const char *argv[], int argc){
+    int index = (int)(db - dbs);
+
+    if (aof_status.loading || repl_status.backlog == NULL)
+        return;
+    command_buffer.len = 0;
+    if (repl_status.stream_db != index){
+        char index_str[12];
+        snprintf(index_str, sizeof index_str, "%d", index);
+        const char *select_argv[] = {"SELECT", index_str};
+        buffer_append_command(&command_buffer, select_argv, NULL, 2);
+        repl_status.stream_db = index;
+    }
+    buffer_append_command(&command_buffer, argv, NULL, argc);
+    replication_feed(command_buffer.data, command_buffer.len);
+}
+
+/*
+ * Sends the part of the backlog from offset to the end of the stream.
+ */
+static void add_reply_from_backlog(redis_client *client, long long offset){
+    long long len = repl_status.master_repl_offset - offset;
+    long long start = (repl_status.backlog_idx - len + repl_status.backlog_size) % repl_status.backlog_size;
+    long long first_chunk = repl_status.backlog_size - start < len ? repl_status.backlog_size - start : len;
+
+    add_reply(client, repl_status.backlog + start, first_chunk);
+    if (len > first_chunk)
+        add_reply(client, repl_status.backlog, len - first_chunk);
+}
+
+/*
+ * Checks if a replica that followed the stream replid up to offset can continue from the backlog.
+ */
+static int can_partial_resync(const char *replid, long long offset){
+    if (strcmp(replid, repl_status.replid) != 0 &&
+        (strcmp(replid, repl_status.replid2) != 0 || offset > repl_status.second_replid_offset))
+        return 0;
+    return offset >= repl_status.master_repl_offset - repl_status.backlog_histlen &&
+           offset <= repl_status.master_repl_offset;
+}
+
+/*
+ * Closes the links of our replicas, e.g. because the keyspace they copied is about to be replaced.
+ */
+static void disconnect_replicas(void){
+    for (int i = 0; i < repl_status.num_replicas; i++)
+        repl_status.replicas[i]->flags |= CLIENT_CLOSE_ASAP;
+}
+
+/*
+ * The database the stream is at from the current offset on, for a replica starting to follow it there.
+ */
+static int stream_db_at_sync(void){
+    return repl_status.stream_db > 0 ? repl_status.stream_db : 0;
+}
+
+/*
+ * Forks the child that streams the snapshot to the waiting replicas. Whatever is still in their reply buffers and the
+ * +FULLRESYNC line go out from the child too, ahead of the snapshot, so the parent doesn't touch those sockets until
+ * the child is done.
+ */
+static void start_diskless_sync(int num_waiting){
+    redis_client *waiting[num_waiting];
+    int fds[num_waiting];
+    char *preambles[num_waiting];
+    size_t preamble_lens[num_waiting];
+    char eof_mark[REPL_ID_LEN + 1];
+    char line[256];
+    int n = 0;
+
+    get_random_hex(eof_mark, REPL_ID_LEN);
+    int line_len = snprintf(line, sizeof line, "+FULLRESYNC %s %lld %d\r\n$EOF:%s\r\n", repl_status.replid,
+                            repl_status.master_repl_offset, stream_db_at_sync(), eof_mark);
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        if (replica->repl_state != REPLICA_WAIT_BGSAVE_START)
+            continue;
+        size_t pending = replica->reply_len - replica->reply_sent;
+        preambles[n] = malloc(pending + line_len);
+        memcpy(preambles[n], replica->reply_buffer + replica->reply_sent, pending);
+        memcpy(preambles[n] + pending, line, line_len);
+        preamble_lens[n] = pending + line_len;
+        fds[n] = replica->fd;
+        waiting[n++] = replica;
+    }
+
+    int ret_val = rdb_bgsave_to_sockets(fds, (const char **)preambles, preamble_lens, n, eof_mark, REPL_ID_LEN);
+    for (int i = 0; i < n; i++){
+        free(preambles[i]);
+        if (ret_val != 0){
+            waiting[i]->flags |= CLIENT_CLOSE_ASAP;
+            continue;
+        }
+        waiting[i]->reply_len = 0; // sent by the child
+        waiting[i]->reply_sent = 0;
+        waiting[i]->reply_hold = 0;
+        waiting[i]->flags |= CLIENT_REPLY_HELD;
+        waiting[i]->repl_state = REPLICA_WAIT_BGSAVE_END;
+    }
+    if (ret_val != 0)
+        fprintf(stderr, "Redis server: Can't start the diskless sync\n");
+    else printf("Redis server: Diskless full resync of %d replica(s) from offset %lld\n", n,
+                repl_status.master_repl_offset);
+}
+
+/*
+ * Starts the BGSAVE for the replicas waiting for a full resync. Every replica waiting when the child is forked shares
+ * its snapshot; the writes made from then on are held back in their reply buffers until the snapshot is sent.
+ */
+static void start_bgsave_for_replicas(void){
+    int num_waiting = 0;
+    time_t oldest_request = time(NULL);
+
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        if (replica->repl_state != REPLICA_WAIT_BGSAVE_START)
+            continue;
+        num_waiting++;
+        if (replica->repl_sync_requested < oldest_request)
+            oldest_request = replica->repl_sync_requested;
+    }
+    if (num_waiting == 0 || rdb_status.child_pid != -1 || aof_status.rewrite_child_pid != -1)
+        return;
+
+    if (server_config.repl_diskless_sync){
+        // give more replicas the chance to arrive, a single pass over the keyspace serves all of them
+        if (time(NULL) - oldest_request >= server_config.repl_diskless_sync_delay)
+            start_diskless_sync(num_waiting);
+        return;
+    }
+    if (rdb_bgsave(SAVE_FILE_NAME) != 0){
+        fprintf(stderr, "Redis server: Can't start the BGSAVE for a full resync\n");
+        for (int i = 0; i < repl_status.num_replicas; i++)
+            if (repl_status.replicas[i]->repl_state == REPLICA_WAIT_BGSAVE_START)
+                repl_status.replicas[i]->flags |= CLIENT_CLOSE_ASAP;
+        return;
+    }
+    char line[128];
+    int line_len = snprintf(line, sizeof line, "+FULLRESYNC %s %lld %d\r\n", repl_status.replid,
+                            repl_status.master_repl_offset, stream_db_at_sync());
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        if (replica->repl_state != REPLICA_WAIT_BGSAVE_START)
+            continue;
+        add_reply(replica, line, line_len);
+        replica->flags |= CLIENT_REPLY_HELD;
+        replica->reply_hold = replica->reply_len;
+        replica->repl_state = REPLICA_WAIT_BGSAVE_END;
+    }
+    printf("Redis server: Full resync of %d replica(s) from offset %lld\n", num_waiting,
+           repl_status.master_repl_offset);
+}
+
+/*
+ * Callback when PSYNC <replid> <offset> is received: the client becomes a replica, either continuing from the
+ * backlog or waiting for a snapshot.
+ */
+void replication_psync(redis_client *client, const char *cmd[], int args){
+    if (args < 3){
+        reply_error(client, "Failed: Incomplete argument list");
+        return;
+    }
+    if (client->flags & (CLIENT_REPLICA | CLIENT_MASTER)){
+        reply_error(client, "Failed: Already replicating");
+        return;
+    }
+    if (repl_status.master_host != NULL && repl_status.state != REPL_STATE_CONNECTED){
+        reply_error(client, "Failed: Can't sync with a replica that is not in sync with its primary");
+        return;
+    }
+    if (repl_status.backlog == NULL){
+        create_backlog();
+        if (repl_status.master_host == NULL){ // the offset was not tracked until now, so no old replid is valid
+            get_random_hex(repl_status.replid, REPL_ID_LEN);
+            repl_status.replid2[0] = '\0';
+            repl_status.second_replid_offset = -1;
+        }
+    }
+    if (repl_status.num_replicas == repl_status.replicas_capacity){
+        repl_status.replicas_capacity = repl_status.replicas_capacity == 0 ? 4 : repl_status.replicas_capacity * 2;
+        repl_status.replicas = realloc(repl_status.replicas,
+                                       sizeof *repl_status.replicas * repl_status.replicas_capacity);
+    }
+    repl_status.replicas[repl_status.num_replicas++] = client;
+    client->flags |= CLIENT_REPLICA;
+    client->repl_ack_time = time(NULL);
+
+    long long offset = strtoll(cmd[2], NULL, 10);
+    if (can_partial_resync(cmd[1], offset)){
+        char line[128];
+        int line_len = snprintf(line, sizeof line, "+CONTINUE %s\r\n", repl_status.replid);
+        add_reply(client, line, line_len);
+        add_reply_from_backlog(client, offset);
+        client->repl_state = REPLICA_ONLINE;
+        client->repl_ack_offset = offset;
+        printf("Redis server: Partial resync of replica on socket %d, sending %lld bytes of backlog\n", client->fd,
+               repl_status.master_repl_offset - offset);
+        return;
+    }
+    client->repl_state = REPLICA_WAIT_BGSAVE_START;
+    client->repl_sync_requested = time(NULL);
+    start_bgsave_for_replicas();
+}
+
+/*
+ * Callback when REPLCONF is received. Replicas send "REPLCONF listening-port <port>" before PSYNC and
+ * "REPLCONF ACK <offset>" every second after it; ACKs are not answered.
+ */
+void replication_replconf(redis_client *client, const char *cmd[], int args){
+    if (args >= 3 && strcasecmp(cmd[1], "ACK") == 0){
+        client->repl_ack_offset = strtoll(cmd[2], NULL, 10);
+        client->repl_ack_time = time(NULL);
+        return;
+    }
+    if (args >= 3 && strcasecmp(cmd[1], "listening-port") == 0)
+        client->repl_listening_port = strtol(cmd[2], NULL, 10);
+    char *resp_response = (char *)serialize("OK", 2, SIMPLE_STRING);
+    add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+    free(resp_response);
+}
+
+/*
+ * Called once a diskless sync child exited: the replicas that got the whole snapshot are sent the writes held back
+ * since the fork.
+ */
+static void diskless_sync_done(void){
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        int ok = 0;
+
+        if (replica->repl_state != REPLICA_WAIT_BGSAVE_END)
+            continue;
+        for (int j = 0; j < rdb_status.num_sockets; j++)
+            if (rdb_status.socket_fds[j] == replica->fd)
+                ok = rdb_status.socket_ok[j];
+        if (!ok){
+            fprintf(stderr, "Redis server: Diskless sync of the replica on socket %d failed\n", replica->fd);
+            replica->flags |= CLIENT_CLOSE_ASAP;
+            continue;
+        }
+        replica->flags &= ~CLIENT_REPLY_HELD;
+        replica->repl_state = REPLICA_ONLINE;
+        printf("Redis server: Streamed the snapshot to the replica on socket %d\n", replica->fd);
+    }
+}
+
+/*
+ * Called once the BGSAVE child exited: the replicas waiting for its snapshot start receiving it.
+ */
+void replication_bgsave_done(int ok){
+    if (rdb_status.child_type == RDB_CHILD_TYPE_SOCKET){
+        diskless_sync_done();
+        start_bgsave_for_replicas();
+        return;
+    }
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        struct stat file_stat;
+
+        if (replica->repl_state != REPLICA_WAIT_BGSAVE_END)
+            continue;
+        if (ok)
+            replica->repl_rdb_fd = open(SAVE_FILE_NAME, O_RDONLY);
+        if (!ok || replica->repl_rdb_fd == -1 || fstat(replica->repl_rdb_fd, &file_stat) == -1){
+            fprintf(stderr, "Redis server: No snapshot for the replica on socket %d\n", replica->fd);
+            replica->flags |= CLIENT_CLOSE_ASAP;
+            continue;
+        }
+        replica->repl_rdb_offset = 0;
+        replica->repl_rdb_size = file_stat.st_size;
+        replica->repl_bulk_header_len = snprintf(replica->repl_bulk_header, sizeof replica->repl_bulk_header,
+                                                 "$%lld\r\n", (long long)file_stat.st_size);
+        replica->repl_bulk_header_sent = 0;
+        replica->repl_state = REPLICA_SEND_BULK;
+    }
+    start_bgsave_for_replicas(); // replicas that asked while the child was running
+}
+
+/*
+ * Sends as much of the snapshot as the socket takes, after the replies queued before it. Once it is sent the writes
+ * held back in the reply buffer are released. Returns -1 if the replica must be dropped.
+ */
+int replication_send_bulk(redis_client *replica){
+    if (replica->reply_sent < replica->reply_hold)
+        return 0;
+
+    while (replica->repl_bulk_header_sent < replica->repl_bulk_header_len){
+        ssize_t n = send(replica->fd, replica->repl_bulk_header + replica->repl_bulk_header_sent,
+                         replica->repl_bulk_header_len - replica->repl_bulk_header_sent, MSG_NOSIGNAL);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        replica->repl_bulk_header_sent += n;
+    }
+    while (replica->repl_rdb_offset < replica->repl_rdb_size){
+        ssize_t n = sendfile(replica->fd, replica->repl_rdb_fd, &replica->repl_rdb_offset,
+                             replica->repl_rdb_size - replica->repl_rdb_offset);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (n == 0) // the file shrank
+            return -1;
+    }
+    close(replica->repl_rdb_fd);
+    replica->repl_rdb_fd = -1;
+    replica->flags &= ~CLIENT_REPLY_HELD;
+    replica->repl_state = REPLICA_ONLINE;
+    printf("Redis server: Sent a %lld bytes snapshot to the replica on socket %d\n",
+           (long long)replica->repl_rdb_size, replica->fd);
+    return 0;
+}
+
+static void abort_transfer(void){
+    free(repl_status.transfer_buffer);
+    repl_status.transfer_buffer = NULL;
+    repl_status.transfer_buffer_capacity = 0;
+    if (repl_status.transfer_fd == -1)
+        return;
+    close(repl_status.transfer_fd);
+    unlink(REPL_TRANSFER_FILE_NAME);
+    repl_status.transfer_fd = -1;
+}
+
+/*
+ * Drops the connection to the primary. The client itself is closed by the event loop.
+ */
+static void drop_master_link(void){
+    if (repl_status.master != NULL){
+        repl_status.master->flags |= CLIENT_CLOSE_ASAP;
+        repl_status.master = NULL;
+    }
+    abort_transfer();
+}
+
+static void connect_to_master(void){
+    repl_status.last_connect_try = time(NULL);
+    int master_socket = connect_to_server(repl_status.master_host, repl_status.master_port);
+    if (master_socket == -1){
+        fprintf(stderr, "Redis server: Can't connect to the primary %s:%ld\n", repl_status.master_host,
+                repl_status.master_port);
+        return;
+    }
+    repl_status.master = add_client(master_socket);
+    repl_status.master->flags |= CLIENT_MASTER | CLIENT_CONNECTING;
+    repl_status.master->db = stream_db_at_sync(); // a partial resync continues the stream where it was
+    repl_status.state = REPL_STATE_CONNECTING;
+}
+
+/*
+ * Callback when REPLICAOF <host> <port> is received. The keyspace is replaced by the one of the primary once the
+ * link is up, and the replicas of this server are dropped since they have to sync again.
+ */
+void replication_set_master(const char *host, long port){
+    char *new_host = strdup(host);
+
+    drop_master_link();
+    free(repl_status.master_host);
+    repl_status.master_host = new_host;
+    repl_status.master_port = port;
+    repl_status.state = REPL_STATE_CONNECT;
+    repl_status.link_down_since = time(NULL);
+    disconnect_replicas();
+    printf("Redis server: Replicating %s:%ld\n", host, port);
+    connect_to_master();
+}
+
+/*
+ * Callback when REPLICAOF NO ONE is received. The keyspace is kept and the server starts a new replication stream,
+ * remembering the old one so that replicas of the old primary can continue from this server.
+ */
+void replication_unset_master(void){
+    if (repl_status.master_host == NULL)
+        return;
+    drop_master_link();
+    free(repl_status.master_host);
+    repl_status.master_host = NULL;
+    repl_status.state = REPL_STATE_NONE;
+
+    memcpy(repl_status.replid2, repl_status.replid, sizeof repl_status.replid);
+    repl_status.second_replid_offset = repl_status.master_repl_offset;
+    get_random_hex(repl_status.replid, REPL_ID_LEN);
+    printf("Redis server: Promoted to primary, new replication id %s\n", repl_status.replid);
+}
+
+/*
+ * Called when the connection to the primary is established (or failed): asks to continue the stream we have been
+ * following. A server that never replicated sends its own replid, which makes the primary start a full resync.
+ */
+int replication_master_connected(redis_client *master){
+    int error = 0;
+    socklen_t error_len = sizeof error;
+
+    if (getsockopt(master->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0){
+        fprintf(stderr, "Redis server: Can't connect to the primary %s:%ld: %s\n", repl_status.master_host,
+                repl_status.master_port, strerror(error));
+        return -1;
+    }
+    master->flags &= ~CLIENT_CONNECTING;
+
+    char port[24], offset[24];
+    snprintf(port, sizeof port, "%ld", server_config.port);
+    snprintf(offset, sizeof offset, "%lld", repl_status.master_repl_offset);
+    const char *replconf_cmd[] = {"REPLCONF", "listening-port", port};
+    const char *psync_cmd[] = {"PSYNC", repl_status.replid, offset};
+    reply_command(master, replconf_cmd, 3);
+    reply_command(master, psync_cmd, 3);
+    repl_status.state = REPL_STATE_RECEIVE_PSYNC;
+    printf("Redis server: Connected to the primary, asking to continue from offset %lld\n",
+           repl_status.master_repl_offset);
+    return 0;
+}
+
+/*
+ * Replaces the keyspace with the snapshot received from the primary.
+ */
+static int load_transferred_snapshot(void){
+    int load_count;
+
+    if (repl_status.transfer_buffer != NULL){
+        handle_flushall(1);
+        load_count = rdb_load_from_buffer((unsigned char *)repl_status.transfer_buffer, repl_status.transfer_read);
+        abort_transfer(); // frees the buffer
+        dirty = load_count > 0 ? load_count : 0; // nothing of it is on disk
+    }
+    else {
+        close(repl_status.transfer_fd);
+        repl_status.transfer_fd = -1;
+        if (rename(REPL_TRANSFER_FILE_NAME, SAVE_FILE_NAME) == -1){
+            perror("Error renaming the snapshot received from the primary");
+            unlink(REPL_TRANSFER_FILE_NAME);
+            return -1;
+        }
+        handle_flushall(1);
+        load_count = rdb_load(SAVE_FILE_NAME);
+        dirty = 0; // the snapshot on disk is the keyspace
+        rdb_status.lastsave = time(NULL);
+    }
+    if (load_count < 0){
+        fprintf(stderr, "Redis server: Can't load the snapshot received from the primary\n");
+        return -1;
+    }
+    printf("Redis server: Loaded %d objects from the primary\n", load_count);
+
+    // the append only file still holds the old keyspace, rewrite it from the new one
+    if (aof_status.fd != -1){
+        if (rdb_status.child_pid != -1 || aof_status.rewrite_child_pid != -1 || aof_bgrewrite(AOF_FILE_NAME) == -1)
+            aof_status.rewrite_scheduled = 1;
+    }
+    repl_status.state = REPL_STATE_CONNECTED;
+    return 0;
+}
+
+/*
+ * Adds received bytes of the snapshot to its file, or to the buffer with repl-diskless-load on.
+ */
+static int transfer_append(const char *data, size_t len){
+    repl_status.transfer_read += len;
+    if (repl_status.transfer_fd != -1)
+        return write_all(repl_status.transfer_fd, data, len);
+
+    size_t needed = repl_status.transfer_read;
+    if (needed > repl_status.transfer_buffer_capacity){
+        size_t new_capacity = repl_status.transfer_buffer_capacity == 0 ? 1024 * 1024 :
+                              repl_status.transfer_buffer_capacity;
+        while (new_capacity < needed)
+            new_capacity *= 2;
+        char *new_buffer = realloc(repl_status.transfer_buffer, new_capacity);
+        if (new_buffer == NULL)
+            return -1;
+        repl_status.transfer_buffer = new_buffer;
+        repl_status.transfer_buffer_capacity = new_capacity;
+    }
+    memcpy(repl_status.transfer_buffer + repl_status.transfer_read - len, data, len);
+    return 0;
+}
+
+/*
+ * Handles a line the primary sent in reply to PSYNC. Returns -1 if the link must be dropped.
+ */
+static int handle_master_line(const char *line){
+    char replid[REPL_ID_LEN + 1];
+    long long offset;
+    int stream_db = 0; // left out by a primary without multiple databases
+
+    if (line[0] == '\0' || strcmp(line, "+OK") == 0) // newlines keep the link alive, +OK answers REPLCONF
+        return 0;
+    if (repl_status.state == REPL_STATE_RECEIVE_SIZE){
+        if (strncmp(line, "$EOF:", 5) == 0 && strlen(line + 5) == REPL_ID_LEN){
+            memcpy(repl_status.transfer_eof_mark, line + 5, REPL_ID_LEN);
+            repl_status.transfer_size = -1;
+        }
+        else if (line[0] != '$' || (repl_status.transfer_size = strtoll(line + 1, NULL, 10)) < 0){
+            fprintf(stderr, "Redis server: Bad snapshot header from the primary: %s\n", line);
+            return -1;
+        }
+        if (!server_config.repl_diskless_load){
+            repl_status.transfer_fd = open(REPL_TRANSFER_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (repl_status.transfer_fd == -1){
+                perror("Error creating the file for the snapshot of the primary");
+                return -1;
+            }
+        }
+        repl_status.transfer_read = 0;
+        repl_status.state = REPL_STATE_TRANSFER;
+        return 0;
+    }
+    if (sscanf(line, "+FULLRESYNC %40s %lld %d", replid, &offset, &stream_db) >= 2){
+        memcpy(repl_status.replid, replid, sizeof replid);
+        repl_status.master_repl_offset = offset;
+        repl_status.stream_db = stream_db >= 0 && stream_db < server_config.databases ? stream_db : 0;
+        repl_status.master->db = repl_status.stream_db;
+        repl_status.replid2[0] = '\0';
+        repl_status.second_replid_offset = -1;
+        create_backlog();
+        repl_status.backlog_histlen = 0; // the old stream does not lead to the new keyspace
+        disconnect_replicas();
+        repl_status.state = REPL_STATE_RECEIVE_SIZE;
+        printf("Redis server: Full resync from the primary, offset %lld\n", offset);
+        return 0;
+    }
+    if (strncmp(line, "+CONTINUE", 9) == 0){
+        if (sscanf(line, "+CONTINUE %40s", replid) == 1 && strcmp(replid, repl_status.replid) != 0){
+            // the primary was promoted, the stream we followed goes on under a new id
+            memcpy(repl_status.replid2, repl_status.replid, sizeof repl_status.replid);
+            repl_status.second_replid_offset = repl_status.master_repl_offset;
+            memcpy(repl_status.replid, replid, sizeof replid);
+        }
+        create_backlog();
+        repl_status.state = REPL_STATE_CONNECTED;
+        printf("Redis server: Partial resync from the primary, offset %lld\n", repl_status.master_repl_offset);
+        return 0;
+    }
+    fprintf(stderr, "Redis server: The primary refused to sync: %s\n", line);
+    return -1;
+}
+
+/*
+ * Handles what the primary sends before the stream of writes (the reply to PSYNC and the snapshot).
+ *
+ * Returns 1 once the rest of the query buffer is the stream of writes, 0 if more data is needed and -1 if the link
+ * must be dropped.
+ */
+int replication_process_master_input(redis_client *master){
+    while (repl_status.state != REPL_STATE_CONNECTED){
+        if (repl_status.state == REPL_STATE_TRANSFER){
+            size_t len = master->query_len;
+            size_t skip = 0;
+            int done;
+            if (repl_status.transfer_size >= 0){
+                if ((long long)len > repl_status.transfer_size - repl_status.transfer_read)
+                    len = repl_status.transfer_size - repl_status.transfer_read;
+                done = repl_status.transfer_read + (long long)len == repl_status.transfer_size;
+            }
+            else { // the snapshot ends with the mark, keep what could be the start of a mark for the next read
+                const char *mark = memmem(master->query_buffer, len, repl_status.transfer_eof_mark, REPL_ID_LEN);
+                done = mark != NULL;
+                if (done){
+                    len = mark - master->query_buffer;
+                    skip = REPL_ID_LEN;
+                }
+                else len = len > REPL_ID_LEN ? len - REPL_ID_LEN : 0;
+            }
+            if (len > 0 && transfer_append(master->query_buffer, len) == -1){
+                perror("Error receiving the snapshot of the primary");
+                return -1;
+            }
+            consume_query_buffer(master, len + skip);
+            if (!done)
+                return 0;
+            if (load_transferred_snapshot() == -1)
+                return -1;
+            continue;
+        }
+
+        char *line_end = memchr(master->query_buffer, '\n', master->query_len);
+        if (line_end == NULL)
+            return master->query_len > 1024 ? -1 : 0;
+        *line_end = '\0';
+        if (line_end > master->query_buffer && line_end[-1] == '\r')
+            line_end[-1] = '\0';
+        int ret_val = handle_master_line(master->query_buffer);
+        consume_query_buffer(master, line_end - master->query_buffer + 1);
+        if (ret_val == -1)
+            return -1;
+    }
+    return 1;
+}
+
+/*
+ * Called before a client is freed.
+ */
+void replication_client_closed(redis_client *client){
+    if (client == repl_status.master){
+        repl_status.master = NULL;
+        abort_transfer();
+        repl_status.state = REPL_STATE_CONNECT;
+        repl_status.link_down_since = time(NULL);
+        printf("Redis server: Lost the connection to the primary\n");
+    }
+    if (!(client->flags & CLIENT_REPLICA))
+        return;
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        if (repl_status.replicas[i] == client){
+            repl_status.replicas[i] = repl_status.replicas[--repl_status.num_replicas];
+            printf("Redis server: Replica on socket %d disconnected\n", client->fd);
+            break;
+        }
+    }
+}
+
+/*
+ * Periodic replication tasks: reconnecting to the primary, acknowledging the processed offset and starting the
+ * BGSAVE for replicas that wait for one.
+ */
+void replication_cron(void){
+    if (repl_status.master_host != NULL && repl_status.state == REPL_STATE_CONNECT &&
+        time(NULL) - repl_status.last_connect_try >= REPL_CONNECT_RETRY_SEC)
+        connect_to_master();
+
+    long current_time_ms = get_current_time_ms();
+    if (repl_status.state == REPL_STATE_CONNECTED && current_time_ms - repl_status.last_ack_ms >= REPL_ACK_INTERVAL_MS){
+        char offset[24];
+        snprintf(offset, sizeof offset, "%lld", repl_status.master_repl_offset);
+        const char *ack_cmd[] = {"REPLCONF", "ACK", offset};
+        reply_command(repl_status.master, ack_cmd, 3);
+        repl_status.last_ack_ms = current_time_ms;
+    }
+    start_bgsave_for_replicas();
+}
+
+static const char * replica_state_name(enum replica_state state){
+    switch (state) {
+        case REPLICA_WAIT_BGSAVE_START:
+        case REPLICA_WAIT_BGSAVE_END:
+            return "wait_bgsave";
+        case REPLICA_SEND_BULK:
+            return "send_bulk";
+        default:
+            return "online";
+    }
+}
+
+/*
+ * Writes the replication section of INFO.
+ */
+void replication_info(FILE *info_stream){
+    time_t now = time(NULL);
+
+    fprintf(info_stream, "# Replication\r\n");
+    fprintf(info_stream, "role:%s\r\n", repl_status.master_host == NULL ? "master" : "slave");
+    if (repl_status.master_host != NULL){
+        fprintf(info_stream, "master_host:%s\r\n", repl_status.master_host);
+        fprintf(info_stream, "master_port:%ld\r\n", repl_status.master_port);
+        fprintf(info_stream, "master_link_status:%s\r\n", repl_status.state == REPL_STATE_CONNECTED ? "up" : "down");
+        if (repl_status.state != REPL_STATE_CONNECTED)
+            fprintf(info_stream, "master_link_down_since_seconds:%ld\r\n", (long)(now - repl_status.link_down_since));
+        fprintf(info_stream, "master_sync_in_progress:%d\r\n", repl_status.state == REPL_STATE_RECEIVE_SIZE ||
+                                                               repl_status.state == REPL_STATE_TRANSFER);
+        if (repl_status.state == REPL_STATE_TRANSFER){
+            fprintf(info_stream, "master_sync_read_bytes:%lld\r\n", repl_status.transfer_read);
+            if (repl_status.transfer_size >= 0)
+                fprintf(info_stream, "master_sync_left_bytes:%lld\r\n",
+                        repl_status.transfer_size - repl_status.transfer_read);
+        }
+        fprintf(info_stream, "slave_repl_offset:%lld\r\n", repl_status.master_repl_offset);
+    }
+    fprintf(info_stream, "connected_slaves:%d\r\n", repl_status.num_replicas);
+    for (int i = 0; i < repl_status.num_replicas; i++){
+        redis_client *replica = repl_status.replicas[i];
+        struct sockaddr_storage addr;
+        socklen_t addr_size = sizeof addr;
+        ip_details ip_info = {"", NULL};
+        char ip_str[INET6_ADDRSTRLEN] = "?";
+
+        if (getpeername(replica->fd, (struct sockaddr *)&addr, &addr_size) == 0){
+            get_ip_details((struct sockaddr *)&addr, &ip_info);
+            if (ip_info.ip_address != NULL)
+                inet_ntop(addr.ss_family, ip_info.ip_address, ip_str, sizeof ip_str);
+        }
+        fprintf(info_stream, "slave%d:ip=%s,port=%ld,state=%s,offset=%lld,lag=%ld\r\n", i, ip_str,
+                replica->repl_listening_port, replica_state_name(replica->repl_state), replica->repl_ack_offset,
+                (long)(now - replica->repl_ack_time));
+    }
+    fprintf(info_stream, "master_replid:%s\r\n", repl_status.replid);
+    fprintf(info_stream, "master_replid2:%s\r\n", repl_status.replid2[0] ? repl_status.replid2 :
+                                                  "0000000000000000000000000000000000000000");
+    fprintf(info_stream, "master_repl_offset:%lld\r\n", repl_status.master_repl_offset);
+    fprintf(info_stream, "second_repl_offset:%lld\r\n", repl_status.second_replid_offset);
+    fprintf(info_stream, "repl_backlog_active:%d\r\n", repl_status.backlog != NULL);
+    fprintf(info_stream, "repl_backlog_size:%lld\r\n", repl_status.backlog_size);
+    fprintf(info_stream, "repl_backlog_first_byte_offset:%lld\r\n",
+            repl_status.master_repl_offset - repl_status.backlog_histlen);
+    fprintf(info_stream, "repl_backlog_histlen:%lld\r\n\r\n", repl_status.backlog_histlen);
+}
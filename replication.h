@@ -0,0 +1,102 @@
+//
+// Replication header file
+//
+// A replica connects to its primary and sends "PSYNC <replid> <offset>": the id of the replication stream it has
+// been following and how many bytes of it were processed. The primary answers in one of two ways:
+//
+//   +FULLRESYNC <replid> <offset> <db>\r\n$<size>\r\n<snapshot>
+//                                                           the replica drops its keyspace and loads the snapshot,
+//                                                           which holds the stream up to <offset>, from where the
+//                                                           stream works on database <db>
+//   +CONTINUE <replid>\r\n                                   the replica already has the keyspace and only misses
+//                                                           the part of the stream kept in the backlog
+//
+// After that the primary sends every write command, in the same RESP format as the append only file, with a SELECT
+// whenever the database changes. The primary keeps the last repl-backlog-size bytes of the stream in a circular
+// backlog, so a replica that was disconnected for a short while continues from its offset instead of loading a whole
+// snapshot again. Replicas forward the stream they receive byte for byte, so a replica of a replica uses the same
+// replid and offsets. A promoted replica starts a new replid but remembers the old one, so the other replicas of its
+// old primary can still continue from their offset.
+//
+// The snapshot for a full resync is saved with a regular BGSAVE. The writes made after the fork are added to the
+// reply buffer of the replica but held back until the snapshot is sent. With repl-diskless-sync on, the forked child
+// writes the snapshot straight into the sockets of every replica that asked within repl-diskless-sync-delay seconds
+// instead, in one pass over the keyspace. Its size is not known up front, so it is sent as
+//
+//   $EOF:<40 random characters>\r\n<snapshot><the same 40 characters>
+//
+// With repl-diskless-load on, a replica keeps the snapshot in memory and loads it from there instead of saving it to
+// disk first.
+//
+
+#ifndef REDIS_REPLICATION_H
+#define REDIS_REPLICATION_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "client.h"
+
+#define REPL_ID_LEN 40
+#define REPL_MIN_BACKLOG_SIZE (16 * 1024)
+#define REPL_CONNECT_RETRY_SEC 1
+#define REPL_ACK_INTERVAL_MS 1000
+#define REPL_TRANSFER_FILE_NAME "temp-replica-transfer.rdb"
+
+enum repl_link_state {
+    REPL_STATE_NONE, // not a replica
+    REPL_STATE_CONNECT, // must (re)connect to the primary
+    REPL_STATE_CONNECTING, // connect() in progress
+    REPL_STATE_RECEIVE_PSYNC, // waiting for the reply to PSYNC
+    REPL_STATE_RECEIVE_SIZE, // waiting for the size of the snapshot
+    REPL_STATE_TRANSFER, // receiving the snapshot
+    REPL_STATE_CONNECTED // receiving the stream of writes
+};
+
+typedef struct {
+    char replid[REPL_ID_LEN + 1]; // id of the replication stream
+    long long master_repl_offset; // bytes of the stream produced (primary) or processed (replica)
+    int stream_db; // database the last SELECT of the stream picked, -1 before the first one
+    char replid2[REPL_ID_LEN + 1]; // id of the stream followed before a replica was promoted, "" if none
+    long long second_replid_offset; // replid2 is valid for offsets up to this one, -1 if none
+    char *backlog; // circular buffer, NULL until the first replica connects
+    long long backlog_size;
+    long long backlog_idx; // where the next byte goes
+    long long backlog_histlen; // valid bytes in the backlog
+    redis_client **replicas;
+    int num_replicas;
+    int replicas_capacity;
+
+    char *master_host; // NULL on a primary
+    long master_port;
+    redis_client *master; // connection to the primary, NULL while disconnected
+    enum repl_link_state state;
+    time_t last_connect_try;
+    time_t link_down_since;
+    long last_ack_ms;
+    int transfer_fd; // file the snapshot is received into, -1 if none
+    char *transfer_buffer; // with repl-diskless-load, the snapshot is received here instead
+    size_t transfer_buffer_capacity;
+    long long transfer_size; // -1 if the snapshot ends with transfer_eof_mark instead
+    long long transfer_read;
+    char transfer_eof_mark[REPL_ID_LEN];
+} replication_state;
+
+extern replication_state repl_status;
+
+void replication_init(void);
+void replication_feed(const char *, size_t);
+void replication_feed_command(const char *[], int);
+void replication_psync(redis_client *, const char *[], int);
+void replication_replconf(redis_client *, const char *[], int);
+void replication_set_master(const char *, long);
+void replication_unset_master(void);
+int replication_master_connected(redis_client *);
+int replication_process_master_input(redis_client *);
+int replication_send_bulk(redis_client *);
+void replication_bgsave_done(int);
+void replication_client_closed(redis_client *);
+void replication_cron(void);
+void replication_info(FILE *);
+
+#endif //REDIS_REPLICATION_H
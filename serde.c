@@ -6,30 +6,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <math.h>
 #include "serde.h"
 
+_Thread_local int resp_protocol = 2;
+
 /*
- * Converts an int to an RESP integer.
+ * Converts a long to an RESP integer.
  */
-unsigned char * int_to_resp_str(const int *val_ptr){
-    int data = *val_ptr;
-    size_t data_length = snprintf(NULL, 0, "%d", *val_ptr); // get num of chars needed to rep str
+unsigned char * long_to_resp_str(const long *val_ptr){
+    long data = *val_ptr;
+    size_t data_length = snprintf(NULL, 0, "%ld", data); // get num of chars needed to rep str
     size_t str_len = data_length + 3;
 
-    char *str_rep = malloc(sizeof(char) * data_length); // hold actual string representation of number
-    unsigned char *out_str = malloc(sizeof (unsigned char) * str_len); // output buffer
+    unsigned char *out_str = malloc(sizeof (unsigned char) * (str_len + 1)); // output buffer
 
-    snprintf(str_rep, data_length + 1, "%d", data); // convert int to str
     out_str[0] = ':';
-    for (int i = 1; i <= data_length; i++){
-        out_str[i] = str_rep[i - 1]; // copy str repr to output
-    }
+    snprintf((char *)out_str + 1, data_length + 1, "%ld", data); // convert long to str straight into the output
     out_str[data_length + 1] = '\r';
     out_str[data_length + 2] = '\n';
-    free(str_rep); // free resources
+    out_str[data_length + 3] = '\0';
     return out_str; // will be freed once this buffer is no longer needed by the caller.
 }
 
+/*
+ * Converts an int to an RESP integer.
+ */
+unsigned char * int_to_resp_str(const int *val_ptr){
+    long data = *val_ptr;
+    return long_to_resp_str(&data);
+}
+
 unsigned char * str_to_simple_resp(const char *val_ptr, size_t len, int error){
     if (len > MAX_SIMPLE_STRING_SIZE){
         return NULL;
@@ -68,9 +75,8 @@ unsigned char * str_to_resp_simple_str(const char *val_ptr, size_t len){
     return str_to_simple_resp(val_ptr, len, 0); // not an error
 }
 
-// TODO: Add error serializatioin and Deserialization
 unsigned char * str_to_resp_simple_err(const char *val_ptr, size_t len){
-    return str_to_simple_resp(val_ptr, len, 0); // not an error
+    return str_to_simple_resp(val_ptr, len, 1);
 }
 
 /*
@@ -101,6 +107,94 @@ unsigned char * str_to_resp_bulk_str(const char *val_ptr, size_t len){
     return out_str;
 }
 
+/*
+ * Converts a boolean to an RESP boolean, or to the integer 1 or 0 for an RESP2 client.
+ */
+unsigned char * bool_to_resp_str(const int *val_ptr){
+    if (resp_protocol == 2){
+        long data = *val_ptr != 0;
+        return long_to_resp_str(&data);
+    }
+    return (unsigned char *)strdup(*val_ptr ? "#t\r\n" : "#f\r\n");
+}
+
+/*
+ * Converts a double to an RESP double, or to a bulk string for an RESP2 client. Infinities are sent as inf and -inf.
+ */
+unsigned char * double_to_resp_str(const double *val_ptr){
+    char digits[32];
+    int len;
+
+    if (isinf(*val_ptr))
+        len = snprintf(digits, sizeof digits, "%s", *val_ptr > 0 ? "inf" : "-inf");
+    else if (isnan(*val_ptr))
+        len = snprintf(digits, sizeof digits, "nan");
+    else len = snprintf(digits, sizeof digits, "%.17g", *val_ptr);
+    if (resp_protocol == 2)
+        return str_to_resp_bulk_str(digits, len);
+    unsigned char *out_str = malloc(len + 3);
+    out_str[0] = ',';
+    memcpy(out_str + 1, digits, len);
+    out_str[len + 1] = '\r';
+    out_str[len + 2] = '\n';
+    return out_str;
+}
+
+/*
+ * Converts the digits of an integer too big for a long (with an optional minus sign) to an RESP big number, or to a
+ * bulk string for an RESP2 client.
+ */
+unsigned char * str_to_resp_big_number(const char *val_ptr, size_t len){
+    if (resp_protocol == 2)
+        return str_to_resp_bulk_str(val_ptr, len);
+    unsigned char *out_str = malloc(len + 3);
+    out_str[0] = '(';
+    memcpy(out_str + 1, val_ptr, len);
+    out_str[len + 1] = '\r';
+    out_str[len + 2] = '\n';
+    return out_str;
+}
+
+/*
+ * Converts a text meant to be shown as it is (e.g. INFO) to an RESP verbatim string of format txt, or to a bulk string
+ * for an RESP2 client.
+ */
+unsigned char * str_to_resp_verbatim_str(const char *val_ptr, size_t len){
+    if (resp_protocol == 2 || len > MAX_BULK_STRING_SIZE)
+        return str_to_resp_bulk_str(val_ptr, len);
+    int header_len = snprintf(NULL, 0, "=%zu\r\ntxt:", len + 4);
+    unsigned char *out_str = malloc(header_len + len + 3);
+    snprintf((char *)out_str, header_len + 1, "=%zu\r\ntxt:", len + 4);
+    memcpy(out_str + header_len, val_ptr, len);
+    out_str[header_len + len] = '\r';
+    out_str[header_len + len + 1] = '\n';
+    return out_str;
+}
+
+/*
+ * Converts a long to an RESP integer, for the values that don't fit an int, which serialize() takes for an INTEGER.
+ */
+unsigned char * serialize_integer(long value){
+    return long_to_resp_str(&value);
+}
+
+/*
+ * Writes the header of an aggregate of count elements (count pairs for a MAP) to out, which must have room for
+ * RESP_HEADER_SIZE bytes, and returns its length. The elements are written after it by the caller. A count of -1 writes
+ * a null array instead, and a NULL_VALUE a null.
+ */
+int serialize_header(char *out, enum resp_type d_type, long count){
+    if (d_type == NULL_VALUE || count < 0){
+        if (resp_protocol == 3)
+            return snprintf(out, RESP_HEADER_SIZE, "_\r\n");
+        return snprintf(out, RESP_HEADER_SIZE, d_type == NULL_VALUE ? "$-1\r\n" : "*-1\r\n");
+    }
+    if (resp_protocol == 2)
+        return snprintf(out, RESP_HEADER_SIZE, "*%ld\r\n", d_type == MAP ? count * 2 : count);
+    char type_symbol = d_type == MAP ? '%' : d_type == SET ? '~' : d_type == PUSH ? '>' : '*';
+    return snprintf(out, RESP_HEADER_SIZE, "%c%ld\r\n", type_symbol, count);
+}
+
 /*
  * Get the number of characters needed to represent a standard type in RESP format.
  */
@@ -224,10 +318,15 @@ unsigned char * serialize_resp_array(const resp_message msg[], size_t array_size
  *
  * Args:
  * addr - the pointer to the standard object to be serialized. Must be type cast to match d_type
- * len - the length of the standard object to be serialized. This value is ignored if d_type is an INTEGER
+ * len - the length of the standard object to be serialized. Ignored for an INTEGER, addr points to an int (see
+ * serialize_integer() for a long).
  * d_type - the resp type the standard object should be serialized to. Might obtain unexpected behaviour if an incompatible
  * type is passed in addr.
  *
+ * The RESP3 types are sent as the closest RESP2 type when resp_protocol is 2. A NULL_VALUE takes no addr, a BOOLEAN
+ * points to an int, a DOUBLE to a double and a BIG_NUMBER to its digits. The aggregates other than ARRAY are built by
+ * the caller after their serialize_header().
+ *
  * Warning:
  * Simple strings can only be 128 characters long. Use Bulk strings for longer data.
  */
@@ -252,6 +351,21 @@ unsigned char * serialize (void *addr, size_t len, enum resp_type d_type){
         case ARRAY:
             serialized_output = serialize_resp_array((resp_message *) addr, len);
             break;
+        case NULL_VALUE:
+            serialized_output = (unsigned char *)strdup(resp_protocol == 3 ? "_\r\n" : "$-1\r\n");
+            break;
+        case BOOLEAN:
+            serialized_output = bool_to_resp_str((int *) addr);
+            break;
+        case DOUBLE:
+            serialized_output = double_to_resp_str((double *) addr);
+            break;
+        case BIG_NUMBER:
+            serialized_output = str_to_resp_big_number((char *) addr, len);
+            break;
+        case VERBATIM_STRING:
+            serialized_output = str_to_resp_verbatim_str((char *) addr, len);
+            break;
         default:
             serialized_output = NULL;
     }
@@ -312,7 +426,7 @@ int get_size_from_resp_data(const char *msg_array, int start_index){
     char str_len[index - start_index + 1];
     for (int i = start_index; i < index; i++)
         str_len[i - start_index] = msg_array[i];
-    str_len[index - 1] = '\0';
+    str_len[index - start_index] = '\0';
     return (int)strtol(str_len, NULL, 10);
 }
 
@@ -464,6 +578,28 @@ resp_message deserialize_std_type(const unsigned char *array){
         out.data_type = BULK_STRING;
         out.value = val;
     }
+    else if (type_symbol == '_'){
+        out.data_type = NULL_VALUE;
+        out.value = NULL;
+    }
+    else if (type_symbol == '#'){
+        int *val = malloc(sizeof(int));
+        *val = array[1] == 't';
+        out.data_type = BOOLEAN;
+        out.value = val;
+    }
+    else if (type_symbol == ','){
+        char *digits = deserialize_simple_str(array);
+        double *val = malloc(sizeof(double));
+        *val = digits != NULL ? strtod(digits, NULL) : 0;
+        free(digits);
+        out.data_type = DOUBLE;
+        out.value = val;
+    }
+    else if (type_symbol == '('){
+        out.data_type = BIG_NUMBER;
+        out.value = deserialize_simple_str(array); // the digits
+    }
     else {
         exit(1);
     }
@@ -493,3 +629,101 @@ void clear_message_array(resp_message msg_array[], size_t array_size){
     for (int i = 0; i < array_size; i++)
         clear_message(&msg_array[i]);
 }
+
+/*
+ * Parses the "<prefix><number>\r\n" line starting at pos. Stores the number in out and returns the position right
+ * after the line, 0 if the line is not complete yet, or -1 if it is malformed.
+ */
+static long parse_resp_length_line(const char *buf, size_t len, size_t pos, char prefix, long *out){
+    size_t max_line = pos + MAX_RESP_LENGTH_DIGITS + 3; // prefix, digits, \r\n
+    size_t end = pos + 1;
+    char *end_ptr;
+
+    if (pos >= len)
+        return 0;
+    if (buf[pos] != prefix)
+        return -1;
+    while (end < len && buf[end] != '\r'){
+        if (end >= max_line)
+            return -1;
+        end++;
+    }
+    if (end + 1 >= len) // the \r\n is not all there yet
+        return end >= max_line ? -1 : 0;
+    if (buf[end + 1] != '\n' || end == pos + 1)
+        return -1;
+
+    char digits[MAX_RESP_LENGTH_DIGITS + 1];
+    memcpy(digits, buf + pos + 1, end - pos - 1);
+    digits[end - pos - 1] = '\0';
+    *out = strtol(digits, &end_ptr, 10);
+    if (*end_ptr != '\0')
+        return -1;
+    return (long)(end + 2);
+}
+
+/*
+ * Parses one command (an RESP array of bulk strings) from the start of buf. Only the length lines are scanned, so
+ * calling this again each time more data arrives costs O(number of arguments), not O(bytes).
+ *
+ * On success, *argv and *argv_len are set to newly allocated arrays holding *argc NUL terminated copies of the
+ * arguments and their lengths, and the number of bytes consumed is returned. An empty array consumes its bytes and
+ * sets *argc to 0. Returns 0 if buf does not hold a complete command yet and -1 if the input is not valid RESP.
+ */
+long parse_resp_command(const char *buf, size_t len, char ***argv, size_t **argv_len, int *argc){
+    long num_args;
+    long pos = parse_resp_length_line(buf, len, 0, '*', &num_args);
+
+    if (pos <= 0)
+        return pos;
+    if (num_args > MAX_COMMAND_ARGS)
+        return -1;
+    if (num_args <= 0){
+        *argv = NULL;
+        *argv_len = NULL;
+        *argc = 0;
+        return pos;
+    }
+
+    // first pass: make sure the whole command is there before allocating anything
+    long body_pos = pos;
+    for (long i = 0; i < num_args; i++){
+        long arg_len;
+        pos = parse_resp_length_line(buf, len, pos, '$', &arg_len);
+        if (pos <= 0)
+            return pos;
+        if (arg_len < 0 || arg_len > MAX_BULK_STRING_SIZE)
+            return -1;
+        if ((size_t)pos + arg_len + 2 > len)
+            return 0;
+        if (buf[pos + arg_len] != '\r' || buf[pos + arg_len + 1] != '\n')
+            return -1;
+        pos += arg_len + 2;
+    }
+
+    // second pass: copy the arguments out
+    *argv = malloc(sizeof(char *) * num_args);
+    *argv_len = malloc(sizeof(size_t) * num_args);
+    pos = body_pos;
+    for (long i = 0; i < num_args; i++){
+        long arg_len;
+        pos = parse_resp_length_line(buf, len, pos, '$', &arg_len);
+        (*argv)[i] = malloc(arg_len + 1);
+        memcpy((*argv)[i], buf + pos, arg_len);
+        (*argv)[i][arg_len] = '\0';
+        (*argv_len)[i] = arg_len;
+        pos += arg_len + 2;
+    }
+    *argc = (int)num_args;
+    return pos;
+}
+
+/*
+ * Releases the arguments allocated by parse_resp_command().
+ */
+void free_command_args(char **argv, size_t *argv_len, int argc){
+    for (int i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+    free(argv_len);
+}
@@ -6,10 +6,11 @@
 #ifndef REDIS_SERDE_H
 #define REDIS_SERDE_H
 
-#endif //REDIS_SERDE_H
-
 #define MAX_SIMPLE_STRING_SIZE 128
-#define MAX_BULK_STRING_SIZE 2097152 // 2 MB
+#define MAX_BULK_STRING_SIZE 536870912 // 512 MB
+#define MAX_COMMAND_ARGS 1048576 // most arguments a single command may have
+#define MAX_RESP_LENGTH_DIGITS 20 // longest "<number>" in a "*<number>\r\n" or "$<number>\r\n" line
+#define RESP_HEADER_SIZE (MAX_RESP_LENGTH_DIGITS + 4) // room for serialize_header()
 
 
 enum resp_type {
@@ -17,9 +18,20 @@ enum resp_type {
     SIMPLE_STRING,
     SIMPLE_ERROR,
     BULK_STRING,
-    ARRAY
+    ARRAY,
+    // RESP3, see resp_protocol: sent as the closest RESP2 type to the clients that didn't pick it with HELLO 3
+    NULL_VALUE, // a null bulk string in RESP2
+    BOOLEAN, // an integer, 1 or 0
+    DOUBLE, // a bulk string
+    BIG_NUMBER, // a bulk string
+    VERBATIM_STRING, // a bulk string, without its format
+    MAP, // an array of the keys and values one after the other
+    SET, // an array
+    PUSH // an array, out of band data like a published message
 };
 
+extern _Thread_local int resp_protocol; // of the client whose replies are being serialized, 2 or 3
+
 typedef struct {
     enum resp_type data_type;
     void * value;
@@ -27,9 +39,15 @@ typedef struct {
 
 // =========================== SER-DE Utilities =================================
 unsigned char * serialize(void *, size_t, enum resp_type);
+unsigned char * serialize_integer(long);
+int serialize_header(char *, enum resp_type, long);
 resp_message deserialize_std_type(const unsigned char *);
 int deserialize_array(const unsigned char *, resp_message [], size_t);
 void clear_message(resp_message *);
 void clear_message_array(resp_message [], size_t);
 int get_size_from_resp_data(const char *, int);
 int deserialize_redis_command(const char *, char *[], size_t);
+long parse_resp_command(const char *, size_t, char ***, size_t **, int *);
+void free_command_args(char **, size_t *, int);
+
+#endif //REDIS_SERDE_H
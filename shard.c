@@ -0,0 +1,767 @@
+//
+// Keyspace shards source file
+//
+// Shards talk with messages only. A request carries commands of a client of the sending shard, the owning shard runs
+// them on a client of its own that has no socket and sends the message back with their replies, to the shard of the
+// client, which finds the client again by its socket and id (it may have hung up meanwhile).
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "shard.h"
+#include "cluster.h"
+#include "multi.h"
+
+// shard_route() results that are not a single shard
+#define SHARD_ROUTE_SPLIT (-1) // keys of several shards, one command per shard
+#define SHARD_ROUTE_ALL (-2) // every shard runs the whole command
+#define SHARD_ROUTE_CROSS (-3) // keys of several shards, and the command can't be split
+#define SHARD_ROUTE_UNSUPPORTED (-4)
+#define SHARD_ROUTE_READ (-5) // runs right here against the keyspace of shard 0, see handle_concurrent_read()
+#define SHARD_ROUTE_ANY (-6) // has no keys, runs on any shard
+
+enum shard_message_type {
+    SHARD_REQUEST,
+    SHARD_REPLY
+};
+
+typedef struct {
+    mpsc_node node; // first, so that a popped node is the message
+    enum shard_message_type type;
+    int from; // shard of the client
+    int to; // shard running the commands
+    int client_fd;
+    unsigned long long client_id;
+    int db; // database the commands work on, selected by the client (and the one it ends on, for a transaction)
+    int resp; // protocol version of the client, the replies are serialized for it
+    client_command *commands; // for a request, the commands to run
+    int num_commands;
+    int transaction; // the commands are the queue of an EXEC, run in one go, see multi.h
+    watched_key *watched_keys; // for a transaction, the keys its client watched
+    int num_watched_keys;
+    char *reply; // for a reply, the replies to the commands one after the other
+    size_t reply_len;
+} shard_message;
+
+shard *shards = NULL;
+int num_shards = 1;
+int concurrent_reads = 0;
+int num_keyspace_shards = 1;
+static _Thread_local int this_shard = 0;
+static _Thread_local redis_client *shard_client = NULL; // runs the commands sent by the other shards
+static _Thread_local long other_shards_keys = 0; // as last published, refreshed once per event loop iteration
+
+// stop-the-world pauses, see shards_pause()
+static pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t paused_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resume_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int pause_requested = 0;
+static long pause_generation = 0; // guarded by pause_mutex, like the two below
+static long resume_generation = 0;
+static int num_paused = 0;
+
+// commands on the state of the whole server, they run on shard 0
+static const char *server_commands[] = {"SAVE", "BGSAVE", "LASTSAVE", "INFO", NULL};
+// commands on keys of several shards that are split into one command per shard, their replies are added up (or for
+// MGET, put back in the order of the keys)
+static const char *split_commands[] = {"DEL", "UNLINK", "EXISTS", "MGET", "MSET", NULL};
+// commands the read threads run themselves
+static const char *concurrent_read_commands[] = {"GET", "EXISTS", "MGET", NULL};
+static const char *unsupported_commands[] = {"CONFIG", "BGREWRITEAOF", "REPLICAOF", "SLAVEOF", "CLUSTER", "MIGRATE",
+                                             "PSYNC", "REPLCONF", NULL};
+
+static int is_in_list(const char *list[], const char *name){
+    for (int i = 0; list[i] != NULL; i++)
+        if (strcmp(list[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+static int key_shard(const char *key, size_t len){
+    return (int)(key_hash_slot(key, len) % num_keyspace_shards);
+}
+
+/*
+ * Checks the shards and read-threads options and sets up the shards. Shard 0 is run by the main thread and exists
+ * even when there is a single one, so that its keyspace is found the same way. The read threads are shards that own
+ * no keys.
+ */
+void shards_init(void){
+    num_shards = server_config.shards > 1 ? (int)server_config.shards : 1;
+    if (server_config.read_threads > 1){
+        if (num_shards > 1){
+            fprintf(stderr, "Redis server: shards and read-threads can't be combined. Exiting.\n");
+            exit(1);
+        }
+        num_shards = (int)server_config.read_threads;
+        concurrent_reads = 1;
+    }
+    if (num_shards > SHARDS_MAX){
+        fprintf(stderr, "Redis server: shards and read-threads are limited to %d\n", SHARDS_MAX);
+        num_shards = SHARDS_MAX;
+    }
+    num_keyspace_shards = concurrent_reads ? 1 : num_shards;
+    if (num_shards > 1 && (server_config.appendonly || server_config.replicaof != NULL ||
+                           server_config.cluster_enabled || server_config.io_threads > 1)){
+        fprintf(stderr, "Redis server: shards and read-threads can't be combined with appendonly, replicaof, "
+                        "cluster-enabled or io-threads. Exiting.\n");
+        exit(1);
+    }
+    if (concurrent_reads)
+        epoch_init(num_shards); // readers are numbered by shard, the one of shard 0 is never used
+
+    shards = aligned_alloc(_Alignof(shard), sizeof *shards * num_shards); // no two shards share a cache line
+    memset(shards, 0, sizeof *shards * num_shards);
+    for (int i = 0; i < num_shards; i++){
+        shards[i].id = i;
+        mpsc_queue_init(&shards[i].inbox);
+        shards[i].wakeup_pipe[0] = -1;
+        shards[i].wakeup_pipe[1] = -1;
+        if (num_shards == 1)
+            continue;
+        size_t counts_size = (sizeof *shards[i].db_counts * 2 * server_config.databases + 63) / 64 * 64;
+        shards[i].db_counts = aligned_alloc(64, counts_size); // a cache line of their own too
+        memset(shards[i].db_counts, 0, counts_size);
+        if (pipe(shards[i].wakeup_pipe) == -1){
+            perror("Error creating a shard wake up pipe");
+            exit(1);
+        }
+        fcntl(shards[i].wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(shards[i].wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    shards[0].dbs = dbs;
+}
+
+static void * shard_thread_main(void *arg){
+    shard *self = arg;
+
+    this_shard = self->id;
+    init_databases();
+    self->dbs = dbs;
+    for (size_t i = 0; i < self->num_loaded_objects; i++){
+        redis_object *obj = self->loaded_objects[i];
+        unsigned long exp_milliseconds = obj->exp_milliseconds;
+
+        db = &dbs[self->loaded_object_dbs[i]];
+        link_object(obj);
+        if (exp_milliseconds > 0)
+            set_object_expiry(obj, exp_milliseconds);
+    }
+    db = &dbs[0];
+    free(self->loaded_objects);
+    free(self->loaded_object_dbs);
+    self->loaded_objects = NULL;
+    self->loaded_object_dbs = NULL;
+
+    int listener = get_listening_socket(server_config.port, 1);
+    if (listener == -1){
+        fprintf(stderr, "Redis server: shard %d could not listen on port %ld. Exiting.\n", self->id, server_config.port);
+        exit(1);
+    }
+    run_event_loop(listener);
+    return NULL;
+}
+
+/*
+ * Hands the keys loaded on startup to the shards they belong to, then starts the threads of shards 1 and up. Called
+ * by the main thread once the keyspace is loaded; it then runs shard 0.
+ */
+void shards_start(void){
+    redis_object *obj, *tmp;
+    size_t capacities[SHARDS_MAX] = {0};
+
+    if (num_shards == 1)
+        return;
+    for (int i = 0; i < server_config.databases; i++){
+        db = &dbs[i];
+        HASH_ITER(hh, db->objects_map, obj, tmp) {
+            int owner = key_shard(obj->key, strlen(obj->key));
+            shard *target = &shards[owner];
+            unsigned long exp_milliseconds = obj->exp_milliseconds;
+
+            if (owner == 0)
+                continue;
+            if (target->num_loaded_objects == capacities[owner]){
+                capacities[owner] = capacities[owner] == 0 ? 1024 : capacities[owner] * 2;
+                target->loaded_objects = realloc(target->loaded_objects, sizeof(redis_object *) * capacities[owner]);
+                target->loaded_object_dbs = realloc(target->loaded_object_dbs, sizeof(int) * capacities[owner]);
+            }
+            unlink_object(obj); // also drops it from the expiry index of shard 0
+            obj->exp_milliseconds = exp_milliseconds;
+            target->loaded_object_dbs[target->num_loaded_objects] = i;
+            target->loaded_objects[target->num_loaded_objects++] = obj;
+        }
+    }
+    db = &dbs[0];
+
+    for (int i = 1; i < num_shards; i++){
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, shard_thread_main, &shards[i]) != 0){
+            fprintf(stderr, "Redis server: error starting shard %d. Exiting.\n", i);
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    if (concurrent_reads)
+        printf("Redis server: Started %d read threads\n", num_shards - 1);
+    else printf("Redis server: Started %d shards\n", num_shards);
+}
+
+int current_shard_id(void){
+    return this_shard;
+}
+
+/*
+ * The end of the wake up pipe the event loop of this shard polls, -1 with a single shard.
+ */
+int shard_wakeup_fd(void){
+    return num_shards > 1 ? shards[this_shard].wakeup_pipe[0] : -1;
+}
+
+/*
+ * Empties the wake up pipe, before the event loop handles the messages and pause requests it was woken up for.
+ */
+void shard_drain_wakeup(void){
+    char buffer[64];
+
+    while (read(shards[this_shard].wakeup_pipe[0], buffer, sizeof buffer) > 0)
+        ;
+    atomic_store(&shards[this_shard].woken, 0);
+}
+
+/*
+ * Makes a shard that may be sleeping in poll() run an event loop iteration. Only the first wake up until the shard
+ * drains its pipe costs a write.
+ */
+static void wake_shard(shard *target){
+    char byte = 0;
+
+    if (atomic_exchange(&target->woken, 1) == 0)
+        write(target->wakeup_pipe[1], &byte, 1);
+}
+
+static void send_message(int to, shard_message *message){
+    mpsc_queue_push(&shards[to].inbox, &message->node);
+    wake_shard(&shards[to]);
+}
+
+/*
+ * Finds the shard a command has to run on, or one of the SHARD_ROUTE_* values.
+ */
+static int shard_route(const client_command *command){
+    const char **cmd = (const char **)command->argv;
+    int first, last, step;
+    int target = -1;
+
+    if (command->argc == 0)
+        return this_shard;
+    if (is_in_list(unsupported_commands, cmd[0]))
+        return SHARD_ROUTE_UNSUPPORTED;
+    if (is_in_list(server_commands, cmd[0]))
+        return 0;
+    if (strcmp(cmd[0], "FLUSHALL") == 0 || strcmp(cmd[0], "FLUSHDB") == 0 || strcmp(cmd[0], "SWAPDB") == 0)
+        return num_keyspace_shards > 1 ? SHARD_ROUTE_ALL : 0;
+    if (strcmp(cmd[0], "PUBLISH") == 0) // every shard has subscribers, read threads too
+        return SHARD_ROUTE_ALL;
+    if (concurrent_reads && this_shard != 0 && is_in_list(concurrent_read_commands, cmd[0]))
+        return SHARD_ROUTE_READ;
+    if (strcmp(cmd[0], "SCAN") == 0 && command->argc > 1) // the cursor says which shard the scan is at
+        return (int)(strtoull(cmd[1], NULL, 10) % num_keyspace_shards);
+    if (!get_command_keys(cmd, command->argc, &first, &last, &step))
+        return SHARD_ROUTE_ANY;
+
+    for (int i = first; i <= last; i += step) {
+        int owner = key_shard(cmd[i], command->argv_len[i]);
+        if (target == -1)
+            target = owner;
+        else if (owner != target)
+            return is_in_list(split_commands, cmd[0]) ? SHARD_ROUTE_SPLIT : SHARD_ROUTE_CROSS;
+    }
+    return target;
+}
+
+static void select_shard_client(int db_index, int resp){
+    if (shard_client == NULL)
+        shard_client = create_client(-1);
+    shard_client->db = db_index;
+    shard_client->resp = resp;
+    resp_protocol = resp;
+}
+
+static char * take_shard_client_replies(size_t *reply_len){
+    char *reply = shard_client->reply_buffer;
+    *reply_len = shard_client->reply_len;
+    shard_client->reply_buffer = NULL;
+    shard_client->reply_len = 0;
+    shard_client->reply_capacity = 0;
+    return reply;
+}
+
+/*
+ * Runs commands on database db_index of this shard and returns their replies one after the other.
+ */
+static char * run_commands(int db_index, int resp, client_command *commands, int num_commands, size_t *reply_len){
+    select_shard_client(db_index, resp);
+    for (int i = 0; i < num_commands; i++) {
+        if (commands[i].argc > 0)
+            execute_command(shard_client, (const char **)commands[i].argv, commands[i].argv_len, commands[i].argc);
+        free_command_args(commands[i].argv, commands[i].argv_len, commands[i].argc);
+    }
+    return take_shard_client_replies(reply_len);
+}
+
+/*
+ * Runs the commands of a transaction sent by another shard and returns the reply of its EXEC. The database a SELECT
+ * among them picked goes back with the reply.
+ */
+static char * run_transaction(shard_message *message, size_t *reply_len){
+    select_shard_client(message->db, message->resp);
+    exec_commands(shard_client, message->commands, message->num_commands, message->watched_keys,
+                  message->num_watched_keys);
+    message->db = shard_client->db;
+    return take_shard_client_replies(reply_len);
+}
+
+static shard_message * new_request(int to, redis_client *client, client_command *commands, int num_commands){
+    shard_message *message = calloc(1, sizeof *message);
+
+    message->type = SHARD_REQUEST;
+    message->from = this_shard;
+    message->to = to;
+    message->client_fd = client->fd;
+    message->client_id = client->id;
+    message->db = client->db;
+    message->resp = client->resp;
+    message->commands = malloc(sizeof *commands * num_commands);
+    memcpy(message->commands, commands, sizeof *commands * num_commands);
+    message->num_commands = num_commands;
+    return message;
+}
+
+static void set_command_arg(client_command *command, int idx, const char *arg, size_t len){
+    command->argv[idx] = malloc(len + 1);
+    memcpy(command->argv[idx], arg, len);
+    command->argv[idx][len] = '\0';
+    command->argv_len[idx] = len;
+}
+
+/*
+ * Adds the reply of the part of a split command that ran on shard from to the ones received so far: integers are
+ * added up, otherwise the first error (or the first reply) is kept. The arrays of a split MGET are kept whole, to be
+ * put together by finish_combined_reply().
+ */
+static void combine_reply(redis_client *client, int from, const char *reply, size_t len){
+    int is_error = len > 0 && reply[0] == '-';
+
+    if (client->shard_key_owners != NULL && !is_error){
+        client->shard_parts[from] = malloc(len);
+        memcpy(client->shard_parts[from], reply, len);
+        return;
+    }
+    if (len > 0 && reply[0] == ':'){
+        client->shard_reply_sum += strtol(reply + 1, NULL, 10);
+        return;
+    }
+    if (client->shard_reply != NULL && (!is_error || client->shard_reply[0] == '-'))
+        return;
+    free(client->shard_reply);
+    client->shard_reply = malloc(len);
+    memcpy(client->shard_reply, reply, len);
+    client->shard_reply_len = len;
+}
+
+/*
+ * Builds the reply of a split MGET: the value of every key, taken in the order of the keys from the array of the shard
+ * owning it.
+ */
+static void merge_mget_replies(redis_client *client){
+    const char **next = malloc(sizeof *next * num_shards); // next value of the array of each shard
+    char *resp_response = NULL;
+    size_t resp_len = 0;
+    FILE *stream = open_memstream(&resp_response, &resp_len);
+
+    for (int s = 0; s < num_shards; s++)
+        next[s] = client->shard_parts[s] != NULL ? client->shard_parts[s] + get_size_of_resp_simple(client->shard_parts[s])
+                                                 : NULL;
+    fprintf(stream, "*%d\r\n", client->shard_num_keys);
+    for (int i = 0; i < client->shard_num_keys; i++){
+        int s = client->shard_key_owners[i];
+        int len = get_size_of_resp_command(next[s]);
+        fwrite(next[s], 1, len, stream);
+        next[s] += len;
+    }
+    fclose(stream);
+    add_reply(client, resp_response, resp_len);
+    free(resp_response);
+    free(next);
+}
+
+static void finish_combined_reply(redis_client *client){
+    if (client->shard_key_owners != NULL){
+        int merged = client->shard_reply == NULL; // otherwise a part failed, its error is the reply
+        if (merged)
+            merge_mget_replies(client);
+        for (int s = 0; s < num_shards; s++)
+            free(client->shard_parts[s]);
+        free(client->shard_parts);
+        free(client->shard_key_owners);
+        client->shard_parts = NULL;
+        client->shard_key_owners = NULL;
+        if (merged)
+            return;
+    }
+    if (client->shard_reply != NULL){
+        add_reply(client, client->shard_reply, client->shard_reply_len);
+        free(client->shard_reply);
+        client->shard_reply = NULL;
+        return;
+    }
+    char *resp_response = (char *)serialize_integer(client->shard_reply_sum);
+    add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+    free(resp_response);
+}
+
+/*
+ * Sends each shard its part of a command: the keys it owns, each with the arguments that go with it like the value of
+ * MSET (SHARD_ROUTE_SPLIT), or the whole command (SHARD_ROUTE_ALL). The part of this shard runs right away.
+ */
+static void split_command(redis_client *client, client_command *command, int to_all){
+    int first, last, step;
+
+    if (!to_all)
+        get_command_keys((const char **)command->argv, command->argc, &first, &last, &step);
+    client->shard_combine_replies = 1;
+    client->shard_replies_pending = 0;
+    client->shard_reply_sum = 0;
+    if (!to_all && strcmp(command->argv[0], "MGET") == 0){ // remember the owner of every key for the reply
+        client->shard_num_keys = last - first + 1;
+        client->shard_key_owners = malloc(sizeof *client->shard_key_owners * client->shard_num_keys);
+        client->shard_parts = calloc(num_shards, sizeof *client->shard_parts);
+        for (int i = first; i <= last; i++)
+            client->shard_key_owners[i - first] = key_shard(command->argv[i], command->argv_len[i]);
+    }
+    for (int s = 0; s < num_shards; s++) {
+        client_command part = {NULL, NULL, 0, 0};
+        int num_keys = 0;
+
+        if (to_all)
+            part.argc = command->argc;
+        else {
+            for (int i = first; i <= last; i += step)
+                num_keys += key_shard(command->argv[i], command->argv_len[i]) == s;
+            if (num_keys == 0)
+                continue;
+            part.argc = 1 + num_keys * step;
+        }
+        part.argv = malloc(sizeof(char *) * part.argc);
+        part.argv_len = malloc(sizeof(size_t) * part.argc);
+        set_command_arg(&part, 0, command->argv[0], command->argv_len[0]);
+        if (to_all)
+            for (int i = 1; i < command->argc; i++)
+                set_command_arg(&part, i, command->argv[i], command->argv_len[i]);
+        else for (int i = first, j = 1; i <= last; i += step) {
+            if (key_shard(command->argv[i], command->argv_len[i]) != s)
+                continue;
+            for (int k = i; k < i + step && k < command->argc; k++)
+                set_command_arg(&part, j++, command->argv[k], command->argv_len[k]);
+        }
+
+        if (s == this_shard){
+            size_t reply_len;
+            char *reply = run_commands(client->db, client->resp, &part, 1, &reply_len);
+            combine_reply(client, s, reply, reply_len);
+            free(reply);
+            continue;
+        }
+        client->shard_replies_pending++;
+        send_message(s, new_request(s, client, &part, 1));
+    }
+    free_command_args(command->argv, command->argv_len, command->argc);
+
+    if (client->shard_replies_pending > 0)
+        client->flags |= CLIENT_WAITING_SHARD;
+    else finish_combined_reply(client);
+}
+
+/*
+ * Sends the first of the commands of a client to the shards that own its keys, when it can't run on this shard, and
+ * with it the commands right after it that go to the same shard. The client then waits for the replies with
+ * CLIENT_WAITING_SHARD set. Commands that can't run with shards are answered right away.
+ *
+ * Returns the number of commands taken (their arguments now belong to the messages sent, or were freed) and 0 if the
+ * first command runs on this shard.
+ */
+int shard_dispatch(redis_client *client, client_command *commands, int num_commands){
+    int target = shard_route(&commands[0]);
+    int count = 1;
+    const char *error = NULL;
+
+    if (target == this_shard || target == SHARD_ROUTE_ANY)
+        return 0;
+    if (target == SHARD_ROUTE_READ){
+        char *resp_response = handle_concurrent_read(client->db, (const char **)commands[0].argv,
+                                                     commands[0].argv_len, commands[0].argc);
+        if (resp_response != NULL){
+            atomic_fetch_add_explicit(&shards[this_shard].reads_processed, 1, memory_order_relaxed);
+            add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+            free(resp_response);
+            free_command_args(commands[0].argv, commands[0].argv_len, commands[0].argc);
+            return 1;
+        }
+        atomic_fetch_add_explicit(&shards[this_shard].reads_forwarded, 1, memory_order_relaxed);
+        target = 0; // shard 0 runs it like any other command
+    }
+    if (target == SHARD_ROUTE_UNSUPPORTED)
+        error = "Failed: Command not supported with shards or read threads";
+    else if (target == SHARD_ROUTE_CROSS)
+        error = "Failed: Keys of this command belong to different shards";
+    if (error != NULL){
+        char *resp_response = (char *)serialize((char *)error, strlen(error), SIMPLE_ERROR);
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+        free_command_args(commands[0].argv, commands[0].argv_len, commands[0].argc);
+        return 1;
+    }
+    if (target == SHARD_ROUTE_SPLIT || target == SHARD_ROUTE_ALL){
+        split_command(client, &commands[0], target == SHARD_ROUTE_ALL);
+        return 1;
+    }
+
+    while (count < num_commands && shard_route(&commands[count]) == target)
+        count++;
+    client->shard_combine_replies = 0;
+    client->shard_replies_pending = 1;
+    client->flags |= CLIENT_WAITING_SHARD;
+    send_message(target, new_request(target, client, commands, count));
+    return count;
+}
+
+/*
+ * Sends the commands of a transaction to the shard owning their keys, along with the keys its client watched, to run
+ * there in one go. Commands without keys run wherever the others do. Returns 0 if they all run on this shard instead,
+ * otherwise 1: they were sent and the client waits for the reply of EXEC, or were refused because their keys belong
+ * to several shards.
+ */
+int shard_dispatch_transaction(redis_client *client){
+    int target = -1;
+    const char *error = NULL;
+
+    for (int i = 0; i < client->num_multi_commands && error == NULL; i++) {
+        int route = shard_route(&client->multi_commands[i]);
+        if (route == SHARD_ROUTE_ANY)
+            continue;
+        if (route == SHARD_ROUTE_READ) // part of a transaction, it has to run where the writes do
+            route = 0;
+        if (route == SHARD_ROUTE_UNSUPPORTED || route == SHARD_ROUTE_ALL)
+            error = "Failed: Command not supported in a transaction with shards or read threads";
+        else if (route < 0 || (target != -1 && route != target))
+            error = "Failed: Keys of this transaction belong to different shards";
+        target = route;
+    }
+    if (error == NULL && (target == -1 || target == this_shard))
+        return 0;
+    if (error != NULL){
+        char *resp_response = (char *)serialize((char *)error, strlen(error), SIMPLE_ERROR);
+        add_reply(client, resp_response, get_size_of_resp_command(resp_response));
+        free(resp_response);
+        for (int i = 0; i < client->num_multi_commands; i++)
+            free_command_args(client->multi_commands[i].argv, client->multi_commands[i].argv_len,
+                              client->multi_commands[i].argc);
+        return 1;
+    }
+
+    shard_message *message = new_request(target, client, client->multi_commands, client->num_multi_commands);
+    message->transaction = 1;
+    message->num_watched_keys = client->num_watched_keys;
+    message->watched_keys = malloc(sizeof *message->watched_keys * (client->num_watched_keys + 1));
+    if (client->num_watched_keys > 0)
+        memcpy(message->watched_keys, client->watched_keys,
+               sizeof *message->watched_keys * client->num_watched_keys);
+    client->shard_combine_replies = 0;
+    client->shard_replies_pending = 1;
+    client->flags |= CLIENT_WAITING_SHARD;
+    send_message(target, message);
+    return 1;
+}
+
+static void reply_received(redis_client *client, int from, const char *reply, size_t len){
+    if (client->shard_combine_replies)
+        combine_reply(client, from, reply, len);
+    else add_reply(client, reply, len);
+    if (--client->shard_replies_pending > 0)
+        return;
+
+    if (client->shard_combine_replies)
+        finish_combined_reply(client);
+    client->flags &= ~CLIENT_WAITING_SHARD;
+    process_client_input(client); // run what it sent meanwhile
+}
+
+static void publish_keyspace_stats(void){
+    shard *self = &shards[this_shard];
+    long keys, expires;
+
+    count_keys(dbs, &keys, &expires);
+    atomic_store_explicit(&self->keys, keys, memory_order_relaxed);
+    atomic_store_explicit(&self->expires, expires, memory_order_relaxed);
+    atomic_store_explicit(&self->dirty, dirty, memory_order_relaxed);
+    for (int i = 0; i < server_config.databases && num_shards > 1; i++){
+        atomic_store_explicit(&self->db_counts[2 * i], dbs[i].objects_count, memory_order_relaxed);
+        atomic_store_explicit(&self->db_counts[2 * i + 1], dbs[i].timed_objects_count, memory_order_relaxed);
+    }
+}
+
+/*
+ * Runs the requests of the other shards and hands the replies to the requests of this one to their clients.
+ */
+void shard_process_messages(void){
+    shard_message *message;
+
+    if (num_shards == 1)
+        return;
+    while ((message = (shard_message *)mpsc_queue_pop(&shards[this_shard].inbox)) != NULL) {
+        if (message->type == SHARD_REQUEST){
+            if (message->transaction)
+                message->reply = run_transaction(message, &message->reply_len);
+            else message->reply = run_commands(message->db, message->resp, message->commands, message->num_commands,
+                                               &message->reply_len);
+            publish_keyspace_stats(); // before the reply, so the client sees the change in INFO right away
+            free(message->commands);
+            free(message->watched_keys);
+            message->commands = NULL;
+            message->watched_keys = NULL;
+            message->type = SHARD_REPLY;
+            send_message(message->from, message);
+            continue;
+        }
+
+        redis_client *client = find_client(message->client_fd, message->client_id);
+        if (client != NULL && (client->flags & CLIENT_WAITING_SHARD) && message->transaction)
+            client->db = message->db;
+        if (client != NULL && (client->flags & CLIENT_WAITING_SHARD))
+            reply_received(client, message->to, message->reply, message->reply_len);
+        free(message->reply);
+        free(message);
+    }
+}
+
+/*
+ * Publishes the counters of this shard for the other ones, once per event loop iteration.
+ */
+void shard_publish_stats(long clients){
+    publish_keyspace_stats();
+    atomic_store_explicit(&shards[this_shard].clients, clients, memory_order_relaxed);
+    other_shards_keys = 0;
+    for (int i = 0; i < num_shards; i++)
+        if (i != this_shard)
+            other_shards_keys += atomic_load_explicit(&shards[i].keys, memory_order_relaxed);
+}
+
+/*
+ * Counts the keys of every shard, for maxkeys: the current ones of this shard and the ones the others published by
+ * the start of the current event loop iteration, which is cheap enough to run for every write.
+ */
+long shards_count_keys(void){
+    long keys, expires;
+
+    count_keys(dbs, &keys, &expires);
+    return num_shards == 1 ? keys : keys + other_shards_keys;
+}
+
+/*
+ * Adds up the counters of every shard: the current ones of this shard and the last ones published by the others,
+ * which are exact while they are paused.
+ */
+void shards_get_stats(shard_stats *stats){
+    count_keys(dbs, &stats->keys, &stats->expires);
+    stats->dirty = dirty;
+    stats->clients = atomic_load_explicit(&shards[this_shard].clients, memory_order_relaxed);
+    stats->reads_processed = atomic_load_explicit(&shards[this_shard].reads_processed, memory_order_relaxed);
+    stats->reads_forwarded = atomic_load_explicit(&shards[this_shard].reads_forwarded, memory_order_relaxed);
+    for (int i = 0; i < num_shards; i++) {
+        if (i == this_shard)
+            continue;
+        stats->keys += atomic_load_explicit(&shards[i].keys, memory_order_relaxed);
+        stats->expires += atomic_load_explicit(&shards[i].expires, memory_order_relaxed);
+        stats->dirty += atomic_load_explicit(&shards[i].dirty, memory_order_relaxed);
+        stats->clients += atomic_load_explicit(&shards[i].clients, memory_order_relaxed);
+        stats->reads_processed += atomic_load_explicit(&shards[i].reads_processed, memory_order_relaxed);
+        stats->reads_forwarded += atomic_load_explicit(&shards[i].reads_forwarded, memory_order_relaxed);
+    }
+}
+
+/*
+ * Adds up the keys, and the keys with an expiry, of a database on every shard, like shards_get_stats().
+ */
+void shards_count_db_keys(int db_index, long *keys, long *expires){
+    *keys = dbs[db_index].objects_count;
+    *expires = dbs[db_index].timed_objects_count;
+    for (int i = 0; i < num_shards; i++){
+        if (i == this_shard)
+            continue;
+        *keys += atomic_load_explicit(&shards[i].db_counts[2 * db_index], memory_order_relaxed);
+        *expires += atomic_load_explicit(&shards[i].db_counts[2 * db_index + 1], memory_order_relaxed);
+    }
+}
+
+/*
+ * Waits while shard 0 has the other shards paused. Called by every shard between two event loop iterations, right
+ * after it published its counters.
+ */
+void shard_check_pause(void){
+    if (!atomic_load_explicit(&pause_requested, memory_order_acquire))
+        return;
+
+    pthread_mutex_lock(&pause_mutex);
+    if (atomic_load(&pause_requested)){
+        long generation = pause_generation;
+        num_paused++;
+        pthread_cond_signal(&paused_cond);
+        while (resume_generation < generation)
+            pthread_cond_wait(&resume_cond, &pause_mutex);
+    }
+    pthread_mutex_unlock(&pause_mutex);
+}
+
+/*
+ * Stops every other shard between two of its event loop iterations, so that shard 0 can read all the keyspaces (to
+ * save them, or to fork a child that does). Returns once they are all waiting in shard_check_pause().
+ */
+void shards_pause(void){
+    if (num_keyspace_shards == 1) // the read threads may go on reading
+        return;
+
+    pthread_mutex_lock(&pause_mutex);
+    pause_generation++;
+    num_paused = 0;
+    atomic_store(&pause_requested, 1);
+    pthread_mutex_unlock(&pause_mutex);
+    for (int i = 1; i < num_shards; i++)
+        wake_shard(&shards[i]);
+
+    pthread_mutex_lock(&pause_mutex);
+    while (num_paused < num_shards - 1)
+        pthread_cond_wait(&paused_cond, &pause_mutex);
+    pthread_mutex_unlock(&pause_mutex);
+}
+
+/*
+ * The databases of a shard, for shard 0 while the others are paused or for a child it forked meanwhile. They are on
+ * the heap, so the child finds them even though the thread local variables of the threads it didn't inherit are gone.
+ */
+redis_db * shard_dbs(int id){
+    return shards[id].dbs;
+}
+
+void shards_resume(void){
+    if (num_keyspace_shards == 1)
+        return;
+
+    pthread_mutex_lock(&pause_mutex);
+    atomic_store(&pause_requested, 0);
+    resume_generation = pause_generation;
+    pthread_cond_broadcast(&resume_cond);
+    pthread_mutex_unlock(&pause_mutex);
+}
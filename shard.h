@@ -0,0 +1,86 @@
+//
+// Keyspace shards header file
+//
+// With shards set above 1, the server runs that many event loops, one per thread, that share nothing on the hot path.
+// Every thread has its own listening socket bound to the same port with SO_REUSEPORT, so the kernel spreads the
+// connections between them, its own clients, and its own part of the keyspace with its own expiry index. A key belongs
+// to shard key_hash_slot(key) % shards, so keys sharing a hash tag are always on the same shard.
+//
+// A command on keys of another shard is sent to that shard through its message queue, together with the commands the
+// client pipelined right after it for the same shard, and the client waits for the replies before its next command
+// runs. DEL, UNLINK, EXISTS, MGET and MSET on keys of several shards are split into one command per shard and their
+// replies are added up (MGET gets its values back in the order of its keys), and FLUSHALL, FLUSHDB and SWAPDB go to
+// every shard. MSETNX can't be split, its keys have to be on one shard. Every shard has all the databases, a command
+// sent to another shard runs on the database its client selected. The commands of a transaction have to be on keys of
+// one shard, EXEC sends them all there. SAVE, BGSAVE, LASTSAVE and INFO run on shard 0, which pauses the other shards
+// while it saves or forks, so the snapshot holds every keyspace as it was at one point in time.
+//
+// With read-threads set above 1 instead, the shards other than 0 own no keys: they send every command on keys to
+// shard 0, the only one changing the keyspace, except GET, MGET and EXISTS, which they run themselves against the
+// keyspace of shard 0 without any lock (see handle_concurrent_read() and epoch.h).
+//
+// The append only file, replication, cluster mode and I/O threads need a single event loop and can't be combined with
+// shards or read threads, nor can CONFIG SET change the options every shard reads.
+//
+
+#ifndef REDIS_SHARD_H
+#define REDIS_SHARD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "redis.h"
+#include "mpsc_queue.h"
+
+#define SHARDS_MAX 128
+
+typedef struct {
+    int id;
+    _Alignas(64) mpsc_queue inbox; // messages from the other shards, pushed by them: a cache line of its own
+    int wakeup_pipe[2]; // written to when a message is queued (or a pause is requested) while the shard may sleep
+    atomic_int woken; // the pipe was written to and not drained yet
+    redis_db *dbs; // the databases of the shard, only read by another thread while the shard is paused
+    redis_object **loaded_objects; // objects of the snapshot loaded on startup that belong to the shard
+    int *loaded_object_dbs; // the database of each of them
+    size_t num_loaded_objects;
+    // published by the shard once per event loop iteration, for the others to add up, on their own cache line
+    _Alignas(64) atomic_long keys;
+    atomic_long expires;
+    atomic_llong dirty;
+    atomic_long clients;
+    atomic_llong reads_processed; // GET and EXISTS run by a read thread
+    atomic_llong reads_forwarded; // the ones it had to send to shard 0 after all
+    atomic_long *db_counts; // the keys and the keys with an expiry of each database, published with the ones above
+} shard;
+
+typedef struct {
+    long keys;
+    long expires;
+    long long dirty;
+    long clients;
+    long long reads_processed;
+    long long reads_forwarded;
+} shard_stats;
+
+extern shard *shards;
+extern int num_shards;
+extern int concurrent_reads; // read-threads is set, the shards other than 0 are read threads
+extern int num_keyspace_shards; // shards owning keys: 1 with read-threads, every key belongs to shard 0
+
+void shards_init(void);
+void shards_start(void);
+int current_shard_id(void);
+int shard_wakeup_fd(void);
+void shard_drain_wakeup(void);
+int shard_dispatch(redis_client *, client_command *, int);
+int shard_dispatch_transaction(redis_client *);
+void shard_process_messages(void);
+void shard_publish_stats(long);
+void shards_get_stats(shard_stats *);
+long shards_count_keys(void);
+void shards_count_db_keys(int, long *, long *);
+void shard_check_pause(void);
+void shards_pause(void);
+void shards_resume(void);
+redis_db * shard_dbs(int);
+
+#endif //REDIS_SHARD_H
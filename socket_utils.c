@@ -4,8 +4,13 @@
 
 #include "socket_utils.h"
 
-int get_listening_socket() {
+/*
+ * Creates a socket listening on port. With reuseport, other sockets may listen on the same port (one per shard) and
+ * the kernel spreads the new connections between them.
+ */
+int get_listening_socket(long port, int reuseport) {
     int listener;
+    char port_str[16];
     int yes = 1; // needed to set socket options. not sure  why
     struct addrinfo address_criteria; // specify criteria to limit the set of socket addresses returned by getaddrinfo()
     struct addrinfo *address_list, *ip_addr_ptr;
@@ -15,7 +20,8 @@ int get_listening_socket() {
     address_criteria.ai_socktype = SOCK_STREAM;
     address_criteria.ai_flags = AI_PASSIVE; // use the IP of the host machine
 
-    int ret_val = getaddrinfo(NULL, REDIS_PORT, &address_criteria, &address_list);
+    snprintf(port_str, sizeof port_str, "%ld", port);
+    int ret_val = getaddrinfo(NULL, port_str, &address_criteria, &address_list);
     if (ret_val != 0){
         fprintf(stderr, "Couldn't get IP address info of host. Error: %s\n", gai_strerror(ret_val));
         exit(1);
@@ -35,6 +41,11 @@ int get_listening_socket() {
             exit(1);
         }
 
+        if (reuseport && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1){
+            perror("Error setting SO_REUSEPORT. Exiting.\n");
+            exit(1);
+        }
+
         int bind_val = bind(listener, ip_addr_ptr->ai_addr, ip_addr_ptr->ai_addrlen);
         if (bind_val < 0) { // close the socket (fd) if it fails to bind
             close(listener);
@@ -52,6 +63,43 @@ int get_listening_socket() {
     return listener;
 }
 
+/*
+ * Starts a non-blocking connection to host:port. Returns the socket or -1 on failure. The connection is established
+ * once the socket becomes writable, SO_ERROR tells if it succeeded.
+ */
+int connect_to_server(const char *host, long port) {
+    int server_socket = -1;
+    char port_str[16];
+    struct addrinfo address_criteria;
+    struct addrinfo *address_list, *ip_addr_ptr;
+
+    memset(&address_criteria, 0, sizeof address_criteria);
+    address_criteria.ai_family = AF_UNSPEC;
+    address_criteria.ai_socktype = SOCK_STREAM;
+
+    snprintf(port_str, sizeof port_str, "%ld", port);
+    int ret_val = getaddrinfo(host, port_str, &address_criteria, &address_list);
+    if (ret_val != 0){
+        fprintf(stderr, "Couldn't get IP address info of %s. Error: %s\n", host, gai_strerror(ret_val));
+        return -1;
+    }
+
+    for (ip_addr_ptr = address_list; ip_addr_ptr != NULL; ip_addr_ptr = ip_addr_ptr->ai_next) {
+        server_socket = socket(ip_addr_ptr->ai_family, ip_addr_ptr->ai_socktype, ip_addr_ptr->ai_protocol);
+        if (server_socket < 0)
+            continue;
+        int flags = fcntl(server_socket, F_GETFL, 0);
+        if (flags != -1)
+            fcntl(server_socket, F_SETFL, flags | O_NONBLOCK);
+        if (connect(server_socket, ip_addr_ptr->ai_addr, ip_addr_ptr->ai_addrlen) == 0 || errno == EINPROGRESS)
+            break;
+        close(server_socket);
+        server_socket = -1;
+    }
+    freeaddrinfo(address_list);
+    return server_socket;
+}
+
 void add_socket(struct pollfd *socket_list[], int socket, int *sockets_count, int *num_sockets_allowed)
 {
     // If we don't have room, add more space in the pfds array
@@ -64,6 +112,7 @@ void add_socket(struct pollfd *socket_list[], int socket, int *sockets_count, in
 
     (*socket_list)[*sockets_count].fd = socket;
     (*socket_list)[*sockets_count].events = POLLIN; // Check ready-to-read
+    (*socket_list)[*sockets_count].revents = 0; // added while the previous poll() results are being handled
 
     (*sockets_count)++;
 }
@@ -7,7 +7,6 @@
 
 #endif //REDIS_SOCKET_UTILS_H
 
-#define REDIS_PORT "6379"
 #define CONN_REQUESTS_QUEUE_SIZE 10
 
 #include <stdio.h>
@@ -17,6 +16,8 @@
 #include <string.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <poll.h>
 
 
@@ -25,7 +26,8 @@ typedef struct {
     void *ip_address;
 } ip_details;
 
-int get_listening_socket();
+int get_listening_socket(long port, int reuseport);
+int connect_to_server(const char *host, long port);
 void add_socket(struct pollfd *socket_list[], int socket, int *sockets_count, int *num_sockets_allowed);
 void remove_socket(struct pollfd socket_list[], int socket_idx, int *sockets_count);
 void get_ip_details(struct sockaddr *ip_input, ip_details *ip_out);
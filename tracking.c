@@ -0,0 +1,429 @@
+//
+// Client side caching source file
+//
+// A slot of the table lists its readers by socket and id rather than by pointer, so that a client hanging up (or
+// turning tracking off) doesn't have to be looked for in every slot: its entries are skipped, and dropped, the next
+// time their slot is used. The clients in broadcast mode are listed by every one of their prefixes instead, and leave
+// them when they stop tracking.
+//
+#include "tracking.h"
+#include "shard.h"
+#include "cluster.h"
+
+#define INVALIDATE_CHANNEL "__redis__:invalidate"
+
+static tracking_slot *tracking_table = NULL; // allocated when the first client starts tracking in the default mode
+static size_t tracking_table_mask = 0;
+static tracking_prefix *prefixes = NULL;
+static int num_prefixes = 0;
+static int prefixes_capacity = 0;
+static tracking_pending_key *pending_keys = NULL; // changed by the command running, in the order they changed
+static redis_client **tracking_clients = NULL; // every client with CLIENT_TRACKING
+static int num_tracking_clients = 0;
+static int tracking_clients_capacity = 0;
+
+static void add_to_list(redis_client ***list, int *num, int *capacity, redis_client *client){
+    if (*num == *capacity){
+        *capacity = *capacity == 0 ? 4 : *capacity * 2;
+        *list = realloc(*list, sizeof **list * *capacity);
+    }
+    (*list)[(*num)++] = client;
+}
+
+static void remove_from_list(redis_client **list, int *num, redis_client *client){
+    for (int i = 0; i < *num; i++)
+        if (list[i] == client){
+            list[i] = list[--(*num)];
+            return;
+        }
+}
+
+static void create_tracking_table(void){
+    size_t num_slots = 1;
+
+    while (num_slots < (size_t)server_config.tracking_table_slots)
+        num_slots <<= 1;
+    tracking_table = calloc(num_slots, sizeof *tracking_table);
+    tracking_table_mask = num_slots - 1;
+}
+
+/*
+ * Encodes the invalidation message of a key, or of every key if key is NULL: a push message for an RESP3 client, a
+ * message of the __redis__:invalidate channel for an RESP2 one.
+ */
+static shared_reply * encode_invalidation(const char *key, int resp3){
+    char *data = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&data, &len);
+
+    if (resp3)
+        fprintf(stream, ">2\r\n$10\r\ninvalidate\r\n");
+    else fprintf(stream, "*3\r\n$7\r\nmessage\r\n$%zu\r\n%s\r\n", strlen(INVALIDATE_CHANNEL), INVALIDATE_CHANNEL);
+    if (key == NULL)
+        fprintf(stream, resp3 ? "_\r\n" : "*-1\r\n");
+    else fprintf(stream, "*1\r\n$%zu\r\n%s\r\n", strlen(key), key);
+    fclose(stream);
+    shared_reply *reply = create_shared_reply(len);
+    memcpy(reply->data, data, len);
+    free(data);
+    return reply;
+}
+
+/*
+ * Queues the invalidation message of a key for a tracking client, encoded the first time it is sent to a client of
+ * the same protocol version and shared by the others. An RESP3 client whose REDIRECT client hung up is told instead.
+ */
+static void send_invalidation(redis_client *client, const char *key, shared_reply *messages[2]){
+    redis_client *target = client;
+
+    if (client->tracking_redirect_id != 0 &&
+        (target = find_client(client->tracking_redirect_fd, client->tracking_redirect_id)) == NULL){
+        if (client->resp == 3){
+            char *broken = NULL;
+            size_t broken_len = 0;
+            FILE *stream = open_memstream(&broken, &broken_len);
+            fprintf(stream, ">2\r\n$21\r\ntracking-redir-broken\r\n:%llu\r\n", client->tracking_redirect_id);
+            fclose(stream);
+            add_reply(client, broken, broken_len);
+            free(broken);
+        }
+        return;
+    }
+    int resp3 = target->resp == 3;
+    if (!resp3 && target->num_channels == 0) // an RESP2 client only understands it in subscribed mode
+        return;
+    if (messages[resp3] == NULL)
+        messages[resp3] = encode_invalidation(key, resp3);
+    add_shared_reply(target, messages[resp3]);
+}
+
+static void release_invalidations(shared_reply *messages[2]){
+    for (int i = 0; i < 2; i++)
+        if (messages[i] != NULL)
+            release_shared_reply(messages[i]);
+}
+
+static int is_own_change(const redis_client *client){
+    return client->flags & CLIENT_TRACKING_NOLOOP && client == current_client;
+}
+
+static tracking_prefix * find_prefix(const char *prefix){
+    for (int i = 0; i < num_prefixes; i++)
+        if (strcmp(prefixes[i].prefix, prefix) == 0)
+            return &prefixes[i];
+    return NULL;
+}
+
+static void add_prefix(redis_client *client, const char *prefix){
+    tracking_prefix *entry = find_prefix(prefix);
+
+    if (entry == NULL){
+        if (num_prefixes == prefixes_capacity){
+            prefixes_capacity = prefixes_capacity == 0 ? 4 : prefixes_capacity * 2;
+            prefixes = realloc(prefixes, sizeof *prefixes * prefixes_capacity);
+        }
+        entry = &prefixes[num_prefixes++];
+        entry->prefix = strdup(prefix);
+        entry->len = strlen(prefix);
+        entry->clients = NULL;
+        entry->num_clients = 0;
+        entry->clients_capacity = 0;
+    }
+    for (int i = 0; i < entry->num_clients; i++)
+        if (entry->clients[i] == client) // given twice
+            return;
+    add_to_list(&entry->clients, &entry->num_clients, &entry->clients_capacity, client);
+    client->tracking_prefixes = realloc(client->tracking_prefixes,
+                                        sizeof *client->tracking_prefixes * (client->num_tracking_prefixes + 1));
+    client->tracking_prefixes[client->num_tracking_prefixes++] = entry->prefix;
+}
+
+static void remove_prefix(redis_client *client, const char *prefix){
+    tracking_prefix *entry = find_prefix(prefix);
+
+    remove_from_list(entry->clients, &entry->num_clients, client);
+    if (entry->num_clients > 0)
+        return;
+    free(entry->prefix);
+    free(entry->clients);
+    *entry = prefixes[--num_prefixes];
+}
+
+/*
+ * Turns tracking off for a client, e.g. because it hung up.
+ */
+void tracking_disable(redis_client *client){
+    if (!(client->flags & CLIENT_TRACKING))
+        return;
+    while (client->num_tracking_prefixes > 0)
+        remove_prefix(client, client->tracking_prefixes[--client->num_tracking_prefixes]);
+    free(client->tracking_prefixes);
+    client->tracking_prefixes = NULL;
+    remove_from_list(tracking_clients, &num_tracking_clients, client);
+    client->flags &= ~(CLIENT_TRACKING | CLIENT_TRACKING_BCAST | CLIENT_TRACKING_OPTIN | CLIENT_TRACKING_OPTOUT |
+                       CLIENT_TRACKING_NOLOOP | CLIENT_TRACKING_CACHING);
+    client->tracking_redirect_id = 0;
+}
+
+/*
+ * Callback for CLIENT TRACKING on|off [REDIRECT <id>] [PREFIX <prefix>]... [BCAST] [OPTIN] [OPTOUT] [NOLOOP]. Turning
+ * it on again replaces the options given before.
+ */
+char * handle_tracking_command(redis_client *client, const char *cmd[], int args){
+    char *response = NULL;
+    int flags = CLIENT_TRACKING;
+    redis_client *target = NULL;
+
+    if (args < 3 || (strcasecmp(cmd[2], "on") != 0 && strcasecmp(cmd[2], "off") != 0)){
+        response = "Failed: Usage CLIENT TRACKING on|off [REDIRECT <id>] [PREFIX <prefix>]... [BCAST] [OPTIN] [OPTOUT] "
+                   "[NOLOOP]";
+        return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    }
+    if (strcasecmp(cmd[2], "off") == 0){
+        tracking_disable(client);
+        response = "OK";
+        return (char *)serialize(response, strlen(response), SIMPLE_STRING);
+    }
+    if (num_shards > 1){
+        response = "Failed: CLIENT TRACKING is not supported with shards or read threads";
+        return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    }
+
+    const char **new_prefixes = malloc(sizeof *new_prefixes * args);
+    int num_new_prefixes = 0;
+    for (int i = 3; i < args && response == NULL; i++){
+        if (strcasecmp(cmd[i], "BCAST") == 0)
+            flags |= CLIENT_TRACKING_BCAST;
+        else if (strcasecmp(cmd[i], "OPTIN") == 0)
+            flags |= CLIENT_TRACKING_OPTIN;
+        else if (strcasecmp(cmd[i], "OPTOUT") == 0)
+            flags |= CLIENT_TRACKING_OPTOUT;
+        else if (strcasecmp(cmd[i], "NOLOOP") == 0)
+            flags |= CLIENT_TRACKING_NOLOOP;
+        else if (strcasecmp(cmd[i], "PREFIX") == 0 && i + 1 < args)
+            new_prefixes[num_new_prefixes++] = cmd[++i];
+        else if (strcasecmp(cmd[i], "REDIRECT") == 0 && i + 1 < args){
+            char *end_ptr = NULL;
+            unsigned long long id = strtoull(cmd[++i], &end_ptr, 10);
+            if (end_ptr == cmd[i] || *end_ptr != '\0' || (target = find_client_by_id(id)) == NULL)
+                response = "Failed: The client ID you want redirect to does not exist";
+        } else response = "Failed: Usage CLIENT TRACKING on|off [REDIRECT <id>] [PREFIX <prefix>]... [BCAST] [OPTIN] "
+                          "[OPTOUT] [NOLOOP]";
+    }
+    if (response == NULL && num_new_prefixes > 0 && !(flags & CLIENT_TRACKING_BCAST))
+        response = "Failed: PREFIX option requires BCAST mode to be enabled";
+    else if (response == NULL && flags & CLIENT_TRACKING_OPTIN && flags & CLIENT_TRACKING_OPTOUT)
+        response = "Failed: You can't use both OPTIN and OPTOUT";
+    else if (response == NULL && flags & CLIENT_TRACKING_BCAST && flags & (CLIENT_TRACKING_OPTIN |
+                                                                           CLIENT_TRACKING_OPTOUT))
+        response = "Failed: OPTIN and OPTOUT are not compatible with BCAST mode";
+    if (response != NULL){
+        free(new_prefixes);
+        return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    }
+
+    tracking_disable(client);
+    client->flags |= flags;
+    client->tracking_redirect_fd = target != NULL ? target->fd : -1;
+    client->tracking_redirect_id = target != NULL ? target->id : 0;
+    add_to_list(&tracking_clients, &num_tracking_clients, &tracking_clients_capacity, client);
+    if (flags & CLIENT_TRACKING_BCAST){
+        if (num_new_prefixes == 0)
+            add_prefix(client, ""); // every key
+        for (int i = 0; i < num_new_prefixes; i++)
+            add_prefix(client, new_prefixes[i]);
+    } else if (tracking_table == NULL)
+        create_tracking_table();
+    free(new_prefixes);
+    response = "OK";
+    return (char *)serialize(response, strlen(response), SIMPLE_STRING);
+}
+
+/*
+ * Callback for CLIENT CACHING yes|no, which picks whether the keys read by the next command of the client are
+ * remembered, in the OPTIN or OPTOUT mode.
+ */
+char * handle_caching_command(redis_client *client, const char *cmd[], int args){
+    char *response = NULL;
+
+    if (args != 3 || (strcasecmp(cmd[2], "yes") != 0 && strcasecmp(cmd[2], "no") != 0))
+        response = "Failed: Usage CLIENT CACHING yes|no";
+    else if (!(client->flags & (CLIENT_TRACKING_OPTIN | CLIENT_TRACKING_OPTOUT)))
+        response = "Failed: CLIENT CACHING can be called only when the client is in tracking mode with OPTIN or "
+                   "OPTOUT mode enabled";
+    else if (strcasecmp(cmd[2], "yes") == 0 && !(client->flags & CLIENT_TRACKING_OPTIN))
+        response = "Failed: CLIENT CACHING yes is only valid when tracking is enabled in OPTIN mode";
+    else if (strcasecmp(cmd[2], "no") == 0 && !(client->flags & CLIENT_TRACKING_OPTOUT))
+        response = "Failed: CLIENT CACHING no is only valid when tracking is enabled in OPTOUT mode";
+    if (response != NULL)
+        return (char *)serialize(response, strlen(response), SIMPLE_ERROR);
+    client->flags |= CLIENT_TRACKING_CACHING;
+    response = "OK";
+    return (char *)serialize(response, strlen(response), SIMPLE_STRING);
+}
+
+static void remove_entry(tracking_slot *slot, int i){
+    free(slot->entries[i].key);
+    slot->num_entries--;
+    memmove(&slot->entries[i], &slot->entries[i + 1], sizeof *slot->entries * (slot->num_entries - i));
+}
+
+static void clear_slot(tracking_slot *slot){
+    for (int i = 0; i < slot->num_entries; i++)
+        free(slot->entries[i].key);
+    slot->num_entries = 0;
+}
+
+static int is_default_tracking(const redis_client *client){
+    return client != NULL && client->flags & CLIENT_TRACKING && !(client->flags & CLIENT_TRACKING_BCAST);
+}
+
+/*
+ * Remembers that a client read a key, unless it did already. The entries of the clients that hung up or stopped
+ * tracking are dropped on the way. The entries are kept oldest first: when the slot is full, the oldest one is evicted
+ * and its client told that its key changed, since it won't be told when it really does.
+ */
+static void remember_reader(tracking_slot *slot, const redis_client *client, const char *key, unsigned hashv){
+    int i = 0;
+
+    while (i < slot->num_entries){
+        tracking_entry *entry = &slot->entries[i];
+        if (entry->fd == client->fd && entry->id == client->id && entry->hashv == hashv && strcmp(entry->key, key) == 0)
+            return;
+        if (!is_default_tracking(find_client(entry->fd, entry->id)))
+            remove_entry(slot, i);
+        else i++;
+    }
+    if (slot->num_entries == TRACKING_SLOT_ENTRIES){
+        shared_reply *messages[2] = {NULL, NULL}; // RESP2, RESP3
+        send_invalidation(find_client(slot->entries[0].fd, slot->entries[0].id), slot->entries[0].key, messages);
+        release_invalidations(messages);
+        remove_entry(slot, 0);
+    }
+    if (slot->num_entries == slot->entries_capacity){
+        slot->entries_capacity = slot->entries_capacity == 0 ? 2 : slot->entries_capacity * 2;
+        slot->entries = realloc(slot->entries, sizeof *slot->entries * slot->entries_capacity);
+    }
+    tracking_entry *entry = &slot->entries[slot->num_entries++];
+    entry->fd = client->fd;
+    entry->id = client->id;
+    entry->hashv = hashv;
+    entry->key = strdup(key);
+}
+
+/*
+ * Remembers the keys read by a command a tracking client just ran, in the default mode. Commands writing keys don't
+ * count as reads of them, even the ones that read them first like INCR.
+ */
+void tracking_remember_keys(redis_client *client, const char *cmd[], int args){
+    int first, last, step;
+    int caching = client->flags & CLIENT_TRACKING_CACHING;
+
+    if (!(client->flags & CLIENT_TRACKING) || client->flags & CLIENT_TRACKING_BCAST ||
+        (client->flags & CLIENT_TRACKING_OPTIN && !caching) || (client->flags & CLIENT_TRACKING_OPTOUT && caching))
+        return;
+    if (is_write_command(cmd[0]) || !get_command_keys(cmd, args, &first, &last, &step))
+        return;
+    for (int i = first; i <= last; i += step){
+        unsigned hashv;
+        HASH_VALUE(cmd[i], strlen(cmd[i]), hashv);
+        remember_reader(&tracking_table[hashv & tracking_table_mask], client, cmd[i], hashv);
+    }
+}
+
+/*
+ * Tells the clients that may have cached a key that changed, given its hash: the ones that read it, which forgets
+ * their reads, and the ones in broadcast mode with a prefix of the key.
+ */
+static void invalidate_key(const char *key, unsigned hashv){
+    shared_reply *messages[2] = {NULL, NULL}; // RESP2, RESP3
+
+    if (tracking_table != NULL){
+        tracking_slot *slot = &tracking_table[hashv & tracking_table_mask];
+        int i = 0;
+        while (i < slot->num_entries){
+            tracking_entry *entry = &slot->entries[i];
+            if (entry->hashv != hashv || strcmp(entry->key, key) != 0){
+                i++;
+                continue;
+            }
+            redis_client *reader = find_client(entry->fd, entry->id);
+            if (is_default_tracking(reader) && !is_own_change(reader))
+                send_invalidation(reader, key, messages);
+            remove_entry(slot, i);
+        }
+    }
+    for (int i = 0; i < num_prefixes; i++){
+        if (strncmp(key, prefixes[i].prefix, prefixes[i].len) != 0)
+            continue;
+        for (int j = 0; j < prefixes[i].num_clients; j++)
+            if (!is_own_change(prefixes[i].clients[j]))
+                send_invalidation(prefixes[i].clients[j], key, messages);
+    }
+    release_invalidations(messages);
+}
+
+static void drop_pending_keys(void){
+    tracking_pending_key *pending, *tmp;
+
+    HASH_ITER(hh, pending_keys, pending, tmp){
+        HASH_DEL(pending_keys, pending);
+        free(pending->key);
+        free(pending);
+    }
+}
+
+/*
+ * Lets the clients that may have cached a key that was just changed know, given its hash. While a command runs, the
+ * key is only noted and the message sent by tracking_flush_invalidations(), once whatever the number of its changes.
+ */
+void tracking_invalidate_key(const char *key, unsigned hashv){
+    tracking_pending_key *pending;
+
+    if (num_tracking_clients == 0)
+        return;
+    if (current_client == NULL){ // e.g. expired by the event loop
+        invalidate_key(key, hashv);
+        return;
+    }
+    size_t len = strlen(key);
+    HASH_FIND(hh, pending_keys, key, len, pending);
+    if (pending != NULL)
+        return;
+    pending = malloc(sizeof *pending);
+    pending->key = strdup(key);
+    pending->hashv = hashv;
+    HASH_ADD_KEYPTR(hh, pending_keys, pending->key, len, pending);
+}
+
+/*
+ * Sends the invalidation messages of the keys changed by the command that just ran, still as the current client so
+ * that NOLOOP clients aren't told about their own changes.
+ */
+void tracking_flush_invalidations(void){
+    tracking_pending_key *pending;
+
+    for (pending = pending_keys; pending != NULL; pending = pending->hh.next)
+        invalidate_key(pending->key, pending->hashv);
+    drop_pending_keys();
+}
+
+/*
+ * Tells every tracking client that all keys changed, for FLUSHDB, FLUSHALL and SWAPDB, and forgets every read.
+ */
+void tracking_invalidate_all(void){
+    shared_reply *messages[2] = {NULL, NULL}; // RESP2, RESP3
+
+    if (num_tracking_clients == 0)
+        return;
+    drop_pending_keys(); // covered by this message
+    for (int i = 0; i < num_tracking_clients; i++)
+        send_invalidation(tracking_clients[i], NULL, messages);
+    release_invalidations(messages);
+    for (size_t i = 0; tracking_table != NULL && i <= tracking_table_mask; i++)
+        clear_slot(&tracking_table[i]);
+}
+
+int tracking_num_clients(void){
+    return num_tracking_clients;
+}
@@ -0,0 +1,71 @@
+//
+// Client side caching header file
+//
+// CLIENT TRACKING makes the server tell a client when keys it may have cached change, so it can drop them from its
+// cache. In the default mode, the server remembers the keys the client read: the first change of one of them sends an
+// invalidation message with its name, and it is forgotten until the client reads it again. The reads are remembered in
+// a fixed table indexed by the hash of the key, each slot listing up to TRACKING_SLOT_ENTRIES reads (a client and a
+// key): the memory used is bounded whatever the number of keys read, as a full slot evicts its oldest read, telling
+// its client that key changed. OPTIN only remembers the reads of the command right after CLIENT CACHING yes, OPTOUT
+// all of them but the one right after CLIENT CACHING no.
+//
+// In broadcast mode (BCAST), nothing is remembered: the client is told about every change of a key starting with one
+// of its prefixes (all keys without PREFIX). With NOLOOP, a client isn't told about its own changes.
+//
+// The invalidation messages go to the client itself, or to the client given with REDIRECT. An RESP3 client (see HELLO)
+// gets them as "invalidate" push messages; an RESP2 one as messages of the __redis__:invalidate channel, which it has
+// to be subscribed to, so an RESP2 client needs REDIRECT to a second connection. FLUSHDB, FLUSHALL and SWAPDB send
+// one with null instead of an array of keys.
+//
+// The keys changed by a command are collected while it runs and their invalidation messages sent once it is done, so
+// a key changed several times by one command (e.g. SET replacing the value and the expiry) is only sent once.
+//
+// Tracking is not supported with shards or read threads.
+//
+
+#ifndef REDIS_TRACKING_H
+#define REDIS_TRACKING_H
+
+#include "redis.h"
+
+#define TRACKING_SLOT_ENTRIES 16 // reads remembered per slot of the table before the oldest is evicted
+
+typedef struct {
+    int fd;
+    unsigned long long id; // the client that read the key, if still connected, see find_client()
+    unsigned hashv;
+    char *key;
+} tracking_entry;
+
+typedef struct {
+    tracking_entry *entries;
+    int num_entries;
+    int entries_capacity;
+} tracking_slot;
+
+// a key changed by the command running, see tracking_flush_invalidations()
+typedef struct {
+    char *key;
+    unsigned hashv;
+    UT_hash_handle hh;
+} tracking_pending_key;
+
+// the clients told about the changes of the keys starting with a prefix, in broadcast mode
+typedef struct {
+    char *prefix;
+    size_t len;
+    redis_client **clients;
+    int num_clients;
+    int clients_capacity;
+} tracking_prefix;
+
+char * handle_tracking_command(redis_client *, const char *[], int);
+char * handle_caching_command(redis_client *, const char *[], int);
+void tracking_remember_keys(redis_client *, const char *[], int);
+void tracking_invalidate_key(const char *, unsigned);
+void tracking_flush_invalidations(void);
+void tracking_invalidate_all(void);
+void tracking_disable(redis_client *);
+int tracking_num_clients(void);
+
+#endif //REDIS_TRACKING_H
@@ -2,9 +2,20 @@
 // Created by timothy on 5/4/24.
 //
 
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include "utils.h"
 #include "serde.h"
 
+#define CRC64_POLY 0x95ac9329ac4bc9b5ULL // Jones polynomial, bit reflected
+
+static uint64_t crc64_table[8][256];
+static pthread_once_t crc64_table_once = PTHREAD_ONCE_INIT;
+
 long get_current_time_ms(){
     long millisecond_val;
     struct timespec time_value;
@@ -14,6 +25,16 @@ long get_current_time_ms(){
     return millisecond_val;
 }
 
+/*
+ * Microseconds from an arbitrary point, for measuring durations: unlike the wall clock, it never jumps.
+ */
+long get_monotonic_time_us(){
+    struct timespec time_value;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_value);
+    return time_value.tv_sec * 1000000 + time_value.tv_nsec / 1000;
+}
+
 /*
  * Convert an expiration time in millisecond to a unix timestamp
  */
@@ -24,30 +45,272 @@ long convert_exp_time_to_timestamp(long exp_time){
     return millisecond_val + exp_time;
 }
 
+/*
+ * Gets the number of private dirty bytes of this process. In a forked child, these are the pages that were copied on
+ * write since the fork.
+ */
+size_t get_private_dirty_bytes(){
+    char line[256];
+    size_t total_kb = 0;
+    size_t kb;
+
+    FILE *file_ptr = fopen("/proc/self/smaps_rollup", "r");
+    if (file_ptr == NULL)
+        file_ptr = fopen("/proc/self/smaps", "r");
+    if (file_ptr == NULL)
+        return 0;
+    while (fgets(line, sizeof line, file_ptr) != NULL){
+        if (sscanf(line, "Private_Dirty: %zu kB", &kb) == 1)
+            total_kb += kb;
+    }
+    fclose(file_ptr);
+    return total_kb * 1024;
+}
+
 /*
  * Gets the number of bytes for a resp message
  */
 int get_size_of_resp_simple(const char *message){
-    // count how many new line characters have occurred
     int index = 0;
-    while(message[index] != '\r' && message[index + 1] != '\n'){
+    while (!(message[index] == '\r' && message[index + 1] == '\n'))
         index++;
-        if (index == MAX_SIMPLE_STRING_SIZE)
-            return index;
-    }
 
     return index + 2; // for \r and \n
 }
 
+/*
+ * Gets the number of bytes taken by a serialized RESP value, including every element of (nested) aggregates. RESP3
+ * types are sized too.
+ */
 int get_size_of_resp_command(const char *message){
     if (message[0] == '+' || message[0] == '-' || message[0] == ':')
         return get_size_of_resp_simple(message);
-    if (message[0] == '$'){
+    if (message[0] == '$' || message[0] == '=' || message[0] == '!'){ // bulk, verbatim and bulk error strings
         int data_size = get_size_from_resp_data(message, 1);
-        int num_size_digits = snprintf(NULL, 0, "%d", data_size);
-        return num_size_digits + data_size + 5;
+        int header_size = get_size_of_resp_simple(message);
+        if (data_size < 0) // null bulk string
+            return header_size;
+        return header_size + data_size + 2;
+    }
+    if (message[0] == '*' || message[0] == '~' || message[0] == '>' || message[0] == '%'){
+        int num_elements = get_size_from_resp_data(message, 1) * (message[0] == '%' ? 2 : 1); // maps hold pairs
+        int size = get_size_of_resp_simple(message);
+        for (int i = 0; i < num_elements; i++)
+            size += get_size_of_resp_command(message + size);
+        return size;
+    }
+    return get_size_of_resp_simple(message);
+}
+
+static void crc64_init_table(){
+    for (int n = 0; n < 256; n++){
+        uint64_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+        crc64_table[0][n] = crc;
+    }
+    // table k holds the crc of byte n followed by k zero bytes, so 8 bytes can be folded in per step
+    for (int n = 0; n < 256; n++){
+        uint64_t crc = crc64_table[0][n];
+        for (int k = 1; k < 8; k++){
+            crc = crc64_table[0][crc & 0xff] ^ (crc >> 8);
+            crc64_table[k][n] = crc;
+        }
+    }
+}
+
+/*
+ * Updates a CRC-64 (Jones polynomial, the one used by Redis RDB files) with len bytes of data. Start with crc = 0.
+ */
+uint64_t crc64(uint64_t crc, const unsigned char *data, size_t len){
+    pthread_once(&crc64_table_once, crc64_init_table);
+
+    while (len >= 8){ // slice-by-8
+        uint64_t word = 0;
+        for (int i = 7; i >= 0; i--)
+            word = (word << 8) | data[i];
+        crc ^= word;
+        crc = crc64_table[7][crc & 0xff] ^ crc64_table[6][(crc >> 8) & 0xff] ^
+              crc64_table[5][(crc >> 16) & 0xff] ^ crc64_table[4][(crc >> 24) & 0xff] ^
+              crc64_table[3][(crc >> 32) & 0xff] ^ crc64_table[2][(crc >> 40) & 0xff] ^
+              crc64_table[1][(crc >> 48) & 0xff] ^ crc64_table[0][crc >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc64_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint64_t gf2_matrix_times(const uint64_t *mat, uint64_t vec){
+    uint64_t sum = 0;
+    while (vec){
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint64_t *square, const uint64_t *mat){
+    for (int n = 0; n < 64; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * Combines crc1 = crc64(0, A) and crc2 = crc64(0, B) into crc64(0, A followed by B), where len2 is the length of B.
+ * This lets the checksum of a big buffer be computed in parallel chunks. Same approach as zlib's crc32_combine():
+ * crc1 is run through len2 zero bytes using an operator matrix that is squared for every bit of len2.
+ */
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, size_t len2){
+    uint64_t even[64]; // even-power-of-two zeros operator
+    uint64_t odd[64]; // odd-power-of-two zeros operator
+
+    if (len2 == 0)
+        return crc1;
+
+    odd[0] = CRC64_POLY; // operator for one zero bit
+    uint64_t row = 1;
+    for (int n = 1; n < 64; n++){
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+
+    do {
+        gf2_matrix_square(even, odd); // apply len2 zero bytes, one bit of len2 at a time
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+/*
+ * Writes len bytes to fd, retrying on short writes. A non-blocking fd (e.g. a client socket written by a BGSAVE
+ * child) is waited on for up to WRITE_ALL_TIMEOUT_MS at a time. Returns -1 on failure.
+ */
+int write_all(int fd, const void *data, size_t len){
+    const char *ptr = data;
+    while (len > 0){
+        ssize_t n = write(fd, ptr, len);
+        if (n == -1){
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                if (poll(&pfd, 1, WRITE_ALL_TIMEOUT_MS) > 0)
+                    continue;
+            }
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Writes len random hex characters and a terminator to out, e.g. for replication and cluster node ids.
+ */
+void get_random_hex(char *out, size_t len){
+    unsigned char random_bytes[len / 2 + 1];
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd == -1 || read(fd, random_bytes, sizeof random_bytes) != (ssize_t)sizeof random_bytes){
+        srand(time(NULL) ^ getpid());
+        for (size_t i = 0; i < sizeof random_bytes; i++)
+            random_bytes[i] = rand();
+    }
+    if (fd != -1)
+        close(fd);
+    for (size_t i = 0; i < len; i++)
+        out[i] = "0123456789abcdef"[(random_bytes[i / 2] >> (i % 2 ? 0 : 4)) & 0xf];
+    out[len] = '\0';
+}
+
+/*
+ * Checks if c is in the set of a [...] pattern, p pointing right after the '['. Returns what follows the set.
+ */
+static const char * match_char_set(const char *p, unsigned char c, int *matched){
+    int negate = *p == '^';
+
+    *matched = 0;
+    if (negate)
+        p++;
+    while (*p != ']' && *p != '\0'){
+        if (*p == '\\' && p[1] != '\0'){
+            *matched |= (unsigned char)p[1] == c;
+            p += 2;
+        } else if (p[1] == '-' && p[2] != ']' && p[2] != '\0'){
+            unsigned char low = p[0], high = p[2];
+            if (low > high){
+                unsigned char tmp = low;
+                low = high;
+                high = tmp;
+            }
+            *matched |= c >= low && c <= high;
+            p += 3;
+        } else *matched |= (unsigned char)*p++ == c;
+    }
+    if (*p == ']')
+        p++;
+    if (negate)
+        *matched = !*matched;
+    return p;
+}
+
+/*
+ * Matches a string against a glob-style pattern: '*' matches any run of characters, '?' any single one, [abc], [a-z]
+ * and [^abc] one character of a set, and '\' makes the next character match itself. Only the last '*' seen is ever
+ * backtracked to, one character further each time, so a match takes O(pattern length * string length) at worst,
+ * however many stars the pattern has.
+ */
+int glob_match(const char *pattern, const char *string){
+    const char *p = pattern, *s = string;
+    const char *star_p = NULL, *star_s = NULL; // right after the last '*', and where its match ends for now
+
+    while (*s != '\0'){
+        const char *next_p = p + 1;
+        int matched;
+
+        if (*p == '*'){
+            while (*p == '*')
+                p++;
+            if (*p == '\0')
+                return 1;
+            star_p = p;
+            star_s = s;
+            continue;
+        }
+        if (*p == '?')
+            matched = 1;
+        else if (*p == '[')
+            next_p = match_char_set(p + 1, *s, &matched);
+        else if (*p == '\\' && p[1] != '\0'){
+            matched = p[1] == *s;
+            next_p = p + 2;
+        } else matched = *p != '\0' && *p == *s;
+
+        if (matched){
+            p = next_p;
+            s++;
+            continue;
+        }
+        if (star_p == NULL)
+            return 0;
+        p = star_p; // let the last '*' match one more character
+        s = ++star_s;
     }
-    if (message[0] == '*')
-        return 1024; // TODO: Calculate total number of bytes for RESP Array
-    return 1024;
+    while (*p == '*')
+        p++;
+    return *p == '\0';
 }
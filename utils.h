@@ -9,8 +9,19 @@
 
 #include <time.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define WRITE_ALL_TIMEOUT_MS 60000 // give up on a non-blocking fd that stays unwritable this long
 
 long get_current_time_ms();
+long get_monotonic_time_us();
 long convert_exp_time_to_timestamp(long);
 int get_size_of_resp_simple(const char *);
 int get_size_of_resp_command(const char *);
+uint64_t crc64(uint64_t, const unsigned char *, size_t);
+uint64_t crc64_combine(uint64_t, uint64_t, size_t);
+size_t get_private_dirty_bytes();
+int write_all(int, const void *, size_t);
+void get_random_hex(char *, size_t);
+int glob_match(const char *, const char *);